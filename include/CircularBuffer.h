@@ -216,7 +216,11 @@ namespace JetHead
 		//! The size of mBuffer
 		int mBufferSize;
 	
-		//! The lock we use for protecting access and making this thread safe
+		/**
+		 * The lock we use for protecting access and making this thread 
+		 * safe, priority inheriting if Mutex::setQueuePriorityInherit
+		 * was on when we were made
+		 */
 		mutable Mutex mLock;
 	
 		//! Readers may block on this if data is not available
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _JH_CLOCK_SOURCE_H_
+#define _JH_CLOCK_SOURCE_H_
+
+#include "Mutex.h"
+#include "Condition.h"
+#include "TimeUtils.h"
+#include "jh_vector.h"
+
+/**
+ *	Where TimeUtils::getCurTime, TimeUtils::getMonotonicUsecs and
+ *	Condition's timed waits get the time from, when one is set with
+ *	TimeUtils::setClockSource.  Timer and the TimerManager only use
+ *	those, so timers run on the clock source too.
+ *
+ *	This is for tests and simulations that want to run hours of timeouts
+ *	in no time.  Waits the kernel does itself, like the Selector's poll
+ *	timeout, stay on the system clocks.
+ */
+class ClockSource
+{
+public:
+	virtual ~ClockSource() {}
+	
+	//! Microseconds on this clock's monotonic time
+	virtual uint64_t getMonotonicUsecs() = 0;
+	
+	//! This clock's time of day
+	virtual void getTime( struct timespec *t ) = 0;
+	
+	/**
+	 * Wait on cond until it is signaled or this clock reaches deadline.
+	 *  mutex is locked when this is called and when it returns, as with
+	 *  Condition::WaitUntil.
+	 *
+	 * @return true if the condition was signaled, and false if the 
+	 * deadline passed.
+	 */
+	virtual bool waitUntil( Condition &cond, Mutex &mutex, 
+							uint64_t deadline ) = 0;
+};
+
+/**
+ *	A clock that only moves when it is told to.  Timed waits on it sleep
+ *	until advance() takes the clock past their deadline, so a test can
+ *	step through a day of timeouts as fast as the code can run them, and
+ *	get the same result every time.
+ *
+ *	The clock starts at the system's time, so timers that were already
+ *	running carry on from where they were.  Don't call advance while
+ *	holding a lock that a thread waiting on the clock waits with.
+ */
+class VirtualClock : public ClockSource
+{
+public:
+	VirtualClock();
+	virtual ~VirtualClock();
+	
+	virtual uint64_t getMonotonicUsecs();
+	virtual void getTime( struct timespec *t );
+	virtual bool waitUntil( Condition &cond, Mutex &mutex, 
+							uint64_t deadline );
+	
+	/**
+	 * Move the clock forward by usecs and wake the waits whose
+	 *  deadline that passes.
+	 */
+	void advance( uint64_t usecs );
+	
+	//! Move the clock forward to usecs, it never goes back
+	void advanceTo( uint64_t usecs );
+	
+	//! The earliest deadline being waited for, ~0 if there is none
+	uint64_t getNextDeadline();
+	
+	//! Move the clock to the earliest deadline being waited for, if any
+	bool advanceToNextDeadline();
+	
+	//! How many threads are waiting on the clock
+	int getNumWaiters();
+	
+	/**
+	 * Wait, on the system clock, until at least count threads are
+	 *  waiting on this clock.  Lets a test know the threads it started
+	 *  have gone to sleep before it advances the clock.
+	 *
+	 * @return false if timeoutMs passed first
+	 */
+	bool waitForWaiters( int count, uint32_t timeoutMs );
+	
+private:
+	struct Waiter
+	{
+		Condition	*mCond;
+		Mutex		*mMutex;
+		uint64_t	mDeadline;
+		int			mPins;
+	};
+	
+	void removeWaiter( Waiter *waiter );
+	
+	Mutex		mLock;
+	Condition	mChanged;
+	uint64_t	mNow;
+	uint64_t	mMonotonicBase;
+	struct timespec	mTimeBase;
+	JetHead::vector<Waiter*>	mWaiters;
+};
+
+/**
+ *	A clock that runs factor times as fast (or slow) as the system's.
+ *	A one hour timeout on a 3600 times clock fires after a second.
+ *	Like VirtualClock, it starts at the system's time.
+ */
+class WarpClock : public ClockSource
+{
+public:
+	WarpClock( double factor );
+	virtual ~WarpClock() {}
+	
+	virtual uint64_t getMonotonicUsecs();
+	virtual void getTime( struct timespec *t );
+	virtual bool waitUntil( Condition &cond, Mutex &mutex, 
+							uint64_t deadline );
+	
+	/**
+	 * Change the speed from now on.  Waits already sleeping keep to
+	 *  the old speed until they next wake.
+	 */
+	void setFactor( double factor );
+	
+	double getFactor();
+	
+private:
+	uint64_t toWarped( uint64_t system );
+	
+	Mutex		mLock;
+	double		mFactor;
+	uint64_t	mSystemBase;
+	uint64_t	mWarpedBase;
+	uint64_t	mMonotonicBase;
+	struct timespec	mTimeBase;
+};
+
+#endif // _JH_CLOCK_SOURCE_H_
@@ -48,6 +48,8 @@
 // For non-kernel timing we support either using gettimeofday or
 // clock_gettime.   In this case we need to declare some appropriate
 // macros
+#include <stdio.h>
+
 #define CT_ONE_MILLION (1000000)
 
 #ifdef JH_CODETIMER_USE_GETTIMEOFDAY
@@ -61,7 +63,11 @@ typedef struct timeval	ct_timer_t;
 
 #include <time.h>
 typedef struct timespec ct_timer_t;
+#ifdef CLOCK_MONOTONIC
+#define GET_TIME(x)		clock_gettime(CLOCK_MONOTONIC, (x))
+#else
 #define GET_TIME(x)		clock_gettime(CLOCK_REALTIME, (x))
+#endif
 #define CALC_USECS(x)	(((x).tv_sec * CT_ONE_MILLION) + ((x).tv_nsec / 1000))
 
 #endif // JH_CODTIMER_USE_GETTIMEOFDAY
@@ -72,11 +78,18 @@ typedef struct timespec ct_timer_t;
 // Define C++ CodeTimer class
 #ifdef __cplusplus
 
+#include "TimeUtils.h"
+
+/**
+ *	The C++ CodeTimer times with the TimeUtils cycle clock, so Start and
+ *	End cost a few cycles each where the CPU has an invariant TSC.
+ */
 class CodeTimer
 {
 public:
 	CodeTimer( const char *name, int interval ) : mName( name ), 
-		mInterval( interval ), mCount( 0 ), mTotal( 0 ), mAverage( 0 )
+		mInterval( interval ), mCount( 0 ), mTotal( 0 ), mAverage( 0 ),
+		mAverageNsecs( 0 ), mStart( 0 )
 	{
 		if (mInterval == 0)
 			mInterval = 1;
@@ -85,23 +98,20 @@ public:
 
 	void Start()
 	{
-		GET_TIME(  &mStart );
+		mStart = TimeUtils::getCycles();
 	}
 
 	uint32_t End()
 	{
-		ct_timer_t et;
-		uint64_t micro_s, micro_e;
+		uint64_t end = TimeUtils::getCyclesOrdered();
 	
 		mCount++;
-		GET_TIME( &et );
-		micro_s = CALC_USECS( mStart );
-		micro_e = CALC_USECS( et );
-		mTotal+=(micro_e-micro_s);
+		mTotal += TimeUtils::cyclesToNsecs( end - mStart );
 	
 		if (  mCount % mInterval == 0 )
 		{
-			mAverage = mTotal / mInterval;
+			mAverageNsecs = mTotal / mInterval;
+			mAverage = mAverageNsecs / 1000;
 			if ( mName != NULL )
 				printf( "CodeTimer( %s ) average %d usecs or %d.%06d secs\n",
 					mName, mAverage,
@@ -114,26 +124,31 @@ public:
 
 	uint32_t getElapsedTime()
 	{
-		ct_timer_t et;
-		uint64_t micro_s, micro_e;
-	
-		GET_TIME( &et );
-		micro_s = CALC_USECS( mStart );
-		micro_e = CALC_USECS( et );
-		return (micro_e-micro_s);
+		return getElapsedNsecs() / 1000;
 	}
 
-	void reset() { mCount = 0; mTotal = 0; mAverage = 0; }
+	uint64_t getElapsedNsecs()
+	{
+		uint64_t end = TimeUtils::getCyclesOrdered();
+		return TimeUtils::cyclesToNsecs( end - mStart );
+	}
+
+	void reset() { mCount = 0; mTotal = 0; mAverage = 0; mAverageNsecs = 0; }
 	
 	uint32_t getAverage() { return mAverage; }
 	
+	uint64_t getAverageNsecs() { return mAverageNsecs; }
+	
 private:
 	const char *mName;
 	int mInterval;
 	int mCount;
+	//! Nanoseconds
 	uint64_t mTotal;
 	uint32_t mAverage;
-	ct_timer_t mStart;
+	uint64_t mAverageNsecs;
+	//! Cycle clock reading
+	uint64_t mStart;
 };
 
 
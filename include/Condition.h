@@ -35,6 +35,8 @@
 #include "Mutex.h"
 #include "TimeUtils.h"
 
+class Fiber;
+
 class Condition
 {
 public:
@@ -46,7 +48,8 @@ public:
 	
 	/**
 	 * This method will block the calling thread, waiting for the
-	 * condition to be signalled.
+	 * condition to be signalled.  Called from a Fiber, only the fiber
+	 * waits, and the other fibers on its thread go on running.
 	 *
 	 * @note The Mutex MUST be locked when this method is called, and
 	 * WILL be locked when this method returns, otherwise the results
@@ -67,6 +70,23 @@ public:
 	 */
 	bool Wait( Mutex &mutex, uint32_t timeoutms );
 	
+	/**
+	 * Like Wait with a timeout, but waits until an absolute deadline in
+	 * microseconds on the TimeUtils::getMonotonicUsecs() clock.  That
+	 * is the clock source's time if one is set.
+	 *
+	 * @return true if the condition was signaled, and false if the 
+	 * deadline passed.
+	 */
+	bool WaitUntil( Mutex &mutex, uint64_t deadline );
+	
+	/**
+	 * Like WaitUntil, but the deadline is always on the system's
+	 * monotonic clock (TimeUtils::getSystemMonotonicUsecs).  This is
+	 * for clock sources to wait with.
+	 */
+	bool WaitUntilSystem( Mutex &mutex, uint64_t deadline );
+	
 	/**
 	 * This method signals the condition, waking up one and only one
 	 * waiting thread.  The thread to be awoken is not specified.  If
@@ -83,8 +103,31 @@ public:
 	void Broadcast();
 	
 private:
-	//! The condition variable we are wrapping
+	//! Wait on the futex, until deadline if it isn't NULL
+	bool waitFutex( Mutex &mutex, const struct timespec *deadline );
+	
+	//! Wait on a fiber, until deadline if it isn't 0
+	bool waitFiber( Mutex &mutex, uint64_t deadline );
+	
+	//! The condition variable we are wrapping, unless JH_MUTEX_FUTEX
 	pthread_cond_t		mCond;
+	
+	/**
+	 * With JH_MUTEX_FUTEX, the futex waited on, which every signal 
+	 *  changes, and how many threads are waiting
+	 */
+	volatile int		mSeq;
+	volatile int		mWaiters;
+	
+	/**
+	 * Fibers waiting, see Fiber::addWaiter.  Changed under 
+	 *  mFiberLock, but a fiber is on it before it gives up the mutex,
+	 *  so a signaller holding the mutex can check it without the lock.
+	 */
+	Fiber *volatile		mFibers;
+	
+	//! Protects mFibers and the links of the fibers on it
+	Mutex				mFiberLock;
 };
 
 #endif // _JH_CONDITION_H_
@@ -58,6 +58,9 @@ public:
 	static const Id kSyncEventId = -3;
 	static const Id kSelectorUpdateEventId = -4;
 	static const Id kAgentEventId = -5;
+	static const Id kIdleEventId = -6;
+	static const Id kAsyncIoEventId = -7;
+	static const Id kTaskDoneEventId = -8;
 	
 	Id	getEventId() { return mEventId; }
 	int getPriority() { return mPriority; }
@@ -109,6 +112,17 @@ public:
 	 */
 	virtual void sendEvent( Event *ev ) = 0;
 
+	/**
+	 * Send count events to the queue at once, as if by sendEvent.  Timers
+	 *  call this with everything that expired for a dispatcher, so it
+	 *  must not block.
+	 */
+	virtual void sendEvents( Event **events, unsigned count )
+	{
+		for ( unsigned i = 0; i < count; i++ )
+			sendEvent( events[ i ] );
+	}
+
 	/**
 	 * Send a event at a later time.
 	 */
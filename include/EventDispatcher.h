@@ -30,6 +30,7 @@
 
 #include "EventQueue.h"
 #include "Mutex.h"
+#include "jh_vector.h"
 #include "EventAgent.h"
 
 /**
@@ -61,6 +62,28 @@ private:
 	JetHead::list<EventListenerNode*> mEventList;
 };
 
+/**
+ * This interface is implemented by low priority work (cache trimming, stats
+ *  aggregation, etc...) that should only run when an EventThread or Selector
+ *  has nothing else to do.  See EventDispatcher::addIdleTask.
+ */
+class IdleTask
+{
+public:
+	/**
+	 * Called on the dispatcher's thread when its event queue is empty.  Do a
+	 *  small unit of work and return, the dispatcher will check for new events
+	 *  between calls.
+	 *
+	 * @return true if there is more work to do, false if the task has nothing
+	 *  to do until the dispatcher goes idle again after handling an event.
+	 */
+	virtual bool runIdle() = 0;
+
+protected:
+	virtual ~IdleTask() {}  // just for compile warning
+};
+
 class EventDispatcher : public IEventDispatcher
 {
 public:
@@ -78,12 +101,21 @@ public:
 	void sendEvent( Event *ev );
 
 	/**
-	 * Send a event at a later time.
+	 * Send a batch of events to the queue, taking the queue lock and
+	 *  waking the thread only once.
+	 */
+	void sendEvents( Event **events, unsigned count );
+
+	/**
+	 * Send a event at a later time.  Unless a timer is given, dispatchers
+	 *  that keep their own timers (EventThread and Selector) fire the
+	 *  event on their own thread, without going through a Timer thread.
 	 */
 	void sendTimedEvent( Event *ev, uint32_t msecs, Timer* timer = NULL );
 
 	/**
-	 * Send a recurring Event with a regular period
+	 * Send a recurring Event with a regular period.  Dispatcher local
+	 *  like sendTimedEvent.
 	 */
 	void sendPeriodicEvent( Event *ev, uint32_t msecs, Timer* timer = NULL );
 
@@ -128,6 +160,31 @@ public:
 	 */
 	int removeEventListener( IEventListener *listener, int event_id );
 
+	/**
+	 * Add a task to be run when this dispatcher's queue is empty.  Idle tasks
+	 *  are called in slices of at most the idle budget and give up the thread
+	 *  as soon as an event is queued.
+	 */
+	void addIdleTask( IdleTask *task );
+
+	/**
+	 * Remove an idle task.  When this returns the task is not running and
+	 *  will not be called again.
+	 */
+	void removeIdleTask( IdleTask *task );
+
+	/**
+	 * Set the maximum time in microseconds idle tasks may run before the 
+	 *  dispatcher checks for other work again.
+	 */
+	void setIdleBudget( uint32_t usecs ) { mIdleBudget = usecs; }
+
+	//! Default idle slice in microseconds
+	static const uint32_t kDefaultIdleBudget = 5000;
+
+	//! Longest runLocalTimers will ask a dispatcher to wait, in ms
+	static const uint32_t kMaxLocalTimerWait = 3600000;
+
 protected:
 	struct SyncEventHolder : public Event
 	{
@@ -145,6 +202,30 @@ protected:
 	virtual void wakeThread() {}
 	virtual void onThreadExit() {}
 	
+	/**
+	 * Return true if this dispatcher's thread calls runLocalTimers, so
+	 *  timed events sent to it don't need a Timer.
+	 */
+	virtual bool hasLocalTimers() { return false; }
+	
+	/**
+	 * Called when the nearest local timer deadline moves, from whatever 
+	 *  thread moved it and with the timer lock held.
+	 *
+	 * @param deadline in TimeUtils::getMonotonicUsecs() time, or 0 if there
+	 *  are no local timers left.
+	 */
+	virtual void localTimersChanged( uint64_t deadline ) {}
+	
+	/**
+	 * Queue the events of all local timers that are due.  Must be called
+	 *  on the dispatcher's thread.
+	 *
+	 * @return milliseconds until the next local timer is due, rounded up,
+	 *  or 0 if there are none.
+	 */
+	uint32_t runLocalTimers();
+	
 	/**
 	 * This method is used to check if a sync event is going to be sent to 
 	 *  the same thread as the sender.  Today we just log a fatal error in this
@@ -154,14 +235,112 @@ protected:
 	
 	bool handleEvent( Event *ev );
 
+	/**
+	 * Run idle tasks for up to the idle budget, or until an event is queued.
+	 *  Must be called on the dispatcher's thread.
+	 *
+	 * @return true if the budget ran out and idle tasks still have work 
+	 *  pending, false if there is no idle work or an event is waiting.
+	 */
+	bool runIdleTasks();
+	
 	EventQueue mQueue;
 	
 private:	
 	void handleSyncEvent( Event *ev );
 	
+	//! Add a local timer, period is 0 for a one time event
+	void addLocalTimer( Event *ev, uint32_t msecs, uint32_t period );
+	
+	/**
+	 * Remove local timers for ev, or with eventId (kInvalidEventId for 
+	 *  all), or for agents delivered to receiver.
+	 */
+	void removeLocalTimers( Event::Id eventId, Event *ev, void *receiver );
+	
+	//! Let the subclass know the nearest deadline, mTimerLock held
+	void updateLocalDeadline();
+	
+	//! A timed event kept by this dispatcher
+	struct LocalTimer
+	{
+		//! The event to queue, NULL once removed
+		SmartPtr<Event> mEvent;
+		
+		//! When it is due, in TimeUtils::getMonotonicUsecs() time
+		uint64_t mDeadline;
+		
+		//! Period in microseconds or 0 for a one time event
+		uint64_t mPeriod;
+		
+		//! Order of insertion, so equal deadlines fire first in first out
+		uint32_t mSeq;
+		
+		//! Orders the heap with the earliest deadline on top
+		bool operator<( const LocalTimer &other ) const
+		{
+			if ( mDeadline != other.mDeadline )
+				return mDeadline > other.mDeadline;
+			
+			return (int32_t)( mSeq - other.mSeq ) > 0;
+		}
+	};
+	
+	//! Push onto the mLocalTimers heap, mTimerLock held
+	void insertLocalTimer( LocalTimer &timer );
+	
+	//! Pop the top of the mLocalTimers heap, mTimerLock held
+	void popLocalTimer();
+	
+	//! Drop removed timers from the top of the heap, mTimerLock held
+	void pruneLocalTimers();
+	
+	struct IdleTaskNode
+	{
+		//! The task, NULL if it has been removed
+		IdleTask *mTask;
+
+		//! Does this task have more work to do?
+		bool mPending;
+	};
+	
 	EventDispatcherHelper mDispatcher;
 	Condition mSyncWait;
 	Mutex mSyncLock;
+
+	//! Tasks run when the queue is empty
+	JetHead::list<IdleTaskNode*> mIdleTasks;
+
+	//! Protects mIdleTasks, recursive so tasks can remove themselves
+	Mutex mIdleLock;
+
+	//! Quick check so dispatchers without idle tasks pay nothing
+	bool mHasIdleTasks;
+
+	//! Set when an event was handled so all idle tasks get called again
+	bool mIdleRearm;
+
+	//! How long a slice of idle tasks may run in microseconds
+	uint32_t mIdleBudget;
+	
+	/**
+	 * A heap of local timers, nearest deadline on top.  Removed timers
+	 *  stay in it with a NULL event until they reach the top, or until 
+	 *  they are half of it.
+	 */
+	JetHead::vector<LocalTimer> mLocalTimers;
+	
+	//! How many of mLocalTimers have been removed
+	unsigned mDeadTimers;
+	
+	//! The next LocalTimer::mSeq
+	uint32_t mTimerSeq;
+	
+	//! Protects mLocalTimers
+	Mutex mTimerLock;
+	
+	//! The deadline last given to localTimersChanged
+	uint64_t mLocalDeadline;
 };
 
 #endif // _JH_EVENTDISPATCHER_H_
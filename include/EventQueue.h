@@ -46,8 +46,18 @@ public:
 	
 	/**
 	 * Send a event to the queue.
+	 *
+	 * @return true if the queue was empty before this event.  Only then
+	 *  does a consumer that drains the whole queue need a wake up.
 	 */
-	void SendEvent( Event *ev );
+	bool SendEvent( Event *ev );
+	
+	/**
+	 * Send count events to the queue under one lock.
+	 *
+	 * @return true if the queue was empty before these events.
+	 */
+	bool SendEvents( Event **events, unsigned count );
 	
 	/**
 	 * Wait for an event to arrive.  User must call release on Event when done
@@ -55,9 +65,17 @@ public:
 	 * 
 	 * @param mstimeout Number of milleseconds to wait before timing out.  If 
 	 *  zero, the default, wait forever.
-	 * @return an event or NULL if timed out.  You must delete the event when using it.
+	 * @return an event or NULL if timed out or woken by Wake.  You must 
+	 *  delete the event when using it.
 	 */
 	Event *WaitEvent( uint32_t mstimeout = 0 );
+	
+	/**
+	 * Make a WaitEvent call return NULL without sending an event, now or
+	 *  the next time it is called.  EventThread uses this to recompute its
+	 *  wait time when an earlier timer is added.
+	 */
+	void Wake();
 
 	/**
 	 * Check if an event is pending on the queue.  User must call release on 
@@ -67,6 +85,11 @@ public:
 	 */
 	Event *PollEvent();
 	
+	/**
+	 * Check if the queue is empty without removing anything from it.
+	 */
+	bool IsEmpty();
+	
 	/**
 	 * Remove all items from the queue with a specified event_id.
 	 */
@@ -90,9 +113,17 @@ public:
 private:
 	Event *pollEventInternal();
 	
+	//! Put ev in the queue by priority, mLock must be held
+	void insertEvent( Event *ev );
+	
 	JetHead::list<Event*> mQueue;
+	
+	//! Priority inheriting if Mutex::setQueuePriorityInherit was on
 	Mutex		mLock;
 	Condition	mWait;
+	
+	//! Set by Wake until WaitEvent returns
+	bool		mWoken;
 };
 
 
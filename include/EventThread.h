@@ -42,6 +42,12 @@ private:
 
 	const Thread *getDispatcherThread() { return &mThread; }
 
+	//! Timed events wait in our queue, see EventDispatcher
+	bool hasLocalTimers() { return true; }
+	
+	//! Wake the thread so it waits for the new deadline
+	void localTimersChanged( uint64_t deadline );
+
 	Runnable<EventThread> mThread;	
 };
 
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JH_FIBER_H_
+#define JH_FIBER_H_
+
+#include "jh_types.h"
+#include "jh_vector.h"
+#include "Selector.h"
+#include "Mutex.h"
+#include "Condition.h"
+#include "RefCount.h"
+#include "jh_memory.h"
+
+#include <ucontext.h>
+
+class FiberScheduler;
+
+/**
+ * A function running on its own stack, that gives up its thread
+ * whenever it would block.  Override run() to do the work, and start
+ * it with FiberScheduler::spawn.  Fibers run on the thread of the
+ * scheduler's Selector, one at a time, switching only when one waits:
+ *
+ * - Socket reads, writes and connects, and ServerSocket::accept, wait
+ *   for the socket with waitForFd.
+ * - Condition waits park just the fiber until signalled, so do the
+ *   waits built on them, like CircularBuffer::waitForData and
+ *   EventQueue::WaitEvent.
+ * - sleep and yield.
+ *
+ * So plain blocking code, HttpAgent::sendAndGet for example, can run
+ * as thousands of fibers on one thread.  Anything else that blocks (a
+ * Mutex another fiber holds, a DNS lookup, a file read) blocks every
+ * fiber on the thread, so don't hold a Mutex across any of the calls
+ * above.
+ *
+ * Fibers are reference counted, and the scheduler holds a reference
+ * from spawn until run() returns.
+ */
+class Fiber : public SelectorListener, public RefCount
+{
+public:
+	//! Room for the 64K buffers some code keeps on the stack
+	static const uint32_t kDefaultStackSize = 256 * 1024;
+	
+	Fiber( uint32_t stackSize = kDefaultStackSize );
+	
+	//! Do the work, on the scheduler's thread
+	virtual void run() = 0;
+	
+	//! Has run() returned?
+	bool isDone() { return mState == kDone; }
+	
+	/**
+	 * Wait for run() to return.  On a fiber only the calling fiber
+	 * waits.  Must not be called from the scheduler's thread otherwise.
+	 */
+	void join();
+	
+	//! The scheduler the fiber was spawned on, NULL until then
+	FiberScheduler *getScheduler() { return mScheduler; }
+	
+	//! The fiber calling this, NULL if not called from a fiber
+	static Fiber *getCurrent() { return mCurrent; }
+	
+	/**
+	 * Wait for events (POLLIN, POLLOUT...) on fd, like poll(2) for a
+	 * single fd.  On a fiber the other fibers run meanwhile, anywhere
+	 * else this just calls poll.
+	 *
+	 * @param msecs how long to wait at most, -1 for ever.
+	 * @return the events that happened, 0 on timeout, -1 on error.
+	 */
+	static int waitForFd( int fd, short events, int msecs );
+	
+	//! Sleep, letting the other fibers run if called from one
+	static void sleep( uint32_t msecs );
+	
+	//! Let any other ready fibers run, does nothing if not on a fiber
+	static void yield();
+	
+protected:
+	virtual ~Fiber();
+	
+private:
+	friend class FiberScheduler;
+	friend class Condition;
+	
+	enum State {
+		kNew,
+		kRunning,
+		kWaiting,
+		kDone
+	};
+	
+	//! The fd from waitForFd is ready
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data );
+	
+	//! Start a new wait, returning its id
+	uint32_t beginWait() { return ++mWaitId; }
+	
+	/**
+	 * Switch to the scheduler until the wait begun with beginWait is
+	 *  woken, or until deadline (on TimeUtils::getMonotonicUsecs) if it
+	 *  isn't 0.  Returns what woke it, 0 for the deadline.
+	 */
+	int suspend( uint64_t deadline );
+	
+	//! Where a new fiber's context starts
+	static void start();
+	
+	/**
+	 * Condition::Wait on a fiber.  addWaiter parks the calling fiber on
+	 *  waiters, then once the Condition has given up its mutex 
+	 *  waitWoken suspends it until wakeCondition or deadline (0 for
+	 *  none).  waitWoken returns false if the deadline passed.
+	 *  waitLock is the Condition's lock on waiters.
+	 */
+	static void addWaiter( Fiber *volatile &waiters, Mutex &waitLock );
+	static bool waitWoken( Mutex &waitLock, uint64_t deadline );
+	
+	//! Condition::Signal and Broadcast, wake one or all of waiters
+	static void wakeCondition( Fiber *volatile &waiters, Mutex &waitLock, 
+							   bool all );
+	
+	//! Take this off the list of a Condition, its lock must be held
+	void unlinkWaiter();
+	
+	volatile int		mState;
+	FiberScheduler		*mScheduler;
+	
+	uint32_t			mStackSize;
+	void				*mStack;
+	ucontext_t			mContext;
+	
+	//! Increases with every wait, so late wakeups are ignored
+	uint32_t			mWaitId;
+	
+	//! What ended the last wait
+	int					mWakeResult;
+	
+	/**
+	 * The Condition's list this is waiting on, and the links in that
+	 *  circular list, all protected by the Condition's lock
+	 */
+	Fiber *volatile		*mWaitList;
+	Fiber				*mNextWaiter;
+	Fiber				*mPrevWaiter;
+	
+	static __thread Fiber	*mCurrent;
+};
+
+//! A Fiber calling a copy of a functor, see FiberScheduler::spawnCall
+template<class Functor>
+class FunctorFiber : public Fiber
+{
+public:
+	FunctorFiber( const Functor &functor, uint32_t stackSize ) : 
+		Fiber( stackSize ), mFunctor( functor ) {}
+	
+	void run() { mFunctor(); }
+	
+protected:
+	virtual ~FunctorFiber() {}
+	
+	Functor mFunctor;
+};
+
+/**
+ * Runs Fibers on a Selector's thread, which goes on handling its
+ * listeners and events in between.  A fiber waiting for an fd is a
+ * listener on the selector, and is switched to from the selector's
+ * call to it.  Other wakeups and new fibers are queued and run from
+ * an event sent to the selector.
+ *
+ * @code
+ * struct Session
+ * {
+ *     Session( const URI &uri ) : mUri( uri ) {}
+ *     void operator()() { HttpAgent agent; agent.get( mUri, ... ); }
+ *     URI mUri;
+ * };
+ *
+ * Selector selector;
+ * FiberScheduler fibers( &selector );
+ *
+ * for ( int i = 0; i < 1000; i++ )
+ *     fibers.spawnCall( Session( uris[ i ] ) );
+ *
+ * fibers.waitForAll();
+ * @endcode
+ */
+class FiberScheduler
+{
+public:
+	//! Run fibers on selector's thread, which must outlive us
+	FiberScheduler( Selector *selector );
+	
+	/**
+	 * Waits for every fiber to finish, so must not be called from the
+	 *  selector's thread while any are left.
+	 */
+	~FiberScheduler();
+	
+	//! Start fiber on the selector's thread, can be called from any
+	void spawn( Fiber *fiber );
+	
+	//! Run a copy of functor, which takes no arguments, as a fiber
+	template<class Functor>
+	SmartPtr<Fiber> spawnCall( const Functor &functor, 
+							   uint32_t stackSize = Fiber::kDefaultStackSize )
+	{
+		SmartPtr<Fiber> fiber = jh_new FunctorFiber<Functor>( functor, 
+															  stackSize );
+		spawn( fiber );
+		return fiber;
+	}
+	
+	Selector *getSelector() { return mSelector; }
+	
+	//! How many fibers have been spawned and not finished
+	int getNumFibers();
+	
+	//! Wait until every fiber has finished, see join
+	void waitForAll();
+	
+private:
+	friend class Fiber;
+	
+	struct Wakeup
+	{
+		Fiber		*mFiber;
+		uint32_t	mWaitId;
+		int			mResult;
+	};
+	
+	struct Timeout
+	{
+		uint64_t	mDeadline;
+		Fiber		*mFiber;
+		uint32_t	mWaitId;
+		
+		//! Orders the heap with the earliest deadline on top
+		bool operator<( const Timeout &other ) const
+		{
+			return mDeadline > other.mDeadline;
+		}
+	};
+	
+	//! Queue resume( fiber, waitId, result ), from any thread
+	void wake( Fiber *fiber, uint32_t waitId, int result );
+	
+	/**
+	 * Switch to fiber if it is still in the wait waitId, and give it
+	 *  result.  On the selector's thread, not from a fiber.
+	 */
+	void resume( Fiber *fiber, uint32_t waitId, int result );
+	
+	//! Run fiber until it waits or returns
+	void switchTo( Fiber *fiber );
+	
+	//! Run what wake queued, an event agent on the selector
+	void runWakeups();
+	
+	//! Time out the waits due by now, a timed event agent
+	void runTimeouts( uint64_t deadline );
+	
+	//! Time out fiber's current wait at deadline
+	void addTimeout( Fiber *fiber, uint64_t deadline );
+	
+	//! Send a timed event for the earliest timeout if none comes sooner
+	void armTimer();
+	
+	//! Give fiber a stack and a context to start in
+	bool prepare( Fiber *fiber );
+	
+	//! Clean up after run() returns
+	void finished( Fiber *fiber );
+	
+	void freeStack( void *stack, uint32_t size );
+	
+	Selector				*mSelector;
+	
+	//! The selector thread's context while it runs a fiber
+	ucontext_t				mContext;
+	
+	Mutex					mWakeupLock;
+	JetHead::vector<Wakeup>	mWakeups;
+	
+	//! A heap of Timeouts, only used on the selector's thread
+	JetHead::vector<Timeout> mTimeouts;
+	
+	//! The deadline of the timed event sent for mTimeouts, 0 if none
+	uint64_t				mTimerDeadline;
+	
+	//! Stacks of kDefaultStackSize to reuse, on the selector's thread
+	JetHead::vector<void*>	mFreeStacks;
+	
+	//! Protects mNumFibers, and is broadcast on when a fiber finishes
+	Mutex					mDoneLock;
+	Condition				mDone;
+	int						mNumFibers;
+};
+
+#endif // JH_FIBER_H_
@@ -113,6 +113,23 @@ namespace JetHead
 		//! A passthrough for write(2)
 		int write( const void *buffer, int len );
 		
+		/**
+		 * Start a read that completes in the background.  When it is
+		 * done an AsyncIoEvent with the result is sent to dispatcher.
+		 * The buffer must stay valid until then.  See IoEngine.
+		 *
+		 * @param offset where to read from, or -1 to read from (and
+		 *  advance) the current position.
+		 * @return 0 if the read was started, -1 if not.
+		 */
+		int readAsync( void *buffer, int len, IEventDispatcher *dispatcher,
+					   jh_off64_t offset = -1, jh_ptr_int_t private_data = 0 );
+		
+		//! Start a background write, see readAsync
+		int writeAsync( const void *buffer, int len, 
+						IEventDispatcher *dispatcher, jh_off64_t offset = -1,
+						jh_ptr_int_t private_data = 0 );
+		
 		/**
 		 *	Get the file position (64-bit safe)
 		 */
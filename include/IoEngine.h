@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef JH_IO_ENGINE_H_
+#define JH_IO_ENGINE_H_
+
+#include "jh_types.h"
+#include "Event.h"
+#include "Mutex.h"
+#include "Thread.h"
+
+class IoUring;
+class Selector;
+
+/**
+ * The result of a read, write or accept started with IoEngine (or
+ * the readAsync, writeAsync and acceptAsync methods of File and
+ * Socket).  It is sent to the dispatcher the request was made with,
+ * and is usually received with an
+ * EventMethod<YourClass, AsyncIoEvent>.
+ */
+class AsyncIoEvent : public Event
+{
+public:
+	enum Op {
+		kRead,
+		kWrite,
+		kAccept
+	};
+	
+	AsyncIoEvent( Op op, int fd, void *buffer, int length, 
+				  jh_ptr_int_t private_data ) : 
+		Event( Event::kAsyncIoEventId ), mOp( op ), mFd( fd ), 
+		mBuffer( buffer ), mLength( length ), mResult( -1 ), mError( 0 ),
+		mPrivateData( private_data ) {}
+	
+	SMART_CASTABLE( Event::kAsyncIoEventId );
+	
+	//! What was requested
+	Op getOp() { return mOp; }
+	
+	//! The fd the request was made on
+	int getFd() { return mFd; }
+	
+	//! The buffer given with the request, NULL for accept
+	void *getBuffer() { return mBuffer; }
+	
+	//! The length given with the request
+	int getLength() { return mLength; }
+	
+	/**
+	 * The number of bytes read or written, or the new connection's fd
+	 * for accept.  -1 if the request failed, see getError().
+	 */
+	int getResult() { return mResult; }
+	
+	//! The errno of a failed request, 0 if it succeeded
+	int getError() { return mError; }
+	
+	//! The private data given with the request
+	jh_ptr_int_t getPrivateData() { return mPrivateData; }
+	
+private:
+	friend class IoEngine;
+	
+	//! Set the result from a system call style return and errno
+	void setResult( int res, int error )
+	{
+		mResult = res;
+		mError = res < 0 ? error : 0;
+	}
+	
+	Op				mOp;
+	int				mFd;
+	void			*mBuffer;
+	int				mLength;
+	int				mResult;
+	int				mError;
+	jh_ptr_int_t	mPrivateData;
+};
+
+/**
+ * Completion based I/O.  Requests are handed off and return at once,
+ * and when the read, write or accept is done an AsyncIoEvent with the
+ * result is sent to the given dispatcher.  The buffer must stay valid
+ * until then.
+ *
+ * On Linux with io_uring the kernel does the I/O itself and a single
+ * thread just collects completions.  Everywhere else (or if io_uring
+ * is unavailable) the engine waits for readiness on its own Selector
+ * and does the system call once the fd is ready.
+ */
+class IoEngine
+{
+public:
+	/**
+	 * The engine shared by File and Socket, created the first time
+	 * it is used.
+	 */
+	static IoEngine *getDefault();
+	
+	//! Destroy the shared engine, if it was created
+	static void destroyDefault();
+	
+	/**
+	 * Create an engine with its own thread.
+	 *
+	 * @param name the name of the thread.
+	 * @param useUring false to always use the Selector based engine.
+	 */
+	IoEngine( const char *name = "IoEngine", bool useUring = true );
+	
+	/**
+	 * Stop the engine.  Requests still outstanding are cancelled
+	 * without sending their events, so their fds and buffers must
+	 * not be in use by anyone else when this is called.
+	 */
+	~IoEngine();
+	
+	//! Is the kernel doing the I/O for us?
+	bool isUring() { return mRing != NULL; }
+	
+	/**
+	 * Read up to len bytes from fd into buffer.
+	 *
+	 * @param offset the position to read at, or -1 to read at (and
+	 *  advance) the fd's current position.  Must be -1 for sockets
+	 *  and pipes.
+	 * @param dispatcher who gets the AsyncIoEvent.
+	 * @param private_data returned in the AsyncIoEvent.
+	 * @return 0 if the request was started, -1 with errno set if not,
+	 *  in which case no event will be sent.
+	 */
+	int read( int fd, void *buffer, int len, jh_off64_t offset,
+			  IEventDispatcher *dispatcher, jh_ptr_int_t private_data = 0 );
+	
+	//! Write len bytes from buffer to fd, otherwise the same as read
+	int write( int fd, const void *buffer, int len, jh_off64_t offset,
+			   IEventDispatcher *dispatcher, jh_ptr_int_t private_data = 0 );
+	
+	/**
+	 * Write to a socket with send(2), without raising SIGPIPE if the
+	 * other side has gone away.  Otherwise the same as write.
+	 */
+	int send( int fd, const void *buffer, int len, 
+			  IEventDispatcher *dispatcher, jh_ptr_int_t private_data = 0 );
+	
+	/**
+	 * Accept a connection on listening socket fd.  The result is the
+	 * new connection's fd, which belongs to the receiver of the event.
+	 */
+	int accept( int fd, IEventDispatcher *dispatcher, 
+				jh_ptr_int_t private_data = 0 );
+	
+	/**
+	 * Requests made between beginBatch and endBatch are handed to
+	 * the kernel together at endBatch, with one system call.  They
+	 * nest, and do nothing if io_uring is not in use.
+	 */
+	void beginBatch();
+	void endBatch();
+	
+	/**
+	 * The number of requests started whose event hasn't been sent
+	 * yet.  Once it is 0 the engine is done with every dispatcher.
+	 */
+	int getNumPending();
+	
+private:
+	struct Request;
+	
+	//! Start a request, taking ownership of it
+	int start( Request *req );
+	
+	//! Hand the request to the kernel, must hold mLock
+	int submitUring( Request *req );
+	
+	//! Link/unlink a request in the outstanding list, must hold mLock
+	void addPending( Request *req );
+	void removePending( Request *req );
+	
+	//! Send the result of a request and free it
+	void complete( Request *req, int res, int error );
+	
+	//! Collects io_uring completions
+	void threadMain();
+	
+	//! The ops we need from the kernel
+	static const uint8_t kOps[];
+	static const int kNumOps = 5;
+	
+	//! How many requests can be queued before they must be submitted
+	static const unsigned kRingSize = 256;
+	
+	Mutex			mLock;
+	
+	//! The ring, NULL if we are using mSelector instead
+	IoUring			*mRing;
+	Selector		*mSelector;
+	
+	//! Requests started and not completed yet
+	Request			*mPending;
+	int				mNumPending;
+	
+	//! Depth of beginBatch calls
+	int				mBatch;
+	
+	//! Collects completions from mRing
+	Runnable<IoEngine>	mThread;
+	
+	static IoEngine *mDefault;
+};
+
+#endif // JH_IO_ENGINE_H_
@@ -52,7 +52,7 @@ class ListenerContainer
 	// NOTE:  Should not be called during handling of listener events.
 	void addListener(ListenerType *listener)
 	{
-		AutoLock lock(mMutex);
+		AutoWriteLock lock(mLock);
 		mListenerList.push_back(listener);
 	}
 	
@@ -60,7 +60,7 @@ class ListenerContainer
 	// NOTE:  Should not be called during handling of listener events.
 	void removeListener(ListenerType *listener)
 	{
-		AutoLock lock(mMutex);
+		AutoWriteLock lock(mLock);
 		
 		// The "typename" is necessary here because templates
 		// are dirty: the compiler is not yet "aware" of
@@ -83,10 +83,11 @@ class ListenerContainer
 		}
 	}
 	
-	// Called to invoke all listeners using the Invoker specified
+	// Called to invoke all listeners using the Invoker specified.
+	// NOTE:  Threads may invoke the listeners at the same time.
 	void invokeListeners(Invoker &invoker)
 	{
-		AutoLock lock(mMutex);
+		AutoReadLock lock(mLock);
 		
 		// See the big comment in removeListener
 		for (typename JetHead::list< ListenerType *>::iterator i = mListenerList.begin(); 
@@ -99,7 +100,7 @@ class ListenerContainer
 	
  private:
 	JetHead::list<ListenerType *> mListenerList;
-	Mutex	mMutex;
+	RWLock	mLock;
 };
 
 #endif // LISTENERCONTAINER_H
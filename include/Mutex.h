@@ -31,15 +31,36 @@
 #include <pthread.h>
 #include "jh_types.h"
 #include "Thread.h"
+#include "jh_vector.h"
 
 #define DebugLock()		TraceLock( __FILE__, __LINE__ )
 #define DebugUnlock()	TraceUnlock( __FILE__, __LINE__ )
 
 #define DebugAutoLock( mutex )	AutoLock _auto_lock_( mutex, __FILE__, __LINE__ )
 
+// Mutex and Condition are built on futexes on Linux, except with 
+//  JH_MUTEX_DEBUG.  Only Mutex.cpp and Condition.cpp look at this.
+#if defined( __linux__ ) && !defined( JH_MUTEX_DEBUG )
+#define JH_MUTEX_FUTEX
+#endif
+
 /**
  *	The Mutex object allows locking of critical sections of code to prevent
  *	concurrency errors.
+ *
+ *	On Linux a Mutex is a bare futex, locked inline with one compare and
+ *	swap when it's free.  When it isn't, it spins for about as long as
+ *	it has had to lately before it sleeps.  Build with JH_MUTEX_DEBUG
+ *	(Debug CMake builds do) to make it an error checking pthread mutex
+ *	instead, which catches being locked twice and unlocked when it isn't
+ *	held, and keeps track of who holds it and where they locked it.
+ *
+ *	A priority inheriting Mutex lends the priority of the threads 
+ *	waiting for it to the thread holding it, so a real time thread
+ *	can't be held up indefinitely by lower priority threads keeping the
+ *	holder from running.  On Linux it is a PI futex, which still locks
+ *	uncontended with a compare and swap, otherwise a pthread mutex with
+ *	PTHREAD_PRIO_INHERIT.
  */
 class Mutex
 {
@@ -48,17 +69,30 @@ class Mutex
 	Mutex( bool recursive = false );
 
 	//! Create a named mutex object, nicer for error messages
-	Mutex( const char *name, bool recursive = false );
+	Mutex( const char *name, bool recursive = false, 
+		   bool priorityInherit = false );
 	
 	//! Clean up the mutex
 	~Mutex();
 	
 
 	//! This method will lock this mutex, blocking until the lock is available
-	void Lock();
+	void Lock()
+	{
+		if ( mSlowPath or mSite != NULL )
+			TraceLock( "unknown", 0 );
+		else
+			fastLock();
+	}
 	
 	//! This method will unlock this mutex.
-	void Unlock();
+	void Unlock()
+	{
+		if ( mSlowPath or mSite != NULL )
+			TraceUnlock( "unknown", 0 );
+		else
+			fastUnlock();
+	}
 	
 	//! Grab the lock, print out trace info if the grab fails
 	void TraceLock( const char *file, int line );
@@ -67,12 +101,78 @@ class Mutex
 	//! This method will unlock this mutex, print out trace info on error
 	void TraceUnlock( const char *file, int line_num );
 
-	//! Is this lock held by this thread?
+	/**
+	 * Is this lock held by this thread?  Without JH_MUTEX_DEBUG this
+	 *  is only known for recursive locks, and is false for others.
+	 */
 	bool isLocked();
 	
-	//! What thread has locked this?
+	//! What thread has locked this?  Always NULL without JH_MUTEX_DEBUG
 	const char *getOwner();
 	
+	bool isPriorityInherit() const { return mPriorityInherit; }
+	
+	/**
+	 * Make the locks of the EventQueues and CircularBuffers created from
+	 *  now on priority inheriting (they aren't to start with).  Turn this
+	 *  on before making the queues shared between real time threads and
+	 *  others, so time critical threads get a bounded wait for them.
+	 */
+	static void setQueuePriorityInherit( bool enable )
+	{
+		mQueuePriorityInherit = enable;
+	}
+	
+	static bool getQueuePriorityInherit() { return mQueuePriorityInherit; }
+	
+	/**
+	 * What the lock profiler knows about a lock, or about one place it
+	 *  is taken.  Times are in nanoseconds.  Wait time is only counted
+	 *  for contended acquisitions.  Hold time stops while the lock is
+	 *  given up in a Condition wait.
+	 */
+	struct LockProfile
+	{
+		char		mName[ 40 ];
+		//! Where the lock was taken, NULL when it is for a whole lock
+		const char	*mFile;
+		int			mLine;
+		uint64_t	mAcquisitions;
+		uint64_t	mContended;
+		uint64_t	mWaitNsecs;
+		uint64_t	mMaxWaitNsecs;
+		uint64_t	mHoldNsecs;
+		uint64_t	mMaxHoldNsecs;
+	};
+	
+	/**
+	 * Turn the lock profiler on or off.  While it is on, every Mutex 
+	 *  and the global critical section count their acquisitions, 
+	 *  contention and wait and hold times, for each name and each
+	 *  place they are taken (the file and line given to TraceLock, so
+	 *  use DebugLock and DebugAutoLock for useful sites).  Mutexes with
+	 *  the same name are counted together.  It costs a trylock and two
+	 *  cycle clock reads a lock, nothing but a flag test when off.
+	 */
+	static void setProfiling( bool enable );
+	
+	static bool isProfiling() { return mProfiling; }
+	
+	/**
+	 * Get the profile, most contended (by total wait time) first.
+	 *
+	 * @param bySite one entry for each place each lock is taken if
+	 * true, one for each lock name if false.
+	 */
+	static void getProfile( JetHead::vector<LockProfile> &profile,
+							bool bySite = true );
+	
+	//! Zero the profile's counts
+	static void resetProfile();
+	
+	//! Log the count most contended locks, and the sites taking them
+	static void logProfile( int count = 10 );
+	
 	/**
 	 * Global intialization of Mutex objects, automatically handled
 	 * elsewhere. you probably don't need to touch this.
@@ -115,7 +215,10 @@ class Mutex
 	 */
 	static void EnterCriticalSection()
 	{
-		pthread_mutex_lock( &mCriticalSection );
+		if ( mProfiling )
+			profileEnterCriticalSection();
+		else
+			pthread_mutex_lock( &mCriticalSection );
 	}
 	
 	/**
@@ -131,7 +234,10 @@ class Mutex
 	 */	
 	static void ExitCriticalSection()
 	{
-		pthread_mutex_unlock( &mCriticalSection );
+		if ( mCriticalSectionSite != NULL )
+			profileExitCriticalSection();
+		else
+			pthread_mutex_unlock( &mCriticalSection );
 	}
 	
  private:
@@ -140,10 +246,77 @@ class Mutex
 	 * the mRecursive member to determine which attributes to set.
 	 */
 	void create_lock();
+	
+	/**
+	 * Lock and unlock the futex, without debugging or profiling.  Only
+	 *  used when mSlowPath is false, which it never is unless 
+	 *  JH_MUTEX_FUTEX was defined when building Mutex.cpp.
+	 */
+	void fastLock()
+	{
+		if ( mRecursive or mPriorityInherit or
+			 not __sync_bool_compare_and_swap( &mFutex, 0, 1 ) )
+			lockFutex();
+	}
+	
+	void fastUnlock()
+	{
+		if ( mRecursive or mPriorityInherit )
+			unlockFutex();
+		else if ( __sync_fetch_and_sub( &mFutex, 1 ) != 1 )
+			wakeFutex();
+	}
+	
+	bool tryLockFutex();
+	void lockFutex();
+	void unlockFutex();
+	void wakeFutex();
+	
+	//! Lock and unlock a priority inheriting futex
+	void lockPi();
+	void unlockPi();
+	
+	//! Unlock fully for a Condition wait, returning the recursion count
+	int releaseForWait();
+	void reacquireAfterWait( int count );
+	
+	/**
+	 * Sleep while *addr is val, until woken or until deadline (an 
+	 *  absolute CLOCK_MONOTONIC time) if it isn't NULL.  Returns false
+	 *  if deadline passed.
+	 */
+	static bool futexWait( volatile int *addr, int val, 
+						   const struct timespec *deadline );
+	static void futexWake( volatile int *addr, int count );
+	
+	void lockFailed( int res );
+	
+	//! Profiling versions of Enter/ExitCriticalSection
+	static void profileEnterCriticalSection();
+	static void profileExitCriticalSection();
+	
+	//! Stop and restart the hold time around a Condition wait
+	void pauseHold();
+	void resumeHold();
 
-	//! The lock for this particular Mutex object
+	//! The lock for this particular Mutex object, unless JH_MUTEX_FUTEX
 	pthread_mutex_t	mMutex;
 	
+	/**
+	 * The lock with JH_MUTEX_FUTEX, 0 when unlocked, 1 when locked, 2
+	 *  when locked and there may be threads sleeping on it.  If it is
+	 *  priority inheriting, the holder's thread id when locked, which
+	 *  the kernel marks with FUTEX_WAITERS when there are any.
+	 */
+	volatile int mFutex;
+	
+	//! The holder of a recursive futex lock and how often they've locked it
+	volatile pthread_t mOwner;
+	int mCount;
+	
+	//! About how long locking has spun for lately
+	int mSpins;
+	
 	//! Who lock this lock (or NULL if it is unlocked)
 	Thread *mLockedBy;
 
@@ -156,6 +329,9 @@ class Mutex
 	 * cause an error?).
 	 */
 	bool mRecursive;
+	
+	//! Is the holder lent the priority of its waiters?
+	bool mPriorityInherit;
 
 	/**
 	 * If we are tracing, this is supposed to be the name of the file
@@ -169,11 +345,35 @@ class Mutex
 	 */
 	int mLockLine;
 	
+	//! How many times the holder has this locked
+	int mDepth;
+	
+	//! The profiler's record for where this was locked, if profiling
+	void *mSite;
+	
+	//! The cycle clock when this was locked, if profiling
+	uint64_t mLockedAt;
+	
 	//! The static lock used globally
 	static pthread_mutex_t mCriticalSection;
 	static bool mInited;
 	
+	static volatile bool mProfiling;
+	
+	static bool mQueuePriorityInherit;
+	
+	/**
+	 * Take the TraceLock and TraceUnlock path, for JH_MUTEX_DEBUG or 
+	 *  profiling.  A Mutex holding mSite also takes it, as it was
+	 *  locked while profiling.
+	 */
+	static volatile bool mSlowPath;
+	static void *mCriticalSectionSite;
+	static uint64_t mCriticalSectionLockedAt;
+	
 	friend class Condition;
+	friend class AutoLock;
+	friend class RWLock;
 };
 
 
@@ -182,19 +382,39 @@ class AutoLock
 {
  public:
 	//! Lock the provided mutex
-	AutoLock( Mutex &m );
+	AutoLock( Mutex &m )
+		: mMutex( m ), mFile( "AutoLock" ), mLine( 0 )
+	{
+		if ( Mutex::mSlowPath or mMutex.mSite != NULL )
+			mMutex.TraceLock( mFile, mLine );
+		else
+			mMutex.fastLock();
+	}
 
 	//! Lock the provided mutex and update tracing information
-	AutoLock( Mutex &m, const char *file, int line );
+	AutoLock( Mutex &m, const char *file, int line )
+		: mMutex( m ), mFile( file ), mLine( line )
+	{
+		if ( Mutex::mSlowPath or mMutex.mSite != NULL )
+			mMutex.TraceLock( mFile, mLine );
+		else
+			mMutex.fastLock();
+	}
 	
 	//! Unlock the mutex when we go out of scope
-	~AutoLock();
+	~AutoLock()
+	{
+		if ( Mutex::mSlowPath or mMutex.mSite != NULL )
+			mMutex.TraceUnlock( mFile, mLine );
+		else
+			mMutex.fastUnlock();
+	}
 
 	//! Manually re-lock the mutex that we are wrapping
-	void Lock();
+	void Lock() { mMutex.Lock(); }
 
 	//! Manually unlock the mutex that we are wrapping
-	void Unlock();
+	void Unlock() { mMutex.Unlock(); }
 	
  private:
 	//! The mutex we are holding
@@ -242,4 +462,242 @@ class GenericAutoLock
 	T &mMutex;
 };
 
+/**
+ *	A reader-writer lock for read-mostly state.  Any number of readers
+ *	can hold it at once, or one writer.
+ *
+ *	Readers count themselves in one of kReaderSlots counters, each on
+ *	its own cache line and picked by hashing the thread, so readers on
+ *	different cores don't bounce a shared count between them.  The 
+ *	slots make an RWLock over 1KB.  An 
+ *	uncontended ReadLock is one atomic add and a test of mWriters.
+ *	Writers are preferred: once a writer is waiting, new readers wait
+ *	for it (and any writers queued behind it), so a thread must not 
+ *	take the read lock again while it holds it.  Writers are serialized
+ *	by a Mutex with the RWLock's name, which the lock profiler sees.
+ */
+class RWLock
+{
+ public:
+	RWLock( const char *name = NULL );
+	~RWLock();
+	
+	//! Lock for reading, blocking while any writer holds or wants it
+	void ReadLock()
+	{
+		volatile int *readers = &slots()[ readerSlot() ].mReaders;
+		
+		__sync_fetch_and_add( readers, 1 );
+		
+		if ( mWriters != 0 )
+			readWait( readers );
+	}
+	
+	void ReadUnlock()
+	{
+		__sync_fetch_and_sub( &slots()[ readerSlot() ].mReaders, 1 );
+		
+		if ( mWriters != 0 )
+			readerLeft();
+	}
+	
+	//! Lock for writing, blocking until all readers are gone
+	void WriteLock();
+	
+	void WriteUnlock();
+	
+ private:
+	static const int kReaderSlots = 16;
+	static const int kCacheLine = 64;
+	
+	struct ReaderSlot
+	{
+		volatile int mReaders;
+		char mPad[ kCacheLine - sizeof( int ) ];
+	};
+	
+	//! The slots, starting on the first cache line in mSlotSpace
+	ReaderSlot *slots()
+	{
+		return (ReaderSlot*)( ( (uintptr_t)mSlotSpace + kCacheLine - 1 ) & 
+							  ~(uintptr_t)( kCacheLine - 1 ) );
+	}
+	
+	//! This thread's reader counter, always the same one for a thread
+	static int readerSlot()
+	{
+		uint32_t hash = (uint32_t)( (uintptr_t)pthread_self() >> 10 );
+		return ( hash * 0x9E3779B1U ) >> 28;
+	}
+	
+	//! Back out of a ReadLock, and wait for the writers to finish
+	void readWait( volatile int *readers );
+	
+	//! A reader has gone while a writer is waiting, wake it to look
+	void readerLeft();
+	
+	//! How many readers there are, summing over the slots
+	int countReaders();
+	
+	//! Room for the slots wherever the RWLock lands, heap or not
+	char mSlotSpace[ ( kReaderSlots + 1 ) * kCacheLine ];
+	
+	//! Writers holding or waiting for the lock
+	volatile int mWriters;
+	
+	//! Readers sleeping for mWriters to get to 0
+	volatile int mReadWaiters;
+	
+	//! Bumped by each reader leaving while the writer waits for them
+	volatile int mDrainSeq;
+	
+	//! Set while the writer is sleeping on mDrainSeq
+	volatile int mDraining;
+	
+	Mutex mWriteLock;
+};
+
+//! Read lock an RWLock for the scope
+class AutoReadLock
+{
+ public:
+	AutoReadLock( RWLock &lock ) : mLock( lock ) { mLock.ReadLock(); }
+	~AutoReadLock() { mLock.ReadUnlock(); }
+	
+ private:
+	RWLock &mLock;
+};
+
+//! Write lock an RWLock for the scope
+class AutoWriteLock
+{
+ public:
+	AutoWriteLock( RWLock &lock ) : mLock( lock ) { mLock.WriteLock(); }
+	~AutoWriteLock() { mLock.WriteUnlock(); }
+	
+ private:
+	RWLock &mLock;
+};
+
+/**
+ *	A sequence lock, for small plain data that is read far more often
+ *	than it is written.  Readers take no lock at all and never make a
+ *	writer wait: they note the sequence, copy the data, and copy it 
+ *	again if a write happened meanwhile.
+ *
+ *	@code
+ *	uint32_t seq;
+ *	do {
+ *		seq = lock.ReadBegin();
+ *		copy = shared;
+ *	} while ( lock.ReadRetry( seq ) );
+ *	@endcode
+ *
+ *	Since a reader can see a write half done, only copy the data inside
+ *	the loop, never follow pointers in it.  SeqLocked wraps this up for
+ *	a single value.
+ */
+class SeqLock
+{
+ public:
+	SeqLock( const char *name = NULL ) : mSeq( 0 ), mWriteLock( name ) {}
+	
+	//! Start reading, returning the sequence to give ReadRetry
+	uint32_t ReadBegin() const
+	{
+		uint32_t seq = mSeq;
+		
+		// Odd while a write is in progress
+		if ( seq & 1 )
+			seq = waitForWriter();
+		
+		readBarrier();
+		return seq;
+	}
+	
+	//! Has there been a write since ReadBegin returned seq?
+	bool ReadRetry( uint32_t seq ) const
+	{
+		readBarrier();
+		return mSeq != seq;
+	}
+	
+	void WriteLock()
+	{
+		mWriteLock.Lock();
+		mSeq++;
+		__sync_synchronize();
+	}
+	
+	void WriteUnlock()
+	{
+		__sync_synchronize();
+		mSeq++;
+		mWriteLock.Unlock();
+	}
+	
+ private:
+	//! Keep the data reads between the sequence reads
+	static void readBarrier()
+	{
+#if defined( __i386__ ) || defined( __x86_64__ )
+		// x86 doesn't reorder loads with loads
+		__asm__ __volatile__( "" ::: "memory" );
+#else
+		__sync_synchronize();
+#endif
+	}
+	
+	//! Spin, then yield, until the sequence is even
+	uint32_t waitForWriter() const;
+	
+	volatile uint32_t mSeq;
+	
+	Mutex mWriteLock;
+};
+
+//! Write lock a SeqLock for the scope
+class AutoSeqWriteLock
+{
+ public:
+	AutoSeqWriteLock( SeqLock &lock ) : mLock( lock ) { mLock.WriteLock(); }
+	~AutoSeqWriteLock() { mLock.WriteUnlock(); }
+	
+ private:
+	SeqLock &mLock;
+};
+
+//! A value of plain data kept under a SeqLock
+template<class T>
+class SeqLocked
+{
+ public:
+	SeqLocked( const T &value = T(), const char *name = NULL ) 
+		: mLock( name ), mValue( value ) {}
+	
+	T get() const
+	{
+		T value;
+		uint32_t seq;
+		
+		do
+		{
+			seq = mLock.ReadBegin();
+			value = mValue;
+		} while ( mLock.ReadRetry( seq ) );
+		
+		return value;
+	}
+	
+	void set( const T &value )
+	{
+		AutoSeqWriteLock lock( mLock );
+		mValue = value;
+	}
+	
+ private:
+	SeqLock mLock;
+	T mValue;
+};
+
 #endif // _JH_MUTEX_H_
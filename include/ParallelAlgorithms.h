@@ -0,0 +1,658 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JH_PARALLEL_ALGORITHMS_H_
+#define JH_PARALLEL_ALGORITHMS_H_
+
+#include "jh_types.h"
+#include "jh_vector.h"
+#include "jh_memory.h"
+#include "TaskExecutor.h"
+
+#include <algorithm>
+
+/**
+ * \file
+ *
+ * Parallel loops, reductions, sorts and prefix scans over index ranges,
+ * raw arrays and JetHead::vectors, run on a TaskExecutor (the default
+ * one unless another is given).
+ *
+ * A range is split in halves, one half handed to the executor as a
+ * task and the other split again, down to chunks of at most grain
+ * elements.  Idle threads steal the biggest halves left.  A grain of 0
+ * picks one giving about 8 chunks a thread, use a bigger one if the
+ * work per element is tiny.  Called from a task they split the work
+ * the same way, so they can be nested.
+ *
+ * Functors are called from several threads at once, so their
+ * operator() must be const and thread safe.
+ */
+
+namespace JetHead
+{
+	namespace ParallelDetail
+	{
+		//! About 8 chunks for each thread, and never 0
+		inline unsigned defaultGrain( unsigned count, TaskExecutor *executor )
+		{
+			unsigned grain = count / ( executor->getNumThreads() * 8 );
+			return grain > 0 ? grain : 1;
+		}
+		
+		inline TaskExecutor *pickExecutor( TaskExecutor *executor )
+		{
+			return executor != NULL ? executor : TaskExecutor::getDefault();
+		}
+		
+		//! Run the first task of an algorithm, and wait for it to finish
+		inline void runRoot( TaskExecutor *executor, Task *task )
+		{
+			// On one of the executor's threads it can run it right here,
+			//  and its subtasks are stolen from this thread's deque.
+			if ( executor->isWorkerThread() )
+				task->run();
+			else
+			{
+				executor->submit( task );
+				task->wait();
+			}
+		}
+		
+		//! Calls body( begin, end ) on chunks of [begin, end)
+		template<class Body>
+		class ForTask : public Task
+		{
+		public:
+			ForTask( TaskExecutor *executor, const Body &body, 
+					 unsigned begin, unsigned end, unsigned grain ) :
+				mExecutor( executor ), mBody( body ), mBegin( begin ),
+				mEnd( end ), mGrain( grain ) {}
+			
+			void run()
+			{
+				SmartPtr<Task> halves[ 32 ];
+				int numHalves = 0;
+				unsigned end = mEnd;
+				
+				// Hand off the top half until what's left is a chunk
+				while ( end - mBegin > mGrain )
+				{
+					unsigned middle = mBegin + ( end - mBegin ) / 2;
+					
+					halves[ numHalves ] = jh_new ForTask( mExecutor, mBody,
+														 middle, end, mGrain );
+					mExecutor->submit( halves[ numHalves++ ] );
+					end = middle;
+				}
+				
+				mBody( mBegin, end );
+				
+				while ( numHalves > 0 )
+					halves[ --numHalves ]->wait();
+			}
+			
+		private:
+			TaskExecutor	*mExecutor;
+			const Body		&mBody;
+			unsigned		mBegin;
+			unsigned		mEnd;
+			unsigned		mGrain;
+		};
+		
+		//! Adapts a body( T *first, T *last ) to index ranges of array
+		template<class T, class Body>
+		class ArrayBody
+		{
+		public:
+			ArrayBody( T *array, const Body &body ) : 
+				mArray( array ), mBody( body ) {}
+			
+			void operator()( unsigned begin, unsigned end ) const
+			{
+				mBody( mArray + begin, mArray + end );
+			}
+			
+		private:
+			T			*mArray;
+			const Body	&mBody;
+		};
+		
+		/**
+		 * Combines body( begin, end, identity ) over chunks of [begin,
+		 *  end) with combine( left, right ), in order.
+		 */
+		template<class R, class Body, class Combine>
+		class ReduceTask : public Future<R>
+		{
+		public:
+			ReduceTask( TaskExecutor *executor, const R &identity,
+						const Body &body, const Combine &combine,
+						unsigned begin, unsigned end, unsigned grain ) :
+				mExecutor( executor ), mIdentity( identity ), mBody( body ),
+				mCombine( combine ), mBegin( begin ), mEnd( end ), 
+				mGrain( grain ) {}
+			
+			void run()
+			{
+				SmartPtr<ReduceTask> halves[ 32 ];
+				int numHalves = 0;
+				unsigned end = mEnd;
+				
+				while ( end - mBegin > mGrain )
+				{
+					unsigned middle = mBegin + ( end - mBegin ) / 2;
+					
+					halves[ numHalves ] = jh_new ReduceTask( mExecutor, 
+						mIdentity, mBody, mCombine, middle, end, mGrain );
+					mExecutor->submit( halves[ numHalves++ ] );
+					end = middle;
+				}
+				
+				R result = mBody( mBegin, end, mIdentity );
+				
+				// The last half handed off is the one right after ours
+				while ( numHalves > 0 )
+				{
+					ReduceTask *half = halves[ --numHalves ];
+					half->wait();
+					result = mCombine( result, half->getResult() );
+				}
+				
+				this->mResult = result;
+			}
+			
+			//! The result once run, even if it ran without being submitted
+			const R &getResult() const { return this->mResult; }
+			
+		private:
+			TaskExecutor	*mExecutor;
+			const R			&mIdentity;
+			const Body		&mBody;
+			const Combine	&mCombine;
+			unsigned		mBegin;
+			unsigned		mEnd;
+			unsigned		mGrain;
+		};
+		
+		//! Folds combine over elements of array, as a reduce body
+		template<class T, class Combine>
+		class ArrayFold
+		{
+		public:
+			ArrayFold( const T *array, const Combine &combine ) :
+				mArray( array ), mCombine( combine ) {}
+			
+			T operator()( unsigned begin, unsigned end, const T &init ) const
+			{
+				T result = init;
+				
+				for ( unsigned i = begin; i < end; i++ )
+					result = mCombine( result, mArray[ i ] );
+				
+				return result;
+			}
+			
+		private:
+			const T			*mArray;
+			const Combine	&mCombine;
+		};
+		
+		template<class T>
+		struct Less
+		{
+			bool operator()( const T &a, const T &b ) const { return a < b; }
+		};
+		
+		/**
+		 * Merge sort, with both the sorting of the halves and the
+		 *  merging done in parallel.  Each level moves the data between
+		 *  the array and a buffer as big, ending in whichever was asked.
+		 */
+		template<class T, class Compare>
+		class Sorter
+		{
+		public:
+			Sorter( TaskExecutor *executor, const Compare &compare, 
+					unsigned grain ) :
+				mExecutor( executor ), mCompare( compare ), mGrain( grain ) {}
+			
+			//! Sort array, leaving the result in buffer if intoBuffer
+			void sort( T *array, T *buffer, unsigned count, bool intoBuffer )
+			{
+				if ( count <= mGrain )
+				{
+					std::sort( array, array + count, mCompare );
+					
+					if ( intoBuffer )
+						std::copy( array, array + count, buffer );
+					
+					return;
+				}
+				
+				unsigned half = count / 2;
+				
+				// Sort the halves into where we are not merging to
+				SmartPtr<Task> right = jh_new SortTask( this, array + half, 
+					buffer + half, count - half, not intoBuffer );
+				mExecutor->submit( right );
+				sort( array, buffer, half, not intoBuffer );
+				right->wait();
+				
+				if ( intoBuffer )
+					merge( array, half, array + half, count - half, buffer );
+				else
+					merge( buffer, half, buffer + half, count - half, array );
+			}
+			
+			//! Merge sorted a and b into out
+			void merge( const T *a, unsigned na, const T *b, unsigned nb,
+						T *out )
+			{
+				if ( na + nb <= mGrain )
+				{
+					std::merge( a, a + na, b, b + nb, out, mCompare );
+					return;
+				}
+				
+				if ( na < nb )
+				{
+					std::swap( a, b );
+					std::swap( na, nb );
+				}
+				
+				// Everything before a's middle and where it would go in b
+				//  ends up before everything after
+				unsigned ma = na / 2;
+				unsigned mb = std::lower_bound( b, b + nb, a[ ma ], mCompare ) - b;
+				
+				SmartPtr<Task> right = jh_new MergeTask( this, a + ma, na - ma, 
+					b + mb, nb - mb, out + ma + mb );
+				mExecutor->submit( right );
+				merge( a, ma, b, mb, out );
+				right->wait();
+			}
+			
+		private:
+			class SortTask : public Task
+			{
+			public:
+				SortTask( Sorter *sorter, T *array, T *buffer, unsigned count,
+						  bool intoBuffer ) : 
+					mSorter( sorter ), mArray( array ), mBuffer( buffer ),
+					mCount( count ), mIntoBuffer( intoBuffer ) {}
+				
+				void run() { mSorter->sort( mArray, mBuffer, mCount, mIntoBuffer ); }
+				
+			private:
+				Sorter		*mSorter;
+				T			*mArray;
+				T			*mBuffer;
+				unsigned	mCount;
+				bool		mIntoBuffer;
+			};
+			
+			class MergeTask : public Task
+			{
+			public:
+				MergeTask( Sorter *sorter, const T *a, unsigned na, 
+						   const T *b, unsigned nb, T *out ) : 
+					mSorter( sorter ), mA( a ), mNa( na ), mB( b ), mNb( nb ),
+					mOut( out ) {}
+				
+				void run() { mSorter->merge( mA, mNa, mB, mNb, mOut ); }
+				
+			private:
+				Sorter		*mSorter;
+				const T		*mA;
+				unsigned	mNa;
+				const T		*mB;
+				unsigned	mNb;
+				T			*mOut;
+			};
+			
+			TaskExecutor	*mExecutor;
+			const Compare	&mCompare;
+			unsigned		mGrain;
+		};
+		
+		template<class T, class Compare>
+		class SortRoot : public Task
+		{
+		public:
+			SortRoot( Sorter<T, Compare> &sorter, T *array, T *buffer,
+					  unsigned count ) :
+				mSorter( sorter ), mArray( array ), mBuffer( buffer ),
+				mCount( count ) {}
+			
+			void run() { mSorter.sort( mArray, mBuffer, mCount, false ); }
+			
+		private:
+			Sorter<T, Compare>	&mSorter;
+			T					*mArray;
+			T					*mBuffer;
+			unsigned			mCount;
+		};
+		
+		//! The first scan pass, folding each chunk
+		template<class T, class Combine>
+		class ScanSums
+		{
+		public:
+			ScanSums( const T *in, T *sums, unsigned count, unsigned grain,
+					  const T &identity, const Combine &combine ) :
+				mIn( in ), mSums( sums ), mCount( count ), mGrain( grain ),
+				mIdentity( identity ), mCombine( combine ) {}
+			
+			void operator()( unsigned begin, unsigned end ) const
+			{
+				for ( unsigned chunk = begin; chunk < end; chunk++ )
+				{
+					unsigned first = chunk * mGrain;
+					unsigned last = std::min( first + mGrain, mCount );
+					T sum = mIdentity;
+					
+					for ( unsigned i = first; i < last; i++ )
+						sum = mCombine( sum, mIn[ i ] );
+					
+					mSums[ chunk ] = sum;
+				}
+			}
+			
+		private:
+			const T			*mIn;
+			T				*mSums;
+			unsigned		mCount;
+			unsigned		mGrain;
+			const T			&mIdentity;
+			const Combine	&mCombine;
+		};
+		
+		//! The second scan pass, scanning each chunk from its offset
+		template<class T, class Combine>
+		class ScanChunks
+		{
+		public:
+			ScanChunks( const T *in, T *out, const T *offsets, 
+						unsigned count, unsigned grain, 
+						const Combine &combine ) :
+				mIn( in ), mOut( out ), mOffsets( offsets ), mCount( count ),
+				mGrain( grain ), mCombine( combine ) {}
+			
+			void operator()( unsigned begin, unsigned end ) const
+			{
+				for ( unsigned chunk = begin; chunk < end; chunk++ )
+				{
+					unsigned first = chunk * mGrain;
+					unsigned last = std::min( first + mGrain, mCount );
+					T sum = mOffsets[ chunk ];
+					
+					for ( unsigned i = first; i < last; i++ )
+					{
+						sum = mCombine( sum, mIn[ i ] );
+						mOut[ i ] = sum;
+					}
+				}
+			}
+			
+		private:
+			const T			*mIn;
+			T				*mOut;
+			const T			*mOffsets;
+			unsigned		mCount;
+			unsigned		mGrain;
+			const Combine	&mCombine;
+		};
+	}
+	
+	/**
+	 * Call body( begin, end ) for chunks of [begin, end), in parallel,
+	 *  returning once they are all done.
+	 */
+	template<class Body>
+	void parallel_for( unsigned begin, unsigned end, const Body &body,
+					   unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		if ( end <= begin )
+			return;
+		
+		executor = ParallelDetail::pickExecutor( executor );
+		
+		if ( grain == 0 )
+			grain = ParallelDetail::defaultGrain( end - begin, executor );
+		
+		if ( end - begin <= grain or executor->getNumThreads() == 1 )
+		{
+			body( begin, end );
+			return;
+		}
+		
+		SmartPtr<Task> root = jh_new ParallelDetail::ForTask<Body>( 
+			executor, body, begin, end, grain );
+		ParallelDetail::runRoot( executor, root );
+	}
+	
+	//! Call body( T *first, T *last ) for chunks of array, in parallel
+	template<class T, class Body>
+	void parallel_for( T *array, unsigned count, const Body &body,
+					   unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		ParallelDetail::ArrayBody<T, Body> arrayBody( array, body );
+		parallel_for( 0, count, arrayBody, grain, executor );
+	}
+	
+	//! Call body( T *first, T *last ) for chunks of vec, in parallel
+	template<class T, class Body>
+	void parallel_for( JetHead::vector<T> &vec, const Body &body,
+					   unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		if ( not vec.empty() )
+			parallel_for( &vec[ 0 ], vec.size(), body, grain, executor );
+	}
+	
+	/**
+	 * Reduce [begin, end) in parallel.  body( begin, end, identity )
+	 *  returns the R for a chunk, and combine( left, right ) combines
+	 *  the R of two neighbouring ranges, which is done in order so it
+	 *  only needs to be associative.
+	 */
+	template<class R, class Body, class Combine>
+	R parallel_reduce( unsigned begin, unsigned end, const R &identity,
+					   const Body &body, const Combine &combine,
+					   unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		if ( end <= begin )
+			return identity;
+		
+		executor = ParallelDetail::pickExecutor( executor );
+		
+		if ( grain == 0 )
+			grain = ParallelDetail::defaultGrain( end - begin, executor );
+		
+		if ( end - begin <= grain or executor->getNumThreads() == 1 )
+			return body( begin, end, identity );
+		
+		SmartPtr<ParallelDetail::ReduceTask<R, Body, Combine> > root = 
+			jh_new ParallelDetail::ReduceTask<R, Body, Combine>( executor,
+				identity, body, combine, begin, end, grain );
+		ParallelDetail::runRoot( executor, root );
+		
+		return root->getResult();
+	}
+	
+	/**
+	 * Combine the elements of array with combine( a, b ), starting from
+	 *  identity, in parallel.  A sum with std::plus<int>(), say.
+	 */
+	template<class T, class Combine>
+	T parallel_reduce( const T *array, unsigned count, const T &identity,
+					   const Combine &combine, unsigned grain = 0, 
+					   TaskExecutor *executor = NULL )
+	{
+		ParallelDetail::ArrayFold<T, Combine> fold( array, combine );
+		return parallel_reduce( 0, count, identity, fold, combine, grain, 
+								executor );
+	}
+	
+	template<class T, class Combine>
+	T parallel_reduce( const JetHead::vector<T> &vec, const T &identity,
+					   const Combine &combine, unsigned grain = 0, 
+					   TaskExecutor *executor = NULL )
+	{
+		if ( vec.empty() )
+			return identity;
+		
+		return parallel_reduce( &vec[ 0 ], vec.size(), identity, combine,
+								grain, executor );
+	}
+	
+	/**
+	 * Sort array in parallel with compare( a, b ), true if a goes first.
+	 *  The sort is not stable, and takes a buffer as big as array.
+	 *  Chunks smaller than grain are sorted with std::sort.
+	 */
+	template<class T, class Compare>
+	void parallel_sort( T *array, unsigned count, const Compare &compare,
+						unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		executor = ParallelDetail::pickExecutor( executor );
+		
+		if ( grain == 0 )
+			grain = std::max( ParallelDetail::defaultGrain( count, executor ),
+							  1024U );
+		
+		if ( count <= grain or executor->getNumThreads() == 1 )
+		{
+			std::sort( array, array + count, compare );
+			return;
+		}
+		
+		T *buffer = jh_new T[ count ];
+		ParallelDetail::Sorter<T, Compare> sorter( executor, compare, grain );
+		SmartPtr<Task> root = jh_new ParallelDetail::SortRoot<T, Compare>( 
+			sorter, array, buffer, count );
+		
+		ParallelDetail::runRoot( executor, root );
+		
+		delete [] buffer;
+	}
+	
+	//! Sort array in parallel with operator <
+	template<class T>
+	void parallel_sort( T *array, unsigned count, unsigned grain = 0,
+						TaskExecutor *executor = NULL )
+	{
+		parallel_sort( array, count, ParallelDetail::Less<T>(), grain, 
+					   executor );
+	}
+	
+	template<class T, class Compare>
+	void parallel_sort( JetHead::vector<T> &vec, const Compare &compare,
+						unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		if ( not vec.empty() )
+			parallel_sort( &vec[ 0 ], vec.size(), compare, grain, executor );
+	}
+	
+	template<class T>
+	void parallel_sort( JetHead::vector<T> &vec, unsigned grain = 0,
+						TaskExecutor *executor = NULL )
+	{
+		parallel_sort( vec, ParallelDetail::Less<T>(), grain, executor );
+	}
+	
+	/**
+	 * An inclusive prefix scan in parallel: out[ i ] is in[ 0 ] combined
+	 *  with everything up to in[ i ].  in and out may be the same.  It
+	 *  combines each element twice, once to total each chunk and once
+	 *  to scan it, with a short serial scan of the chunk totals between.
+	 */
+	template<class T, class Combine>
+	void parallel_scan( const T *in, T *out, unsigned count, 
+						const T &identity, const Combine &combine,
+						unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		executor = ParallelDetail::pickExecutor( executor );
+		
+		if ( grain == 0 )
+			grain = ParallelDetail::defaultGrain( count, executor );
+		
+		unsigned numChunks = ( count + grain - 1 ) / grain;
+		
+		if ( numChunks <= 1 or executor->getNumThreads() == 1 )
+		{
+			T sum = identity;
+			
+			for ( unsigned i = 0; i < count; i++ )
+			{
+				sum = combine( sum, in[ i ] );
+				out[ i ] = sum;
+			}
+			
+			return;
+		}
+		
+		T *offsets = jh_new T[ numChunks ];
+		
+		parallel_for( 0, numChunks, ParallelDetail::ScanSums<T, Combine>( 
+						  in, offsets, count, grain, identity, combine ), 
+					  1, executor );
+		
+		// Turn the chunk totals into what goes before each chunk
+		T sum = identity;
+		
+		for ( unsigned chunk = 0; chunk < numChunks; chunk++ )
+		{
+			T total = offsets[ chunk ];
+			offsets[ chunk ] = sum;
+			sum = combine( sum, total );
+		}
+		
+		parallel_for( 0, numChunks, ParallelDetail::ScanChunks<T, Combine>( 
+						  in, out, offsets, count, grain, combine ), 
+					  1, executor );
+		
+		delete [] offsets;
+	}
+	
+	//! Scan in into out, which is resized to match
+	template<class T, class Combine>
+	void parallel_scan( const JetHead::vector<T> &in, JetHead::vector<T> &out,
+						const T &identity, const Combine &combine,
+						unsigned grain = 0, TaskExecutor *executor = NULL )
+	{
+		out.resize( in.size() );
+		
+		if ( not in.empty() )
+		{
+			parallel_scan( &in[ 0 ], &out[ 0 ], in.size(), identity, combine,
+						   grain, executor );
+		}
+	}
+}
+
+#endif // JH_PARALLEL_ALGORITHMS_H_
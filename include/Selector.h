@@ -29,6 +29,7 @@
 #define JH_SELECTOR_H_
 
 #include "jh_list.h"
+#include "jh_vector.h"
 #include "EventThread.h"
 #include "Mutex.h"
 
@@ -45,7 +46,9 @@ public:
 	 * have occured on a specific file descriptor.  There could be one
 	 * or more events.  Also you could be informed about events that
 	 * you didn't register for.  Specifically you will always get
-	 * POLLNVAL and POLLHUP if they occur.
+	 * POLLNVAL, POLLHUP and POLLERR if they occur.  Other events are
+	 * only reported if this listener asked for them, even if another
+	 * listener on the same fd asked for more.
 	 *
 	 * @param fd the file descriptor that the event(s) occured on.
 	 * @param events the set of events that occured.
@@ -59,6 +62,31 @@ protected:
 	virtual ~SelectorListener() {}
 };
 
+/**
+ * Implemented by users of Selector::addListenerAsync and
+ * Selector::removeListenerAsync that want to know when the change has
+ * taken effect.
+ */
+class SelectorUpdateListener
+{
+public:
+	/**
+	 * Called on the selector's thread once an asynchronous add or
+	 * remove is in effect.  Not called if the selector shuts down
+	 * first.
+	 *
+	 * @param fd the file descriptor given to the call.
+	 * @param listener the listener given to the call.
+	 * @param added true for addListenerAsync, false for
+	 * removeListenerAsync.
+	 */
+	virtual void listenerUpdated( int fd, SelectorListener *listener, 
+								  bool added ) = 0;
+protected:
+	//! Virtual destructor, does nothing, just for compile warning
+	virtual ~SelectorUpdateListener() {}
+};
+
 /**
  * This class is used to build a thread that waits for file events.
  * This class can be used to replace code that would have
@@ -73,9 +101,71 @@ protected:
  * events only.  See EventDispatcher for information about
  * handling JHCommon events.
  */
+class SelectorPoller;
+
 class Selector : public EventDispatcher
 {
 public:
+	/**
+	 * The system facility used by a selector to wait for file events.
+	 * If the requested backend isn't available on this system poll
+	 * is used instead.
+	 */
+	enum Backend {
+		//! poll(2), portable, but every wait is O(number of fds)
+		kBackendPoll,
+		
+		/**
+		 * epoll(7), Linux only.  Adding, modifying and removing an fd
+		 * is O(1) and waits only cost in proportion to the ready fds.
+		 * Note that the kernel forgets about an fd when it is closed,
+		 * so listeners must be removed before closing their fd.
+		 */
+		kBackendEpoll,
+		
+		/**
+		 * io_uring(7) poll requests, Linux 5.6 and later.  Like epoll
+		 * only ready fds cost anything, and registration changes go
+		 * to the kernel in the same system call as the wait.  Edge
+		 * triggering is not supported, those listeners are level
+		 * triggered.  Falls back to the default backend if io_uring
+		 * is not available.
+		 */
+		kBackendIoUring,
+		
+		//! The best backend available on this platform
+		kBackendDefault
+	};
+	
+	//! Flags for addListener
+	enum {
+		//! Call the listener whenever the fd is ready (the default)
+		kLevelTriggered = 0,
+		
+		/**
+		 * Only call the listener when the fd becomes ready, so it
+		 * must read or write until EAGAIN before it will be called
+		 * again.  The fd should be non-blocking.  Only the epoll
+		 * backend supports this, poll falls back to level triggered,
+		 * and so does an fd shared with a level triggered listener.
+		 */
+		kEdgeTriggered = 1 << 0,
+		
+		/**
+		 * Call the listener once, then not again until rearm() is
+		 * called.  This allows handing the fd to another thread
+		 * without removing and adding the listener.
+		 */
+		kOneShot = 1 << 1,
+		
+		/**
+		 * When several fds are ready at once, call the listeners of
+		 * high priority fds before all the others.  An fd is high
+		 * priority if any of its listeners is.
+		 */
+		kHighPriority = 1 << 2
+	};
+	
 	/** 
 	 * Will contruct a selector class and start it's thread running.
 	 *
@@ -83,8 +173,10 @@ public:
 	 * as the thread name.  This is usefull for debugging.  If a NULL
 	 * name is provided or this optional param is omited the default
 	 * name of "Selector" will be used as the thread name.
+	 * @param backend the system facility used to wait for file
+	 * events.  See Backend.
 	 */
-	Selector( const char *name = NULL );
+	Selector( const char *name = NULL, Backend backend = kBackendDefault );
 
 	/** 
 	 * Desctroy the selector and shutdown the thread.  This function
@@ -113,19 +205,166 @@ public:
 	 * @param listener the interface to call when an event occurs.
 	 * @param private_data this data will be passed to the listener when ever
 	 *  the listener is informed of an event.
+	 * @param flags kEdgeTriggered, kOneShot and/or kHighPriority, or
+	 *  kLevelTriggered.
 	 */
 	void addListener( int fd, short events, 
-					  SelectorListener *listener, jh_ptr_int_t private_data = 0 );
+					  SelectorListener *listener, jh_ptr_int_t private_data = 0,
+					  int flags = kLevelTriggered );
 
 	/** 
 	 * Remove a listener(s) previously added.  We remove any matches
 	 * to the fd and the listener interface.
 	 *
 	 * @param fd the file descriptor that was previously added.
-	 * @param listener the interface previously added.
+	 * @param listener the interface previously added, or NULL to
+	 *  remove every listener on fd.
 	 */
 	void removeListener( int fd, SelectorListener *listener );
 	
+	/**
+	 * Same as addListener, but doesn't wait for the selector thread to
+	 * pick up the change.  The listener is not called for any event
+	 * the selector saw before the change took effect, so events for an
+	 * old file that used the same fd can't reach it.
+	 *
+	 * @param done if not NULL, called on the selector thread once the
+	 * listener is in effect.
+	 */
+	void addListenerAsync( int fd, short events, SelectorListener *listener, 
+						   jh_ptr_int_t private_data = 0, 
+						   int flags = kLevelTriggered,
+						   SelectorUpdateListener *done = NULL );
+	
+	/**
+	 * Same as removeListener, but doesn't wait for the selector thread
+	 * to pick up the change.  The listener will not be called again
+	 * once this returns, so it is safe to close the fd and destroy the
+	 * listener.
+	 *
+	 * @param done if not NULL, called on the selector thread once the
+	 * removal is in effect.
+	 */
+	void removeListenerAsync( int fd, SelectorListener *listener,
+							  SelectorUpdateListener *done = NULL );
+	
+	/**
+	 * Reenable a kOneShot listener after it has been called.  This
+	 * can be called from any thread and doesn't block waiting for the
+	 * selector.  With the epoll backend and only this listener on the
+	 * fd it is a single system call.  Does nothing if the listener is
+	 * already armed.
+	 *
+	 * @param fd the file descriptor that was previously added.
+	 * @param listener the interface previously added.
+	 */
+	void rearm( int fd, SelectorListener *listener );
+	
+	//! The backend actually in use, never kBackendDefault
+	Backend getBackend();
+	
+	//! How many listeners are registered, a rough measure of load
+	int getNumListeners();
+	
+	/**
+	 * Statistics on busy polling, to weigh the CPU it burns against
+	 * the wakeups it saves.  See setBusyPoll.
+	 */
+	struct BusyPollStats
+	{
+		//! Non blocking polls made while spinning
+		uint64_t mSpins;
+		
+		//! Spins that found work, each one a wakeup we didn't wait for
+		uint64_t mSpinHits;
+		
+		//! Time spent spinning, all of it on the CPU
+		uint64_t mSpinUsecs;
+		
+		//! Times the spin window ran out and we blocked
+		uint64_t mSleeps;
+		
+		//! Time spent blocked in the poller
+		uint64_t mSleepUsecs;
+	};
+	
+	/**
+	 * Trade CPU for latency.  After handling any work the selector
+	 * keeps polling its fds without blocking for spinUsecs before it
+	 * goes to sleep, so data that arrives in that window is handled
+	 * without waiting for the scheduler to wake the thread up.
+	 *
+	 * @param spinUsecs how long to spin, 0 to always block (the
+	 *  default).
+	 * @param socketUsecs if not 0, also set SO_BUSY_POLL to this and
+	 *  SO_PREFER_BUSY_POLL on every socket registered with this
+	 *  selector, so the kernel polls the network device instead of
+	 *  waiting for its interrupts.  Values above the net.core.busy_read
+	 *  sysctl need CAP_NET_ADMIN.
+	 */
+	void setBusyPoll( uint32_t spinUsecs, uint32_t socketUsecs = 0 );
+	
+	//! Get the busy poll statistics since they were last reset
+	void getBusyPollStats( BusyPollStats &stats );
+	
+	//! Zero the busy poll statistics
+	void resetBusyPollStats();
+	
+	/**
+	 * Limit how many bytes a listener should read each time it is
+	 * called, so one flooded fd can't starve the others.  Whatever
+	 * it leaves behind is still there on the next loop, after every
+	 * other ready fd and the event queue had their turn.  Listeners
+	 * that read in a loop should stop once hasReadBudget() returns
+	 * false.  Reads made with Socket::read and File::read from a
+	 * listener are charged automatically, other listeners call
+	 * chargeRead() themselves.  Edge triggered and one shot
+	 * listeners must drain their fd, so they have no budget.
+	 *
+	 * @param bytes the budget per call, 0 for no limit (the default).
+	 */
+	void setReadBudget( int bytes );
+	
+	/**
+	 * Give one listener its own read budget, instead of the one set
+	 * with setReadBudget(int).
+	 *
+	 * @param bytes the budget per call, 0 for no limit, or -1 to go
+	 *  back to the selector's budget.
+	 */
+	void setReadBudget( int fd, SelectorListener *listener, int bytes );
+	
+	/**
+	 * Charge bytes read against the budget of the listener being
+	 * called.  Does nothing if not called from a listener on the
+	 * selector thread.
+	 *
+	 * @return false if the budget is used up.
+	 */
+	bool chargeRead( int bytes );
+	
+	//! Does the listener being called have any budget left?
+	bool hasReadBudget();
+	
+	//! How often the budgets ran out
+	struct FairnessStats
+	{
+		//! Listener calls that used up their read budget
+		uint64_t mReadBudgetExhausted;
+		
+		//! Loops that left events queued, see kEventBudget
+		uint64_t mEventBudgetExhausted;
+		
+		//! Ready high priority fds serviced ahead of the others
+		uint64_t mHighPriorityCalls;
+	};
+	
+	//! Get the fairness statistics since they were last reset
+	void getFairnessStats( FairnessStats &stats );
+	
+	//! Zero the fairness statistics
+	void resetFairnessStats();
+	
 private:
 	struct ListenerNode
 	{
@@ -134,7 +373,10 @@ private:
 
 		//! Things on this fd should be handled by this listener
 		ListenerNode( int fd, SelectorListener *listener ) : mFd( fd ), 
-			mListener( listener ) {}
+			mListener( listener ), mFlags( kLevelTriggered ), 
+			mReadBudget( -1 ), mArmed( true ),
+			mKernelOneShot( false ), mPending( false ), mDead( false ),
+			mNext( NULL ) {}
 
 		//! Is this Listener the same as the other?
 		bool operator==( const ListenerNode &other )
@@ -164,6 +406,33 @@ private:
 
 		//! Some opaque private data that is passed back to the listener
 		jh_ptr_int_t mPrivateData;
+
+		//! kEdgeTriggered, kOneShot and kHighPriority
+		int mFlags;
+		
+		//! Read budget per call, -1 to use the selector's
+		int mReadBudget;
+
+		//! False if this is a kOneShot listener that has been called
+		bool mArmed;
+
+		/**
+		 * True if this kOneShot listener is the only one on its fd and
+		 * the poller disarms the fd itself.
+		 */
+		bool mKernelOneShot;
+
+		//! Added, but the poller hasn't been updated yet
+		bool mPending;
+
+		//! Removed, will be freed by updatePoller
+		bool mDead;
+
+		//! Should this listener be called for events?
+		bool isLive() { return mArmed and not mPending and not mDead; }
+
+		//! The next listener on the same fd
+		ListenerNode *mNext;
 	};
 	
 	enum {
@@ -174,17 +443,63 @@ private:
 		PIPE_WRITER = 1
 	};
 	
-	//! How many FDs can one selector be polling at once?
-	static const int kMaxPollFds = 64;
+	//! An fd whose merged event mask must be recomputed
+	struct DirtyFd
+	{
+		//! The fd
+		int mFd;
+
+		/**
+		 * A listener was removed from this fd, so it may have been
+		 * closed and reopened since the poller last saw it.
+		 */
+		bool mRemoved;
+
+		//! The listener added or removed
+		SelectorListener *mListener;
+
+		//! Who to tell when the change is in effect, may be NULL
+		SelectorUpdateListener *mDone;
+	};
 	
-	//! Trigger a call to fillPollFds when it is safe to do so
-	void updateListeners();	
+	/**
+	 * Trigger a call to updatePoller when it is safe to do so.  If
+	 * wait is true and we aren't the selector thread, wait for it.
+	 * mLock must be held.
+	 */
+	void updateListeners( bool wait );
 
+	//! Add a pending ListenerNode, mLock must be held
+	void queueAdd( int fd, short events, SelectorListener *listener, 
+				   jh_ptr_int_t private_data, int flags,
+				   SelectorUpdateListener *done );
+
+	//! Mark the listeners on fd dead, mLock must be held
+	bool queueRemove( int fd, SelectorListener *listener, 
+					  SelectorUpdateListener *done );
+	
+	//! Remember that the listeners on fd changed
+	void markDirty( int fd, bool removed, SelectorListener *listener = NULL,
+					SelectorUpdateListener *done = NULL );
+	
 	//! Call everyone that is listening for events on this fd
 	bool callListeners( int fd, uint32_t events );
+	
+	/**
+	 * Call the listeners for the ready fds from the last wait, those
+	 * of high priority fds first.  Sets gotEvent if the event queue
+	 * needs to be looked at.
+	 */
+	void handleReadyFds( int numReady, bool &gotEvent );
+	
+	//! Handle one ready fd for handleReadyFds
+	void handleReadyFd( int fd, short revents, bool &gotEvent );
+	
+	//! Does fd have a live kHighPriority listener?  mLock must be held
+	bool isHighPriority( int fd );
 
-	//! Fill up the pollfds we will be calling poll on.
-	void fillPollFds( struct pollfd *fds, int &numFds );
+	//! Push the merged event masks of all dirty fds to the poller
+	void updatePoller();
 	
 	// Event Dispatcher overrides
 
@@ -198,6 +513,43 @@ private:
 	//! Send a null event to the selector to wake it up 
 	void wakeThread();
 
+	//! Consume the wakeups sent by wakeThread
+	void clearWakeup();
+	
+	//! Timed events wait in our queue, see EventDispatcher
+	bool hasLocalTimers() { return true; }
+	
+	//! Arm mTimerFd for the new deadline, or wake the thread without one
+	void localTimersChanged( uint64_t deadline );
+	
+	/**
+	 * Under a clock source the timerfd and poll timeout would be on the
+	 * wrong clock, so mClockThread waits for the local timer deadline
+	 * on the clock source and wakes us when it is due.
+	 */
+	void clockThreadMain();
+
+	/**
+	 * Handle up to kEventBudget queued events.  Returns true if there
+	 * are still events left.
+	 */
+	bool handleEvents();
+
+	//! Most events handled before checking the fds again
+	static const int kEventBudget = 256;
+	
+	//! Set the socket busy poll options on fd, must hold mLock
+	void setSocketBusyPoll( int fd );
+	
+	/**
+	 * Account for one wait on the poller while busy polling is on.
+	 * Returns the time at the end of the wait.  The spin window is
+	 * real time, so this is on the system's monotonic clock whatever
+	 * the clock source.
+	 */
+	uint64_t countBusyPoll( uint64_t start, bool spun, bool slept, 
+							bool gotWork );
+
 	const Thread *getDispatcherThread();
 	
 	/**
@@ -206,19 +558,49 @@ private:
 	 */
 	ListenerNode *findListener( int fd, SelectorListener *listener = NULL );
 	
-	//! The list of ListenerNodes
-	JetHead::list<ListenerNode*> mList;
+	//! The first ListenerNode for fd, NULL if none
+	ListenerNode *getListeners( int fd )
+	{
+		if ( fd < 0 or (unsigned)fd >= mTable.size() )
+			return NULL;
+		
+		return mTable[ fd ];
+	}
+	
+	/**
+	 * The ListenerNodes indexed by fd, each entry is a chain of the
+	 * listeners on that fd linked by mNext.  Dead nodes stay in their
+	 * chain until updatePoller frees them.
+	 */
+	JetHead::vector<ListenerNode*> mTable;
+	
+	//! Number of listeners that haven't been removed
+	int				mNumListeners;
+
+	//! fds whose listeners changed since the last updatePoller
+	JetHead::vector<DirtyFd> mDirtyFds;
+	
+	//! Waits for file events using the selected backend
+	SelectorPoller	*mPoller;
 
 	//! The lock on my internal state
 	Mutex			mLock;
 
 	/**
 	 * In order to have non-fd related events working with the
-	 * poll-based eventing of the Selector, we have this pipe.  Events
-	 * are packaged up and sent on the writable end of the pipe, the
-	 * readable end of the pipe triggers a poll event.
+	 * poll-based eventing of the Selector, we have this pipe.  When
+	 * the event queue goes from empty to non-empty the writable end
+	 * is written, the readable end triggers a poll event.  On Linux
+	 * this is a single eventfd used as both ends.
 	 */
 	int				mPipe[ 2 ];
+	
+	/**
+	 * A timerfd set to the nearest local timer deadline, so timers are
+	 * just another fd in the poll set.  -1 where there are no timerfds,
+	 * then the poll timeout is used instead.
+	 */
+	int				mTimerFd;
 
 	//! The thread object for the selector's thread
 	Runnable<Selector> 	mThread;
@@ -232,6 +614,51 @@ private:
 	//! Should I update the pollfds that I am polling on?
 	bool			mUpdateFds;
 
+	//! Has a kSelectorUpdateEventId been sent and not handled yet?
+	bool			mUpdatePosted;
+
+	//! Incremented every time updatePoller runs, protected by mLock
+	uint32_t		mUpdateGeneration;
+	
+	//! How long to spin before blocking, 0 if busy polling is off
+	volatile uint32_t mBusyPollUsecs;
+	
+	//! SO_BUSY_POLL for our sockets, 0 to leave them alone
+	uint32_t		mSocketBusyPoll;
+	
+	//! Protected by mLock
+	BusyPollStats	mBusyPollStats;
+	
+	//! Default read budget per listener call, 0 for none
+	int				mReadBudget;
+	
+	//! Budget left for the listener being called, -1 if unlimited
+	int				mReadBudgetLeft;
+	
+	//! Is a listener being called right now?
+	bool			mInCallback;
+	
+	//! Number of live kHighPriority listeners
+	int				mNumHighPriority;
+	
+	//! Indices of the normal priority ready fds, for handleReadyFds
+	JetHead::vector<int> mDeferred;
+	
+	//! Protected by mLock
+	FairnessStats	mFairnessStats;
+	
+	//! Waits for mClockDeadline, started the first time there is a clock source
+	Runnable<Selector> *mClockThread;
+	
+	//! Local timer deadline for mClockThread, 0 for none
+	uint64_t		mClockDeadline;
+	
+	//! Protects mClockThread and mClockDeadline
+	Mutex			mClockLock;
+	
+	//! Signalled when mClockDeadline changes
+	Condition		mClockChanged;
+
 	/**
 	 * Used to make calls in the public interface blocking until they
 	 * have been properly handled
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef JH_SELECTOR_GROUP_H_
+#define JH_SELECTOR_GROUP_H_
+
+#include "Selector.h"
+#include "Socket.h"
+#include "jh_vector.h"
+
+/**
+ * A group of Selectors, by default one per core, used to spread
+ * socket I/O over several threads.  Every socket is still handled
+ * by exactly one selector thread, so listeners see the same
+ * threading they would with a single Selector, but different
+ * sockets are handled in parallel.
+ *
+ * Connections can be accepted in two ways.  With listen() and
+ * SO_REUSEPORT every selector has its own ServerSocket on the same
+ * port and the kernel spreads new connections between them, so
+ * there is no single accept thread.  Without SO_REUSEPORT one
+ * ServerSocket accepts and the new sockets are handed out by the
+ * group's Policy.  In both cases the listener's handleAccept should
+ * call assign() on the new socket.
+ */
+class SelectorGroup
+{
+public:
+	//! How getNextSelector picks a selector
+	enum Policy {
+		//! Hand out the selectors in turn
+		kRoundRobin,
+		
+		//! Hand out the selector with the fewest listeners
+		kLeastLoaded
+	};
+	
+	/**
+	 * Create and start the selectors.
+	 *
+	 * @param numSelectors how many selectors, 0 for one per online cpu.
+	 * @param policy how to pick a selector for new sockets.
+	 * @param name used to name the threads name-0, name-1, ...  If
+	 * NULL "Selector" is used.
+	 * @param backend passed to each Selector.
+	 */
+	SelectorGroup( int numSelectors = 0, Policy policy = kRoundRobin,
+				   const char *name = NULL, 
+				   Selector::Backend backend = Selector::kBackendDefault );
+	
+	//! Stop listening and shutdown all the selectors
+	~SelectorGroup();
+	
+	//! How many selectors are in the group
+	int size() { return mSelectors.size(); }
+	
+	//! Get the i'th selector
+	Selector *getSelector( int i ) { return mSelectors[ i ]; }
+	
+	//! Pick a selector for a new socket using the group's Policy
+	Selector *getNextSelector();
+	
+	//! The selector of the group running the calling thread, or NULL
+	Selector *getCurrentSelector();
+	
+	/**
+	 * Attach a newly accepted socket to a selector.  If the group is
+	 * accepting with SO_REUSEPORT and this is called from
+	 * handleAccept the socket stays on the selector that accepted it,
+	 * otherwise getNextSelector picks one.
+	 */
+	void assign( JetHead::Socket *socket, JetHead::SocketListener *listener );
+	
+	/**
+	 * Start accepting connections on addr.  The listener's
+	 * handleAccept is called on the thread of the selector that
+	 * accepted the connection.  If addr has port 0 all the server
+	 * sockets share whatever port the first one got, see
+	 * getLocalAddress.
+	 *
+	 * @param reusePort give each selector its own ServerSocket using
+	 * SO_REUSEPORT.  If it's not supported a single ServerSocket is
+	 * used.
+	 * @return 0 on success, -1 on failure.
+	 */
+	int listen( const JetHead::Socket::Address &addr, int backlog,
+				JetHead::SocketListener *listener, bool reusePort = true );
+	
+	/**
+	 * Close all the server sockets.  Must not be called from one of
+	 * the group's selector threads.
+	 */
+	void stopListening();
+	
+	//! Get the address we are listening on
+	int getLocalAddress( JetHead::Socket::Address &addr );
+	
+	//! Is each selector accepting for itself with SO_REUSEPORT?
+	bool isReusePort() { return mReusePort; }
+	
+private:
+	//! Create a server socket bound to addr, NULL on failure
+	JetHead::ServerSocket *createServer( const JetHead::Socket::Address &addr,
+										 int backlog, bool reusePort,
+										 JetHead::SocketListener *listener,
+										 Selector *selector );
+	
+	//! The selectors, created and destroyed by us
+	JetHead::vector<Selector*> mSelectors;
+	
+	//! The sockets we are accepting on
+	JetHead::vector<JetHead::ServerSocket*> mServers;
+	
+	//! How we hand out selectors
+	Policy mPolicy;
+	
+	//! The next selector for kRoundRobin, updated atomically
+	uint32_t mNext;
+	
+	//! Are we listening with one server socket per selector?
+	bool mReusePort;
+};
+
+#endif // JH_SELECTOR_GROUP_H_
@@ -37,6 +37,8 @@
 #include "File.h"
 #include "jh_vector.h"
 
+class AsyncIoEvent;
+
 namespace JetHead
 {
 	class Socket;
@@ -259,10 +261,14 @@ namespace JetHead
 		//! Cleanup and remove listeners
 		virtual ~Socket();
 	
-		//! Connect to this host/port
+		/**
+		 * Connect to this host/port.  The blocking calls here (connect,
+		 * read, write and ServerSocket::accept) wait on the Fiber's
+		 * Selector when called from a Fiber, so only the fiber blocks.
+		 */
 		int connect( const Socket::Address &addr );
 	
-		//! Connect to this host/port, unless it takes too long
+		//! Connect to this host/port, unless it takes too long (seconds)
 		int connect( const Socket::Address &addr, int timeout );
 		
 		//! Connect, will trigger a call to handleConnect if/when successful
@@ -287,6 +293,22 @@ namespace JetHead
 	
 		//! Write 'len' bytes to the socket.  Return the number actually written.
 		int write( const void *buffer, int len );
+		
+		/**
+		 * Start a read that completes in the background.  When data
+		 * arrives an AsyncIoEvent with the result is sent to
+		 * dispatcher.  The buffer must stay valid until then.  See
+		 * IoEngine.
+		 *
+		 * @return 0 if the read was started, -1 if not.
+		 */
+		int readAsync( void *buffer, int len, IEventDispatcher *dispatcher,
+					   jh_ptr_int_t private_data = 0 );
+		
+		//! Start a background write, see readAsync
+		int writeAsync( const void *buffer, int len, 
+						IEventDispatcher *dispatcher, 
+						jh_ptr_int_t private_data = 0 );
 	
 		//! Call recvfrom (get some data, tell me who it is from)
 		int recvfrom(void* buf, int len, Socket::Address& addr, int flags=0);
@@ -463,6 +485,12 @@ namespace JetHead
 		SocketListener *mListener;
 	
 	private:
+		//! Charge a read against the selector's read budget
+		void chargeRead( int bytes );
+		
+		//! Non-blocking connect, then wait up to msecs (-1 forever) for it
+		int connectWait( const Socket::Address &addr, int msecs );
+		
 		//! The socket FD
 		int mFd;
 	
@@ -517,6 +545,34 @@ namespace JetHead
 		//! Block, waiting for the next incoming connection, and return that to me.
 		Socket *accept();
 		
+		/**
+		 * Allow several sockets to bind to the same address and port
+		 * (SO_REUSEPORT).  The kernel then balances incoming
+		 * connections between them, so each one can accept on its own
+		 * thread.  Must be called before bind.
+		 *
+		 * @return true if OK, false if not supported or an error occurred
+		 */
+		bool setReusePort( bool on = true );
+		
+		/**
+		 * Start accepting a connection in the background.  When one
+		 * comes in an AsyncIoEvent is sent to dispatcher, pass it to
+		 * acceptComplete to get the new Socket.  See IoEngine.
+		 *
+		 * @return 0 if the accept was started, -1 if not.
+		 */
+		int acceptAsync( IEventDispatcher *dispatcher, 
+						 jh_ptr_int_t private_data = 0 );
+		
+		/**
+		 * Wrap the connection from a completed acceptAsync, just like
+		 * accept would have returned it.
+		 *
+		 * @return the new Socket, or NULL if the accept failed.
+		 */
+		Socket *acceptComplete( AsyncIoEvent *ev );
+		
 	protected:
 		//! Handle IO from the selector
 		void processFileEvents( int fd, short events, jh_ptr_int_t private_data );
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JH_TASK_EXECUTOR_H_
+#define JH_TASK_EXECUTOR_H_
+
+#include "jh_types.h"
+#include "jh_list.h"
+#include "jh_vector.h"
+#include "Event.h"
+#include "Mutex.h"
+#include "Condition.h"
+#include "RefCount.h"
+#include "jh_memory.h"
+
+class TaskExecutor;
+
+/**
+ * A piece of CPU bound work for a TaskExecutor.  Override run() to do
+ * it.  Tasks are reference counted, and the executor holds a reference
+ * from when the task is submitted until it has run and any
+ * TaskDoneEvent has been sent.  A Task can only be submitted once.
+ */
+class Task : public RefCount
+{
+public:
+	Task() : mState( kNew ), mExecutor( NULL ), mDispatcher( NULL ),
+		mPrivateData( 0 ) {}
+	
+	//! Do the work, on one of the executor's threads
+	virtual void run() = 0;
+	
+	//! Has run() returned?
+	bool isDone() { return mState == kDone; }
+	
+	/**
+	 * Wait for run() to return.  On one of the executor's own threads
+	 * this runs other tasks meanwhile, so a task can submit tasks and
+	 * wait for them without tying up the thread.  The task must have
+	 * been submitted.
+	 */
+	void wait();
+	
+protected:
+	virtual ~Task() {}
+	
+private:
+	friend class TaskExecutor;
+	
+	enum State {
+		kNew,
+		kQueued,
+		kDone
+	};
+	
+	volatile int		mState;
+	TaskExecutor		*mExecutor;
+	
+	//! Who gets the TaskDoneEvent, if anyone
+	IEventDispatcher	*mDispatcher;
+	jh_ptr_int_t		mPrivateData;
+};
+
+/**
+ * A Task that produces a value.  run() sets mResult, and get() waits
+ * for the task and returns it.
+ */
+template<class Result>
+class Future : public Task
+{
+public:
+	Future() : mResult() {}
+	
+	Result get()
+	{
+		wait();
+		return mResult;
+	}
+	
+protected:
+	virtual ~Future() {}
+	
+	Result mResult;
+};
+
+//! A Task calling a copy of a functor, see TaskExecutor::submitCall
+template<class Functor>
+class FunctorTask : public Task
+{
+public:
+	FunctorTask( const Functor &functor ) : mFunctor( functor ) {}
+	
+	void run() { mFunctor(); }
+	
+protected:
+	virtual ~FunctorTask() {}
+	
+	Functor mFunctor;
+};
+
+//! A Future returning what a functor does, see TaskExecutor::submitFuture
+template<class Result, class Functor>
+class FunctorFuture : public Future<Result>
+{
+public:
+	FunctorFuture( const Functor &functor ) : mFunctor( functor ) {}
+	
+	void run() { this->mResult = mFunctor(); }
+	
+protected:
+	virtual ~FunctorFuture() {}
+	
+	Functor mFunctor;
+};
+
+/**
+ * Sent to the dispatcher a task was submitted with once it has run.
+ * Usually received with an EventMethod<YourClass, TaskDoneEvent>.
+ */
+class TaskDoneEvent : public Event
+{
+public:
+	TaskDoneEvent( Task *task, jh_ptr_int_t private_data ) : 
+		Event( Event::kTaskDoneEventId ), mTask( task ), 
+		mPrivateData( private_data ) {}
+	
+	SMART_CASTABLE( Event::kTaskDoneEventId );
+	
+	//! The task, which holds any result
+	Task *getTask() { return mTask; }
+	
+	//! The private data given with the task
+	jh_ptr_int_t getPrivateData() { return mPrivateData; }
+	
+private:
+	SmartPtr<Task>	mTask;
+	jh_ptr_int_t	mPrivateData;
+};
+
+/**
+ * A pool of threads running Tasks, for fanning CPU bound work (parsing,
+ * compression, hashing) out over the cores without blocking an
+ * EventThread or starting threads for it.
+ *
+ * Each thread has its own deque of tasks (Chase and Lev's work stealing
+ * deque).  Tasks submitted by a task go on its thread's deque, and the
+ * thread takes the newest task from there, without locking, while idle
+ * threads steal the oldest.  Tasks submitted from other threads go on
+ * a shared list that every thread takes from.
+ *
+ * @code
+ * struct Hash
+ * {
+ *     Hash( Buffer *buffer ) : mBuffer( buffer ) {}
+ *     uint32_t operator()() { return crc32( mBuffer ); }
+ *     Buffer *mBuffer;
+ * };
+ *
+ * SmartPtr<Future<uint32_t> > hash = 
+ *     TaskExecutor::getDefault()->submitFuture<uint32_t>( Hash( buffer ) );
+ * ...
+ * uint32_t crc = hash->get();
+ * @endcode
+ */
+class TaskExecutor
+{
+public:
+	/**
+	 * The executor shared by everyone, with a thread for each CPU,
+	 * created the first time it is used.
+	 */
+	static TaskExecutor *getDefault();
+	
+	//! Destroy the shared executor, if it was created
+	static void destroyDefault();
+	
+	/**
+	 * Create an executor.
+	 *
+	 * @param numThreads the number of threads, 0 for one for each CPU.
+	 * @param name the name of the threads.
+	 */
+	TaskExecutor( int numThreads = 0, const char *name = "TaskExecutor" );
+	
+	//! Run every task already submitted, then stop the threads
+	~TaskExecutor();
+	
+	/**
+	 * Run task on one of our threads.
+	 *
+	 * @param dispatcher if not NULL, is sent a TaskDoneEvent once the
+	 *  task has run.
+	 * @param private_data returned in the TaskDoneEvent.
+	 */
+	void submit( Task *task, IEventDispatcher *dispatcher = NULL,
+				 jh_ptr_int_t private_data = 0 );
+	
+	//! Run a copy of functor, which takes no arguments
+	template<class Functor>
+	SmartPtr<Task> submitCall( const Functor &functor, 
+							   IEventDispatcher *dispatcher = NULL,
+							   jh_ptr_int_t private_data = 0 )
+	{
+		SmartPtr<Task> task = jh_new FunctorTask<Functor>( functor );
+		submit( task, dispatcher, private_data );
+		return task;
+	}
+	
+	/**
+	 * Run a copy of functor, which takes no arguments and returns a 
+	 *  Result, which the Future returned holds afterwards.
+	 */
+	template<class Result, class Functor>
+	SmartPtr<Future<Result> > submitFuture( 
+		const Functor &functor, IEventDispatcher *dispatcher = NULL,
+		jh_ptr_int_t private_data = 0 )
+	{
+		SmartPtr<Future<Result> > future = 
+			jh_new FunctorFuture<Result, Functor>( functor );
+		submit( future, dispatcher, private_data );
+		return future;
+	}
+	
+	int getNumThreads() { return mWorkers.size(); }
+	
+	//! Is this being called by a task (of ours)?
+	bool isWorkerThread();
+	
+private:
+	class Deque;
+	struct Worker;
+	
+	friend class Task;
+	
+	//! A worker's main loop
+	void workerLoop( Worker *worker );
+	
+	//! Find a task to run, from worker's deque, the list or a steal
+	Task *findTask( Worker *worker );
+	
+	//! Is there a task anywhere?
+	bool haveTasks();
+	
+	void runTask( Task *task );
+	
+	//! Wait for task, running others if on one of our threads
+	void waitFor( Task *task );
+	
+	//! Wake a sleeping worker, if there is one
+	void wakeWorker();
+	
+	JetHead::vector<Worker*>	mWorkers;
+	
+	//! Tasks submitted from outside
+	JetHead::list<Task*>		mSubmitted;
+	Mutex						mSubmittedLock;
+	volatile int				mNumSubmitted;
+	
+	//! Workers with nothing to do sleep on mWakeup
+	Mutex						mSleepLock;
+	Condition					mWakeup;
+	volatile int				mSleepers;
+	volatile bool				mStopping;
+	
+	//! Threads outside waiting for tasks sleep on mDone
+	Mutex						mDoneLock;
+	Condition					mDone;
+	volatile int				mDoneWaiters;
+	
+	//! Workers asleep on mDone in waitFor, new tasks wake them too
+	volatile int				mStealWaiters;
+	
+	//! Empty looks for a task before a worker in waitFor sleeps
+	static const int			kWaitSpins = 64;
+	
+	static TaskExecutor			*mDefault;
+	
+	//! The worker running on this thread, if it is one
+	static __thread Worker		*mCurrentWorker;
+};
+
+#endif // JH_TASK_EXECUTOR_H_
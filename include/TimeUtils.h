@@ -30,9 +30,34 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
+
+class ClockSource;
 
 namespace TimeUtils
 {
+	/**
+	 * The clock set with setClockSource, or NULL to use the system
+	 *  clocks.  Only read it through the functions below.
+	 */
+	extern ClockSource *gClockSource;
+	
+	/**
+	 * Make getCurTime, getMonotonicUsecs and Condition timeouts use
+	 *  source instead of the system clocks, or go back to the system
+	 *  clocks if source is NULL.  Set it before starting threads that
+	 *  wait on the time, a wait that has started keeps its clock.  See
+	 *  ClockSource.h.
+	 */
+	void setClockSource( ClockSource *source );
+	
+	//! The clock source, NULL if the system clocks are used
+	inline ClockSource *getClockSource() { return gClockSource; }
+	
+	//! Ask gClockSource for the time
+	void getClockSourceTime( struct timespec *t );
+	uint64_t getClockSourceMonotonicUsecs();
+	
 	inline int getDifference( struct timeval const *t1, struct timeval const *t2 )
 	{
 		int ms = ( t1->tv_sec - t2->tv_sec ) * 1000;
@@ -61,12 +86,8 @@ namespace TimeUtils
 		return us;
 	}
 
-	inline void getCurTime( struct timeval *t )
-	{
-		gettimeofday( t, NULL );
-	}
-
-	inline void getCurTime( struct timespec *t )
+	//! The time of day from the system, whatever the clock source
+	inline void getSystemTime( struct timespec *t )
 	{
 #ifdef HAS_CLOCK_GETTIME
 		clock_gettime(CLOCK_REALTIME, t);
@@ -78,6 +99,49 @@ namespace TimeUtils
 #endif		
 	}
 
+	//! The system's monotonic clock, whatever the clock source
+	inline uint64_t getSystemMonotonicUsecs()
+	{
+		struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+#else
+		getSystemTime( &ts );
+#endif
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	inline void getCurTime( struct timeval *t )
+	{
+		if ( gClockSource != NULL )
+		{
+			struct timespec ts;
+			getClockSourceTime( &ts );
+			t->tv_sec = ts.tv_sec;
+			t->tv_usec = ts.tv_nsec / 1000;
+			return;
+		}
+		
+		gettimeofday( t, NULL );
+	}
+
+	inline void getCurTime( struct timespec *t )
+	{
+		if ( gClockSource != NULL )
+			getClockSourceTime( t );
+		else
+			getSystemTime( t );
+	}
+
+	//! Microseconds on a clock that doesn't jump when the time is set
+	inline uint64_t getMonotonicUsecs()
+	{
+		if ( gClockSource != NULL )
+			return getClockSourceMonotonicUsecs();
+		
+		return getSystemMonotonicUsecs();
+	}
+
 	inline void setTimeStruct( struct timespec *t, uint32_t msecs )
 	{
 		t->tv_sec = msecs / 1000;
@@ -123,6 +187,121 @@ namespace TimeUtils
 			t->tv_usec += 1000000;
 		}
 	}
+	
+	/**
+	 * The cycle clock, a cheap monotonic timestamp for instrumenting hot
+	 *  paths.  On x86-64 with an invariant TSC (one that ticks at a 
+	 *  constant rate whatever the CPU's speed or sleep state) it is the
+	 *  TSC, read in a few cycles with no system call.  Otherwise it is
+	 *  nanoseconds on CLOCK_MONOTONIC.  The first read calibrates the 
+	 *  TSC against CLOCK_MONOTONIC, which takes about 10ms.
+	 *
+	 * It always runs on the system's time, whatever the clock source.
+	 */
+	struct CycleClock
+	{
+		volatile bool	mReady;
+		bool			mTsc;
+		//! Nanoseconds per cycle, as a 32.32 fixed point number
+		uint64_t		mNsecsPerCycle;
+		//! A cycle count and the CLOCK_MONOTONIC nanoseconds it was at
+		uint64_t		mBaseCycles;
+		uint64_t		mBaseNsecs;
+	};
+	
+	extern CycleClock gCycleClock;
+	
+	//! Calibrate the cycle clock, done by the first getCycles
+	void initCycleClock();
+	
+	//! Nanoseconds on the system's monotonic clock
+	inline uint64_t getSystemMonotonicNsecs()
+	{
+		struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+#else
+		getSystemTime( &ts );
+#endif
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	
+	//! Is the cycle clock the TSC?
+	inline bool cycleClockIsTsc()
+	{
+		if ( not gCycleClock.mReady )
+			initCycleClock();
+		
+		return gCycleClock.mTsc;
+	}
+	
+	//! Read the cycle clock
+	inline uint64_t getCycles()
+	{
+		if ( __builtin_expect( not gCycleClock.mReady, 0 ) )
+			initCycleClock();
+		
+#if defined( __x86_64__ )
+		if ( gCycleClock.mTsc )
+		{
+			uint32_t lo, hi;
+			__asm__ __volatile__( "rdtsc" : "=a" ( lo ), "=d" ( hi ) );
+			return ( (uint64_t)hi << 32 ) | lo;
+		}
+#endif
+		return getSystemMonotonicNsecs();
+	}
+	
+	/**
+	 * Like getCycles, but the read waits for the code before it to
+	 *  finish (rdtscp), so it can end a timed section without the 
+	 *  CPU moving the read up into it.
+	 */
+	inline uint64_t getCyclesOrdered()
+	{
+		if ( __builtin_expect( not gCycleClock.mReady, 0 ) )
+			initCycleClock();
+		
+#if defined( __x86_64__ )
+		if ( gCycleClock.mTsc )
+		{
+			uint32_t lo, hi, aux;
+			__asm__ __volatile__( "rdtscp" 
+								  : "=a" ( lo ), "=d" ( hi ), "=c" ( aux ) );
+			return ( (uint64_t)hi << 32 ) | lo;
+		}
+#endif
+		return getSystemMonotonicNsecs();
+	}
+	
+	//! Turn a number of cycles into nanoseconds
+	inline uint64_t cyclesToNsecs( uint64_t cycles )
+	{
+#if defined( __x86_64__ )
+		if ( gCycleClock.mTsc )
+		{
+			return (uint64_t)( ( (unsigned __int128)cycles * 
+								 gCycleClock.mNsecsPerCycle ) >> 32 );
+		}
+#endif
+		return cycles;
+	}
+	
+	/**
+	 * Nanoseconds on CLOCK_MONOTONIC's timeline, from the cycle clock.
+	 *  Much cheaper than asking the system, but it drifts from it by
+	 *  the calibration error, a few parts per million.
+	 */
+	inline uint64_t getFastMonotonicNsecs()
+	{
+		uint64_t cycles = getCycles();
+		
+		if ( not gCycleClock.mTsc )
+			return cycles;
+		
+		return gCycleClock.mBaseNsecs + 
+			cyclesToNsecs( cycles - gCycleClock.mBaseCycles );
+	}
 };
 
 #endif // JH_TIMEUTILS_H_
@@ -31,8 +31,10 @@
 #include "Event.h"
 #include "Thread.h"
 #include "Mutex.h"
+#include "Condition.h"
 #include "TimerManager.h"
 #include "jh_list.h"
+#include "jh_vector.h"
 
 class TimerListener
 {
@@ -59,35 +61,56 @@ public:
 	 *  serviced by this timer will have a minimum resolution of the tick
 	 *  time set at initialization.
 	 *
+	 *  Timers have no thread of their own.  The TimerManager's service
+	 *  thread runs them all, sleeping on the monotonic clock until the
+	 *  next timeout of any of them is due.  Ticks that nothing is due on
+	 *  are skipped, so an idle Timer costs no wakeups.
+	 *
+	 *  A tick time of kTickless makes a tickless timer instead, which
+	 *  keeps timeouts to the microsecond.
+	 *
+	 *  Timeouts can be given a slack, how much later than asked they
+	 *  may fire.  The timer picks the time in that window that is the
+	 *  roundest number of ticks (or microseconds when tickless), so
+	 *  timeouts whose windows overlap tend to fire together on one
+	 *  wakeup instead of one wakeup each.
+	 *
 	 *	NOTE:   All Timer objects are started immediately upon creation.
 	 *
-	 *  @param  tickTimeMs - Tick time in milliseconds for this Timer
+	 *  @param  tickTimeMs - Tick time in milliseconds for this Timer, or
+	 *  kTickless
 	 *  @param  stoppable - Indicates whether timer is stoppable
 	 */
 	Timer(int tickTimeMs,
 		  bool stoppable = true);
 	
+	//! Tick time of a tickless Timer
+	static const int kTickless = 0;
+	
 	/**
-	 *  @brief Get tick time in milliseconds for this Timer
+	 *  @brief Get tick time in milliseconds for this Timer, kTickless 
+	 *  for a tickless one
 	 */
 	int getTickTime();
 	
 	/**
 	 *  @brief Start timer
 	 *
-	 *  This method starts the timer thread which will accumulate ticks
-	 *  using the interval specified at construction.   This method will
-	 *  do nothing if the Timer is already running.
+	 *  This method hands the timer to the TimerManager's service
+	 *  thread, which will accumulate ticks using the interval specified
+	 *  at construction.   This method will do nothing if the Timer is
+	 *  already running.
 	 */
 	void start();
 	
 	/**
 	 *  @brief Stop timer
 	 *
-	 *  This method stops a running timer thread.   On exit the thread
-	 *  is stopped and the timer is no longer running.   This also results
-	 *  in all current timer nodes being destroyed without firing.
-	 *  This method will do nothing if the Timer is not stoppable.
+	 *  This method takes the timer back from the service thread.   On
+	 *  exit the timer is no longer running and none of its callbacks
+	 *  are being made.   This also results in all current timer nodes
+	 *  being destroyed without firing.  This method will do nothing if
+	 *  the Timer is not stoppable.
 	 */
 	void stop();
 	
@@ -102,10 +125,21 @@ public:
 	 * @param event - the event to send.
 	 * @param dispatcher - the dispatcher to dispatch event to
 	 * @param msecs - how many milliseconds to wait before dispatching.
+	 * @param slackMs - how many milliseconds later it may be dispatched.
 	 */
 	void sendTimedEvent( Event *event, 
 						 IEventDispatcher *dispatcher, 
-						 uint32_t msecs );
+						 uint32_t msecs,
+						 uint32_t slackMs = 0 );
+	
+	/**
+	 * Like sendTimedEvent, but the delay is in microseconds.  Only a
+	 *  tickless timer keeps to it, others round it up to whole ticks.
+	 */
+	void sendTimedEventUsecs( Event *event, 
+							  IEventDispatcher *dispatcher, 
+							  uint64_t usecs,
+							  uint64_t slackUsecs = 0 );
 
 	/**
 	 * @brief Add event to be dispatched periodically
@@ -119,10 +153,12 @@ public:
 	 * @param event - the event to send.
 	 * @param dispatcher - the dispatcher to dispatch event to
 	 * @param period - how many milliseconds to wait before dispatching.
+	 * @param slackMs - how many milliseconds late each one may be.
 	 */
 	void sendPeriodicEvent( Event *event,
 							IEventDispatcher *dispatcher,
-							uint32_t period );
+							uint32_t period,
+							uint32_t slackMs = 0 );
 
 	/**
 	 * Remove all timed events from a given dispatcher with a certian
@@ -159,13 +195,24 @@ public:
 	 * @param listener - the listener to send notification to
 	 * @param msecs - how many milliseconds to wait before notification
 	 * @param private_data - private data associated with the notification
+	 * @param slackMs - how many milliseconds later it may be called
 	 */
 	/**
 	 * Add a timer listener.  This listener will be called after msecs.
 	 */
 	void addTimer( TimerListener *listener, 
 				   uint32_t msecs,
-				   uint32_t private_data );
+				   uint32_t private_data,
+				   uint32_t slackMs = 0 );
+	
+	/**
+	 * Like addTimer, but the delay is in microseconds.  Only a tickless
+	 *  timer keeps to it, others round it up to whole ticks.
+	 */
+	void addTimerUsecs( TimerListener *listener, 
+						uint64_t usecs,
+						uint32_t private_data,
+						uint64_t slackUsecs = 0 );
 	
 	/**
 	 * Add a timer listener for a periodic delayed notification.
@@ -173,18 +220,45 @@ public:
 	 * @param listener - the listener to send notification to
 	 * @param period - how many milliseconds to wait before notification
 	 * @param private_data - private data associated with the notification
+	 * @param slackMs - how many milliseconds late each call may be
 	 */
 	/**
 	 * Add a timer listener.  This listener will be called after msecs.
 	 */
 	void addPeriodicTimer( TimerListener *listener,
 						   uint32_t msecs,
-						   uint32_t private_data );
+						   uint32_t private_data,
+						   uint32_t slackMs = 0 );
+	
+	/**
+	 * How well slack is letting timeouts share wakeups.  The
+	 * coalescing ratio is mExpirations / mWakeups.
+	 */
+	struct CoalescingStats
+	{
+		//! Timeouts that fired
+		uint64_t mExpirations;
+		
+		//! Times the service thread woke up and fired any
+		uint64_t mWakeups;
+		
+		//! Timeouts that were added with some slack
+		uint64_t mSlackTimers;
+	};
+	
+	//! Get the coalescing statistics since they were last reset
+	void getCoalescingStats( CoalescingStats &stats );
+	
+	//! Zero the coalescing statistics
+	void resetCoalescingStats();
 protected:
 	
 	//!  Reference counted object, destructor is protected.
 	virtual ~Timer();
 	
+	//! The service thread calls service()
+	friend class TimerManager;
+	
 	//! These are the time events we are currently tracking
 	struct TimerNode
 	{
@@ -208,13 +282,131 @@ protected:
 
 		//! How many leftover ms have we accumulated if this is repeating?
 		uint32_t mRemainingMS;
+		
+		//! Head of the wheel slot list this node is on, NULL if none
+		TimerNode **mSlot;
+		
+		//! Neighbours on the slot list
+		TimerNode *mPrev;
+		TimerNode *mNext;
+		
+		//! Next node in the same mEventHash bucket
+		TimerNode *mHashNext;
+		
+		//! Tickless: when this is due, on the monotonic clock
+		uint64_t mDeadline;
+		
+		//! Tickless: microseconds between repeats, or 0 for none
+		uint64_t mPeriodUsecs;
+		
+		//! Tickless: where in mHeap this node is, or kNotInHeap
+		unsigned mHeapIndex;
+		
+		/**
+		 * When this is due before the slack is applied, a tick like 
+		 * mTick or a monotonic time like mDeadline
+		 */
+		uint64_t mDue;
+		
+		//! How late this may fire, in ticks or microseconds like mDue
+		uint64_t mSlack;
+	};
+	
+	//! mHeapIndex of a node that isn't in mHeap
+	static const unsigned kNotInHeap = ~0U;
+	
+	/**
+	 * A callback that is due, taken off the nodes under the lock and
+	 * made after it is released.  Both mDispatcher and mListener are
+	 * NULL once it has been made or cancelled.
+	 */
+	struct ExpiredTimer
+	{
+		SmartPtr<Event> mEvent;
+		IEventDispatcher *mDispatcher;
+		TimerListener *mListener;
+		uint32_t mPrivateData;
 	};
 	
+	/**
+	 * Add a timer for either an event or a listener.  Times are in 
+	 * microseconds, periodUsecs is 0 for a one time timer.
+	 */
+	void addNode( Event *event, IEventDispatcher *dispatcher,
+				  TimerListener *listener, uint32_t private_data,
+				  uint64_t usecs, uint64_t periodUsecs, 
+				  uint64_t slackUsecs );
+	
 	//! Add a new time event
 	void addTimerNode( const TimerNode& node );
 	
-	//! Our main loop
-	void clockHandler();
+	//! Put node on the wheel slot for its tick, or in the heap
+	void placeNode( TimerNode *node );
+	
+	//! Take node off its wheel slot, or out of the heap
+	void unlinkNode( TimerNode *node );
+	
+	//! Queue the callback of a node that is due, and re-arm it if periodic
+	void expireNode( TimerNode *node );
+	
+	/**
+	 * Make the callbacks queued by expireNode, with mMutex released.
+	 * Events for the same dispatcher are sent together.  Call with
+	 * mMutex held once.
+	 */
+	void fireExpired();
+	
+	/**
+	 * Wait for an event batch being sent to be delivered, so a remove
+	 * can't race with it.  Call with mMutex held.
+	 */
+	void waitForSend();
+	
+	//! Move mHeap[ index ] towards the root while it is due sooner
+	void heapUp( unsigned index );
+	
+	//! Move mHeap[ index ] towards the leaves while it is due later
+	void heapDown( unsigned index );
+	
+	//! Add an event node to mEventHash
+	void hashNode( TimerNode *node );
+	
+	//! Remove an event node from mEventHash
+	void unhashNode( TimerNode *node );
+	
+	//! Unlink, unhash and recycle a node
+	void freeNode( TimerNode *node );
+	
+	//! mEventHash bucket for ev
+	unsigned hashEvent( Event *ev );
+	
+	/**
+	 * Move the nodes on a slot of an outer wheel to the wheels below.
+	 * Returns index, so the caller knows when to cascade the next wheel.
+	 */
+	unsigned cascade( int level, unsigned index );
+	
+	/**
+	 * Free all event nodes for dispatcher with event_id (or any id if
+	 * kInvalidEventId), or for agents delivered to receiver if it is
+	 * not NULL.
+	 */
+	void removeNodes( Event::Id event_id, IEventDispatcher *dispatcher,
+					  void *receiver );
+	
+	//! service() returns this when nothing is scheduled
+	static const uint64_t kNever = ~0ULL;
+	
+	/**
+	 * Called on the service thread to fire everything due by now, on
+	 * the monotonic clock.
+	 *
+	 * @return when service() is next needed, or kNever.
+	 */
+	uint64_t service( uint64_t now );
+	
+	//! The next tick after mTicks that handleTick has anything to do on
+	uint32_t nextBusyTick();
 
 	//! Handle a clock tick (every kMsPerTick)
 	void handleTick();
@@ -222,11 +414,23 @@ protected:
 	//! Reset timeout list and mTicks
 	void reset();
 	
-	//! Stop the clock thread and clean up data associated with it.
+	//! Take the timer back from the service thread
 	void doStop();
 	
-	//! Our thread
-	Runnable<Timer> *mClockThread;
+	//! Has start() handed us to the service thread?
+	bool mStarted;
+	
+	//! Microseconds per tick
+	uint64_t mUsecsPerTick;
+	
+	//! When tick mTicks was due, on the monotonic clock
+	uint64_t mTickUsecs;
+	
+	//! When service() last asked to be called next
+	uint64_t mNextService;
+	
+	//! Number of nodes on the wheels, mExpiring or the heap
+	unsigned mNumPending;
 
 	//! What is the resolution of this Timer in ms.
 	int mMsPerTick;
@@ -234,11 +438,65 @@ protected:
 	//! Is this Timer "stoppable" or not
 	bool mStoppable;
 	
-	//! Locking for internal state (only really mList and mTicks)
+	//! Is this a tickless Timer?
+	bool mTickless;
+	
+	//! Tickless: the pending nodes, a binary heap by mDeadline
+	JetHead::vector<TimerNode*> mHeap;
+	
+	//! Callbacks that are due, only added to by the service thread
+	JetHead::vector<ExpiredTimer> mExpired;
+	
+	//! The events fireExpired is sending to one dispatcher
+	JetHead::vector<Event*> mBatch;
+	
+	//! Is fireExpired sending mBatch?
+	bool mSending;
+	
+	//! Signalled when fireExpired has sent mBatch
+	Condition mSent;
+	
+	//! Protected by mMutex
+	CoalescingStats mCoalescingStats;
+	
+	//! Locking for internal state (the wheels, the hash and mTicks)
 	Mutex mMutex;
 	
-	//! Everything we are waiting on
-	JetHead::list<TimerNode> mList;
+	/**
+	 * The timing wheels.  Wheel 0 has a slot for each of the next
+	 * kWheelSize ticks, each wheel above has a slot for kWheelSize
+	 * slots of the one below.  Nodes are moved down a wheel when their
+	 * slot comes up, so adding, removing and expiring a node are all
+	 * constant time.
+	 */
+	enum { 
+		kWheelBits = 8, 
+		kWheelSize = 1 << kWheelBits,
+		kWheelMask = kWheelSize - 1,
+		kNumWheels = 4
+	};
+	TimerNode *mWheel[ kNumWheels ][ kWheelSize ];
+	
+	//! Nodes of the tick being handled, not yet called
+	TimerNode *mExpiring;
+	
+	//! Event nodes by event, so removing an event doesn't scan
+	TimerNode **mEventHash;
+	
+	//! Number of buckets in mEventHash, a power of 2
+	unsigned mHashSize;
+	
+	//! Number of nodes in mEventHash
+	unsigned mNumHashed;
+	
+	//! Freed nodes kept for reuse, linked by mNext
+	TimerNode *mFreeNodes;
+	
+	//! Number of nodes on mFreeNodes
+	unsigned mNumFree;
+	
+	//! Most nodes kept on mFreeNodes
+	static const unsigned kMaxFreeNodes = 1024;
 
 	//! Number of ticks we have seen
 	uint32_t mTicks;
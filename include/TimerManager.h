@@ -30,6 +30,8 @@
 
 #include "Timer.h"
 #include "Mutex.h"
+#include "Condition.h"
+#include "Thread.h"
 #include "RefCount.h"
 #include "jh_vector.h"
 
@@ -40,7 +42,12 @@ class Timer;
  *
  *  TimerManager is a singleton class that acts as a factory for Timer
  *  objects in the system.   Timers that are allocated via the TimerManager
- *  will be shared, reducing the number of outstanding threads.
+ *  will be shared, one for each resolution.
+ *
+ *  TimerManager also runs the one thread that services every Timer in
+ *  the process, whatever its resolution.  It sleeps until the next
+ *  timeout of any Timer is due, so Timers themselves are just the
+ *  data structures that hold their timeouts.
  *
  *  TimerManager is also the owner/allocate of the default timer that is
  *  shared system wide with a 100ms resolution.
@@ -63,6 +70,8 @@ public:
 	 *  This method will return a Timer that can service the specified
 	 *  resolution without in milliseconds.   If one does not exist that
 	 *  can service the requested resolution then one will be created.
+	 *  The TimerManager owns the Timer and shares it with everyone who
+	 *  asks for the same resolution, so it can't be stopped.
 	 *
 	 *	@param  tickTimeMs - Requested tick time in milliseconds for Timer
 	 */
@@ -107,8 +116,9 @@ public:
 	 *  @brief Add Timer to the TimerManager
 	 *
 	 *  This method adds a weak reference to the specified Timer to
-	 *  the TimerManager.   This is called by a Timer when it is created
-	 *  and users should not call this method.
+	 *  the TimerManager, and the service thread starts running it.
+	 *  This is called by a Timer when it is started and users should
+	 *  not call this method.
 	 */
 	void addTimer(Timer* timer);
 	
@@ -116,11 +126,21 @@ public:
 	 *  @brief Remove Timer from the TimerManager
 	 *
 	 *  This method removes the weak reference to the specified Timer
-	 *  from the TimerManager.   This is called by a Timer when
-	 *  it is destroyed and users should not call this method.
+	 *  from the TimerManager.   When it returns the service thread is
+	 *  no longer running the Timer, unless it is the caller.  This is
+	 *  called by a Timer when it is stopped or destroyed and users
+	 *  should not call this method.
 	 */
 	void removeTimer(Timer* timer);
 	
+	/**
+	 *  @brief Wake the service thread
+	 *
+	 *  Called by a Timer when it has a timeout due sooner than it told
+	 *  the service thread.  Users should not call this method.
+	 */
+	void wakeService();
+	
 protected:
 	//! Prevent non-singleton usage
 	TimerManager();
@@ -132,9 +152,15 @@ protected:
 	~TimerManager();
 
 private:
+	//! The service thread's main loop
+	void serviceHandler();
+	
 	//! The default timer which will use the default kMsPerTick
 	SmartPtr<Timer> mDefaultTimer;
 	
+	//! The timers made by getTimer
+	JetHead::vector<SmartPtr<Timer> > mSharedTimers;
+	
 	//! How many ms do we wait per tick?
 	static const int kMsPerTick = 100;
 	
@@ -146,6 +172,24 @@ private:
 	
 	//! Locking for internal state
 	Mutex mMutex;
+	
+	//! The thread that runs all the Timers
+	Runnable<TimerManager> *mServiceThread;
+	
+	//! The Timer the service thread is running, protected by mMutex
+	Timer *mServicing;
+	
+	//! Signalled when the service thread is done with mServicing
+	Condition mServiced;
+	
+	//! Protects mWoken, this is taken with a Timer's lock held
+	Mutex mWakeLock;
+	
+	//! Set by wakeService, so the service thread looks again
+	bool mWoken;
+	
+	//! Wakes the service thread
+	Condition mWakeup;
 };
 
 
@@ -40,7 +40,8 @@ SET_LOG_LEVEL( LOG_LVL_NOTICE );
 using namespace JetHead;
 
 CircularBuffer::CircularBuffer( uint8_t *buffer, int buf_size )
-	: mLock( true ), mFreeBuffer( false )
+	: mLock( "CircularBuffer", true, Mutex::getQueuePriorityInherit() ),
+	mFreeBuffer( false )
 {
 	mBuffer = buffer;
 	mReadPtr = mBuffer;
@@ -51,7 +52,8 @@ CircularBuffer::CircularBuffer( uint8_t *buffer, int buf_size )
 }
 
 CircularBuffer::CircularBuffer( int buf_size )
-	: mLock( true ), mFreeBuffer( true )
+	: mLock( "CircularBuffer", true, Mutex::getQueuePriorityInherit() ),
+	mFreeBuffer( true )
 {
 	mBuffer = jh_new uint8_t[ buf_size ];
 	mReadPtr = mBuffer;
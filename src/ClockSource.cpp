@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ClockSource.h"
+
+#include "logging.h"
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+namespace TimeUtils
+{
+	ClockSource *gClockSource = NULL;
+	
+	void setClockSource( ClockSource *source )
+	{
+		__sync_synchronize();
+		gClockSource = source;
+		__sync_synchronize();
+	}
+	
+	// These read gClockSource once, in case it is being changed
+	void getClockSourceTime( struct timespec *t )
+	{
+		ClockSource *source = gClockSource;
+		
+		if ( source != NULL )
+			source->getTime( t );
+		else
+			getSystemTime( t );
+	}
+	
+	uint64_t getClockSourceMonotonicUsecs()
+	{
+		ClockSource *source = gClockSource;
+		
+		if ( source != NULL )
+			return source->getMonotonicUsecs();
+		
+		return getSystemMonotonicUsecs();
+	}
+}
+
+//! Set t to base plus usecs
+static void offsetTime( const struct timespec &base, uint64_t usecs,
+						struct timespec *t )
+{
+	uint64_t nsecs = base.tv_nsec + ( usecs % 1000000 ) * 1000;
+	t->tv_sec = base.tv_sec + usecs / 1000000 + nsecs / 1000000000;
+	t->tv_nsec = nsecs % 1000000000;
+}
+
+// Both clocks start at the current clock source's time, so switching
+//  from one source to another never takes the time backwards.
+
+VirtualClock::VirtualClock()
+{
+	mNow = TimeUtils::getMonotonicUsecs();
+	mMonotonicBase = mNow;
+	TimeUtils::getCurTime( &mTimeBase );
+}
+
+VirtualClock::~VirtualClock()
+{
+	if ( not mWaiters.empty() )
+		LOG_WARN( "%d threads still waiting on the clock", 
+				  (int)mWaiters.size() );
+}
+
+uint64_t VirtualClock::getMonotonicUsecs()
+{
+	AutoLock lock( mLock );
+	return mNow;
+}
+
+void VirtualClock::getTime( struct timespec *t )
+{
+	AutoLock lock( mLock );
+	offsetTime( mTimeBase, mNow - mMonotonicBase, t );
+}
+
+/**
+ * The waiter goes on mWaiters while the caller still holds mutex, and
+ *  advance locks mutex before it signals cond, so the signal can't get
+ *  in before the wait starts.  advance pins the waiters it is about to
+ *  signal, and a pinned waiter doesn't return (and take its Condition
+ *  away) until advance is done with it.
+ */
+bool VirtualClock::waitUntil( Condition &cond, Mutex &mutex, 
+							  uint64_t deadline )
+{
+	Waiter waiter;
+	waiter.mCond = &cond;
+	waiter.mMutex = &mutex;
+	waiter.mDeadline = deadline;
+	waiter.mPins = 0;
+	
+	mLock.Lock();
+	
+	if ( mNow >= deadline )
+	{
+		mLock.Unlock();
+		return false;
+	}
+	
+	mWaiters.push_back( &waiter );
+	mChanged.Broadcast();
+	mLock.Unlock();
+	
+	cond.Wait( mutex );
+	
+	mLock.Lock();
+	removeWaiter( &waiter );
+	
+	bool signaled = ( mNow < deadline );
+	
+	if ( waiter.mPins > 0 )
+	{
+		// advance wants mutex, and must not be waited for while
+		//  holding it
+		mutex.Unlock();
+		
+		while ( waiter.mPins > 0 )
+			mChanged.Wait( mLock );
+		
+		mLock.Unlock();
+		mutex.Lock();
+	}
+	else
+	{
+		mLock.Unlock();
+	}
+	
+	return signaled;
+}
+
+void VirtualClock::advance( uint64_t usecs )
+{
+	mLock.Lock();
+	uint64_t to = mNow + usecs;
+	mLock.Unlock();
+	
+	advanceTo( to );
+}
+
+void VirtualClock::advanceTo( uint64_t usecs )
+{
+	JetHead::vector<Waiter*> due;
+	
+	mLock.Lock();
+	
+	if ( usecs > mNow )
+		mNow = usecs;
+	
+	for ( unsigned i = 0; i < mWaiters.size(); i++ )
+	{
+		if ( mWaiters[ i ]->mDeadline <= mNow )
+		{
+			mWaiters[ i ]->mPins++;
+			due.push_back( mWaiters[ i ] );
+		}
+	}
+	
+	LOG_NOISE( "now %llu us, waking %d", (unsigned long long)mNow, 
+		       (int)due.size() );
+	
+	mLock.Unlock();
+	
+	// Waiters lock their mutex before mLock, so this can't hold mLock
+	for ( unsigned i = 0; i < due.size(); i++ )
+	{
+		due[ i ]->mMutex->Lock();
+		due[ i ]->mCond->Broadcast();
+		due[ i ]->mMutex->Unlock();
+	}
+	
+	mLock.Lock();
+	
+	for ( unsigned i = 0; i < due.size(); i++ )
+		due[ i ]->mPins--;
+	
+	mChanged.Broadcast();
+	mLock.Unlock();
+}
+
+uint64_t VirtualClock::getNextDeadline()
+{
+	AutoLock lock( mLock );
+	
+	uint64_t next = ~0ULL;
+	
+	for ( unsigned i = 0; i < mWaiters.size(); i++ )
+	{
+		if ( mWaiters[ i ]->mDeadline < next )
+			next = mWaiters[ i ]->mDeadline;
+	}
+	
+	return next;
+}
+
+bool VirtualClock::advanceToNextDeadline()
+{
+	uint64_t next = getNextDeadline();
+	
+	if ( next == ~0ULL )
+		return false;
+	
+	advanceTo( next );
+	return true;
+}
+
+int VirtualClock::getNumWaiters()
+{
+	AutoLock lock( mLock );
+	return mWaiters.size();
+}
+
+bool VirtualClock::waitForWaiters( int count, uint32_t timeoutMs )
+{
+	uint64_t deadline = TimeUtils::getSystemMonotonicUsecs() + 
+		(uint64_t)timeoutMs * 1000;
+	
+	AutoLock lock( mLock );
+	
+	while ( (int)mWaiters.size() < count )
+	{
+		if ( not mChanged.WaitUntilSystem( mLock, deadline ) and
+			 (int)mWaiters.size() < count )
+			return false;
+	}
+	
+	return true;
+}
+
+//! Take waiter off mWaiters, called with mLock held
+void VirtualClock::removeWaiter( Waiter *waiter )
+{
+	for ( unsigned i = 0; i < mWaiters.size(); i++ )
+	{
+		if ( mWaiters[ i ] == waiter )
+		{
+			mWaiters.erase( i );
+			break;
+		}
+	}
+	
+	mChanged.Broadcast();
+}
+
+WarpClock::WarpClock( double factor )
+:	mFactor( factor )
+{
+	if ( mFactor <= 0.0 )
+	{
+		LOG_WARN( "bad factor %f, using 1", factor );
+		mFactor = 1.0;
+	}
+	
+	mSystemBase = TimeUtils::getSystemMonotonicUsecs();
+	mWarpedBase = TimeUtils::getMonotonicUsecs();
+	mMonotonicBase = mWarpedBase;
+	TimeUtils::getCurTime( &mTimeBase );
+}
+
+uint64_t WarpClock::getMonotonicUsecs()
+{
+	AutoLock lock( mLock );
+	return toWarped( TimeUtils::getSystemMonotonicUsecs() );
+}
+
+void WarpClock::getTime( struct timespec *t )
+{
+	AutoLock lock( mLock );
+	
+	uint64_t now = toWarped( TimeUtils::getSystemMonotonicUsecs() );
+	offsetTime( mTimeBase, now - mMonotonicBase, t );
+}
+
+bool WarpClock::waitUntil( Condition &cond, Mutex &mutex, 
+						   uint64_t deadline )
+{
+	mLock.Lock();
+	
+	uint64_t system = TimeUtils::getSystemMonotonicUsecs();
+	uint64_t now = toWarped( system );
+	
+	if ( now >= deadline )
+	{
+		mLock.Unlock();
+		return false;
+	}
+	
+	// Round up, so the wait doesn't end just short of the deadline
+	double usecs = (double)( deadline - now ) / mFactor + 1.0;
+	mLock.Unlock();
+	
+	// Keep far off deadlines from overflowing
+	if ( usecs > 1e15 )
+		usecs = 1e15;
+	
+	return cond.WaitUntilSystem( mutex, system + (uint64_t)usecs );
+}
+
+void WarpClock::setFactor( double factor )
+{
+	if ( factor <= 0.0 )
+	{
+		LOG_WARN( "bad factor %f", factor );
+		return;
+	}
+	
+	AutoLock lock( mLock );
+	
+	uint64_t system = TimeUtils::getSystemMonotonicUsecs();
+	mWarpedBase = toWarped( system );
+	mSystemBase = system;
+	mFactor = factor;
+}
+
+double WarpClock::getFactor()
+{
+	AutoLock lock( mLock );
+	return mFactor;
+}
+
+//! The warped time at system time system, called with mLock held
+uint64_t WarpClock::toWarped( uint64_t system )
+{
+	return mWarpedBase + (uint64_t)( ( system - mSystemBase ) * mFactor );
+}
@@ -26,17 +26,36 @@
  */
 
 #include "Condition.h"
+#include "ClockSource.h"
+#include "Fiber.h"
+
+#include <limits.h>
 
 #include "logging.h"
 
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
+// Timed waits use the monotonic clock where pthreads supports it, so 
+//  setting the time doesn't stretch or cut short a wait.
+#if defined( CLOCK_MONOTONIC ) && !defined( PLATFORM_DARWIN )
+#define JH_CONDITION_MONOTONIC
+#endif
+
 
 //! Initialize a new condition variable (see pthread_cond_init(3))
 Condition::Condition()
+:	mSeq( 0 ), mWaiters( 0 ), mFibers( NULL ), mFiberLock( "Condition" )
 {
+#ifdef JH_CONDITION_MONOTONIC
+	pthread_condattr_t attr;
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+	pthread_cond_init( &mCond, &attr );
+	pthread_condattr_destroy( &attr );
+#else
 	pthread_cond_init( &mCond, NULL );
+#endif
 }
 
 //! Cleanup the condition variable we were wrapping
@@ -65,7 +84,20 @@ Condition::~Condition()
  */
 void Condition::Wait( Mutex &mutex )
 {
+	if ( Fiber::getCurrent() != NULL )
+	{
+		waitFiber( mutex, 0 );
+		return;
+	}
+	
+#ifdef JH_MUTEX_FUTEX
+	waitFutex( mutex, NULL );
+	return;
+#endif
+	
+	mutex.pauseHold();
 	pthread_cond_wait( &mCond, &mutex.mMutex );
+	mutex.resumeHold();
 }
 
 /**
@@ -83,11 +115,8 @@ bool Condition::Wait( Mutex &mutex, uint32_t timeoutms )
 {
 	if ( timeoutms > 0 )
 	{
-		struct timespec timeout;
-		TimeUtils::getCurTime( &timeout );
-		TimeUtils::addOffset( &timeout, timeoutms );
-		if ( pthread_cond_timedwait( &mCond, &mutex.mMutex, &timeout ) != 0 )
-			return false;
+		return WaitUntil( mutex, TimeUtils::getMonotonicUsecs() + 
+						  (uint64_t)timeoutms * 1000 );
 	}
 	else
 		Wait( mutex );
@@ -95,6 +124,65 @@ bool Condition::Wait( Mutex &mutex, uint32_t timeoutms )
 	return true;
 }
 
+/**
+ * This method will block the calling thread, waiting for the
+ * condition to be signalled or for the monotonic clock to reach
+ * deadline.
+ *
+ * @return true if the condition was signaled, and false if the 
+ * deadline passed.
+ */
+bool Condition::WaitUntil( Mutex &mutex, uint64_t deadline )
+{
+	// The fiber's timeout is on the same clock, and 0 means none
+	if ( Fiber::getCurrent() != NULL )
+		return waitFiber( mutex, deadline ? deadline : 1 );
+	
+	ClockSource *source = TimeUtils::getClockSource();
+	
+	if ( source != NULL )
+		return source->waitUntil( *this, mutex, deadline );
+	
+	return WaitUntilSystem( mutex, deadline );
+}
+
+/**
+ * Like WaitUntil, but the deadline is on the system's monotonic
+ * clock whatever the clock source.
+ */
+bool Condition::WaitUntilSystem( Mutex &mutex, uint64_t deadline )
+{
+	struct timespec timeout;
+	
+#if defined( JH_MUTEX_FUTEX )
+	timeout.tv_sec = deadline / 1000000;
+	timeout.tv_nsec = ( deadline % 1000000 ) * 1000;
+	
+	return waitFutex( mutex, &timeout );
+#elif defined( JH_CONDITION_MONOTONIC )
+	timeout.tv_sec = deadline / 1000000;
+	timeout.tv_nsec = ( deadline % 1000000 ) * 1000;
+#else
+	// The condition waits on the real time clock, so turn the deadline
+	//  into a time from now on that clock.
+	uint64_t now = TimeUtils::getSystemMonotonicUsecs();
+	TimeUtils::getSystemTime( &timeout );
+	
+	if ( deadline > now )
+	{
+		uint64_t nsecs = timeout.tv_nsec + ( deadline - now ) * 1000;
+		timeout.tv_sec += nsecs / 1000000000;
+		timeout.tv_nsec = nsecs % 1000000000;
+	}
+#endif
+	
+	mutex.pauseHold();
+	int res = pthread_cond_timedwait( &mCond, &mutex.mMutex, &timeout );
+	mutex.resumeHold();
+	
+	return ( res == 0 );
+}
+
 /**
  * This method signals the condition, waking up one and only one
  * waiting thread.  The thread to be awoken is not specified.  If
@@ -103,7 +191,19 @@ bool Condition::Wait( Mutex &mutex, uint32_t timeoutms )
  */
 void Condition::Signal()
 {
+	// Checked again under mFiberLock, this just keeps Signals without
+	//  fibers from taking it
+	if ( mFibers != NULL )
+		Fiber::wakeCondition( mFibers, mFiberLock, false );
+	
+#ifdef JH_MUTEX_FUTEX
+	__sync_fetch_and_add( &mSeq, 1 );
+	
+	if ( mWaiters > 0 )
+		Mutex::futexWake( &mSeq, 1 );
+#else
 	pthread_cond_signal( &mCond );
+#endif
 }
 
 /**
@@ -113,5 +213,63 @@ void Condition::Signal()
  */
 void Condition::Broadcast()
 {
+	if ( mFibers != NULL )
+		Fiber::wakeCondition( mFibers, mFiberLock, true );
+	
+#ifdef JH_MUTEX_FUTEX
+	__sync_fetch_and_add( &mSeq, 1 );
+	
+	if ( mWaiters > 0 )
+		Mutex::futexWake( &mSeq, INT_MAX );
+#else
 	pthread_cond_broadcast( &mCond );
+#endif
+}
+
+/**
+ * A futex condition is a sequence number that every signal changes.  
+ *  The waiter reads it while still holding the mutex, and the kernel 
+ *  only puts it to sleep if it hasn't changed since, so a signal after
+ *  the mutex is given up can't be missed.  Like any condition, a waiter
+ *  can wake up without being signaled.
+ */
+bool Condition::waitFutex( Mutex &mutex, const struct timespec *deadline )
+{
+#ifdef JH_MUTEX_FUTEX
+	__sync_fetch_and_add( &mWaiters, 1 );
+	int seq = mSeq;
+	
+	mutex.pauseHold();
+	int count = mutex.releaseForWait();
+	
+	bool signaled = Mutex::futexWait( &mSeq, seq, deadline );
+	
+	mutex.reacquireAfterWait( count );
+	mutex.resumeHold();
+	
+	__sync_fetch_and_sub( &mWaiters, 1 );
+	
+	return signaled;
+#else
+	return false;
+#endif
+}
+
+/**
+ * A fiber gives up the mutex the same way a thread does, so a
+ *  recursive lock held more than once is let go of completely.
+ */
+bool Condition::waitFiber( Mutex &mutex, uint64_t deadline )
+{
+	Fiber::addWaiter( mFibers, mFiberLock );
+	
+	mutex.pauseHold();
+	int count = mutex.releaseForWait();
+	
+	bool signaled = Fiber::waitWoken( mFiberLock, deadline );
+	
+	mutex.reacquireAfterWait( count );
+	mutex.resumeHold();
+	
+	return signaled;
 }
@@ -28,9 +28,12 @@
 #include "EventDispatcher.h"
 #include "EventAgent.h"
 #include "Timer.h"
+#include "TimeUtils.h"
 #include "logging.h"
 #include "jh_memory.h"
 
+#include <algorithm>
+
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
@@ -133,6 +136,13 @@ int EventDispatcherHelper::removeEventListener( IEventListener *listener, int ev
 }
 
 EventDispatcher::EventDispatcher()
+:	mIdleLock( true ),
+	mHasIdleTasks( false ),
+	mIdleRearm( false ),
+	mIdleBudget( kDefaultIdleBudget ),
+	mDeadTimers( 0 ),
+	mTimerSeq( 0 ),
+	mLocalDeadline( 0 )
 {
 	// NOTE:  This is a sort of hacky way of preventing a bad condition from
 	// occuring.  It was found that when we are processing a signal to do
@@ -148,6 +158,16 @@ EventDispatcher::EventDispatcher()
 
 EventDispatcher::~EventDispatcher()
 {
+	for (JetHead::list<IdleTaskNode*>::iterator i = mIdleTasks.begin();
+		 i != mIdleTasks.end(); ++i)
+	{
+		delete *i;
+	}
+
+	mIdleTasks.clear();
+	
+	AutoLock l( mTimerLock );
+	mLocalTimers.clear();
 }
 
 void EventDispatcher::sendEventSync( Event *ev )
@@ -156,8 +176,8 @@ void EventDispatcher::sendEventSync( Event *ev )
 	// event ref count handled by holder.
 	SyncEventHolder holder( ev );
 
-	mQueue.SendEvent( &holder );
-	wakeThread();
+	if ( mQueue.SendEvent( &holder ) )
+		wakeThread();
 	
 	if (isThreadCurrent())
 		LOG_ERR_FATAL("Sending sync event to your current thread, I will die now...");
@@ -171,13 +191,29 @@ void EventDispatcher::sendEventSync( Event *ev )
 void EventDispatcher::sendEvent( Event *ev )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
-	mQueue.SendEvent( ev );
-	wakeThread();
+	// The dispatcher drains the queue every time it wakes up, so it only
+	//  needs waking when the queue goes from empty to non-empty.
+	if ( mQueue.SendEvent( ev ) )
+		wakeThread();
+}
+
+void EventDispatcher::sendEvents( Event **events, unsigned count )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if ( mQueue.SendEvents( events, count ) )
+		wakeThread();
 }
 
 void EventDispatcher::sendTimedEvent( Event *ev, uint32_t msecs, Timer* timer)
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
+	if ( timer == NULL and hasLocalTimers() )
+	{
+		addLocalTimer( ev, msecs, 0 );
+		return;
+	}
+	
 	if ( timer == NULL )
 	{
 		timer = TimerManager::getInstance()->getDefaultTimer();
@@ -189,6 +225,12 @@ void EventDispatcher::sendPeriodicEvent( Event *ev, uint32_t msecs, Timer* timer
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
+	if ( timer == NULL and hasLocalTimers() )
+	{
+		addLocalTimer( ev, msecs, msecs );
+		return;
+	}
+	
 	if ( timer == NULL )
 	{
 		timer = TimerManager::getInstance()->getDefaultTimer();
@@ -217,6 +259,7 @@ int EventDispatcher::remove( Event::Id eventId )
 	//  It is important that we remove events from the TimerManager first.
 	//  This ensure that an event does not get dispatched to the queue after we
 	//  clear the queue.
+	removeLocalTimers( eventId, NULL, NULL );
 	TimerManager *timerMan = TimerManager::getInstance();
 	timerMan->removeTimedEvent( eventId, this );
 	mQueue.Remove( eventId );	
@@ -243,6 +286,7 @@ int EventDispatcher::remove( Event *ev )
 	//  It is important that we remove events from the TimerManager first.  
 	//  This ensure that an event does not get dispatched to the queue after we
 	//  clear the queue.
+	removeLocalTimers( Event::kInvalidEventId, ev, NULL );
 	TimerManager *timerMan = TimerManager::getInstance();
 	timerMan->removeTimedEvent( ev );
 	mQueue.Remove( ev );	
@@ -266,6 +310,7 @@ int EventDispatcher::removeAgentsByReceiver(void* recipient)
 		return e->send(this);
 	}
 
+	removeLocalTimers( Event::kInvalidEventId, NULL, recipient );
 	TimerManager *timerMan = TimerManager::getInstance();
 	timerMan->removeAgentsByReceiver(recipient, this);
 	mQueue.RemoveAgentsByReceiver(recipient);
@@ -291,6 +336,7 @@ int EventDispatcher::removeAll()
 
 	// Same a remove exept we give TimerManager an invalid id so that he will
 	//  remove all events for this dispatcher.
+	removeLocalTimers( Event::kInvalidEventId, NULL, NULL );
 	TimerManager *timerMan = TimerManager::getInstance();
 	timerMan->removeTimedEvent( Event::kInvalidEventId, this );
 	mQueue.Flush();
@@ -298,6 +344,165 @@ int EventDispatcher::removeAll()
 }
 
 
+void EventDispatcher::addLocalTimer( Event *ev, uint32_t msecs, 
+									 uint32_t period )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	LocalTimer timer;
+	timer.mEvent = ev;
+	timer.mDeadline = TimeUtils::getMonotonicUsecs() + (uint64_t)msecs * 1000;
+	timer.mPeriod = (uint64_t)period * 1000;
+	
+	DebugAutoLock( mTimerLock );
+	insertLocalTimer( timer );
+	updateLocalDeadline();
+}
+
+void EventDispatcher::insertLocalTimer( LocalTimer &timer )
+{
+	// Timers due at the same time fire in the order they were added
+	timer.mSeq = mTimerSeq++;
+	
+	mLocalTimers.push_back( timer );
+	std::push_heap( &mLocalTimers[ 0 ], 
+					&mLocalTimers[ 0 ] + mLocalTimers.size() );
+}
+
+void EventDispatcher::popLocalTimer()
+{
+	std::pop_heap( &mLocalTimers[ 0 ], 
+				   &mLocalTimers[ 0 ] + mLocalTimers.size() );
+	mLocalTimers.resize( mLocalTimers.size() - 1 );
+}
+
+void EventDispatcher::pruneLocalTimers()
+{
+	while ( not mLocalTimers.empty() and mLocalTimers[ 0 ].mEvent == NULL )
+	{
+		popLocalTimer();
+		mDeadTimers--;
+	}
+}
+
+void EventDispatcher::removeLocalTimers( Event::Id eventId, Event *ev, 
+										 void *receiver )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	DebugAutoLock( mTimerLock );
+	
+	// The events are let go now, the heap entries when they come up
+	for ( unsigned i = 0; i < mLocalTimers.size(); i++ )
+	{
+		Event *timed = mLocalTimers[ i ].mEvent;
+		bool match;
+		
+		if ( timed == NULL )
+			continue;
+		
+		if ( ev != NULL )
+			match = ( timed == ev );
+		else if ( receiver != NULL )
+			match = ( timed->getEventId() == Event::kAgentEventId and
+					  static_cast<EventAgent*>( timed )->getDeliveryTarget() 
+					  == receiver );
+		else
+			match = ( eventId == Event::kInvalidEventId or 
+					  timed->getEventId() == eventId );
+		
+		if ( match )
+		{
+			mLocalTimers[ i ].mEvent = NULL;
+			mDeadTimers++;
+		}
+	}
+	
+	// Don't let removed timers pile up behind a far off one
+	if ( mDeadTimers > mLocalTimers.size() / 2 )
+	{
+		JetHead::vector<LocalTimer> live;
+		
+		for ( unsigned i = 0; i < mLocalTimers.size(); i++ )
+		{
+			if ( mLocalTimers[ i ].mEvent != NULL )
+				live.push_back( mLocalTimers[ i ] );
+		}
+		
+		mLocalTimers = live;
+		mDeadTimers = 0;
+		
+		if ( not mLocalTimers.empty() )
+			std::make_heap( &mLocalTimers[ 0 ], 
+							&mLocalTimers[ 0 ] + mLocalTimers.size() );
+	}
+	
+	updateLocalDeadline();
+}
+
+void EventDispatcher::updateLocalDeadline()
+{
+	uint64_t deadline = 0;
+	
+	pruneLocalTimers();
+	
+	if ( not mLocalTimers.empty() )
+		deadline = mLocalTimers[ 0 ].mDeadline;
+	
+	if ( deadline != mLocalDeadline )
+	{
+		mLocalDeadline = deadline;
+		localTimersChanged( deadline );
+	}
+}
+
+uint32_t EventDispatcher::runLocalTimers()
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	uint64_t now = TimeUtils::getMonotonicUsecs();
+	
+	DebugAutoLock( mTimerLock );
+	
+	pruneLocalTimers();
+	
+	while ( not mLocalTimers.empty() )
+	{
+		LocalTimer timer = mLocalTimers[ 0 ];
+		
+		// The nearest is on top, so we are done at the first one in the
+		//  future.
+		if ( timer.mDeadline > now )
+			break;
+		
+		popLocalTimer();
+		pruneLocalTimers();
+		
+		// We are on our own thread, so no wake up is needed
+		mQueue.SendEvent( timer.mEvent );
+		
+		// Periodic timers keep to their period, but don't try to make up
+		//  for periods we slept through.
+		if ( timer.mPeriod != 0 )
+		{
+			timer.mDeadline += timer.mPeriod;
+			if ( timer.mDeadline <= now )
+				timer.mDeadline = now + timer.mPeriod;
+			
+			insertLocalTimer( timer );
+		}
+	}
+	
+	updateLocalDeadline();
+	
+	if ( mLocalTimers.empty() )
+		return 0;
+	
+	// Waking up once an hour keeps the timeout well within an int
+	uint64_t msecs = ( mLocalTimers[ 0 ].mDeadline - now + 999 ) / 1000;
+	return ( msecs < kMaxLocalTimerWait ) ? msecs : kMaxLocalTimerWait;
+}
+
 bool EventDispatcher::isThreadCurrent()
 {
 	TRACE_BEGIN(LOG_LVL_NOISE);
@@ -318,6 +523,121 @@ int EventDispatcher::removeEventListener( IEventListener *listener, int event_id
 	return mDispatcher.removeEventListener( listener, event_id );
 }
 
+void EventDispatcher::addIdleTask( IdleTask *task )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if ( task == NULL )
+	{
+		LOG_WARN( "Attempt to add NULL idle task" );
+		return;
+	}
+	
+	IdleTaskNode *node = jh_new IdleTaskNode;
+	
+	node->mTask = task;
+	node->mPending = true;
+	
+	mIdleLock.Lock();
+	mIdleTasks.push_back( node );
+	mHasIdleTasks = true;
+	mIdleLock.Unlock();
+
+	// The dispatcher may be blocked waiting for an event, kick it so that
+	//  it notices the new task.
+	if ( not isThreadCurrent() )
+		sendEvent( jh_new Event( Event::kIdleEventId ) );
+}
+
+void EventDispatcher::removeIdleTask( IdleTask *task )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	// Since the lock is held while tasks are running this will wait for 
+	//  a running slice to complete.  The node is pruned by runIdleTasks so 
+	//  that a task can safely remove itself from runIdle.
+	DebugAutoLock( mIdleLock );
+	
+	for (JetHead::list<IdleTaskNode*>::iterator i = mIdleTasks.begin();
+		 i != mIdleTasks.end(); ++i)
+	{
+		if ( (*i)->mTask == task )
+			(*i)->mTask = NULL;
+	}
+}
+
+bool EventDispatcher::runIdleTasks()
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if ( not mHasIdleTasks )
+		return false;
+	
+	DebugAutoLock( mIdleLock );
+	
+	bool pending = true;
+	
+	// Every task gets called again after we have handled an event.
+	if ( mIdleRearm )
+	{
+		for (JetHead::list<IdleTaskNode*>::iterator i = mIdleTasks.begin();
+			 i != mIdleTasks.end(); ++i)
+		{
+			(*i)->mPending = true;
+		}
+		
+		mIdleRearm = false;
+	}
+	
+	// The budget is real time, even when the ClockSource is warped
+	uint64_t start = TimeUtils::getSystemMonotonicUsecs();
+	
+	while ( pending )
+	{
+		pending = false;
+
+		for (JetHead::list<IdleTaskNode*>::iterator i = mIdleTasks.begin();
+			 i != mIdleTasks.end(); ++i)
+		{
+			IdleTaskNode *node = *i;
+			
+			// Prune removed tasks
+			if ( node->mTask == NULL )
+			{
+				delete node;
+				i = i.erase();
+				--i;
+				continue;
+			}
+			
+			if ( not node->mPending )
+				continue;
+			
+			// Real work always comes first
+			if ( not mQueue.IsEmpty() )
+				return false;
+			
+			if ( TimeUtils::getSystemMonotonicUsecs() - start >= 
+				 mIdleBudget )
+			{
+				return true;
+			}
+			
+			node->mPending = node->mTask->runIdle();
+			
+			// The task could have removed itself.
+			if ( node->mTask == NULL )
+				node->mPending = false;
+			
+			pending = pending or node->mPending;
+		}
+	}
+	
+	mHasIdleTasks = not mIdleTasks.empty();
+	
+	return false;
+}
+
 void EventDispatcher::handleSyncEvent( Event *ev )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
@@ -348,6 +668,9 @@ bool EventDispatcher::handleEvent( Event *ev )
 		return false;
 	}
 	
+	// Every idle task gets another chance once we go idle again
+	mIdleRearm = true;
+	
 	switch ( ev->getEventId() )
 	{
 		case Event::kShutdownEventId:
@@ -361,6 +684,11 @@ bool EventDispatcher::handleEvent( Event *ev )
 			handleSyncEvent( ev );
 			break;
 		
+		case Event::kIdleEventId:
+			// Only sent to wake us up so the new idle task gets run.
+			ev->Release();
+			break;
+		
 		default:
 			mDispatcher.dispatchEvent( ev );
 			ev->Release();
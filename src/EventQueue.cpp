@@ -32,7 +32,9 @@
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
-EventQueue::EventQueue() : mLock( "EventQueue" )
+EventQueue::EventQueue() 
+	: mLock( "EventQueue", false, Mutex::getQueuePriorityInherit() ), 
+	mWoken( false )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 }
@@ -43,12 +45,46 @@ EventQueue::~EventQueue()
 	// look at all event in the queue and delete them.
 }
 
-void EventQueue::SendEvent( Event *ev )
+bool EventQueue::SendEvent( Event *ev )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
 	DebugAutoLock( mLock );
 	
+	bool wasEmpty = mQueue.empty();
+	
+	insertEvent( ev );
+	
+	LOG( "queue size %d", mQueue.size() );	
+
+	mWait.Signal();
+	
+	return wasEmpty;
+}
+
+bool EventQueue::SendEvents( Event **events, unsigned count )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	DebugAutoLock( mLock );
+	
+	bool wasEmpty = mQueue.empty();
+	
+	for ( unsigned i = 0; i < count; i++ )
+		insertEvent( events[ i ] );
+	
+	LOG( "queue size %d", mQueue.size() );	
+
+	if ( count > 1 )
+		mWait.Broadcast();
+	else
+		mWait.Signal();
+	
+	return wasEmpty;
+}
+
+void EventQueue::insertEvent( Event *ev )
+{
 	ev->AddRef();
 
 	if ( ev->getPriority() == PRIORITY_NORMAL )
@@ -75,10 +111,6 @@ void EventQueue::SendEvent( Event *ev )
 			mQueue.push_back( ev );
 		}
 	}
-	
-	LOG( "queue size %d", mQueue.size() );	
-
-	mWait.Signal();
 }
 
 Event *EventQueue::WaitEvent( uint32_t mstimeout )
@@ -90,12 +122,18 @@ Event *EventQueue::WaitEvent( uint32_t mstimeout )
 
 	while ( ev == NULL )
 	{
+		if ( mWoken )
+		{
+			mWoken = false;
+			return NULL;
+		}
+		
 		LOG( "timeout %d", mstimeout );
 		if ( mWait.Wait( mLock, mstimeout ) )
 		{
 			LOG( "signalled" );
 			ev = pollEventInternal();
-			if ( ev == NULL )
+			if ( ev == NULL and not mWoken )
 			{
 				LOG_ERR( "Signalled empty queue" );
 			}
@@ -109,6 +147,15 @@ Event *EventQueue::WaitEvent( uint32_t mstimeout )
 	return ev;
 }
 
+void EventQueue::Wake()
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	DebugAutoLock( mLock );
+	mWoken = true;
+	mWait.Signal();
+}
+
 Event *EventQueue::pollEventInternal()
 {
 	if (mQueue.empty()) return NULL;
@@ -126,6 +173,12 @@ Event *EventQueue::PollEvent()
 	return pollEventInternal();
 }
 
+bool EventQueue::IsEmpty()
+{
+	DebugAutoLock( mLock );
+	return mQueue.empty();
+}
+
 void EventQueue::Remove( Event::Id id )
 {
 	DebugAutoLock( mLock );
@@ -56,14 +56,24 @@ void EventThread::threadMain()
 	
 	while( !done )
 	{
+		// Let idle tasks have the thread while there is nothing else to do,
+		//  they give it up as soon as an event is queued.
+		while ( runIdleTasks() )
+			runLocalTimers();
+		
+		// Wait no longer than the nearest timer.  A timer that is due 
+		//  queues its event here, so it fires on this thread.
+		uint32_t timeout = runLocalTimers();
+		
 		LOG_INFO( "Waiting Event" );
 
-		ev = mQueue.WaitEvent();
+		ev = mQueue.WaitEvent( timeout );
 
-		LOG_NOISE( "Got Event" );
-		
+		// Timed out or woken up for a new timer
 		if ( ev == NULL )
-			LOG_ERR_FATAL( "got a null event\n" );
+			continue;
+		
+		LOG_NOISE( "Got Event" );
 		
 		// not needed, at this time.
 		//AutoLock a( mLock );
@@ -72,3 +82,10 @@ void EventThread::threadMain()
 	}
 }
 
+void EventThread::localTimersChanged( uint64_t deadline )
+{
+	// Only an earlier deadline than the one being waited for matters,
+	//  but waking up once too often is cheap.
+	if ( deadline != 0 and not isThreadCurrent() )
+		mQueue.Wake();
+}
@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Fiber.h"
+#include "EventAgentT.h"
+#include "TimeUtils.h"
+
+#include "logging.h"
+#include "jh_memory.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+#ifndef MAP_STACK
+#define MAP_STACK	0
+#endif
+
+__thread Fiber *Fiber::mCurrent = NULL;
+
+//! Most stacks a scheduler keeps for new fibers
+static const unsigned kMaxFreeStacks = 64;
+
+Fiber::Fiber( uint32_t stackSize ) : mState( kNew ), mScheduler( NULL ),
+	mStackSize( stackSize ), mStack( NULL ), mWaitId( 0 ), mWakeResult( 0 ),
+	mWaitList( NULL ), mNextWaiter( NULL ), mPrevWaiter( NULL )
+{
+}
+
+Fiber::~Fiber()
+{
+}
+
+void Fiber::join()
+{
+	if ( mScheduler == NULL )
+	{
+		LOG_WARN( "Fiber %p was never spawned", this );
+		return;
+	}
+	
+	AutoLock l( mScheduler->mDoneLock );
+	
+	while ( mState != kDone )
+		mScheduler->mDone.Wait( mScheduler->mDoneLock );
+}
+
+int Fiber::waitForFd( int fd, short events, int msecs )
+{
+	Fiber *self = mCurrent;
+	
+	if ( self == NULL or msecs == 0 )
+	{
+		struct pollfd pfd;
+		int res;
+		
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		
+		do
+		{
+			res = poll( &pfd, 1, msecs );
+		} while ( res < 0 and errno == EINTR );
+		
+		return ( res > 0 ) ? pfd.revents : res;
+	}
+	
+	uint64_t deadline = 0;
+	
+	if ( msecs > 0 )
+		deadline = TimeUtils::getMonotonicUsecs() + (uint64_t)msecs * 1000;
+	
+	Selector *selector = self->mScheduler->mSelector;
+	uint32_t waitId = self->beginWait();
+	
+	// We are the selector's thread, so these take effect right away.
+	selector->addListener( fd, events, self, waitId );
+	int res = self->suspend( deadline );
+	selector->removeListener( fd, self );
+	
+	return res;
+}
+
+void Fiber::sleep( uint32_t msecs )
+{
+	Fiber *self = mCurrent;
+	
+	if ( self == NULL )
+	{
+		usleep( msecs * 1000 );
+		return;
+	}
+	
+	self->beginWait();
+	self->suspend( TimeUtils::getMonotonicUsecs() + (uint64_t)msecs * 1000 );
+}
+
+void Fiber::yield()
+{
+	Fiber *self = mCurrent;
+	
+	if ( self == NULL )
+		return;
+	
+	// To the back of the queue
+	self->mScheduler->wake( self, self->beginWait(), 1 );
+	self->suspend( 0 );
+}
+
+void Fiber::processFileEvents( int fd, short events, 
+							   jh_ptr_int_t private_data )
+{
+	mScheduler->resume( this, (uint32_t)private_data, events );
+}
+
+int Fiber::suspend( uint64_t deadline )
+{
+	if ( deadline != 0 )
+		mScheduler->addTimeout( this, deadline );
+	
+	mState = kWaiting;
+	swapcontext( &mContext, &mScheduler->mContext );
+	
+	// resume has set mState and mWakeResult
+	return mWakeResult;
+}
+
+void Fiber::start()
+{
+	Fiber *self = mCurrent;
+	
+	self->run();
+	
+	// Returning goes to uc_link, the scheduler's context, which sees
+	//  this and cleans up.
+	self->mState = kDone;
+}
+
+void Fiber::addWaiter( Fiber *volatile &waiters, Mutex &waitLock )
+{
+	Fiber *self = mCurrent;
+	
+	AutoLock l( waitLock );
+	
+	self->beginWait();
+	self->mWaitList = &waiters;
+	
+	if ( waiters == NULL )
+	{
+		waiters = self;
+		self->mNextWaiter = self->mPrevWaiter = self;
+	}
+	else
+	{
+		// Last in the circular list, just before the first
+		self->mNextWaiter = waiters;
+		self->mPrevWaiter = waiters->mPrevWaiter;
+		self->mPrevWaiter->mNextWaiter = self;
+		waiters->mPrevWaiter = self;
+	}
+}
+
+bool Fiber::waitWoken( Mutex &waitLock, uint64_t deadline )
+{
+	Fiber *self = mCurrent;
+	
+	// A signal since addWaiter has queued a wakeup, which the scheduler
+	//  can't get to before we have switched to it.
+	bool signalled = ( self->suspend( deadline ) != 0 );
+	
+	if ( not signalled )
+	{
+		AutoLock l( waitLock );
+		
+		// Unless a signal took us off the list as the deadline passed
+		if ( self->mWaitList != NULL )
+			self->unlinkWaiter();
+		else
+			signalled = true;
+	}
+	
+	return signalled;
+}
+
+void Fiber::wakeCondition( Fiber *volatile &waiters, Mutex &waitLock, 
+						   bool all )
+{
+	AutoLock l( waitLock );
+	
+	while ( waiters != NULL )
+	{
+		Fiber *fiber = waiters;
+		
+		fiber->unlinkWaiter();
+		fiber->mScheduler->wake( fiber, fiber->mWaitId, 1 );
+		
+		if ( not all )
+			break;
+	}
+}
+
+void Fiber::unlinkWaiter()
+{
+	Fiber *volatile &waiters = *mWaitList;
+	
+	if ( mNextWaiter == this )
+		waiters = NULL;
+	else
+	{
+		mNextWaiter->mPrevWaiter = mPrevWaiter;
+		mPrevWaiter->mNextWaiter = mNextWaiter;
+		
+		if ( waiters == this )
+			waiters = mNextWaiter;
+	}
+	
+	mWaitList = NULL;
+	mNextWaiter = mPrevWaiter = NULL;
+}
+
+FiberScheduler::FiberScheduler( Selector *selector ) : mSelector( selector ),
+	mWakeupLock( "FiberScheduler" ), mTimerDeadline( 0 ), mNumFibers( 0 )
+{
+}
+
+FiberScheduler::~FiberScheduler()
+{
+	waitForAll();
+	
+	// Nothing can be queued or running for us after this
+	mSelector->removeAgentsByReceiver( this );
+	
+	for ( unsigned i = 0; i < mWakeups.size(); i++ )
+		mWakeups[ i ].mFiber->Release();
+	
+	for ( unsigned i = 0; i < mTimeouts.size(); i++ )
+		mTimeouts[ i ].mFiber->Release();
+	
+	for ( unsigned i = 0; i < mFreeStacks.size(); i++ )
+		munmap( mFreeStacks[ i ], Fiber::kDefaultStackSize );
+}
+
+void FiberScheduler::spawn( Fiber *fiber )
+{
+	if ( fiber->mScheduler != NULL )
+	{
+		LOG_WARN( "Fiber %p already spawned", fiber );
+		return;
+	}
+	
+	fiber->mScheduler = this;
+	
+	// Ours until it finishes
+	fiber->AddRef();
+	
+	{
+		AutoLock l( mDoneLock );
+		mNumFibers++;
+	}
+	
+	wake( fiber, 0, 0 );
+}
+
+int FiberScheduler::getNumFibers()
+{
+	AutoLock l( mDoneLock );
+	return mNumFibers;
+}
+
+void FiberScheduler::waitForAll()
+{
+	AutoLock l( mDoneLock );
+	
+	while ( mNumFibers > 0 )
+		mDone.Wait( mDoneLock );
+}
+
+void FiberScheduler::wake( Fiber *fiber, uint32_t waitId, int result )
+{
+	Wakeup wakeup = { fiber, waitId, result };
+	bool first;
+	
+	fiber->AddRef();
+	
+	{
+		AutoLock l( mWakeupLock );
+		first = mWakeups.empty();
+		mWakeups.push_back( wakeup );
+	}
+	
+	// One event runs everything queued until it is handled
+	if ( first )
+	{
+		( jh_new AsyncEventAgent0<FiberScheduler>( this, 
+			&FiberScheduler::runWakeups ) )->send( mSelector );
+	}
+}
+
+void FiberScheduler::resume( Fiber *fiber, uint32_t waitId, int result )
+{
+	// A late wakeup, for a wait that has already ended
+	if ( fiber->mState != Fiber::kWaiting or fiber->mWaitId != waitId )
+		return;
+	
+	// Can't switch from one fiber straight to another, since the
+	//  scheduler's context is where the first would go back to.
+	if ( Fiber::mCurrent != NULL )
+	{
+		wake( fiber, waitId, result );
+		return;
+	}
+	
+	fiber->mWakeResult = result;
+	switchTo( fiber );
+}
+
+void FiberScheduler::switchTo( Fiber *fiber )
+{
+	fiber->mState = Fiber::kRunning;
+	Fiber::mCurrent = fiber;
+	swapcontext( &mContext, &fiber->mContext );
+	Fiber::mCurrent = NULL;
+	
+	if ( fiber->mState == Fiber::kDone )
+		finished( fiber );
+}
+
+void FiberScheduler::runWakeups()
+{
+	JetHead::vector<Wakeup> wakeups;
+	
+	{
+		AutoLock l( mWakeupLock );
+		wakeups = mWakeups;
+		mWakeups.clear();
+	}
+	
+	for ( unsigned i = 0; i < wakeups.size(); i++ )
+	{
+		Fiber *fiber = wakeups[ i ].mFiber;
+		
+		if ( fiber->mState == Fiber::kNew )
+		{
+			if ( prepare( fiber ) )
+				switchTo( fiber );
+			else
+			{
+				fiber->mState = Fiber::kDone;
+				finished( fiber );
+			}
+		}
+		else
+			resume( fiber, wakeups[ i ].mWaitId, wakeups[ i ].mResult );
+		
+		fiber->Release();
+	}
+}
+
+void FiberScheduler::addTimeout( Fiber *fiber, uint64_t deadline )
+{
+	Timeout timeout = { deadline, fiber, fiber->mWaitId };
+	
+	fiber->AddRef();
+	mTimeouts.push_back( timeout );
+	std::push_heap( &mTimeouts[ 0 ], &mTimeouts[ 0 ] + mTimeouts.size() );
+	
+	armTimer();
+}
+
+void FiberScheduler::armTimer()
+{
+	if ( mTimeouts.empty() )
+		return;
+	
+	uint64_t deadline = mTimeouts[ 0 ].mDeadline;
+	
+	// Deadlines mostly come in order, so the event sent for an
+	//  earlier one is usually still on its way.
+	if ( mTimerDeadline != 0 and mTimerDeadline <= deadline )
+		return;
+	
+	uint64_t now = TimeUtils::getMonotonicUsecs();
+	uint32_t msecs = 0;
+	
+	if ( deadline > now )
+		msecs = ( deadline - now + 999 ) / 1000;
+	
+	mTimerDeadline = deadline;
+	( jh_new AsyncEventAgent1<FiberScheduler, uint64_t>( this,
+		&FiberScheduler::runTimeouts, deadline ) )->sendTimed( mSelector, 
+															   msecs );
+}
+
+void FiberScheduler::runTimeouts( uint64_t deadline )
+{
+	if ( deadline == mTimerDeadline )
+		mTimerDeadline = 0;
+	
+	uint64_t now = TimeUtils::getMonotonicUsecs();
+	
+	while ( not mTimeouts.empty() and mTimeouts[ 0 ].mDeadline <= now )
+	{
+		Timeout timeout = mTimeouts[ 0 ];
+		
+		std::pop_heap( &mTimeouts[ 0 ], &mTimeouts[ 0 ] + mTimeouts.size() );
+		mTimeouts.resize( mTimeouts.size() - 1 );
+		
+		resume( timeout.mFiber, timeout.mWaitId, 0 );
+		timeout.mFiber->Release();
+	}
+	
+	armTimer();
+}
+
+bool FiberScheduler::prepare( Fiber *fiber )
+{
+	uint32_t size = fiber->mStackSize;
+	
+	if ( size == Fiber::kDefaultStackSize and not mFreeStacks.empty() )
+	{
+		fiber->mStack = mFreeStacks[ mFreeStacks.size() - 1 ];
+		mFreeStacks.resize( mFreeStacks.size() - 1 );
+	}
+	else
+	{
+		// Address space only until it is touched, with a guard page at
+		//  the bottom to catch an overflow.
+		void *stack = mmap( NULL, size, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANON | MAP_STACK, -1, 0 );
+		
+		if ( stack == MAP_FAILED )
+		{
+			LOG_ERR_PERROR( "Failed to map a %u byte fiber stack", size );
+			return false;
+		}
+		
+		mprotect( stack, getpagesize(), PROT_NONE );
+		fiber->mStack = stack;
+	}
+	
+	getcontext( &fiber->mContext );
+	fiber->mContext.uc_stack.ss_sp = fiber->mStack;
+	fiber->mContext.uc_stack.ss_size = size;
+	fiber->mContext.uc_link = &mContext;
+	makecontext( &fiber->mContext, &Fiber::start, 0 );
+	
+	return true;
+}
+
+void FiberScheduler::finished( Fiber *fiber )
+{
+	if ( fiber->mStack != NULL )
+	{
+		freeStack( fiber->mStack, fiber->mStackSize );
+		fiber->mStack = NULL;
+	}
+	
+	{
+		AutoLock l( mDoneLock );
+		mNumFibers--;
+		mDone.Broadcast();
+	}
+	
+	fiber->Release();
+}
+
+void FiberScheduler::freeStack( void *stack, uint32_t size )
+{
+	if ( size == Fiber::kDefaultStackSize and 
+		 mFreeStacks.size() < kMaxFreeStacks )
+		mFreeStacks.push_back( stack );
+	else
+		munmap( stack, size );
+}
@@ -35,6 +35,7 @@
 #include "jh_types.h"
 #include "logging.h"
 #include "File.h"
+#include "IoEngine.h"
 #include "JH_64BitFops.h"
 
 using namespace JetHead;
@@ -168,6 +169,8 @@ int File::read( void *buffer, int len )
 
 	if ( res == -1 )
 		setError();
+	else if ( res > 0 and mSelector != NULL )
+		mSelector->chargeRead( res );
 	
 	return res;
 }
@@ -182,6 +185,31 @@ int File::write( const void *buffer, int len )
 	return res;
 }
 	
+int File::readAsync( void *buffer, int len, IEventDispatcher *dispatcher,
+					 jh_off64_t offset, jh_ptr_int_t private_data )
+{
+	int res = IoEngine::getDefault()->read( mFd, buffer, len, offset, 
+											dispatcher, private_data );
+	
+	if ( res == -1 )
+		setError();
+	
+	return res;
+}
+
+int File::writeAsync( const void *buffer, int len, 
+					  IEventDispatcher *dispatcher, jh_off64_t offset, 
+					  jh_ptr_int_t private_data )
+{
+	int res = IoEngine::getDefault()->write( mFd, buffer, len, offset, 
+											 dispatcher, private_data );
+	
+	if ( res == -1 )
+		setError();
+	
+	return res;
+}
+
 jh_off64_t	File::getLength() const
 {
 	jh_stat64_t file_status;
@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "jh_types.h"
+
+#include "IoEngine.h"
+#include "IoUring.h"
+#include "Selector.h"
+
+#include "logging.h"
+#include "jh_memory.h"
+#include "JH_64BitFops.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+IoEngine *IoEngine::mDefault = NULL;
+
+//! Guards creation of mDefault
+static Mutex gDefaultLock;
+
+#ifdef JH_HAVE_IO_URING
+const uint8_t IoEngine::kOps[] = 
+	{ IORING_OP_NOP, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_SEND,
+	  IORING_OP_ACCEPT };
+#endif
+
+/**
+ * One outstanding request.  Its address is the io_uring user data,
+ * and without io_uring it is also the one shot Selector listener
+ * that does the I/O once the fd is ready.
+ */
+struct IoEngine::Request : public SelectorListener
+{
+	Request( IoEngine *engine, AsyncIoEvent *ev, jh_off64_t offset,
+			 IEventDispatcher *dispatcher ) : mEngine( engine ), 
+		mEvent( ev ), mOffset( offset ), mDispatcher( dispatcher ),
+		mSend( false ), mPrev( NULL ), mNext( NULL ) {}
+	
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data );
+	
+	IoEngine			*mEngine;
+	AsyncIoEvent		*mEvent;
+	jh_off64_t			mOffset;
+	IEventDispatcher	*mDispatcher;
+	
+	//! Write with send(2) instead of write(2)
+	bool				mSend;
+	
+	//! Links in mEngine's list of outstanding requests
+	Request				*mPrev;
+	Request				*mNext;
+};
+
+void IoEngine::Request::processFileEvents( int fd, short events, 
+										   jh_ptr_int_t private_data )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	int res = -1;
+	
+	switch ( mEvent->getOp() )
+	{
+		case AsyncIoEvent::kRead:
+			if ( mOffset < 0 )
+				res = ::read( fd, mEvent->getBuffer(), mEvent->getLength() );
+			else
+				res = jh_pread( fd, mEvent->getBuffer(), mEvent->getLength(),
+								mOffset );
+			break;
+			
+		case AsyncIoEvent::kWrite:
+			if ( mSend )
+				res = ::send( fd, mEvent->getBuffer(), mEvent->getLength(),
+							  MSG_NOSIGNAL );
+			else if ( mOffset < 0 )
+				res = ::write( fd, mEvent->getBuffer(), mEvent->getLength() );
+			else
+				res = jh_pwrite( fd, mEvent->getBuffer(), mEvent->getLength(),
+								 mOffset );
+			break;
+			
+		case AsyncIoEvent::kAccept:
+			res = ::accept( fd, NULL, NULL );
+			break;
+	}
+	
+	// Someone else got there first, wait for the next event
+	if ( res < 0 and ( errno == EAGAIN or errno == EWOULDBLOCK ) )
+	{
+		mEngine->mSelector->rearm( fd, this );
+		return;
+	}
+	
+	int error = errno;
+	mEngine->mSelector->removeListenerAsync( fd, this );
+	
+	// We are not called again once removed, and the Selector never
+	//  touches a removed listener, so it's safe to free ourselves.
+	mEngine->complete( this, res, error );
+}
+
+IoEngine *IoEngine::getDefault()
+{
+	AutoLock l( gDefaultLock );
+	
+	if ( mDefault == NULL )
+		mDefault = jh_new IoEngine();
+	
+	return mDefault;
+}
+
+void IoEngine::destroyDefault()
+{
+	AutoLock l( gDefaultLock );
+	
+	delete mDefault;
+	mDefault = NULL;
+}
+
+IoEngine::IoEngine( const char *name, bool useUring ) : mRing( NULL ), 
+	mSelector( NULL ), mPending( NULL ), mNumPending( 0 ), mBatch( 0 ),
+	mThread( name, this, &IoEngine::threadMain )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+#ifdef JH_HAVE_IO_URING
+	if ( useUring )
+		mRing = IoUring::create( kRingSize, kOps, kNumOps );
+#endif
+	
+	if ( mRing == NULL )
+	{
+		LOG_NOTICE( "Not using io_uring, falling back to a selector" );
+		mSelector = jh_new Selector( name );
+	}
+	
+	// Without the ring the thread just exits, but it is always
+	//  started so the destructor has something to join.
+	mThread.Start();
+}
+
+IoEngine::~IoEngine()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+#ifdef JH_HAVE_IO_URING
+	if ( mRing != NULL )
+	{
+		AutoLock l( mLock );
+		
+		// A NOP with no request tells the thread to stop
+		struct io_uring_sqe *sqe = mRing->getSqe();
+		
+		if ( sqe != NULL )
+		{
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = 0;
+		}
+		
+		if ( sqe == NULL or mRing->submit() < 0 )
+			LOG_ERR_FATAL( "Failed to stop io_uring thread" );
+	}
+#endif
+	
+	mThread.Join();
+	
+	// Stops the selector thread, after which no listener can run
+	delete mSelector;
+	
+#ifdef JH_HAVE_IO_URING
+	// Closing the ring cancels anything the kernel still has
+	delete mRing;
+	mRing = NULL;
+#endif
+	
+	if ( mNumPending != 0 )
+		LOG_NOTICE( "Cancelling %d outstanding requests", mNumPending );
+	
+	// The events were never sent, so nobody holds a reference yet
+	while ( mPending != NULL )
+	{
+		Request *req = mPending;
+		removePending( req );
+		delete req->mEvent;
+		delete req;
+	}
+}
+
+int IoEngine::read( int fd, void *buffer, int len, jh_off64_t offset,
+					IEventDispatcher *dispatcher, jh_ptr_int_t private_data )
+{
+	AsyncIoEvent *ev = jh_new AsyncIoEvent( AsyncIoEvent::kRead, fd, buffer,
+											len, private_data );
+	
+	return start( jh_new Request( this, ev, offset, dispatcher ) );
+}
+
+int IoEngine::write( int fd, const void *buffer, int len, jh_off64_t offset,
+					 IEventDispatcher *dispatcher, jh_ptr_int_t private_data )
+{
+	AsyncIoEvent *ev = jh_new AsyncIoEvent( AsyncIoEvent::kWrite, fd, 
+											(void*)buffer, len, private_data );
+	
+	return start( jh_new Request( this, ev, offset, dispatcher ) );
+}
+
+int IoEngine::send( int fd, const void *buffer, int len, 
+					IEventDispatcher *dispatcher, jh_ptr_int_t private_data )
+{
+	AsyncIoEvent *ev = jh_new AsyncIoEvent( AsyncIoEvent::kWrite, fd, 
+											(void*)buffer, len, private_data );
+	Request *req = jh_new Request( this, ev, -1, dispatcher );
+	req->mSend = true;
+	
+	return start( req );
+}
+
+int IoEngine::accept( int fd, IEventDispatcher *dispatcher, 
+					  jh_ptr_int_t private_data )
+{
+	AsyncIoEvent *ev = jh_new AsyncIoEvent( AsyncIoEvent::kAccept, fd, NULL,
+											0, private_data );
+	
+	return start( jh_new Request( this, ev, -1, dispatcher ) );
+}
+
+int IoEngine::start( Request *req )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	int fd = req->mEvent->getFd();
+	int res = 0;
+	
+	if ( fd < 0 or req->mDispatcher == NULL )
+	{
+		errno = fd < 0 ? EBADF : EINVAL;
+		res = -1;
+	}
+	else
+	{
+		AutoLock l( mLock );
+		
+		if ( mRing != NULL )
+			res = submitUring( req );
+		
+		if ( res == 0 )
+			addPending( req );
+	}
+	
+	if ( res < 0 )
+	{
+		int error = errno;
+		delete req->mEvent;
+		delete req;
+		errno = error;
+		return -1;
+	}
+	
+	// Not under our lock, the Selector calls us back with its lock
+	//  held.  The request may even complete before this returns.
+	if ( mRing == NULL )
+	{
+		short events = req->mEvent->getOp() == AsyncIoEvent::kWrite ? 
+			POLLOUT : POLLIN;
+		
+		mSelector->addListenerAsync( fd, events, req, 0, Selector::kOneShot );
+	}
+	
+	return 0;
+}
+
+int IoEngine::submitUring( Request *req )
+{
+#ifdef JH_HAVE_IO_URING
+	struct io_uring_sqe *sqe = mRing->getSqe();
+	
+	if ( sqe == NULL )
+		return -1;
+	
+	AsyncIoEvent *ev = req->mEvent;
+	
+	sqe->fd = ev->getFd();
+	sqe->user_data = (uintptr_t)req;
+	
+	switch ( ev->getOp() )
+	{
+		case AsyncIoEvent::kRead:
+			sqe->opcode = IORING_OP_READ;
+			break;
+			
+		case AsyncIoEvent::kWrite:
+			sqe->opcode = req->mSend ? IORING_OP_SEND : IORING_OP_WRITE;
+			break;
+			
+		case AsyncIoEvent::kAccept:
+			sqe->opcode = IORING_OP_ACCEPT;
+			break;
+	}
+	
+	if ( ev->getOp() != AsyncIoEvent::kAccept )
+	{
+		sqe->addr = (uintptr_t)ev->getBuffer();
+		sqe->len = ev->getLength();
+		
+		// -1 means the current file position
+		if ( req->mSend )
+			sqe->msg_flags = MSG_NOSIGNAL;
+		else
+			sqe->off = (uint64_t)req->mOffset;
+	}
+	
+	// The entry is in the ring now, so if this fails it just goes
+	//  with the next submit.
+	if ( mBatch == 0 and mRing->submit() < 0 )
+		LOG_WARN_PERROR( "io_uring submit failed" );
+	
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void IoEngine::beginBatch()
+{
+	AutoLock l( mLock );
+	mBatch++;
+}
+
+void IoEngine::endBatch()
+{
+	AutoLock l( mLock );
+	
+	if ( mBatch == 0 )
+	{
+		LOG_WARN( "endBatch without beginBatch" );
+		return;
+	}
+	
+#ifdef JH_HAVE_IO_URING
+	if ( --mBatch == 0 and mRing != NULL and mRing->submit() < 0 )
+		LOG_WARN_PERROR( "io_uring submit failed" );
+#else
+	mBatch--;
+#endif
+}
+
+int IoEngine::getNumPending()
+{
+	AutoLock l( mLock );
+	return mNumPending;
+}
+
+void IoEngine::addPending( Request *req )
+{
+	req->mPrev = NULL;
+	req->mNext = mPending;
+	
+	if ( mPending != NULL )
+		mPending->mPrev = req;
+	
+	mPending = req;
+	mNumPending++;
+}
+
+void IoEngine::removePending( Request *req )
+{
+	if ( req->mPrev != NULL )
+		req->mPrev->mNext = req->mNext;
+	else
+		mPending = req->mNext;
+	
+	if ( req->mNext != NULL )
+		req->mNext->mPrev = req->mPrev;
+	
+	mNumPending--;
+}
+
+void IoEngine::complete( Request *req, int res, int error )
+{
+	req->mEvent->setResult( res, error );
+	
+	// The event's reference goes to the dispatcher.  The request only
+	//  stops being pending once sendEvent is done with the dispatcher,
+	//  so getNumPending() going to 0 means it's safe to destroy it.
+	req->mDispatcher->sendEvent( req->mEvent );
+	
+	{
+		AutoLock l( mLock );
+		removePending( req );
+	}
+	
+	delete req;
+}
+
+void IoEngine::threadMain()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+#ifdef JH_HAVE_IO_URING
+	if ( mRing == NULL )
+		return;
+	
+	bool running = true;
+	
+	while ( running )
+	{
+		if ( not mRing->hasCompletions() and mRing->wait( 1 ) < 0 )
+		{
+			if ( errno != EINTR )
+				LOG_ERR_PERROR( "io_uring wait failed" );
+			continue;
+		}
+		
+		uint64_t data;
+		int res;
+		
+		while ( mRing->getCompletion( data, res ) )
+		{
+			if ( data == 0 )
+			{
+				running = false;
+				continue;
+			}
+			
+			// The kernel returns -errno instead of setting errno
+			complete( (Request*)(uintptr_t)data, res < 0 ? -1 : res, -res );
+		}
+	}
+#endif
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "jh_types.h"
+
+#include "IoUring.h"
+
+#ifdef JH_HAVE_IO_URING
+
+#include "logging.h"
+#include "jh_memory.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+// The ring head and tail indices are shared with the kernel, so they
+//  are read and written through volatile with full barriers between
+//  them and the ring contents.
+#define RING_LOAD( p )	( *(volatile unsigned*)( p ) )
+#define RING_STORE( p, v )	( *(volatile unsigned*)( p ) = ( v ) )
+
+static int io_uring_setup( unsigned entries, struct io_uring_params *p )
+{
+	return syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int io_uring_enter( int fd, unsigned to_submit, unsigned min_complete,
+						   unsigned flags )
+{
+	return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, 
+					flags, NULL, _NSIG / 8 );
+}
+
+static int io_uring_register( int fd, unsigned opcode, void *arg, 
+							  unsigned nr_args )
+{
+	return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+IoUring *IoUring::create( unsigned entries, const uint8_t *ops, int numOps )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	struct io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+	
+	int fd = io_uring_setup( entries, &params );
+	
+	if ( fd < 0 )
+	{
+		LOG_NOTICE( "io_uring_setup failed: %s", strerror( errno ) );
+		return NULL;
+	}
+	
+	IoUring *ring = jh_new IoUring( fd );
+	
+	if ( not ring->map( params ) or not ring->probe( ops, numOps ) )
+	{
+		delete ring;
+		return NULL;
+	}
+	
+	return ring;
+}
+
+IoUring::IoUring( int fd ) : mFd( fd ), mSqRing( MAP_FAILED ), 
+	mSqRingSize( 0 ), mCqRing( MAP_FAILED ), mCqRingSize( 0 ),
+	mSqes( (struct io_uring_sqe*)MAP_FAILED ), mSqesSize( 0 ), 
+	mSqeHead( 0 ), mSqeTail( 0 )
+{
+}
+
+IoUring::~IoUring()
+{
+	if ( mSqes != MAP_FAILED )
+		munmap( mSqes, mSqesSize );
+	
+	if ( mCqRing != MAP_FAILED and mCqRing != mSqRing )
+		munmap( mCqRing, mCqRingSize );
+	
+	if ( mSqRing != MAP_FAILED )
+		munmap( mSqRing, mSqRingSize );
+	
+	close( mFd );
+}
+
+bool IoUring::map( const struct io_uring_params &params )
+{
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	mCqRingSize = params.cq_off.cqes + 
+		params.cq_entries * sizeof( struct io_uring_cqe );
+	
+	// Newer kernels let both rings share one mapping
+	bool single = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+	
+	if ( single and mCqRingSize > mSqRingSize )
+		mSqRingSize = mCqRingSize;
+	
+	mSqRing = ::mmap( NULL, mSqRingSize, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING );
+	
+	if ( mSqRing == MAP_FAILED )
+	{
+		LOG_ERR_PERROR( "Failed to map io_uring submission ring" );
+		return false;
+	}
+	
+	if ( single )
+	{
+		mCqRing = mSqRing;
+	}
+	else
+	{
+		mCqRing = ::mmap( NULL, mCqRingSize, PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING );
+		
+		if ( mCqRing == MAP_FAILED )
+		{
+			LOG_ERR_PERROR( "Failed to map io_uring completion ring" );
+			return false;
+		}
+	}
+	
+	mSqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+	mSqes = (struct io_uring_sqe*)::mmap( NULL, mSqesSize, 
+										  PROT_READ | PROT_WRITE,
+										  MAP_SHARED | MAP_POPULATE, mFd, 
+										  IORING_OFF_SQES );
+	
+	if ( mSqes == MAP_FAILED )
+	{
+		LOG_ERR_PERROR( "Failed to map io_uring submission entries" );
+		return false;
+	}
+	
+	uint8_t *sq = (uint8_t*)mSqRing;
+	mSqHead = (unsigned*)( sq + params.sq_off.head );
+	mSqTail = (unsigned*)( sq + params.sq_off.tail );
+	mSqMask = *(unsigned*)( sq + params.sq_off.ring_mask );
+	mSqEntries = *(unsigned*)( sq + params.sq_off.ring_entries );
+	mSqArray = (unsigned*)( sq + params.sq_off.array );
+	
+	uint8_t *cq = (uint8_t*)mCqRing;
+	mCqHead = (unsigned*)( cq + params.cq_off.head );
+	mCqTail = (unsigned*)( cq + params.cq_off.tail );
+	mCqMask = *(unsigned*)( cq + params.cq_off.ring_mask );
+	mCqes = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+	
+	mSqeHead = mSqeTail = RING_LOAD( mSqTail );
+	
+	return true;
+}
+
+bool IoUring::probe( const uint8_t *ops, int numOps )
+{
+	if ( numOps == 0 )
+		return true;
+	
+	const unsigned kMaxOps = 256;
+	size_t size = sizeof( struct io_uring_probe ) + 
+		kMaxOps * sizeof( struct io_uring_probe_op );
+	struct io_uring_probe *p = (struct io_uring_probe*)calloc( 1, size );
+	
+	if ( p == NULL )
+		return false;
+	
+	bool res = true;
+	
+	if ( io_uring_register( mFd, IORING_REGISTER_PROBE, p, kMaxOps ) < 0 )
+	{
+		LOG_NOTICE( "io_uring probe failed: %s", strerror( errno ) );
+		res = false;
+	}
+	
+	for ( int i = 0; res and i < numOps; i++ )
+	{
+		if ( ops[ i ] > p->last_op or 
+			 ( p->ops[ ops[ i ] ].flags & IO_URING_OP_SUPPORTED ) == 0 )
+		{
+			LOG_NOTICE( "io_uring op %d not supported", ops[ i ] );
+			res = false;
+		}
+	}
+	
+	free( p );
+	return res;
+}
+
+struct io_uring_sqe *IoUring::getSqe()
+{
+	if ( mSqeTail - RING_LOAD( mSqHead ) >= mSqEntries )
+	{
+		if ( submit() < 0 )
+			return NULL;
+		
+		// The kernel consumes entries as they are submitted unless it
+		//  is out of memory.
+		if ( mSqeTail - RING_LOAD( mSqHead ) >= mSqEntries )
+		{
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	
+	struct io_uring_sqe *sqe = &mSqes[ mSqeTail & mSqMask ];
+	mSqeTail++;
+	memset( sqe, 0, sizeof( *sqe ) );
+	
+	return sqe;
+}
+
+void IoUring::flush()
+{
+	unsigned tail = RING_LOAD( mSqTail );
+	
+	for ( ; mSqeHead != mSqeTail; mSqeHead++ )
+	{
+		mSqArray[ tail & mSqMask ] = mSqeHead & mSqMask;
+		tail++;
+	}
+	
+	// The entries must be visible before the kernel sees the new tail
+	__sync_synchronize();
+	RING_STORE( mSqTail, tail );
+}
+
+int IoUring::submit( unsigned waitFor )
+{
+	flush();
+	
+	// Anything a previous call couldn't submit is still in the ring
+	unsigned toSubmit = RING_LOAD( mSqTail ) - RING_LOAD( mSqHead );
+	
+	if ( toSubmit == 0 and waitFor == 0 )
+		return 0;
+	
+	return io_uring_enter( mFd, toSubmit, waitFor, 
+						   waitFor > 0 ? IORING_ENTER_GETEVENTS : 0 );
+}
+
+int IoUring::wait( unsigned waitFor )
+{
+	int res = io_uring_enter( mFd, 0, waitFor, IORING_ENTER_GETEVENTS );
+	
+	return res < 0 ? res : 0;
+}
+
+bool IoUring::hasCompletions()
+{
+	return RING_LOAD( mCqHead ) != RING_LOAD( mCqTail );
+}
+
+bool IoUring::getCompletion( uint64_t &userData, int &res )
+{
+	unsigned head = RING_LOAD( mCqHead );
+	
+	if ( head == RING_LOAD( mCqTail ) )
+		return false;
+	
+	// Don't read the entry before we have seen the tail move past it
+	__sync_synchronize();
+	
+	struct io_uring_cqe *cqe = &mCqes[ head & mCqMask ];
+	userData = cqe->user_data;
+	res = cqe->res;
+	
+	// And let the kernel reuse it only after we are done with it
+	__sync_synchronize();
+	RING_STORE( mCqHead, head + 1 );
+	
+	return true;
+}
+
+#endif // JH_HAVE_IO_URING
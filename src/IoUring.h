@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef JH_IO_URING_H_
+#define JH_IO_URING_H_
+
+#include "jh_types.h"
+
+// io_uring is Linux only.  Define JH_NO_IO_URING to leave it out when
+//  building against kernel headers that are too old to have it.
+#if !defined( PLATFORM_DARWIN ) && !defined( JH_NO_IO_URING )
+#define JH_HAVE_IO_URING 1
+
+#include <linux/io_uring.h>
+
+/**
+ * A small wrapper around the io_uring(7) system calls, so we don't
+ * need liburing.  It owns the ring and its memory mappings.  There is
+ * no locking here: only one thread at a time may queue and submit,
+ * and only one thread at a time may take completions, though those
+ * two can be different threads.
+ */
+class IoUring
+{
+public:
+	/**
+	 * Set up a ring.  Returns NULL if io_uring isn't available (old
+	 * kernel, or disabled by sysctl or seccomp), or if any of the
+	 * numOps opcodes in ops are not supported by the kernel.
+	 *
+	 * @param entries size of the submission queue, a power of 2.
+	 */
+	static IoUring *create( unsigned entries, const uint8_t *ops = NULL,
+							int numOps = 0 );
+	
+	~IoUring();
+	
+	/**
+	 * Get a cleared submission entry to fill in.  It is handed to
+	 * the kernel by the next submit.  If the queue is full the queued
+	 * entries are submitted first, NULL is only returned if that
+	 * fails.
+	 */
+	struct io_uring_sqe *getSqe();
+	
+	/**
+	 * Hand all queued entries to the kernel, then wait until at least
+	 * waitFor completions are ready.
+	 *
+	 * @return the number of entries submitted, or -1 with errno set.
+	 */
+	int submit( unsigned waitFor = 0 );
+	
+	/**
+	 * Wait until at least waitFor completions are ready without
+	 * submitting anything, so it can be called from the completion
+	 * thread while another thread queues entries.
+	 *
+	 * @return 0 or -1 with errno set.
+	 */
+	int wait( unsigned waitFor );
+	
+	//! Are there completions waiting to be taken?
+	bool hasCompletions();
+	
+	/**
+	 * Take the next completion.
+	 *
+	 * @return false if there are none.
+	 */
+	bool getCompletion( uint64_t &userData, int &res );
+	
+private:
+	IoUring( int fd );
+
+	//! Map the rings into our address space
+	bool map( const struct io_uring_params &params );
+	
+	//! Check that the kernel supports all these opcodes
+	bool probe( const uint8_t *ops, int numOps );
+	
+	//! Copy queued entries into the submission ring
+	void flush();
+	
+	int 		mFd;
+	
+	//! The mappings, mCqRing may be the same as mSqRing
+	void		*mSqRing;
+	size_t		mSqRingSize;
+	void		*mCqRing;
+	size_t		mCqRingSize;
+	struct io_uring_sqe *mSqes;
+	size_t		mSqesSize;
+	
+	//! Pointers into the submission ring shared with the kernel
+	unsigned	*mSqHead;
+	unsigned	*mSqTail;
+	unsigned	mSqMask;
+	unsigned	mSqEntries;
+	unsigned	*mSqArray;
+	
+	//! Entries [mSqeHead, mSqeTail) are filled in but not yet flushed
+	unsigned	mSqeHead;
+	unsigned	mSqeTail;
+	
+	//! Pointers into the completion ring shared with the kernel
+	unsigned	*mCqHead;
+	unsigned	*mCqTail;
+	unsigned	mCqMask;
+	struct io_uring_cqe *mCqes;
+};
+
+#endif // JH_HAVE_IO_URING
+
+#endif // JH_IO_URING_H_
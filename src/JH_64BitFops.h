@@ -33,11 +33,15 @@
 #define jh_stat64	stat64
 #define jh_lseek	lseek
 #define jh_fstat64	fstat64
+#define jh_pread	pread
+#define jh_pwrite	pwrite
 #else
 #define jh_stat64_t struct stat64
 #define jh_stat64	stat64
 #define jh_lseek	lseek64
 #define jh_fstat64	fstat64
+#define jh_pread	pread64
+#define jh_pwrite	pwrite64
 #endif
 
 #endif // JH_64BIT_FOPS_H_
@@ -26,6 +26,19 @@
  */
 
 #include "Mutex.h"
+#include "TimeUtils.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "logging.h"
 
@@ -33,21 +46,231 @@ SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
 bool Mutex::mInited = false;
+volatile bool Mutex::mProfiling = false;
+bool Mutex::mQueuePriorityInherit = false;
+#ifdef JH_MUTEX_FUTEX
+volatile bool Mutex::mSlowPath = false;
+#else
+volatile bool Mutex::mSlowPath = true;
+#endif
+void *Mutex::mCriticalSectionSite = NULL;
+uint64_t Mutex::mCriticalSectionLockedAt = 0;
+
+namespace {
+
+/**
+ * The lock profiler's counts for one lock name at one site.  Sites live
+ *  in a fixed open addressed table, claimed and counted with atomics,
+ *  so counting never takes a lock of its own.  The table is keyed on
+ *  the name and file pointers, which for names and __FILE__ are 
+ *  nearly always literals.  The name is copied in case it isn't.
+ */
+struct LockSite
+{
+	volatile int		mState;
+	const char			*mNameKey;
+	const char			*mFile;
+	int					mLine;
+	char				mName[ 40 ];
+	volatile uint64_t	mAcquisitions;
+	volatile uint64_t	mContended;
+	volatile uint64_t	mWaitCycles;
+	volatile uint64_t	mMaxWaitCycles;
+	volatile uint64_t	mHoldCycles;
+	volatile uint64_t	mMaxHoldCycles;
+};
+
+enum { kSiteEmpty, kSiteClaiming, kSiteReady };
+
+const int kNumLockSites = 1024;
+
+LockSite gLockSites[ kNumLockSites ];
+
+//! Acquisitions not counted because the table was full
+volatile uint64_t gLockSitesLost = 0;
+
+const char *kCriticalSectionName = "CriticalSection";
+
+//! Find or make the site for name at file:line, NULL if the table's full
+LockSite *findSite( const char *name, const char *file, int line )
+{
+	uintptr_t hash = (uintptr_t)name * 31 + (uintptr_t)file;
+	hash = ( hash * 31 + line ) * 0x9E3779B1;
+	
+	for ( int i = 0; i < kNumLockSites; i++ )
+	{
+		LockSite *site = &gLockSites[ ( ( hash >> 8 ) + i ) % kNumLockSites ];
+		
+		if ( site->mState == kSiteEmpty and
+			 __sync_bool_compare_and_swap( &site->mState, kSiteEmpty, 
+										   kSiteClaiming ) )
+		{
+			site->mNameKey = name;
+			site->mFile = file;
+			site->mLine = line;
+			strncpy( site->mName, name == NULL ? "unnamed" : name, 
+					 sizeof( site->mName ) - 1 );
+			__sync_synchronize();
+			site->mState = kSiteReady;
+			return site;
+		}
+		
+		// Somebody is filling it in, which only takes a moment
+		while ( site->mState == kSiteClaiming )
+			__sync_synchronize();
+		
+		if ( site->mNameKey == name and site->mFile == file and 
+			 site->mLine == line )
+			return site;
+	}
+	
+	__sync_fetch_and_add( &gLockSitesLost, 1 );
+	return NULL;
+}
+
+void atomicMax( volatile uint64_t *max, uint64_t value )
+{
+	uint64_t cur = *max;
+	
+	while ( value > cur )
+	{
+		uint64_t was = __sync_val_compare_and_swap( max, cur, value );
+		
+		if ( was == cur )
+			break;
+		
+		cur = was;
+	}
+}
+
+//! Count an acquisition of a lock
+void countAcquire( LockSite *site, bool contended, uint64_t waited )
+{
+	__sync_fetch_and_add( &site->mAcquisitions, 1 );
+	
+	if ( contended )
+	{
+		__sync_fetch_and_add( &site->mContended, 1 );
+		__sync_fetch_and_add( &site->mWaitCycles, waited );
+		atomicMax( &site->mMaxWaitCycles, waited );
+	}
+}
+
+void countHold( LockSite *site, uint64_t held )
+{
+	__sync_fetch_and_add( &site->mHoldCycles, held );
+	atomicMax( &site->mMaxHoldCycles, held );
+}
+
+//! Count an acquisition at a site, returning the site
+LockSite *countLock( const char *name, const char *file, int line,
+					 bool contended, uint64_t waited )
+{
+	LockSite *site = findSite( name, file, line );
+	
+	if ( site != NULL )
+		countAcquire( site, contended, waited );
+	
+	return site;
+}
+
+/**
+ * Lock mutex, profiling it.  Returns the site to count the acquisition 
+ *  against.
+ */
+LockSite *profiledLock( pthread_mutex_t *mutex, const char *name,
+						const char *file, int line, int *res )
+{
+	bool contended = false;
+	uint64_t waited = 0;
+	
+	*res = pthread_mutex_trylock( mutex );
+	
+	if ( *res == EBUSY )
+	{
+		contended = true;
+		uint64_t start = TimeUtils::getCycles();
+		*res = pthread_mutex_lock( mutex );
+		waited = TimeUtils::getCycles() - start;
+	}
+	
+	if ( *res != 0 )
+		return NULL;
+	
+	return countLock( name, file, line, contended, waited );
+}
+
+//! Most a contended lock spins before sleeping
+const int kMaxSpins = 100;
+
+//! Spinning only helps if the holder can run at the same time
+const bool gSpin = ( sysconf( _SC_NPROCESSORS_ONLN ) > 1 );
+
+inline void cpuRelax()
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+	__asm__ __volatile__( "pause" ::: "memory" );
+#else
+	__asm__ __volatile__( "" ::: "memory" );
+#endif
+}
+
+#ifdef JH_MUTEX_FUTEX
+//! This thread's kernel thread id, which PI futexes hold
+__thread int tTid = 0;
+
+pthread_once_t gTidOnce = PTHREAD_ONCE_INIT;
+
+//! The forking thread has a new id in the child
+void forgetTid()
+{
+	tTid = 0;
+}
+
+void registerForgetTid()
+{
+	pthread_atfork( NULL, NULL, forgetTid );
+}
+
+inline int currentTid()
+{
+	if ( tTid == 0 )
+	{
+		pthread_once( &gTidOnce, registerForgetTid );
+		tTid = syscall( SYS_gettid );
+	}
+	
+	return tTid;
+}
+#endif
+
+}
 
 Mutex::Mutex( bool recursive )
-	: mLockedBy( NULL ), mName( NULL ), mRecursive( recursive )
+	: mLockedBy( NULL ), mName( NULL ), mRecursive( recursive ), 
+	mPriorityInherit( false ), mLockFile( NULL ), mLockLine( 0 ), 
+	mDepth( 0 ), mSite( NULL ), mLockedAt( 0 )
 {
 	create_lock();
 }
 
-Mutex::Mutex( const char *name, bool recursive )
-	: mLockedBy( NULL ), mName( name ), mRecursive( recursive )
+Mutex::Mutex( const char *name, bool recursive, bool priorityInherit )
+	: mLockedBy( NULL ), mName( name ), mRecursive( recursive ),
+	mPriorityInherit( priorityInherit ), mLockFile( NULL ), mLockLine( 0 ),
+	mDepth( 0 ), mSite( NULL ), mLockedAt( 0 )
 {
 	create_lock();
 }
 
 Mutex::~Mutex()
 {
+#ifdef JH_MUTEX_FUTEX
+	if ( mFutex != 0 )
+		LOG_ERR_FATAL( "Lock %s destroyed while locked", mName );
+	
+	return;
+#endif
+	
 	// Destroy the mutex
 	int res = pthread_mutex_destroy( &mMutex );
 	
@@ -62,44 +285,88 @@ Mutex::~Mutex()
 	}
 }
 	
-void Mutex::Lock()
-{
-	TraceLock( "unknown", 0 );
-}
-
-void Mutex::Unlock()
-{
-	TraceUnlock( "unknown", 0 );
-}
-	
 void Mutex::TraceLock( const char *file, int line )
 {
-	int res = pthread_mutex_lock( &mMutex );
-	
-	mLockedBy = Thread::GetCurrent();
+	int res = 0;
+	LockSite *site = NULL;
 	
-	if ( res )
+#ifdef JH_MUTEX_FUTEX
+	if ( mProfiling )
 	{
-		if ( res == EDEADLK )			
-		{
-			LOG_ERR_FATAL( "Lock %s already taken at %s:%d", 
-						   mName, mLockFile, mLockLine );
-		}
-		else
+		bool contended = false;
+		uint64_t waited = 0;
+		
+		if ( not tryLockFutex() )
 		{
-			LOG_ERR_FATAL( "Lock %s failed with error %d at %s:%d", 
-						   mName, res, mLockFile, mLockLine );
+			contended = true;
+			uint64_t start = TimeUtils::getCycles();
+			lockFutex();
+			waited = TimeUtils::getCycles() - start;
 		}
+		
+		site = countLock( mName, file, line, contended, waited );
 	}
+	else
+		lockFutex();
+#else
+	if ( mProfiling )
+		site = profiledLock( &mMutex, mName, file, line, &res );
+	else
+		res = pthread_mutex_lock( &mMutex );
+#endif
+	
+	if ( res )
+		lockFailed( res );
 	
+#ifdef JH_MUTEX_DEBUG
+	mLockedBy = Thread::GetCurrent();
 	mLockFile = file;
 	mLockLine = line;
+#endif
+	
+	// Hold time is counted from the outermost lock of a recursive one.
+	//  mDepth is only kept while profiling.
+	if ( mSite != NULL )
+		mDepth++;
+	else if ( site != NULL )
+	{
+		mSite = site;
+		mDepth = 1;
+		mLockedAt = TimeUtils::getCycles();
+	}
+}
+
+void Mutex::lockFailed( int res )
+{
+	if ( res == EDEADLK )			
+	{
+		LOG_ERR_FATAL( "Lock %s already taken at %s:%d", 
+					   mName, mLockFile, mLockLine );
+	}
+	else
+	{
+		LOG_ERR_FATAL( "Lock %s failed with error %d at %s:%d", 
+					   mName, res, mLockFile, mLockLine );
+	}
 }
 
 void Mutex::TraceUnlock( const char *file, int line_num )
 {
+	if ( mSite != NULL and --mDepth == 0 )
+	{
+		countHold( (LockSite*)mSite, TimeUtils::getCycles() - mLockedAt );
+		mSite = NULL;
+	}
+	
+#ifdef JH_MUTEX_FUTEX
+	fastUnlock();
+	int res = 0;
+#else
+#ifdef JH_MUTEX_DEBUG
 	mLockedBy = NULL;
+#endif
 	int res = pthread_mutex_unlock( &mMutex );
+#endif
 	
 	if ( res )
 	{
@@ -112,7 +379,238 @@ void Mutex::TraceUnlock( const char *file, int line_num )
 
 bool Mutex::isLocked()
 {
+#if defined( JH_MUTEX_DEBUG )
 	return ( mLockedBy == Thread::GetCurrent() );
+#elif defined( JH_MUTEX_FUTEX )
+	return ( mRecursive and mCount > 0 and 
+			 pthread_equal( mOwner, pthread_self() ) );
+#else
+	return false;
+#endif
+}
+
+// The futex lock is only used with JH_MUTEX_FUTEX, but the inline
+//  fast path refers to it whatever this was built with.  RWLock sleeps
+//  on futexes even with JH_MUTEX_DEBUG, and spins where there are none.
+
+bool Mutex::futexWait( volatile int *addr, int val, 
+					   const struct timespec *deadline )
+{
+#ifdef __linux__
+	// The bitset wait takes an absolute CLOCK_MONOTONIC deadline
+	int res = syscall( SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val,
+					   deadline, NULL, FUTEX_BITSET_MATCH_ANY );
+	
+	return not ( res != 0 and errno == ETIMEDOUT );
+#else
+	sched_yield();
+	return true;
+#endif
+}
+
+void Mutex::futexWake( volatile int *addr, int count )
+{
+#ifdef __linux__
+	syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+#endif
+}
+
+bool Mutex::tryLockFutex()
+{
+	int locked = 1;
+	
+#ifdef JH_MUTEX_FUTEX
+	if ( mPriorityInherit )
+		locked = currentTid();
+#endif
+	
+	if ( mRecursive )
+	{
+		pthread_t self = pthread_self();
+		
+		if ( mCount > 0 and pthread_equal( mOwner, self ) )
+		{
+			mCount++;
+			return true;
+		}
+		
+		if ( not __sync_bool_compare_and_swap( &mFutex, 0, locked ) )
+			return false;
+		
+		mOwner = self;
+		mCount = 1;
+		return true;
+	}
+	
+	return __sync_bool_compare_and_swap( &mFutex, 0, locked );
+}
+
+/**
+ * The futex lock is Drepper's, from "Futexes Are Tricky", with glibc's
+ *  adaptive spinning in front of the sleep.  A thread that is going to
+ *  sleep sets the lock to 2, so the unlock knows to wake somebody.
+ */
+void Mutex::lockFutex()
+{
+	pthread_t self = pthread_self();
+	
+	if ( mRecursive )
+	{
+		if ( mCount > 0 and pthread_equal( mOwner, self ) )
+		{
+			mCount++;
+			return;
+		}
+	}
+	
+	if ( mPriorityInherit )
+		lockPi();
+	else if ( not __sync_bool_compare_and_swap( &mFutex, 0, 1 ) )
+	{
+		bool locked = false;
+		
+		if ( gSpin )
+		{
+			int max = mSpins * 2 + 10;
+			int spins = 0;
+			
+			if ( max > kMaxSpins )
+				max = kMaxSpins;
+			
+			while ( spins < max )
+			{
+				spins++;
+				cpuRelax();
+				
+				if ( mFutex == 0 and 
+					 __sync_bool_compare_and_swap( &mFutex, 0, 1 ) )
+				{
+					locked = true;
+					break;
+				}
+			}
+			
+			mSpins += ( spins - mSpins ) / 8;
+		}
+		
+		if ( not locked )
+		{
+			while ( __sync_lock_test_and_set( &mFutex, 2 ) != 0 )
+				futexWait( &mFutex, 2, NULL );
+		}
+	}
+	
+	if ( mRecursive )
+	{
+		mOwner = self;
+		mCount = 1;
+	}
+}
+
+//! Unlock a recursive or priority inheriting futex lock
+void Mutex::unlockFutex()
+{
+	if ( mRecursive )
+	{
+		if ( --mCount > 0 )
+			return;
+		
+		mOwner = (pthread_t)0;
+	}
+	
+	if ( mPriorityInherit )
+		unlockPi();
+	else if ( __sync_fetch_and_sub( &mFutex, 1 ) != 1 )
+		wakeFutex();
+}
+
+//! Finish an unlock that found a thread may be sleeping on the lock
+void Mutex::wakeFutex()
+{
+	mFutex = 0;
+	__sync_synchronize();
+	futexWake( &mFutex, 1 );
+}
+
+/**
+ * A PI futex is locked and unlocked in user space when there's nobody
+ *  waiting.  Otherwise the kernel queues the waiters by priority and
+ *  boosts the holder until it unlocks.
+ */
+void Mutex::lockPi()
+{
+#ifdef JH_MUTEX_FUTEX
+	int tid = currentTid();
+	
+	if ( __sync_bool_compare_and_swap( &mFutex, 0, tid ) )
+		return;
+	
+	while ( syscall( SYS_futex, &mFutex, FUTEX_LOCK_PI_PRIVATE, 0, 
+					 NULL, NULL, 0 ) != 0 )
+	{
+		if ( errno != EINTR and errno != EAGAIN )
+		{
+			lockFailed( errno );
+			return;
+		}
+	}
+#endif
+}
+
+void Mutex::unlockPi()
+{
+#ifdef JH_MUTEX_FUTEX
+	if ( __sync_bool_compare_and_swap( &mFutex, currentTid(), 0 ) )
+		return;
+	
+	if ( syscall( SYS_futex, &mFutex, FUTEX_UNLOCK_PI_PRIVATE, 0, 
+				  NULL, NULL, 0 ) != 0 )
+	{
+		LOG_ERR_FATAL( "Unlock lock %s that isn't held error %d", 
+					   mName, errno );
+	}
+#endif
+}
+
+/**
+ * Without JH_MUTEX_FUTEX only fiber waits get here.  pthreads doesn't
+ *  say how deep a recursive lock is held, but unlocking one that this
+ *  thread no longer holds fails, so unlock until it does.
+ */
+int Mutex::releaseForWait()
+{
+#ifndef JH_MUTEX_FUTEX
+	int levels = 1;
+	pthread_mutex_unlock( &mMutex );
+	
+	while ( mRecursive and pthread_mutex_unlock( &mMutex ) == 0 )
+		levels++;
+	
+	return levels;
+#endif
+	int count = 1;
+	
+	if ( mRecursive )
+	{
+		count = mCount;
+		mCount = 1;
+	}
+	
+	fastUnlock();
+	return count;
+}
+
+void Mutex::reacquireAfterWait( int count )
+{
+#ifndef JH_MUTEX_FUTEX
+	for ( int i = 0; i < count; i++ )
+		pthread_mutex_lock( &mMutex );
+	return;
+#endif
+	fastLock();
+	
+	if ( mRecursive )
+		mCount = count;
 }
 
 const char *Mutex::getOwner()
@@ -123,6 +621,191 @@ const char *Mutex::getOwner()
 		return NULL;
 }
 
+void Mutex::pauseHold()
+{
+	if ( mSite != NULL )
+		countHold( (LockSite*)mSite, TimeUtils::getCycles() - mLockedAt );
+}
+
+void Mutex::resumeHold()
+{
+	if ( mSite != NULL )
+		mLockedAt = TimeUtils::getCycles();
+}
+
+void Mutex::profileEnterCriticalSection()
+{
+	int res;
+	LockSite *site = profiledLock( &mCriticalSection, kCriticalSectionName, 
+								   NULL, 0, &res );
+	
+	if ( site != NULL )
+	{
+		mCriticalSectionSite = site;
+		mCriticalSectionLockedAt = TimeUtils::getCycles();
+	}
+}
+
+void Mutex::profileExitCriticalSection()
+{
+	LockSite *site = (LockSite*)mCriticalSectionSite;
+	mCriticalSectionSite = NULL;
+	
+	if ( site != NULL )
+		countHold( site, TimeUtils::getCycles() - mCriticalSectionLockedAt );
+	
+	pthread_mutex_unlock( &mCriticalSection );
+}
+
+void Mutex::setProfiling( bool enable )
+{
+	// Calibrate the cycle clock now, its first read can log
+	TimeUtils::initCycleClock();
+	
+	__sync_synchronize();
+	mProfiling = enable;
+#ifdef JH_MUTEX_FUTEX
+	mSlowPath = enable;
+#endif
+	__sync_synchronize();
+}
+
+//! Add the counts in site to profile
+static void addCounts( Mutex::LockProfile &profile, const LockSite &site )
+{
+	profile.mAcquisitions += site.mAcquisitions;
+	profile.mContended += site.mContended;
+	profile.mWaitNsecs += TimeUtils::cyclesToNsecs( site.mWaitCycles );
+	profile.mHoldNsecs += TimeUtils::cyclesToNsecs( site.mHoldCycles );
+	
+	uint64_t wait = TimeUtils::cyclesToNsecs( site.mMaxWaitCycles );
+	uint64_t hold = TimeUtils::cyclesToNsecs( site.mMaxHoldCycles );
+	
+	if ( wait > profile.mMaxWaitNsecs )
+		profile.mMaxWaitNsecs = wait;
+	
+	if ( hold > profile.mMaxHoldNsecs )
+		profile.mMaxHoldNsecs = hold;
+}
+
+void Mutex::getProfile( JetHead::vector<LockProfile> &profile, bool bySite )
+{
+	profile.clear();
+	
+	for ( int i = 0; i < kNumLockSites; i++ )
+	{
+		const LockSite &site = gLockSites[ i ];
+		
+		if ( site.mState != kSiteReady or site.mAcquisitions == 0 )
+			continue;
+		
+		unsigned j = 0;
+		
+		// Without sites, add to the entry with the same name
+		if ( not bySite )
+		{
+			while ( j < profile.size() and 
+					strcmp( profile[ j ].mName, site.mName ) != 0 )
+				j++;
+		}
+		else
+		{
+			j = profile.size();
+		}
+		
+		if ( j == profile.size() )
+		{
+			LockProfile entry;
+			memset( &entry, 0, sizeof( entry ) );
+			strcpy( entry.mName, site.mName );
+			
+			if ( bySite )
+			{
+				entry.mFile = site.mFile;
+				entry.mLine = site.mLine;
+			}
+			
+			profile.push_back( entry );
+		}
+		
+		addCounts( profile[ j ], site );
+	}
+	
+	// Most wait time first
+	for ( unsigned i = 1; i < profile.size(); i++ )
+	{
+		LockProfile entry = profile[ i ];
+		unsigned j = i;
+		
+		while ( j > 0 and profile[ j - 1 ].mWaitNsecs < entry.mWaitNsecs )
+		{
+			profile[ j ] = profile[ j - 1 ];
+			j--;
+		}
+		
+		profile[ j ] = entry;
+	}
+}
+
+void Mutex::resetProfile()
+{
+	for ( int i = 0; i < kNumLockSites; i++ )
+	{
+		LockSite &site = gLockSites[ i ];
+		site.mAcquisitions = 0;
+		site.mContended = 0;
+		site.mWaitCycles = 0;
+		site.mMaxWaitCycles = 0;
+		site.mHoldCycles = 0;
+		site.mMaxHoldCycles = 0;
+	}
+	
+	gLockSitesLost = 0;
+}
+
+void Mutex::logProfile( int count )
+{
+	JetHead::vector<LockProfile> locks;
+	JetHead::vector<LockProfile> sites;
+	
+	getProfile( locks, false );
+	getProfile( sites, true );
+	
+	LOG_NOTICE( "Most contended locks:" );
+	
+	for ( int i = 0; i < count and i < (int)locks.size(); i++ )
+	{
+		const LockProfile &lock = locks[ i ];
+		
+		LOG_NOTICE( "%s: %llu locks, %llu contended, wait %llu us "
+					"(max %llu), hold %llu us (max %llu)", lock.mName,
+					(unsigned long long)lock.mAcquisitions,
+					(unsigned long long)lock.mContended,
+					(unsigned long long)lock.mWaitNsecs / 1000,
+					(unsigned long long)lock.mMaxWaitNsecs / 1000,
+					(unsigned long long)lock.mHoldNsecs / 1000,
+					(unsigned long long)lock.mMaxHoldNsecs / 1000 );
+		
+		for ( unsigned j = 0; j < sites.size(); j++ )
+		{
+			const LockProfile &site = sites[ j ];
+			
+			if ( strcmp( site.mName, lock.mName ) != 0 or 
+				 site.mContended == 0 )
+				continue;
+			
+			LOG_NOTICE( "    at %s:%d: %llu contended, wait %llu us",
+						site.mFile == NULL ? "unknown" : site.mFile,
+						site.mLine, (unsigned long long)site.mContended,
+						(unsigned long long)site.mWaitNsecs / 1000 );
+		}
+	}
+	
+	if ( gLockSitesLost != 0 )
+		LOG_NOTICE( "%llu locks not counted, too many sites", 
+					(unsigned long long)gLockSitesLost );
+}
+
 #ifdef PLATFORM_DARWIN
 #define JH_PTHREAD_MUTEX_RECURSIVE PTHREAD_MUTEX_RECURSIVE
 #define JH_PTHREAD_MUTEX_ERRORCHECK PTHREAD_MUTEX_ERRORCHECK
@@ -131,16 +814,38 @@ const char *Mutex::getOwner()
 #define JH_PTHREAD_MUTEX_ERRORCHECK PTHREAD_MUTEX_ERRORCHECK_NP
 #endif
 
+// Only JH_MUTEX_DEBUG checks for being locked twice or unlocked by 
+//  another thread.
+#if defined( JH_MUTEX_DEBUG )
+#define JH_PTHREAD_MUTEX_PLAIN JH_PTHREAD_MUTEX_ERRORCHECK
+#else
+#define JH_PTHREAD_MUTEX_PLAIN PTHREAD_MUTEX_DEFAULT
+#endif
+
 void Mutex::create_lock()
 {
 	int res = 0;
+	
+	mFutex = 0;
+	mOwner = (pthread_t)0;
+	mCount = 0;
+	mSpins = 0;
+	
+#ifdef JH_MUTEX_FUTEX
+	return;
+#endif
 
 	pthread_mutexattr_t attr;
 	pthread_mutexattr_init( &attr );
 	if ( mRecursive )
 		res = pthread_mutexattr_settype( &attr, JH_PTHREAD_MUTEX_RECURSIVE );
 	else
-		res = pthread_mutexattr_settype( &attr, JH_PTHREAD_MUTEX_ERRORCHECK );
+		res = pthread_mutexattr_settype( &attr, JH_PTHREAD_MUTEX_PLAIN );
+	
+#ifdef _POSIX_THREAD_PRIO_INHERIT
+	if ( mPriorityInherit )
+		res = pthread_mutexattr_setprotocol( &attr, PTHREAD_PRIO_INHERIT );
+#endif
 	
 	// Initialize the mutex in the default state 
 	res = pthread_mutex_init( &mMutex, &attr );
@@ -168,30 +873,116 @@ void Mutex::create_lock()
 	}
 }
 
+RWLock::RWLock( const char *name )
+:	mWriters( 0 ), mReadWaiters( 0 ), mDrainSeq( 0 ), mDraining( 0 ),
+	mWriteLock( name )
+{
+	ReaderSlot *readers = slots();
+	
+	for ( int i = 0; i < kReaderSlots; i++ )
+		readers[ i ].mReaders = 0;
+}
 
-AutoLock::AutoLock( Mutex &m )
-	: mMutex( m ), mFile( "AutoLock" ), mLine( 0 )
+RWLock::~RWLock()
 {
-	mMutex.TraceLock( "AutoLock", 0 );
+	if ( mWriters != 0 or countReaders() != 0 )
+		LOG_ERR_FATAL( "RWLock destroyed while locked" );
 }
 
-AutoLock::AutoLock( Mutex &m, const char *file, int line )
-	: mMutex( m ), mFile( file ), mLine( line )
+void RWLock::WriteLock()
 {
-	mMutex.TraceLock( file, line );
+	// From here new readers wait, until there are no writers left
+	__sync_fetch_and_add( &mWriters, 1 );
+	
+	mWriteLock.Lock();
+	
+	// Readers already in only hold it briefly, so spin before sleeping
+	int spins = gSpin ? kMaxSpins : 0;
+	
+	while ( countReaders() != 0 )
+	{
+		if ( spins > 0 )
+		{
+			spins--;
+			cpuRelax();
+			continue;
+		}
+		
+		mDraining = 1;
+		__sync_synchronize();
+		
+		int seq = mDrainSeq;
+		
+		if ( countReaders() != 0 )
+			Mutex::futexWait( &mDrainSeq, seq, NULL );
+		
+		mDraining = 0;
+	}
+}
+
+void RWLock::WriteUnlock()
+{
+	mWriteLock.Unlock();
+	
+	if ( __sync_sub_and_fetch( &mWriters, 1 ) == 0 and mReadWaiters != 0 )
+		Mutex::futexWake( &mWriters, INT_MAX );
 }
 
-AutoLock::~AutoLock()
+void RWLock::readWait( volatile int *readers )
 {
-	mMutex.TraceUnlock( mFile, mLine );
+	do
+	{
+		__sync_fetch_and_sub( readers, 1 );
+		readerLeft();
+		
+		__sync_fetch_and_add( &mReadWaiters, 1 );
+		
+		int writers;
+		
+		while ( ( writers = mWriters ) != 0 )
+			Mutex::futexWait( &mWriters, writers, NULL );
+		
+		__sync_fetch_and_sub( &mReadWaiters, 1 );
+		
+		__sync_fetch_and_add( readers, 1 );
+	} while ( mWriters != 0 );
 }
 
-void AutoLock::Lock()
+void RWLock::readerLeft()
 {
-	mMutex.Lock();
+	__sync_fetch_and_add( &mDrainSeq, 1 );
+	
+	if ( mDraining )
+		Mutex::futexWake( &mDrainSeq, 1 );
 }
 
-void AutoLock::Unlock()
+int RWLock::countReaders()
 {
-	mMutex.Unlock();
+	ReaderSlot *slot = slots();
+	int readers = 0;
+	
+	for ( int i = 0; i < kReaderSlots; i++ )
+		readers += slot[ i ].mReaders;
+	
+	return readers;
+}
+
+uint32_t SeqLock::waitForWriter() const
+{
+	int spins = gSpin ? kMaxSpins : 0;
+	uint32_t seq;
+	
+	// Writers are brief, but may have been preempted
+	while ( ( seq = mSeq ) & 1 )
+	{
+		if ( spins > 0 )
+		{
+			spins--;
+			cpuRelax();
+		}
+		else
+			sched_yield();
+	}
+	
+	return seq;
 }
@@ -28,28 +28,80 @@
 #include "jh_types.h"
 
 #include "Selector.h"
+#include "SelectorPoller.h"
 
 #include "logging.h"
 #include "jh_memory.h"
+#include "TimeUtils.h"
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#ifndef PLATFORM_DARWIN
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
-Selector::Selector( const char *name ) : mLock( true ), 
+// Not in older libc headers
+#if !defined( SO_PREFER_BUSY_POLL ) && !defined( PLATFORM_DARWIN )
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+Selector::Selector( const char *name, Backend backend ) : mNumListeners( 0 ),
+	mLock( "Selector", true ), 
 	mThread( name == NULL ? "Selector" : name, this, &Selector::threadMain ),
-	mUpdateFds( false )
+	mUpdateFds( false ), mUpdatePosted( false ), mUpdateGeneration( 0 ),
+	mBusyPollUsecs( 0 ), mSocketBusyPoll( 0 ), mReadBudget( 0 ),
+	mReadBudgetLeft( -1 ), mInCallback( false ), mNumHighPriority( 0 ),
+	mClockThread( NULL ), mClockDeadline( 0 ), mClockLock( "SelectorClock" )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
+#ifdef PLATFORM_DARWIN
 	int res = pipe( mPipe );
 	
+	if ( res == 0 )
+	{
+		// Wakeups are coalesced, a full pipe already means we are awake
+		fcntl( mPipe[ PIPE_READER ], F_SETFL, O_NONBLOCK );
+		fcntl( mPipe[ PIPE_WRITER ], F_SETFL, O_NONBLOCK );
+	}
+#else
+	// An eventfd is a counter, so one fd is both ends of the "pipe"
+	mPipe[ PIPE_READER ] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	mPipe[ PIPE_WRITER ] = mPipe[ PIPE_READER ];
+	int res = mPipe[ PIPE_READER ] < 0 ? -1 : 0;
+#endif
+
+#if defined( PLATFORM_DARWIN ) || !defined( CLOCK_MONOTONIC )
+	mTimerFd = -1;
+#else
+	mTimerFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	
+	if ( mTimerFd < 0 )
+		LOG_NOTICE( "timerfd_create failed: %s", strerror( errno ) );
+#endif
+	
 	LOG( "pipe reader %d writer %d", mPipe[ PIPE_READER ], mPipe[ PIPE_WRITER ] );
 	
 	if ( res != 0 )
 		LOG_ERR_FATAL( "failed to create pipe" );	
 
+	memset( &mBusyPollStats, 0, sizeof( mBusyPollStats ) );
+	memset( &mFairnessStats, 0, sizeof( mFairnessStats ) );
+	
+	mPoller = SelectorPoller::create( backend );
+	mPoller->setEvents( mPipe[ PIPE_READER ], POLLIN );
+	
+	if ( mTimerFd >= 0 )
+		mPoller->setEvents( mTimerFd, POLLIN );
+
 	mRunning = true;
 	mThread.Start();
 	mShutdown = false;
@@ -61,13 +113,192 @@ Selector::~Selector()
 
 	shutdown();
 	
+	// The clock thread wakes us through the pipe
+	if ( mClockThread != NULL )
+	{
+		mClockLock.Lock();
+		mClockThread->Stop();
+		mClockChanged.Signal();
+		mClockLock.Unlock();
+		
+		mClockThread->Join();
+		delete mClockThread;
+	}
+	
 	LOG( "Closing pipes" );
 	// close the pipes fd's.
 	close( mPipe[ PIPE_WRITER ] );
-	close( mPipe[ PIPE_READER ] );
+	if ( mPipe[ PIPE_READER ] != mPipe[ PIPE_WRITER ] )
+		close( mPipe[ PIPE_READER ] );
+	
+	if ( mTimerFd >= 0 )
+		close( mTimerFd );
 
 	if ( mThread == *Thread::GetCurrent() )
 		LOG_ERR_FATAL( "A selector MUST NOT be deleted by its own thread!" );
+
+	delete mPoller;
+	
+	for ( unsigned fd = 0; fd < mTable.size(); fd++ )
+	{
+		ListenerNode *node = mTable[ fd ];
+		
+		while ( node != NULL )
+		{
+			ListenerNode *next = node->mNext;
+			delete node;
+			node = next;
+		}
+	}
+}
+
+Selector::Backend Selector::getBackend()
+{
+	return mPoller->getBackend();
+}
+
+int Selector::getNumListeners()
+{
+	return mNumListeners;
+}
+
+void Selector::setBusyPoll( uint32_t spinUsecs, uint32_t socketUsecs )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	AutoLock l( mLock );
+	
+	mBusyPollUsecs = spinUsecs;
+	
+	if ( socketUsecs == mSocketBusyPoll )
+		return;
+	
+	mSocketBusyPoll = socketUsecs;
+	
+	// New listeners get it in queueAdd, catch up with the old ones
+	for ( unsigned fd = 0; fd < mTable.size(); fd++ )
+	{
+		if ( mTable[ fd ] != NULL )
+			setSocketBusyPoll( fd );
+	}
+}
+
+void Selector::getBusyPollStats( BusyPollStats &stats )
+{
+	AutoLock l( mLock );
+	stats = mBusyPollStats;
+}
+
+void Selector::resetBusyPollStats()
+{
+	AutoLock l( mLock );
+	memset( &mBusyPollStats, 0, sizeof( mBusyPollStats ) );
+}
+
+void Selector::setReadBudget( int bytes )
+{
+	AutoLock l( mLock );
+	mReadBudget = ( bytes > 0 ) ? bytes : 0;
+}
+
+void Selector::setReadBudget( int fd, SelectorListener *listener, int bytes )
+{
+	AutoLock l( mLock );
+	
+	for ( ListenerNode *node = getListeners( fd ); node != NULL; 
+		  node = node->mNext )
+	{
+		if ( node->mListener == listener and not node->mDead )
+			node->mReadBudget = ( bytes >= 0 ) ? bytes : -1;
+	}
+}
+
+bool Selector::chargeRead( int bytes )
+{
+	// Only reads made from a callback on our own thread count
+	if ( not mInCallback or mReadBudgetLeft < 0 or not isThreadCurrent() )
+		return true;
+	
+	if ( mReadBudgetLeft == 0 )
+		return false;
+	
+	mReadBudgetLeft -= ( bytes < mReadBudgetLeft ) ? bytes : mReadBudgetLeft;
+	
+	if ( mReadBudgetLeft == 0 )
+	{
+		AutoLock l( mLock );
+		mFairnessStats.mReadBudgetExhausted++;
+		LOG_NOISE( "read budget exhausted" );
+		return false;
+	}
+	
+	return true;
+}
+
+bool Selector::hasReadBudget()
+{
+	if ( not mInCallback or mReadBudgetLeft < 0 or not isThreadCurrent() )
+		return true;
+	
+	return mReadBudgetLeft > 0;
+}
+
+void Selector::getFairnessStats( FairnessStats &stats )
+{
+	AutoLock l( mLock );
+	stats = mFairnessStats;
+}
+
+void Selector::resetFairnessStats()
+{
+	AutoLock l( mLock );
+	memset( &mFairnessStats, 0, sizeof( mFairnessStats ) );
+}
+
+void Selector::setSocketBusyPoll( int fd )
+{
+#ifdef SO_BUSY_POLL
+	int usecs = mSocketBusyPoll;
+	int prefer = usecs != 0 ? 1 : 0;
+	
+	// Anything that isn't a socket fails with ENOTSOCK, which is fine
+	if ( setsockopt( fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, 
+					 sizeof( usecs ) ) != 0 )
+	{
+		if ( errno != ENOTSOCK )
+			LOG_NOTICE( "Failed to set SO_BUSY_POLL on fd %d: %s", fd,
+						strerror( errno ) );
+		return;
+	}
+	
+	if ( setsockopt( fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, 
+					 sizeof( prefer ) ) != 0 )
+	{
+		LOG_NOISE( "SO_PREFER_BUSY_POLL not supported on fd %d", fd );
+	}
+#endif
+}
+
+uint64_t Selector::countBusyPoll( uint64_t start, bool spun, bool slept,
+								  bool gotWork )
+{
+	uint64_t now = TimeUtils::getSystemMonotonicUsecs();
+	AutoLock l( mLock );
+	
+	if ( spun )
+	{
+		mBusyPollStats.mSpins++;
+		mBusyPollStats.mSpinUsecs += now - start;
+		
+		if ( gotWork )
+			mBusyPollStats.mSpinHits++;
+	}
+	else if ( slept )
+	{
+		mBusyPollStats.mSleeps++;
+		mBusyPollStats.mSleepUsecs += now - start;
+	}
+	
+	return now;
 }
 
 void Selector::shutdown()
@@ -97,115 +328,268 @@ void Selector::shutdown()
 	}
 }
 
-void Selector::addListener( int fd, short events, SelectorListener *listener, jh_ptr_int_t private_data )
+void Selector::addListener( int fd, short events, SelectorListener *listener, 
+							jh_ptr_int_t private_data, int flags )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
 
+	AutoLock l( mLock );
+	queueAdd( fd, events, listener, private_data, flags, NULL );
+	updateListeners( true );
+}
+
+void Selector::addListenerAsync( int fd, short events, 
+								 SelectorListener *listener,
+								 jh_ptr_int_t private_data, int flags,
+								 SelectorUpdateListener *done )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+	AutoLock l( mLock );
+	queueAdd( fd, events, listener, private_data, flags, done );
+	updateListeners( false );
+}
+
+void Selector::removeListener( int fd, SelectorListener *listener )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+	AutoLock l( mLock );
+	
+	if ( queueRemove( fd, listener, NULL ) )
+		updateListeners( true );
+}
+
+void Selector::removeListenerAsync( int fd, SelectorListener *listener,
+									SelectorUpdateListener *done )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+	AutoLock l( mLock );
+	
+	if ( queueRemove( fd, listener, done ) )
+		updateListeners( false );
+}
+
+void Selector::queueAdd( int fd, short events, SelectorListener *listener, 
+						 jh_ptr_int_t private_data, int flags,
+						 SelectorUpdateListener *done )
+{
 	ListenerNode *node = jh_new ListenerNode();
 	
 	node->mFd = fd;
 	node->mEvents = events;
 	node->mListener = listener;
 	node->mPrivateData = private_data;
+	node->mFlags = flags;
+	node->mReadBudget = -1;
+	node->mArmed = true;
+	node->mKernelOneShot = false;
 	
-	AutoLock l( mLock );
+	// Not called until updatePoller has told the poller about fd, so
+	//  events still pending for an old file on the same fd can't get
+	//  here.
+	node->mPending = true;
+	node->mDead = false;
+	node->mNext = NULL;
+	
+	if ( fd < 0 )
+	{
+		LOG_WARN( "Invalid fd %d", fd );
+		delete node;
+		return;
+	}
+	
+	if ( (unsigned)fd >= mTable.size() )
+		mTable.resize( fd + 1 );
+	
+	if ( mSocketBusyPoll != 0 and mTable[ fd ] == NULL )
+		setSocketBusyPoll( fd );
 	
-	mList.push_back( node );	
-	updateListeners();	
+	// Listeners on the same fd are called in the order they were added
+	ListenerNode **tail = &mTable[ fd ];
+	while ( *tail != NULL )
+		tail = &(*tail)->mNext;
 	
-	LOG( "added fd %d events %x, list size %d", fd, events, mList.size() );
+	*tail = node;
+	mNumListeners++;
+	
+	if ( flags & kHighPriority )
+		mNumHighPriority++;
+	markDirty( fd, false, listener, done );
+	
+	LOG_NOISE( "added fd %d events %x, %d listeners", fd, events, mNumListeners );
 }
 
-void Selector::removeListener( int fd, SelectorListener *listener )
+bool Selector::queueRemove( int fd, SelectorListener *listener, 
+							SelectorUpdateListener *done )
 {
-	TRACE_BEGIN( LOG_LVL_INFO );
-
-	AutoLock l( mLock );
-	ListenerNode n( fd, NULL );
+	ListenerNode n( fd, listener );
 	bool update = false;
 	
-	JetHead::list<ListenerNode*>::iterator i = mList.begin(); 
-	while (i != mList.end())
+	// The nodes are only marked dead here and freed by updatePoller, 
+	//  so we never pull a node out from under callListeners.  Once
+	//  marked the listener will not be called again.
+	for ( ListenerNode *node = getListeners( fd ); node != NULL; 
+		  node = node->mNext )
 	{
-		if (*(*i) == n)
+		if ( *node == n and not node->mDead )
 		{
 			update = true;
-			delete *i;
-			i = i.erase();
+			node->mDead = true;
+			mNumListeners--;
+			
+			if ( node->mFlags & kHighPriority )
+				mNumHighPriority--;
 		} 
-		else 
-		{
-			++i;
-		}
 	}
 		
 	if ( update )
-	{
-		updateListeners();		
-	}
+		markDirty( fd, true, listener, done );
+	
+	return update;
 }
 	
+void Selector::rearm( int fd, SelectorListener *listener )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+	AutoLock l( mLock );
+	ListenerNode *node = findListener( fd, listener );
+	
+	if ( node == NULL or node->mArmed )
+		return;
+	
+	node->mArmed = true;
+	
+	// If the poller disarmed the fd itself it can rearm it directly,
+	//  from any thread.
+	if ( node->mKernelOneShot and mPoller->rearm( fd ) )
+		return;
+	
+	// Otherwise the selector has to put it back in the poll set.  The
+	//  listener is already registered so there is no stale fd to worry
+	//  about and we don't need to wait.
+	markDirty( fd, false );
+	updateListeners( false );
+}
+
 Selector::ListenerNode *Selector::findListener( int fd, SelectorListener *listener )
 {
 	ListenerNode n( fd, listener );
-	for (JetHead::list<ListenerNode*>::iterator i = mList.begin(); 
-		 i != mList.end(); ++i)
+	for ( ListenerNode *node = getListeners( fd ); node != NULL; 
+		  node = node->mNext )
 	{
-		if (*(*i) == n)
+		if ( *node == n and not node->mDead )
 		{
-			return *i;
+			return node;
 		}
 	}
 		
 	return NULL;
 }
 
-void Selector::updateListeners()
+void Selector::updateListeners( bool wait )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
 	// if called from the selector, just set a flag to update the Fds list
-	// otherwise send an event to update the Fds.  But we also need to wait
-	// for this change to be made effective.  Otherwise we could get events
-	// for old Fd on a new listener if the same Fd was used for the new file.
+	// otherwise send an event to update the Fds.  The synchronous calls
+	// also wait for the change to be made effective, the async ones get
+	// the same protection from stale fds by leaving new listeners 
+	// pending until then.
 	if ( *Thread::GetCurrent() == mThread )
 	{
 		mUpdateFds = true;
 	}
 	else if ( mRunning )
 	{
-		Event *ev = jh_new Event( Event::kSelectorUpdateEventId );
-		sendEvent( ev );
-		mCondition.Wait( mLock );
+		uint32_t generation = mUpdateGeneration;
+		
+		// One update event covers every change queued before it is
+		//  handled.
+		if ( not mUpdatePosted )
+		{
+			mUpdatePosted = true;
+			sendEvent( jh_new Event( Event::kSelectorUpdateEventId ) );
+		}
+		
+		while ( wait and mRunning and generation == mUpdateGeneration )
+			mCondition.Wait( mLock );
 	}
 	// else threadMain has exited or is exiting so no nothing we are ending.
 }
+
+void Selector::markDirty( int fd, bool removed, SelectorListener *listener,
+						  SelectorUpdateListener *done )
+{
+	DirtyFd dirty;
+	dirty.mFd = fd;
+	dirty.mRemoved = removed;
+	dirty.mListener = listener;
+	dirty.mDone = done;
+	mDirtyFds.push_back( dirty );
+}
 	
 void Selector::threadMain()
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
 	bool gotEvent = false;
-	struct pollfd	fds[ kMaxPollFds ];
-	int				numFds = 0;
+	bool moreEvents = false;
+	bool idleWork = false;
+	uint64_t lastWork = 0;
 	
-	fillPollFds( fds, numFds );
+	updatePoller();
 	
 	// Event will be sent by EventThread on exit
 	while( mRunning )
 	{
-		LOG( "%p on %d files", this, numFds );
-		for ( int i = 1; i < numFds; i++ )
-		{
-			LOG( "%p fd %d", this, fds[ i ].fd );
-		}
-		
 		// set errno to zero
 		// this is being set to better monitor the behavior of poll on
 		// the 7401 until poll gets fixed
 		errno = 0;
 		int res = 0;
 		
+		// If idle tasks or events are still waiting don't block, just 
+		//  check the fds.
+		int timeout = ( idleWork or moreEvents ) ? 0 : -1;
+		
+		// Without a timerfd the poll timeout takes care of local timers,
+		//  under a clock source mClockThread wakes us for them.
+		bool onClock = ( TimeUtils::getClockSource() != NULL );
+		
+		if ( mTimerFd < 0 or onClock )
+		{
+			int next = runLocalTimers();
+			
+			if ( not mQueue.IsEmpty() )
+			{
+				moreEvents = true;
+				timeout = 0;
+			}
+			else if ( not onClock and next > 0 and 
+					  ( timeout < 0 or next < timeout ) )
+				timeout = next;
+		}
+		
+		// When busy polling we don't block until there has been no
+		//  work for the whole spin window.
+		uint32_t spinUsecs = mBusyPollUsecs;
+		uint64_t start = 0;
+		bool spin = false;
+		
+		if ( spinUsecs != 0 )
+		{
+			start = TimeUtils::getSystemMonotonicUsecs();
+			
+			if ( timeout < 0 and start - lastWork < spinUsecs )
+			{
+				timeout = 0;
+				spin = true;
+			}
+		}
+		
 		// test here to ensure that errno cannot be modified before it is tested.
-		if ( ( res = poll( fds, numFds, -1 ) ) < 0 )
+		if ( ( res = mPoller->wait( timeout ) ) < 0 )
 		{
 			// for whatever reason, there are times when poll returns -1,
 			// but doesn't set errno
@@ -217,201 +601,362 @@ void Selector::threadMain()
 				LOG_ERR_PERROR( "Poll returned %d", res );
 		}
 		
-		LOG( "%p woke up %d", this, res );
-		
-		if ( res > 0 )
+		if ( spinUsecs != 0 )
 		{
-			LOG( "got %d from poll", res );
+			uint64_t now = countBusyPoll( start, spin, timeout < 0, res > 0 );
 			
-			for ( int i = 0; i < numFds; i++ )
-			{
-				if ( fds[ i ].fd == mPipe[ PIPE_READER ] )
-				{
-					LOG( "got %x on pipe %d", fds[ 0 ].revents, fds[ i ].fd );
-					if ( fds[ i ].revents & POLLIN )
-					{
-						char buf[10];
-						read( mPipe[ PIPE_READER ], &buf, 4 );
-						
-						// We need to handle events after we handle file
-						// descriptor polls because one of the events
-						// that we handle modifies the current list of
-						// file descriptors for poll and we need to handle
-						// any that occured before updating them.
-						gotEvent = true;
-					}			
-					else if ( fds[ i ].revents & ( POLLHUP | POLLNVAL ) )
-					{
-						LOG_ERR_FATAL( "POLLHUP recieved on pipe" );
-					}
-				}
-				else
-				{
-					LOG_NOISE( "got %x on fd %d", fds[ i ].revents, fds[ i ].fd );
-					if ( fds[ i ].revents != 0 )
-					{
-						// if callListeners removes a listener we need to update 
-						//  Fds.  However only set if callListeners returns true
-						//  This should not be cleared since one of the listeners
-						//  could have called removeListener and that call might 
-						//  have set mUpdateFds
-						if ( callListeners( fds[ i ].fd, fds[ i ].revents ) )
-							mUpdateFds = true;
-					}
-				}
-			}
+			// Events and idle tasks left over from the last pass count
+			//  as work too.
+			if ( res > 0 or not spin )
+				lastWork = now;
 		}
+		
+		LOG( "%p woke up %d", this, res );
+		
+		handleReadyFds( res, gotEvent );
 
 		// Now that file descriptors have been handled we can deal with
 		// events if needed, including updating the poll file descriptor
 		// list if it's been changed.
-		if ( gotEvent )
+		if ( gotEvent or moreEvents )
 		{
-			Event *ev = mQueue.PollEvent();
-
-			if ( ev == NULL )
-			{
-				LOG_WARN( "got NULL event" );
-			}
-			else if ( ev->getEventId() == Event::kSelectorUpdateEventId )
-			{
-				LOG( "got kSelectorUpdateEventId" );
-				mUpdateFds = true;
-				ev->Release();
-			}
-			else
+			moreEvents = handleEvents();
+			gotEvent = false;
+			
+			if ( moreEvents )
 			{
-				LOG( "got event %d", ev->getEventId() );
-				bool done = EventDispatcher::handleEvent( ev );
-				if ( done )
-					mRunning = false;
+				AutoLock l( mLock );
+				mFairnessStats.mEventBudgetExhausted++;
 			}
-			
-			gotEvent = false;
 		}
 		
 		if ( mUpdateFds )
 		{
-			fillPollFds( fds, numFds );
+			updatePoller();
 			mUpdateFds = false;
 		}
 		
 		mCondition.Broadcast();
+		
+		// Idle tasks only run when the queue is empty and give up the 
+		//  thread after a slice so that the fds get polled again.
+		if ( mRunning )
+			idleWork = runIdleTasks();
 	}
 	
 	LOG_NOTICE( "Thread exiting" );
 }
 
-void Selector::fillPollFds( struct pollfd *fds, int &numFds )
+void Selector::handleReadyFds( int numReady, bool &gotEvent )
 {
-	AutoLock m( mLock );
-	TRACE_BEGIN( LOG_LVL_INFO );
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if ( mNumHighPriority == 0 )
+	{
+		for ( int i = 0; i < numReady; i++ )
+			handleReadyFd( mPoller->getReadyFd( i ), 
+						   mPoller->getReadyEvents( i ), gotEvent );
+		return;
+	}
+	
+	// Service the high priority fds first and put the rest aside.  The
+	//  priority is looked up once per fd so a listener changing in a
+	//  callback can't get an fd handled twice or not at all.
+	mDeferred.clear();
+	
+	for ( int i = 0; i < numReady; i++ )
+	{
+		int fd = mPoller->getReadyFd( i );
+		bool high;
+		
+		{
+			AutoLock l( mLock );
+			high = isHighPriority( fd );
+			if ( high )
+				mFairnessStats.mHighPriorityCalls++;
+		}
+		
+		if ( high )
+			handleReadyFd( fd, mPoller->getReadyEvents( i ), gotEvent );
+		else
+			mDeferred.push_back( i );
+	}
+	
+	for ( unsigned i = 0; i < mDeferred.size(); i++ )
+	{
+		int idx = mDeferred[ i ];
+		handleReadyFd( mPoller->getReadyFd( idx ), 
+					   mPoller->getReadyEvents( idx ), gotEvent );
+	}
+}
 
-	fds[ 0 ].fd = mPipe[ PIPE_READER ];
-	fds[ 0 ].events = POLLIN;
+void Selector::handleReadyFd( int fd, short revents, bool &gotEvent )
+{
+	if ( fd == mPipe[ PIPE_READER ] )
+	{
+		LOG_NOISE( "got %x on pipe %d", revents, fd );
+		if ( revents & POLLIN )
+		{
+			// Clear the wakeup before draining the queue, so an
+			//  event sent after the drain wakes us up again.
+			clearWakeup();
+			
+			// We need to handle events after we handle file
+			// descriptor polls because one of the events
+			// that we handle modifies the current list of
+			// file descriptors for poll and we need to handle
+			// any that occured before updating them.
+			gotEvent = true;
+		}			
+		else if ( revents & ( POLLHUP | POLLNVAL ) )
+		{
+			LOG_ERR_FATAL( "POLLHUP recieved on pipe" );
+		}
+	}
+	else if ( fd == mTimerFd )
+	{
+		uint64_t expirations;
+		
+		// The due timers queue their events, which get handled right
+		//  after the fds.
+		read( mTimerFd, &expirations, sizeof( expirations ) );
+		runLocalTimers();
+		gotEvent = true;
+	}
+	else
+	{
+		LOG_NOISE( "got %x on fd %d", revents, fd );
+		// if callListeners removes a listener we need to update 
+		//  Fds.  However only set if callListeners returns true
+		//  This should not be cleared since one of the listeners
+		//  could have called removeListener and that call might 
+		//  have set mUpdateFds
+		if ( callListeners( fd, revents ) )
+			mUpdateFds = true;
+	}
+}
 
-	int j, i = 1;
+bool Selector::isHighPriority( int fd )
+{
+	for ( ListenerNode *node = getListeners( fd ); node != NULL; 
+		  node = node->mNext )
+	{
+		if ( node->isLive() and ( node->mFlags & kHighPriority ) )
+			return true;
+	}
+	
+	return false;
+}
 
-	for (JetHead::list<ListenerNode*>::iterator listener = mList.begin(); 
-		 listener != mList.end(); ++listener)
+bool Selector::handleEvents()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	// Senders only wake us when the queue goes from empty to non-empty,
+	//  so handle everything that is there, up to the budget so the fds
+	//  don't starve.
+	for ( int i = 0; i < kEventBudget and mRunning; i++ )
 	{
-		// If we already have this fd in our list, skip it
-		for ( j = 1; j < i; j++ )
+		Event *ev = mQueue.PollEvent();
+		
+		if ( ev == NULL )
+			return false;
+		
+		if ( ev->getEventId() == Event::kSelectorUpdateEventId )
 		{
-			if ( fds[ j ].fd == (*listener)->mFd )
-			{
-				fds[ j ].events &= (*listener)->mEvents;
-				break;
-			}
+			LOG( "got kSelectorUpdateEventId" );
+			mUpdateFds = true;
+			ev->Release();
 		}
-		
-		if ( j == i )
+		else
 		{
-			fds[ i ].fd = (*listener)->mFd;
-			fds[ i ].events = (*listener)->mEvents;
-			i++;
+			LOG( "got event %d", ev->getEventId() );
+			bool done = EventDispatcher::handleEvent( ev );
+			if ( done )
+				mRunning = false;
+		}
+	}
+	
+	return mRunning and not mQueue.IsEmpty();
+}
 
-			if ( i == kMaxPollFds )
+void Selector::updatePoller()
+{
+	JetHead::vector<DirtyFd> done;
+	
+	{
+		AutoLock m( mLock );
+		TRACE_BEGIN( LOG_LVL_INFO );
+		
+		// Changes made after this will need another update event
+		mUpdatePosted = false;
+		
+		for ( unsigned i = 0; i < mDirtyFds.size(); i++ )
+		{
+			int fd = mDirtyFds[ i ].mFd;
+			short events = 0;
+			int flags = kEdgeTriggered;
+			int count = 0;
+			bool armed = false;
+			ListenerNode *last = NULL;
+			
+			// The poller gets the union of what every armed listener on
+			//  this fd wants, callListeners hands each listener only its
+			//  own part.  The fd is only edge triggered if all the
+			//  listeners are.
+			ListenerNode **link = fd < 0 ? NULL : &mTable[ fd ];
+			while ( link != NULL and *link != NULL )
 			{
-				numFds = kMaxPollFds;
-				return;
+				ListenerNode *node = *link;
+				
+				// Nothing can be looking at a dead node now
+				if ( node->mDead )
+				{
+					*link = node->mNext;
+					delete node;
+					continue;
+				}
+				
+				link = &node->mNext;
+				count++;
+				last = node;
+				node->mPending = false;
+				node->mKernelOneShot = false;
+				
+				if ( not node->mArmed )
+					continue;
+				
+				armed = true;
+				events |= node->mEvents;
+				
+				if ( ( node->mFlags & kEdgeTriggered ) == 0 )
+					flags &= ~kEdgeTriggered;
 			}
+			
+			// A lone one shot listener lets the poller disarm the fd
+			//  itself, otherwise one shot is done by leaving disarmed
+			//  listeners out.
+			if ( count == 1 and ( last->mFlags & kOneShot ) and 
+				 mPoller->supportsOneShot() )
+			{
+				flags |= kOneShot;
+				last->mKernelOneShot = true;
+			}
+			
+			// A removed fd may have been closed and reused, make sure the
+			//  poller forgets about the old one before watching it again.
+			if ( mDirtyFds[ i ].mRemoved )
+				mPoller->setEvents( fd, 0 );
+			
+			// Listeners that only care about POLLHUP and friends still
+			//  need the fd watched.
+			if ( events == 0 and armed )
+				events = POLLHUP;
+			
+			LOG_NOISE( "fd %d events %x flags %x", fd, events, flags );
+			mPoller->setEvents( fd, events, flags );
+			
+			if ( mDirtyFds[ i ].mDone != NULL )
+				done.push_back( mDirtyFds[ i ] );
 		}
+		
+		LOG( "updated %d fds, %d listeners", mDirtyFds.size(), mNumListeners );
+		
+		mDirtyFds.clear();
+		mUpdateGeneration++;
 	}
 	
-	numFds = i;
-	
-	for ( i = 0; i < numFds; i++ )
+	// Everything is in effect, let the async callers know.
+	for ( unsigned i = 0; i < done.size(); i++ )
 	{
-		LOG_NOISE( "file entry %d: fd %d events %x", i, fds[ i ].fd, fds[ i ].events );
+		done[ i ].mDone->listenerUpdated( done[ i ].mFd, done[ i ].mListener,
+										  not done[ i ].mRemoved );
 	}
-	
-	LOG( "poll on %d fds, size %d", numFds, mList.size() );
 }
 
-						
 bool Selector::callListeners( int fd, uint32_t events )
 {
 	AutoLock l( mLock );
 	TRACE_BEGIN( LOG_LVL_INFO );
-	ListenerNode n( fd, NULL );
 	bool result = false;
 	
-	JetHead::list<ListenerNode*>::iterator listener = mList.begin();
-	while (listener != mList.end())
+	// Nodes are only freed by updatePoller, so the chain stays intact
+	//  even if a listener removes itself or others.  Listeners added
+	//  from a callback are pending and skipped.
+	for ( ListenerNode *node = getListeners( fd ); node != NULL; 
+		  node = node->mNext )
 	{
-		if (*(*listener) == n)
+		if ( not node->isLive() )
+			continue;
+		
+		LOG( "got event %x %p", events, node );
+		
+		// We want to remove the listener from the list if 
+		//  revents includes POLLHUP or POLLNVAL.  But we also
+		//  need for the listener to know about these event(s).
+		// A "good" listener could take care of this by 
+		//  removing himself from the selector.  The lock has 
+		//  been made recursive so this is possible without dead
+		//  locking.  But a "bad" listener may ignore these 
+		//  event entirly.  
+		// So in the spirit of "doing the right thing".  We need
+		//  to deal with both cases.  The node is only marked
+		//  dead here and freed later by updatePoller, so it
+		//  doesn't matter which one removes it.
+		SelectorListener *interface = node->mListener;
+		jh_ptr_int_t pd = node->mPrivateData;
+		short listenerEvents = events & ( node->mEvents | 
+										  POLLHUP | POLLNVAL | POLLERR );
+		
+		// A one shot listener is disarmed before it is called, so
+		//  it can rearm itself from the callback.
+		if ( listenerEvents != 0 and ( node->mFlags & kOneShot ) )
 		{
-			LOG( "got event %x %p", events, *listener );
-		
-			// We want to remove the listener from the list if 
-			//  revents includes POLLHUP or POLLNVAL.  But we also
-			//  need for the listener to know about these event(s).
-			// A "good" listener could take care of this by 
-			//  removing himself from the selector.  The lock has 
-			//  been made recursive so this is possible without dead
-			//  locking.  But a "bad" listener may ignore these 
-			//  event entirly.  
-			// So in the spirit of "doing the right thing".  We need
-			//  to deal with both cases.  However once we 
-			//  call the listener's callback, the listener itself
-			//  might be destroyed.  But if POLLHUP or POLLNVAL
-			//  was recieved and the listener has not been destroyed
-			//  we must do it.
+			node->mArmed = false;
 			
-			// listener might be destroyed if POLLHUP or POLLNVAL
-			//  events are recieved.  So we will get any data we 
-			//  need from it now. 
-			SelectorListener *interface = (*listener)->mListener;
-			jh_ptr_int_t pd = (*listener)->mPrivateData;
-		
-			if ( events & ( POLLHUP | POLLNVAL ) )
-			{	
-				if ( events & POLLHUP )
-					LOG_INFO( "POLLHUP recieved on fd = %d (%p)", fd, *listener );
-				
-				if ( events & POLLNVAL )
-					LOG_WARN( "POLLNVAL recieved on fd = %d (%p)", fd, *listener );
-								
-				delete *listener;
-				listener = listener.erase();
-
-				result = true;
-			}
-			else
+			if ( not node->mKernelOneShot )
 			{
-				// Gets incremented by the "erase" in the other branch
-				++listener;
+				markDirty( fd, false );
+				result = true;
 			}
+		}
+		
+		if ( events & ( POLLHUP | POLLNVAL ) )
+		{	
+			if ( events & POLLHUP )
+				LOG_INFO( "POLLHUP recieved on fd = %d (%p)", fd, node );
 			
-			if ( interface != NULL )
-			{
-				LOG_NOISE( "eventsCallback %p %d %d", interface, events, fd );
-				interface->processFileEvents( fd, events, pd );
-				LOG_NOISE( "eventsCallback done" );
-			}
-		} else {
-			++listener;
+			if ( events & POLLNVAL )
+				LOG_WARN( "POLLNVAL recieved on fd = %d (%p)", fd, node );
+			
+			node->mDead = true;
+			mNumListeners--;
+			markDirty( fd, true );
+			
+			if ( node->mFlags & kHighPriority )
+				mNumHighPriority--;
+			
+			result = true;
+		}
+		
+		if ( interface != NULL and listenerEvents != 0 )
+		{
+			// Edge triggered and one shot listeners must drain the fd
+			//  before they see it again, so they get no read budget.
+			int budget = -1;
+			if ( ( node->mFlags & ( kEdgeTriggered | kOneShot ) ) == 0 )
+				budget = ( node->mReadBudget >= 0 ) ? node->mReadBudget : 
+					mReadBudget;
+			
+			mReadBudgetLeft = ( budget > 0 ) ? budget : -1;
+			mInCallback = true;
+			
+			LOG_NOISE( "eventsCallback %p %d %d", interface, listenerEvents, fd );
+			interface->processFileEvents( fd, listenerEvents, pd );
+			LOG_NOISE( "eventsCallback done" );
+			
+			mInCallback = false;
+			mReadBudgetLeft = -1;
 		}
 	}
 	
@@ -426,11 +971,92 @@ const Thread *Selector::getDispatcherThread()
 void Selector::wakeThread()
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
-	char buf[] = "EVNT";
-	int res = write( mPipe[ PIPE_WRITER ], &buf, 4 );
+#ifdef PLATFORM_DARWIN
+	char buf = 'E';
+#else
+	uint64_t buf = 1;
+#endif
+	int res = write( mPipe[ PIPE_WRITER ], &buf, sizeof( buf ) );
 
-	if ( res != 4 )
+	// EAGAIN means there is already a wakeup pending
+	if ( res != (int)sizeof( buf ) and errno != EAGAIN )
 		LOG_ERR( "write to pipe failed %d", res );
 }
 
+void Selector::localTimersChanged( uint64_t deadline )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if ( TimeUtils::getClockSource() != NULL )
+	{
+		AutoLock l( mClockLock );
+		
+		mClockDeadline = deadline;
+		
+		if ( mClockThread == NULL )
+		{
+			if ( deadline == 0 )
+				return;
+			
+			mClockThread = jh_new Runnable<Selector>( "SelectorClock", this,
+												&Selector::clockThreadMain );
+			mClockThread->Start();
+		}
+		
+		mClockChanged.Signal();
+		return;
+	}
+	
+	if ( mTimerFd < 0 )
+	{
+		// The thread picks up the new deadline when it next goes round
+		if ( deadline != 0 and not isThreadCurrent() )
+			wakeThread();
+		return;
+	}
+	
+#if !defined( PLATFORM_DARWIN ) && defined( CLOCK_MONOTONIC )
+	// An all zero it_value disarms the timer
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	spec.it_value.tv_sec = deadline / 1000000;
+	spec.it_value.tv_nsec = ( deadline % 1000000 ) * 1000;
+	
+	if ( timerfd_settime( mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL ) != 0 )
+		LOG_ERR_PERROR( "timerfd_settime failed" );
+#endif
+}
+
+void Selector::clockThreadMain()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	AutoLock l( mClockLock );
+	
+	while ( not mClockThread->CheckStop() )
+	{
+		if ( mClockDeadline == 0 )
+			mClockChanged.Wait( mClockLock );
+		else if ( not mClockChanged.WaitUntil( mClockLock, mClockDeadline ) )
+		{
+			// WaitUntil is on the clock source, so the deadline is due
+			//  there.  runLocalTimers gives us the next one.
+			mClockDeadline = 0;
+			wakeThread();
+		}
+	}
+}
+
+void Selector::clearWakeup()
+{
+#ifdef PLATFORM_DARWIN
+	char buf[ 64 ];
+	while ( read( mPipe[ PIPE_READER ], buf, sizeof( buf ) ) > 0 )
+		;
+#else
+	uint64_t count;
+	read( mPipe[ PIPE_READER ], &count, sizeof( count ) );
+#endif
+}
+
 
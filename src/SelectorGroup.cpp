@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "jh_types.h"
+
+#include "SelectorGroup.h"
+
+#include "logging.h"
+#include "jh_memory.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace JetHead;
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+SelectorGroup::SelectorGroup( int numSelectors, Policy policy, 
+							  const char *name, Selector::Backend backend ) 
+	: mPolicy( policy ), mNext( 0 ), mReusePort( false )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	if ( numSelectors <= 0 )
+		numSelectors = sysconf( _SC_NPROCESSORS_ONLN );
+	
+	if ( numSelectors <= 0 )
+		numSelectors = 1;
+	
+	if ( name == NULL )
+		name = "Selector";
+	
+	for ( int i = 0; i < numSelectors; i++ )
+	{
+		char threadName[ 64 ];
+		snprintf( threadName, sizeof( threadName ), "%s-%d", name, i );
+		mSelectors.push_back( jh_new Selector( threadName, backend ) );
+	}
+	
+	LOG( "created %d selectors", numSelectors );
+}
+
+SelectorGroup::~SelectorGroup()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	stopListening();
+	
+	for ( unsigned i = 0; i < mSelectors.size(); i++ )
+	{
+		delete mSelectors[ i ];
+	}
+}
+
+Selector *SelectorGroup::getNextSelector()
+{
+	if ( mPolicy == kLeastLoaded )
+	{
+		Selector *best = mSelectors[ 0 ];
+		int bestLoad = best->getNumListeners();
+		
+		for ( unsigned i = 1; i < mSelectors.size() and bestLoad > 0; i++ )
+		{
+			int load = mSelectors[ i ]->getNumListeners();
+			
+			if ( load < bestLoad )
+			{
+				best = mSelectors[ i ];
+				bestLoad = load;
+			}
+		}
+		
+		return best;
+	}
+	
+	uint32_t next = __sync_fetch_and_add( &mNext, 1 );
+	return mSelectors[ next % mSelectors.size() ];
+}
+
+Selector *SelectorGroup::getCurrentSelector()
+{
+	for ( unsigned i = 0; i < mSelectors.size(); i++ )
+	{
+		if ( mSelectors[ i ]->isThreadCurrent() )
+			return mSelectors[ i ];
+	}
+	
+	return NULL;
+}
+
+void SelectorGroup::assign( Socket *socket, SocketListener *listener )
+{
+	Selector *selector = NULL;
+	
+	if ( mReusePort )
+		selector = getCurrentSelector();
+	
+	if ( selector == NULL )
+		selector = getNextSelector();
+	
+	socket->setSelector( listener, selector );
+}
+
+ServerSocket *SelectorGroup::createServer( const Socket::Address &addr, 
+										   int backlog, bool reusePort, 
+										   SocketListener *listener,
+										   Selector *selector )
+{
+	ServerSocket *server = jh_new ServerSocket();
+	
+	if ( ( reusePort and not server->setReusePort() ) or 
+		 server->bind( addr ) != 0 )
+	{
+		delete server;
+		return NULL;
+	}
+	
+	// The selector must be set before listen so that no connection is
+	//  missed.
+	server->setSelector( listener, selector );
+	
+	if ( server->listen( backlog ) != 0 )
+	{
+		delete server;
+		return NULL;
+	}
+	
+	return server;
+}
+
+int SelectorGroup::listen( const Socket::Address &addr, int backlog, 
+						   SocketListener *listener, bool reusePort )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	stopListening();
+	
+	ServerSocket *server = NULL;
+	
+	if ( reusePort and mSelectors.size() > 1 )
+		server = createServer( addr, backlog, true, listener, mSelectors[ 0 ] );
+	
+	if ( server == NULL )
+	{
+		if ( reusePort and mSelectors.size() > 1 )
+			LOG_NOTICE( "SO_REUSEPORT not available, using one acceptor" );
+		
+		server = createServer( addr, backlog, false, listener, mSelectors[ 0 ] );
+		
+		if ( server == NULL )
+			return -1;
+		
+		mServers.push_back( server );
+		return 0;
+	}
+	
+	mServers.push_back( server );
+	
+	// If we were asked for any port, everyone has to use the one the
+	//  first socket got.
+	Socket::Address bound = addr;
+	Socket::Address first;
+	server->getLocalAddress( first );
+	bound.setPort( first.getPort() );
+	
+	for ( unsigned i = 1; i < mSelectors.size(); i++ )
+	{
+		server = createServer( bound, backlog, true, listener, mSelectors[ i ] );
+		
+		if ( server == NULL )
+		{
+			LOG_WARN( "Failed to create acceptor %d", i );
+			stopListening();
+			return -1;
+		}
+		
+		mServers.push_back( server );
+	}
+	
+	mReusePort = true;
+	return 0;
+}
+
+void SelectorGroup::stopListening()
+{
+	for ( unsigned i = 0; i < mServers.size(); i++ )
+	{
+		delete mServers[ i ];
+	}
+	
+	mServers.clear();
+	mReusePort = false;
+}
+
+int SelectorGroup::getLocalAddress( Socket::Address &addr )
+{
+	if ( mServers.empty() )
+		return -1;
+	
+	return mServers[ 0 ]->getLocalAddress( addr );
+}
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "jh_types.h"
+
+#include "SelectorPoller.h"
+#include "IoUring.h"
+
+#include "logging.h"
+#include "jh_memory.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PLATFORM_DARWIN
+#include <sys/epoll.h>
+#endif
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+/**
+ * Poller using poll(2).  The pollfd array is kept packed with an fd
+ * to index map, so changing the mask of one fd is O(1), but every
+ * wait is still O(number of fds).
+ */
+class PollPoller : public SelectorPoller
+{
+public:
+	Selector::Backend getBackend() { return Selector::kBackendPoll; }
+
+	void setEvents( int fd, short events, int flags );
+	int wait( int timeout );
+
+private:
+	//! The array handed to poll
+	JetHead::vector<struct pollfd> mFds;
+
+	//! Index + 1 in mFds of each fd, 0 if fd is not in mFds
+	JetHead::vector<unsigned> mIndex;
+};
+
+void PollPoller::setEvents( int fd, short events, int flags )
+{
+	if ( fd < 0 )
+		return;
+	
+	if ( (unsigned)fd >= mIndex.size() )
+	{
+		if ( events == 0 )
+			return;
+		
+		mIndex.resize( fd + 1 );
+	}
+	
+	unsigned index = mIndex[ fd ];
+	
+	if ( events == 0 )
+	{
+		if ( index == 0 )
+			return;
+		
+		// Move the last entry into the hole so the array stays packed
+		unsigned last = mFds.size() - 1;
+		mFds[ index - 1 ] = mFds[ last ];
+		mIndex[ mFds[ index - 1 ].fd ] = index;
+		mFds.resize( last );
+		mIndex[ fd ] = 0;
+	}
+	else if ( index == 0 )
+	{
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		mFds.push_back( pfd );
+		mIndex[ fd ] = mFds.size();
+	}
+	else
+	{
+		mFds[ index - 1 ].events = events;
+	}
+}
+
+int PollPoller::wait( int timeout )
+{
+	mReady.clear();
+	
+	int res = poll( mFds.empty() ? NULL : &mFds[ 0 ], mFds.size(), timeout );
+	
+	if ( res <= 0 )
+		return res;
+	
+	for ( unsigned i = 0; i < mFds.size() and (int)mReady.size() < res; i++ )
+	{
+		if ( mFds[ i ].revents != 0 )
+			mReady.push_back( mFds[ i ] );
+	}
+	
+	return mReady.size();
+}
+
+#ifndef PLATFORM_DARWIN
+/**
+ * Poller using epoll(7).  Registration changes are a single
+ * epoll_ctl and a wait only costs in proportion to the number of
+ * ready fds, so mostly idle fds are essentially free.
+ */
+class EpollPoller : public SelectorPoller
+{
+public:
+	EpollPoller( int epollFd ) : mEpollFd( epollFd ) {}
+	~EpollPoller() { close( mEpollFd ); }
+	
+	Selector::Backend getBackend() { return Selector::kBackendEpoll; }
+	
+	void setEvents( int fd, short events, int flags );
+	int wait( int timeout );
+	bool supportsOneShot() { return true; }
+	bool rearm( int fd );
+
+private:
+	//! What we told epoll about an fd
+	struct FdState
+	{
+		//! The mask the fd is registered with, 0 if none
+		short mEvents;
+
+		//! The Selector flags it is registered with
+		int mFlags;
+
+		//! Is it in the epoll set, or in mAlwaysReady?
+		bool mInKernel;
+	};
+	
+	//! Remove fd from mAlwaysReady, if it's there
+	void removeAlwaysReady( int fd );
+	
+	//! Build the epoll_event for this mask and flags
+	void fillEvent( struct epoll_event &ev, int fd, short events, int flags );
+	
+	//! How many events we collect per call to epoll_wait
+	static const int kMaxEvents = 256;
+	
+	//! The epoll instance
+	int mEpollFd;
+	
+	//! What each fd is registered with
+	JetHead::vector<FdState> mFds;
+	
+	/**
+	 * fds that epoll refuses to watch.  Regular files (EPERM) are
+	 * always ready as far as poll is concerned and bad fds (EBADF)
+	 * get POLLNVAL, so we report them the same way on every wait.
+	 * revents holds what to report.
+	 */
+	JetHead::vector<struct pollfd> mAlwaysReady;
+	
+	//! Buffer for epoll_wait
+	struct epoll_event mEpollEvents[ kMaxEvents ];
+};
+
+void EpollPoller::fillEvent( struct epoll_event &ev, int fd, short events,
+							 int flags )
+{
+	// The poll and epoll event bits have the same values, and epoll
+	//  always reports EPOLLERR and EPOLLHUP just like poll does.
+	ev.events = (unsigned short)events;
+	
+	if ( flags & Selector::kEdgeTriggered )
+		ev.events |= EPOLLET;
+	
+	if ( flags & Selector::kOneShot )
+		ev.events |= EPOLLONESHOT;
+	
+	ev.data.u64 = 0;
+	ev.data.fd = fd;
+}
+
+void EpollPoller::setEvents( int fd, short events, int flags )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+
+	if ( fd < 0 )
+		return;
+	
+	if ( (unsigned)fd >= mFds.size() )
+	{
+		if ( events == 0 )
+			return;
+		
+		mFds.resize( fd + 1 );
+	}
+	
+	FdState &state = mFds[ fd ];
+	
+	if ( events == 0 )
+		flags = 0;
+	
+	// One shot fds are disabled by the kernel after an event, so
+	//  setting them again is how they get rearmed.
+	if ( state.mEvents == events and state.mFlags == flags and 
+		 ( flags & Selector::kOneShot ) == 0 )
+	{
+		return;
+	}
+	
+	short old = state.mInKernel ? state.mEvents : 0;
+	state.mEvents = events;
+	state.mFlags = flags;
+	state.mInKernel = false;
+	removeAlwaysReady( fd );
+	
+	struct epoll_event ev;
+	fillEvent( ev, fd, events, flags );
+	
+	if ( events == 0 )
+	{
+		// The fd may have already been closed, which removes it from
+		//  the epoll set, so errors here are ok.
+		epoll_ctl( mEpollFd, EPOLL_CTL_DEL, fd, &ev );
+		return;
+	}
+	
+	int res = epoll_ctl( mEpollFd, old == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, 
+						 fd, &ev );
+	
+	// The fd was closed and reopened behind our back, or is still in
+	//  the set through a dup'd descriptor.
+	if ( res < 0 and errno == ENOENT )
+		res = epoll_ctl( mEpollFd, EPOLL_CTL_ADD, fd, &ev );
+	else if ( res < 0 and errno == EEXIST )
+		res = epoll_ctl( mEpollFd, EPOLL_CTL_MOD, fd, &ev );
+	
+	if ( res == 0 )
+	{
+		state.mInKernel = true;
+		return;
+	}
+	
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	
+	if ( errno == EPERM )
+	{
+		LOG( "fd %d doesn't support epoll, always ready", fd );
+		pfd.revents = events & ( POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM );
+	}
+	else
+	{
+		if ( errno != EBADF )
+			LOG_ERR_PERROR( "epoll_ctl failed for fd %d", fd );
+		pfd.revents = POLLNVAL;
+	}
+	
+	if ( pfd.revents != 0 )
+		mAlwaysReady.push_back( pfd );
+}
+
+bool EpollPoller::rearm( int fd )
+{
+	if ( fd < 0 or (unsigned)fd >= mFds.size() )
+		return false;
+	
+	FdState &state = mFds[ fd ];
+	
+	if ( not state.mInKernel or ( state.mFlags & Selector::kOneShot ) == 0 )
+		return false;
+	
+	struct epoll_event ev;
+	fillEvent( ev, fd, state.mEvents, state.mFlags );
+	
+	return epoll_ctl( mEpollFd, EPOLL_CTL_MOD, fd, &ev ) == 0;
+}
+
+void EpollPoller::removeAlwaysReady( int fd )
+{
+	for ( unsigned i = 0; i < mAlwaysReady.size(); i++ )
+	{
+		if ( mAlwaysReady[ i ].fd == fd )
+		{
+			mAlwaysReady.erase( i );
+			return;
+		}
+	}
+}
+
+int EpollPoller::wait( int timeout )
+{
+	mReady.clear();
+	
+	if ( not mAlwaysReady.empty() )
+		timeout = 0;
+	
+	int res = epoll_wait( mEpollFd, mEpollEvents, kMaxEvents, timeout );
+	
+	if ( res < 0 )
+		return res;
+	
+	for ( int i = 0; i < res; i++ )
+	{
+		struct pollfd pfd;
+		pfd.fd = mEpollEvents[ i ].data.fd;
+		pfd.events = 0;
+		pfd.revents = mEpollEvents[ i ].events & 0xffff;
+		mReady.push_back( pfd );
+	}
+	
+	unsigned i = 0;
+	while ( i < mAlwaysReady.size() )
+	{
+		mReady.push_back( mAlwaysReady[ i ] );
+		
+		// A file that is always ready only has one edge
+		if ( mFds[ mAlwaysReady[ i ].fd ].mFlags & 
+			 ( Selector::kEdgeTriggered | Selector::kOneShot ) )
+		{
+			mAlwaysReady.erase( i );
+		}
+		else
+		{
+			i++;
+		}
+	}
+	
+	return mReady.size();
+}
+#endif
+
+#ifdef JH_HAVE_IO_URING
+/**
+ * Poller using io_uring(7) poll requests.  A poll request completes
+ * once, so after every event the fd's request is queued again, and it
+ * goes to the kernel with the next wait, after the listeners had
+ * their chance to consume the data.  Registration changes are queued
+ * the same way, so a whole loop iteration is one system call.
+ */
+class UringPoller : public SelectorPoller
+{
+public:
+	UringPoller( IoUring *ring ) : mRing( ring ) {}
+	~UringPoller() { delete mRing; }
+	
+	Selector::Backend getBackend() { return Selector::kBackendIoUring; }
+	
+	void setEvents( int fd, short events, int flags );
+	int wait( int timeout );
+	bool supportsOneShot() { return true; }
+	
+	//! The ops we need from the kernel
+	static const uint8_t kOps[];
+	static const int kNumOps = 3;
+	
+	//! How many submissions we can queue before we have to flush
+	static const unsigned kRingSize = 1024;
+	
+private:
+	struct FdState
+	{
+		//! The mask the fd is registered with, 0 if none
+		short mEvents;
+		
+		//! The Selector flags it is registered with
+		int mFlags;
+		
+		//! Bumped every time the fd's poll request is replaced
+		uint32_t mGeneration;
+		
+		//! Does the fd have a poll request in the kernel?
+		bool mQueued;
+	};
+	
+	//! Queue a poll request for the fd's current mask
+	void queuePoll( int fd );
+	
+	//! The user data of a poll request
+	static uint64_t pollData( int fd, uint32_t generation )
+	{
+		return ( (uint64_t)generation << 32 ) | (uint32_t)fd;
+	}
+	
+	//! User data of requests whose completions we ignore
+	static const uint64_t kIgnoreData = ~0ULL;
+	
+	IoUring *mRing;
+	
+	//! What each fd is registered with
+	JetHead::vector<FdState> mFds;
+	
+	//! The timeout for the wait in progress
+	struct __kernel_timespec mTimeout;
+};
+
+const uint8_t UringPoller::kOps[] = 
+	{ IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_TIMEOUT };
+
+void UringPoller::queuePoll( int fd )
+{
+	FdState &state = mFds[ fd ];
+	struct io_uring_sqe *sqe = mRing->getSqe();
+	
+	if ( sqe == NULL )
+	{
+		LOG_ERR_PERROR( "Failed to queue poll for fd %d", fd );
+		return;
+	}
+	
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	
+	// The kernel reads this field in a way that works on big endian
+	//  systems for both the 16 and the 32 bit versions of it.
+	sqe->poll_events = (unsigned short)state.mEvents;
+	sqe->user_data = pollData( fd, state.mGeneration );
+	state.mQueued = true;
+}
+
+void UringPoller::setEvents( int fd, short events, int flags )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	if ( fd < 0 )
+		return;
+	
+	if ( (unsigned)fd >= mFds.size() )
+	{
+		if ( events == 0 )
+			return;
+		
+		mFds.resize( fd + 1 );
+	}
+	
+	FdState &state = mFds[ fd ];
+	
+	if ( events == 0 )
+		flags = 0;
+	
+	// One shot fds don't get requeued after an event, so setting them
+	//  again is how they get rearmed.
+	if ( state.mEvents == events and state.mFlags == flags and 
+		 ( flags & Selector::kOneShot ) == 0 )
+	{
+		return;
+	}
+	
+	if ( state.mQueued )
+	{
+		struct io_uring_sqe *sqe = mRing->getSqe();
+		
+		if ( sqe != NULL )
+		{
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = pollData( fd, state.mGeneration );
+			sqe->user_data = kIgnoreData;
+		}
+		
+		state.mQueued = false;
+	}
+	
+	// Anything the old request still reports is stale now
+	state.mGeneration++;
+	state.mEvents = events;
+	state.mFlags = flags;
+	
+	if ( events != 0 )
+		queuePoll( fd );
+}
+
+int UringPoller::wait( int timeout )
+{
+	mReady.clear();
+	
+	unsigned waitFor = 1;
+	
+	if ( timeout == 0 or mRing->hasCompletions() )
+	{
+		waitFor = 0;
+	}
+	else if ( timeout > 0 )
+	{
+		// A pure timeout, if an fd is ready first it completes later
+		//  on and is ignored.
+		struct io_uring_sqe *sqe = mRing->getSqe();
+		
+		if ( sqe != NULL )
+		{
+			mTimeout.tv_sec = timeout / 1000;
+			mTimeout.tv_nsec = ( timeout % 1000 ) * 1000000LL;
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t)&mTimeout;
+			sqe->len = 1;
+			sqe->user_data = kIgnoreData;
+		}
+	}
+	
+	if ( mRing->submit( waitFor ) < 0 )
+	{
+		// EBUSY means the completion queue is full, which we are
+		//  about to deal with.
+		if ( errno != EBUSY and errno != EAGAIN )
+			return -1;
+	}
+	
+	uint64_t data;
+	int res;
+	
+	while ( mRing->getCompletion( data, res ) )
+	{
+		if ( data == kIgnoreData )
+			continue;
+		
+		int fd = (int)( data & 0xffffffff );
+		
+		if ( (unsigned)fd >= mFds.size() )
+			continue;
+		
+		FdState &state = mFds[ fd ];
+		
+		if ( not state.mQueued or 
+			 state.mGeneration != (uint32_t)( data >> 32 ) )
+		{
+			continue;
+		}
+		
+		state.mQueued = false;
+		
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = state.mEvents;
+		
+		if ( res >= 0 )
+		{
+			pfd.revents = res & 0xffff;
+			
+			if ( ( state.mFlags & Selector::kOneShot ) == 0 )
+				queuePoll( fd );
+		}
+		else
+		{
+			// Most likely EBADF, the fd was closed under us.  We don't
+			//  requeue it, it's up to the listener to remove it.
+			pfd.revents = res == -EBADF ? POLLNVAL : POLLERR;
+		}
+		
+		mReady.push_back( pfd );
+	}
+	
+	return mReady.size();
+}
+#endif
+
+SelectorPoller *SelectorPoller::create( Selector::Backend backend )
+{
+#ifdef JH_HAVE_IO_URING
+	if ( backend == Selector::kBackendIoUring )
+	{
+		IoUring *ring = IoUring::create( UringPoller::kRingSize, 
+										 UringPoller::kOps, 
+										 UringPoller::kNumOps );
+		
+		if ( ring != NULL )
+			return jh_new UringPoller( ring );
+		
+		LOG_WARN( "io_uring not available, using the default backend" );
+		backend = Selector::kBackendDefault;
+	}
+#endif
+	
+#ifndef PLATFORM_DARWIN
+	if ( backend == Selector::kBackendEpoll or 
+		 backend == Selector::kBackendDefault )
+	{
+		int fd = epoll_create1( EPOLL_CLOEXEC );
+		
+		if ( fd >= 0 )
+			return jh_new EpollPoller( fd );
+		
+		LOG_WARN( "epoll_create1 failed (%s), falling back to poll", 
+				  strerror( errno ) );
+	}
+#endif
+	
+	return jh_new PollPoller();
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef JH_SELECTOR_POLLER_H_
+#define JH_SELECTOR_POLLER_H_
+
+#include "jh_types.h"
+#include "jh_vector.h"
+#include "Selector.h"
+
+#include <sys/poll.h>
+
+/**
+ * Internal interface between the Selector and the system call it uses
+ * to wait for file events.  The Selector keeps one merged event mask
+ * per fd and tells the poller whenever it changes, so each backend
+ * only ever sees one registration per fd.  All methods are only
+ * called from the selector thread (or before it is started).
+ */
+class SelectorPoller
+{
+public:
+	//! Create a poller for the backend, falling back to poll if needed
+	static SelectorPoller *create( Selector::Backend backend );
+
+	virtual ~SelectorPoller() {}
+	
+	//! Which backend is this?
+	virtual Selector::Backend getBackend() = 0;
+	
+	/**
+	 * Set the events we wait for on fd, replacing any previous
+	 * mask.  An events mask of 0 stops waiting on fd altogether.
+	 * flags are Selector::kEdgeTriggered and Selector::kOneShot,
+	 * pollers that don't support them ignore them.  Setting a one
+	 * shot fd always rearms it.
+	 */
+	virtual void setEvents( int fd, short events, int flags = 0 ) = 0;
+	
+	//! Can this poller disable an fd by itself after one event?
+	virtual bool supportsOneShot() { return false; }
+	
+	/**
+	 * Reenable a one shot fd after it reported an event.  Unlike the
+	 * other methods this may be called from any thread, as long as
+	 * the selector's lock is held.
+	 *
+	 * @return false if it could not be done, and setEvents must be
+	 * called from the selector thread instead.
+	 */
+	virtual bool rearm( int fd ) { return false; }
+	
+	/**
+	 * Wait for events.  Returns the number of ready fds, which can
+	 * then be read with getReadyFd() and getReadyEvents(), or -1 with
+	 * errno set.
+	 *
+	 * @param timeout in ms, -1 to wait forever and 0 to not block.
+	 */
+	virtual int wait( int timeout ) = 0;
+	
+	//! The fd of the i'th ready entry from the last wait
+	int getReadyFd( int i ) { return mReady[ i ].fd; }
+	
+	//! The events that occured on the i'th ready entry from the last wait
+	short getReadyEvents( int i ) { return mReady[ i ].revents; }
+	
+protected:
+	//! The results of the last call to wait
+	JetHead::vector<struct pollfd> mReady;
+};
+
+#endif // JH_SELECTOR_POLLER_H_
@@ -38,6 +38,8 @@
 
 #include "Socket.h"
 #include "File.h"
+#include "IoEngine.h"
+#include "Fiber.h"
 #include "jh_memory.h"
 #include "logging.h"
 
@@ -97,6 +99,11 @@ Socket::~Socket()
 int Socket::connect( const Socket::Address &addr )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	// Let the other fibers run while the handshake is in progress
+	if ( Fiber::getCurrent() != NULL )
+		return connectWait( addr, -1 );
+	
 	int len;
 	const struct sockaddr *saddr = addr.getAddr( len );
 	int res = ::connect( mFd, saddr, len );
@@ -110,6 +117,11 @@ int Socket::connect( const Socket::Address &addr )
 }
 
 int Socket::connect( const Socket::Address &addr, int timeout )
+{
+	return connectWait( addr, timeout * 1000 );
+}
+
+int Socket::connectWait( const Socket::Address &addr, int msecs )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
 	socklen_t len = 0;
@@ -117,11 +129,6 @@ int Socket::connect( const Socket::Address &addr, int timeout )
 	int res = 0;
 	int saveflags, ret, back_err;
 	const struct sockaddr *saddr = addr.getAddr( len_addr );
-	fd_set fd_w;
-	struct timeval t;
-
-	t.tv_sec = timeout;
-	t.tv_usec = 0;
 
 	saveflags=fcntl(mFd,F_GETFL,0);
 
@@ -149,10 +156,8 @@ int Socket::connect( const Socket::Address &addr, int timeout )
 		return -1;
 	}
 
-	FD_ZERO(&fd_w);
-	FD_SET(mFd,&fd_w);
-
-	res=select(FD_SETSIZE,NULL,&fd_w,NULL,&t);
+	/* poll, or the Selector on a fiber, so any fd number works */
+	res=Fiber::waitForFd(mFd,POLLOUT,msecs);
 
 	if(res < 0) {
 		return -1;
@@ -262,9 +267,6 @@ int Socket::read( void *buffer, int len )
 	
 	if (mReadTimeout)
 	{
-		int retCode = 0;
-		fd_set readSet;
-		struct timeval timeout;
 		int numBytes = 0;
 
 		if( mReadTimeout < 0 ) 
@@ -272,37 +274,10 @@ int Socket::read( void *buffer, int len )
 			return -1; // invalid timeout
 		}
 
-		FD_ZERO( &readSet );
-		FD_SET( ( unsigned )mFd, &readSet );
-
-		timeout.tv_sec = mReadTimeout;
-		timeout.tv_usec = 0;
-
-		while( true ) {
-			if( mReadTimeout == 0 ) 
-			{
-				retCode = select( FD_SETSIZE, &readSet, NULL, NULL, NULL );
-			} 
-			else 
-			{
-				retCode = select( FD_SETSIZE, &readSet, NULL, NULL, &timeout );
-			}
-
-			if( retCode == 0 ) 
-			{
-				return -1; // timed out
-			}
-			if( retCode == -1 ) 
-			{
-				if( errno == EINTR )
-					continue;
-				
-				return -1; // error
-			} 
-			else 
-			{
-				break; // continue with read 
-			}
+		// poll, or the Selector on a fiber, so any fd number works
+		if( Fiber::waitForFd( mFd, POLLIN, mReadTimeout * 1000 ) <= 0 )
+		{
+			return -1; // timed out or error
 		}
 
 		// read data
@@ -313,19 +288,37 @@ int Socket::read( void *buffer, int len )
 			return -1; // socket error;
 		}
 
+		chargeRead( numBytes );
 		return numBytes;
 	}
 	else
 	{
+		int res;
+		
+		// Only the fiber waits for the data
+		if ( Fiber::getCurrent() != NULL )
+			Fiber::waitForFd( mFd, POLLIN, -1 );
+		
 		if (not mSockStream)
 		{
-			return recvfrom(buffer, len, mLastDatagramSender);
+			res = recvfrom(buffer, len, mLastDatagramSender);
 		} else {
-			return ::read(mFd, buffer, len);
+			res = ::read(mFd, buffer, len);
 		}
+		
+		chargeRead( res );
+		return res;
 	}
 } 
 
+void Socket::chargeRead( int bytes )
+{
+	// Count the read against our selector's budget when called from
+	//  one of its listeners.
+	if ( bytes > 0 and mSelector != NULL )
+		mSelector->chargeRead( bytes );
+}
+
 int Socket::write( const void *buffer, int len )
 {
 	// Passing in the MSG_NOSIGNAL flag to tell the OS not to send us
@@ -333,7 +326,45 @@ int Socket::write( const void *buffer, int len )
 	// point we might make this a member variable that can be tweaked
 	// by the user, but that's interface clutter that we don't need
 	// yet.
-	return ::send(mFd, buffer, len, MSG_NOSIGNAL);
+	if ( Fiber::getCurrent() == NULL )
+		return ::send(mFd, buffer, len, MSG_NOSIGNAL);
+	
+	// On a fiber send what fits and wait on the Selector for room for
+	//  the rest, which is what a blocking send does for the thread.
+	const char *data = (const char*)buffer;
+	int sent = 0;
+	
+	while ( sent < len )
+	{
+		int res = ::send( mFd, data + sent, len - sent, 
+						  MSG_NOSIGNAL | MSG_DONTWAIT );
+		
+		if ( res >= 0 )
+			sent += res;
+		else if ( errno == EINTR )
+			continue;
+		else if ( errno != EAGAIN and errno != EWOULDBLOCK )
+			return ( sent > 0 ) ? sent : -1;
+		else if ( Fiber::waitForFd( mFd, POLLOUT, -1 ) < 0 )
+			return ( sent > 0 ) ? sent : -1;
+	}
+	
+	return sent;
+}
+
+int Socket::readAsync( void *buffer, int len, IEventDispatcher *dispatcher,
+					   jh_ptr_int_t private_data )
+{
+	return IoEngine::getDefault()->read( mFd, buffer, len, -1, dispatcher,
+										 private_data );
+}
+
+int Socket::writeAsync( const void *buffer, int len, 
+						IEventDispatcher *dispatcher, 
+						jh_ptr_int_t private_data )
+{
+	return IoEngine::getDefault()->send( mFd, buffer, len, dispatcher, 
+										 private_data );
 }
 
 JetHead::ErrCode Socket::close()
@@ -862,6 +893,10 @@ Socket *ServerSocket::accept()
 	TRACE_BEGIN( LOG_LVL_INFO );
 	Socket *new_sock = NULL;
 	
+	// Only the fiber waits for the connection
+	if ( Fiber::getCurrent() != NULL )
+		Fiber::waitForFd( getFd(), POLLIN, -1 );
+	
 	int res = ::accept( getFd(), NULL, NULL );
 
 	if ( res != -1 )
@@ -878,6 +913,53 @@ Socket *ServerSocket::accept()
 	return new_sock;
 }
 
+int ServerSocket::acceptAsync( IEventDispatcher *dispatcher, 
+							   jh_ptr_int_t private_data )
+{
+	return IoEngine::getDefault()->accept( getFd(), dispatcher, private_data );
+}
+
+Socket *ServerSocket::acceptComplete( AsyncIoEvent *ev )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	Socket *new_sock = NULL;
+	
+	if ( ev->getOp() != AsyncIoEvent::kAccept )
+	{
+		LOG_WARN( "Not an accept event" );
+	}
+	else if ( ev->getResult() != -1 )
+	{
+		new_sock = jh_new Socket( ev->getResult() );
+		new_sock->setConnected( true );
+		new_sock->setParent(this);
+	}
+	else
+	{
+		LOG_WARN( "Accept failed: %s", strerror( ev->getError() ) );
+	}
+	
+	return new_sock;
+}
+
+bool ServerSocket::setReusePort( bool on )
+{
+#ifdef SO_REUSEPORT
+	int val = on ? 1 : 0;
+	
+	if ( setsockopt( getFd(), SOL_SOCKET, SO_REUSEPORT, &val, 
+					 sizeof( val ) ) != 0 )
+	{
+		LOG_WARN_PERROR( "Failed to set SO_REUSEPORT" );
+		return false;
+	}
+	
+	return true;
+#else
+	return false;
+#endif
+}
+
 void ServerSocket::processFileEvents( int fd, short events, jh_ptr_int_t private_data )
 {
 	TRACE_BEGIN( LOG_LVL_INFO );
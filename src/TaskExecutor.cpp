@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TaskExecutor.h"
+#include "Thread.h"
+
+#include "logging.h"
+#include "jh_memory.h"
+
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+TaskExecutor *TaskExecutor::mDefault = NULL;
+
+//! Guards creation of mDefault
+static Mutex gDefaultLock;
+
+/**
+ * Chase and Lev's work stealing deque ("Dynamic Circular Work-Stealing
+ *  Deque", SPAA 2005).  The owning worker pushes and pops at the bottom
+ *  and only needs an atomic operation to take the last task.  Thieves
+ *  take from the top with a compare and swap.  When the array fills it
+ *  is doubled, and old arrays are kept until the deque is destroyed, as
+ *  a thief may still be reading one.
+ */
+class TaskExecutor::Deque
+{
+public:
+	Deque() : mTop( 0 ), mBottom( 0 )
+	{
+		mArray = newArray( kInitialSize, NULL );
+	}
+	
+	~Deque()
+	{
+		while ( mArray != NULL )
+		{
+			Array *previous = mArray->mPrevious;
+			delete [] mArray->mTasks;
+			delete mArray;
+			mArray = previous;
+		}
+	}
+	
+	//! Push task, only called by the owner
+	void push( Task *task )
+	{
+		unsigned long b = mBottom;
+		unsigned long t = mTop;
+		Array *array = mArray;
+		
+		if ( (long)( b - t ) > (long)array->mMask )
+			array = grow( array, t, b );
+		
+		array->mTasks[ b & array->mMask ] = task;
+		__sync_synchronize();
+		mBottom = b + 1;
+	}
+	
+	//! Pop the newest task, only called by the owner
+	Task *pop()
+	{
+		unsigned long b = mBottom - 1;
+		Array *array = mArray;
+		
+		mBottom = b;
+		__sync_synchronize();
+		
+		unsigned long t = mTop;
+		long size = (long)( b - t );
+		
+		if ( size < 0 )
+		{
+			mBottom = b + 1;
+			return NULL;
+		}
+		
+		Task *task = array->mTasks[ b & array->mMask ];
+		
+		if ( size > 0 )
+			return task;
+		
+		// The last one, which a thief may be taking too
+		if ( not __sync_bool_compare_and_swap( &mTop, t, t + 1 ) )
+			task = NULL;
+		
+		mBottom = b + 1;
+		return task;
+	}
+	
+	//! Take the oldest task, NULL if there's none or we lost a race
+	Task *steal()
+	{
+		unsigned long t = mTop;
+		__sync_synchronize();
+		unsigned long b = mBottom;
+		
+		if ( (long)( b - t ) <= 0 )
+			return NULL;
+		
+		Array *array = mArray;
+		Task *task = array->mTasks[ t & array->mMask ];
+		
+		if ( not __sync_bool_compare_and_swap( &mTop, t, t + 1 ) )
+			return NULL;
+		
+		return task;
+	}
+	
+	bool isEmpty()
+	{
+		return (long)( mBottom - mTop ) <= 0;
+	}
+	
+private:
+	static const unsigned long kInitialSize = 64;
+	
+	struct Array
+	{
+		unsigned long	mMask;
+		Task			**mTasks;
+		Array			*mPrevious;
+	};
+	
+	static Array *newArray( unsigned long size, Array *previous )
+	{
+		Array *array = jh_new Array;
+		array->mMask = size - 1;
+		array->mTasks = jh_new Task*[ size ];
+		array->mPrevious = previous;
+		return array;
+	}
+	
+	Array *grow( Array *array, unsigned long t, unsigned long b )
+	{
+		Array *bigger = newArray( ( array->mMask + 1 ) * 2, array );
+		
+		for ( unsigned long i = t; i != b; i++ )
+		{
+			bigger->mTasks[ i & bigger->mMask ] = 
+				array->mTasks[ i & array->mMask ];
+		}
+		
+		__sync_synchronize();
+		mArray = bigger;
+		return bigger;
+	}
+	
+	volatile unsigned long	mTop;
+	volatile unsigned long	mBottom;
+	Array * volatile		mArray;
+};
+
+struct TaskExecutor::Worker
+{
+	Worker( TaskExecutor *executor, const char *name, int index ) 
+	:	mExecutor( executor ), mIndex( index ), 
+		mSeed( index * 2654435761U + 1 ),
+		mThread( name, this, &Worker::run ) {}
+	
+	void run() { mExecutor->workerLoop( this ); }
+	
+	TaskExecutor		*mExecutor;
+	int					mIndex;
+	
+	//! For picking who to steal from
+	uint32_t			mSeed;
+	
+	Deque				mDeque;
+	Runnable<Worker>	mThread;
+};
+
+__thread TaskExecutor::Worker *TaskExecutor::mCurrentWorker = NULL;
+
+void Task::wait()
+{
+	if ( mState != kDone )
+		mExecutor->waitFor( this );
+}
+
+TaskExecutor *TaskExecutor::getDefault()
+{
+	AutoLock l( gDefaultLock );
+	
+	if ( mDefault == NULL )
+		mDefault = jh_new TaskExecutor();
+	
+	return mDefault;
+}
+
+void TaskExecutor::destroyDefault()
+{
+	AutoLock l( gDefaultLock );
+	
+	delete mDefault;
+	mDefault = NULL;
+}
+
+TaskExecutor::TaskExecutor( int numThreads, const char *name ) :
+	mSubmittedLock( "TaskExecutor" ), mNumSubmitted( 0 ), mSleepers( 0 ),
+	mStopping( false ), mDoneWaiters( 0 ), mStealWaiters( 0 )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	if ( numThreads <= 0 )
+		numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	
+	if ( numThreads <= 0 )
+		numThreads = 1;
+	
+	for ( int i = 0; i < numThreads; i++ )
+	{
+		char threadName[ 64 ];
+		snprintf( threadName, sizeof( threadName ), "%s %d", name, i );
+		mWorkers.push_back( jh_new Worker( this, threadName, i ) );
+	}
+	
+	// Start them once they are all there to steal from
+	for ( unsigned i = 0; i < mWorkers.size(); i++ )
+		mWorkers[ i ]->mThread.Start();
+	
+	LOG_INFO( "%d threads", numThreads );
+}
+
+TaskExecutor::~TaskExecutor()
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	mSleepLock.Lock();
+	mStopping = true;
+	mWakeup.Broadcast();
+	mSleepLock.Unlock();
+	
+	for ( unsigned i = 0; i < mWorkers.size(); i++ )
+		mWorkers[ i ]->mThread.Join();
+	
+	// Only once none of them can be stealing from the others
+	for ( unsigned i = 0; i < mWorkers.size(); i++ )
+		delete mWorkers[ i ];
+}
+
+bool TaskExecutor::isWorkerThread()
+{
+	return ( mCurrentWorker != NULL and mCurrentWorker->mExecutor == this );
+}
+
+void TaskExecutor::submit( Task *task, IEventDispatcher *dispatcher,
+						   jh_ptr_int_t private_data )
+{
+	if ( task->mState != Task::kNew )
+	{
+		LOG_ERR( "Task %p submitted twice", task );
+		return;
+	}
+	
+	task->AddRef();
+	task->mState = Task::kQueued;
+	task->mExecutor = this;
+	task->mDispatcher = dispatcher;
+	task->mPrivateData = private_data;
+	
+	if ( isWorkerThread() )
+		mCurrentWorker->mDeque.push( task );
+	else
+	{
+		AutoLock l( mSubmittedLock );
+		mSubmitted.push_back( task );
+		mNumSubmitted++;
+	}
+	
+	wakeWorker();
+}
+
+void TaskExecutor::wakeWorker()
+{
+	// A worker counts itself in mSleepers before its last look for a 
+	//  task, so either it sees the task or we see it.
+	__sync_synchronize();
+	
+	if ( mSleepers > 0 )
+	{
+		AutoLock l( mSleepLock );
+		mWakeup.Signal();
+	}
+	
+	// Same again for workers waiting on a task, which could steal it
+	if ( mStealWaiters > 0 )
+	{
+		AutoLock l( mDoneLock );
+		mDone.Broadcast();
+	}
+}
+
+Task *TaskExecutor::findTask( Worker *worker )
+{
+	Task *task = worker->mDeque.pop();
+	
+	if ( task != NULL )
+		return task;
+	
+	if ( mNumSubmitted > 0 )
+	{
+		AutoLock l( mSubmittedLock );
+		
+		if ( not mSubmitted.empty() )
+		{
+			task = mSubmitted.front();
+			mSubmitted.pop_front();
+			mNumSubmitted--;
+			return task;
+		}
+	}
+	
+	// Steal, starting from someone picked at random
+	unsigned numWorkers = mWorkers.size();
+	
+	worker->mSeed = worker->mSeed * 1664525 + 1013904223;
+	unsigned start = ( worker->mSeed >> 16 ) % numWorkers;
+	
+	for ( unsigned i = 0; i < numWorkers; i++ )
+	{
+		Worker *victim = mWorkers[ ( start + i ) % numWorkers ];
+		
+		if ( victim == worker )
+			continue;
+		
+		// A failed steal may have lost a race, and there may be more
+		while ( not victim->mDeque.isEmpty() )
+		{
+			task = victim->mDeque.steal();
+			
+			if ( task != NULL )
+				return task;
+		}
+	}
+	
+	return NULL;
+}
+
+bool TaskExecutor::haveTasks()
+{
+	if ( mNumSubmitted > 0 )
+		return true;
+	
+	for ( unsigned i = 0; i < mWorkers.size(); i++ )
+	{
+		if ( not mWorkers[ i ]->mDeque.isEmpty() )
+			return true;
+	}
+	
+	return false;
+}
+
+void TaskExecutor::runTask( Task *task )
+{
+	task->run();
+	
+	task->mState = Task::kDone;
+	__sync_synchronize();
+	
+	if ( mDoneWaiters > 0 )
+	{
+		AutoLock l( mDoneLock );
+		mDone.Broadcast();
+	}
+	
+	if ( task->mDispatcher != NULL )
+	{
+		task->mDispatcher->sendEvent( 
+			jh_new TaskDoneEvent( task, task->mPrivateData ) );
+	}
+	
+	task->Release();
+}
+
+void TaskExecutor::workerLoop( Worker *worker )
+{
+	TRACE_BEGIN( LOG_LVL_INFO );
+	
+	mCurrentWorker = worker;
+	
+	for (;;)
+	{
+		Task *task = findTask( worker );
+		
+		if ( task != NULL )
+		{
+			runTask( task );
+			continue;
+		}
+		
+		// Give whoever is about to submit a chance before sleeping
+		sched_yield();
+		
+		task = findTask( worker );
+		
+		if ( task != NULL )
+		{
+			runTask( task );
+			continue;
+		}
+		
+		AutoLock l( mSleepLock );
+		
+		__sync_fetch_and_add( &mSleepers, 1 );
+		
+		bool idle = not haveTasks();
+		
+		if ( idle and not mStopping )
+			mWakeup.Wait( mSleepLock );
+		
+		__sync_fetch_and_sub( &mSleepers, 1 );
+		
+		// Once stopping we go when there's nothing left to do
+		if ( idle and mStopping )
+			break;
+	}
+	
+	mCurrentWorker = NULL;
+}
+
+void TaskExecutor::waitFor( Task *task )
+{
+	if ( isWorkerThread() )
+	{
+		int spins = 0;
+		
+		// Run other tasks until it's done, it's probably one of them
+		while ( task->mState != Task::kDone )
+		{
+			Task *other = findTask( mCurrentWorker );
+			
+			if ( other != NULL )
+			{
+				runTask( other );
+				spins = 0;
+			}
+			else if ( ++spins < kWaitSpins )
+				sched_yield();
+			else
+			{
+				// Another worker is running it and taking a while.  Sleep
+				//  until a task is done or there's one to steal.
+				AutoLock l( mDoneLock );
+				
+				__sync_fetch_and_add( &mDoneWaiters, 1 );
+				__sync_fetch_and_add( &mStealWaiters, 1 );
+				
+				if ( task->mState != Task::kDone and not haveTasks() )
+					mDone.Wait( mDoneLock );
+				
+				__sync_fetch_and_sub( &mStealWaiters, 1 );
+				__sync_fetch_and_sub( &mDoneWaiters, 1 );
+				
+				spins = 0;
+			}
+		}
+		
+		return;
+	}
+	
+	AutoLock l( mDoneLock );
+	
+	__sync_fetch_and_add( &mDoneWaiters, 1 );
+	
+	while ( task->mState != Task::kDone )
+		mDone.Wait( mDoneLock );
+	
+	__sync_fetch_and_sub( &mDoneWaiters, 1 );
+}
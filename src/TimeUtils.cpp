@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "TimeUtils.h"
+
+#include <pthread.h>
+
+#if defined( __x86_64__ )
+#include <cpuid.h>
+#endif
+
+#include "logging.h"
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+namespace TimeUtils
+{
+	CycleClock gCycleClock;
+}
+
+static pthread_once_t gCycleClockOnce = PTHREAD_ONCE_INIT;
+
+#if defined( __x86_64__ )
+//! Does the CPU have an invariant TSC and rdtscp?
+static bool hasInvariantTsc()
+{
+	unsigned eax, ebx, ecx, edx;
+	
+	if ( __get_cpuid( 0x80000000, &eax, &ebx, &ecx, &edx ) == 0 or 
+		 eax < 0x80000007 )
+		return false;
+	
+	// rdtscp
+	__get_cpuid( 0x80000001, &eax, &ebx, &ecx, &edx );
+	
+	if ( ( edx & ( 1 << 27 ) ) == 0 )
+		return false;
+	
+	// Invariant TSC
+	__get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx );
+	
+	return ( edx & ( 1 << 8 ) ) != 0;
+}
+
+static uint64_t readTsc()
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__( "rdtsc" : "=a" ( lo ), "=d" ( hi ) );
+	return ( (uint64_t)hi << 32 ) | lo;
+}
+
+//! A TSC reading and the CLOCK_MONOTONIC time it was taken at
+static void readBoth( uint64_t *cycles, uint64_t *nsecs )
+{
+	uint64_t before = TimeUtils::getSystemMonotonicNsecs();
+	*cycles = readTsc();
+	uint64_t after = TimeUtils::getSystemMonotonicNsecs();
+	
+	*nsecs = before + ( after - before ) / 2;
+}
+#endif
+
+static void calibrate()
+{
+	TimeUtils::CycleClock &clock = TimeUtils::gCycleClock;
+	
+	clock.mTsc = false;
+	clock.mNsecsPerCycle = 1ULL << 32;
+	clock.mBaseCycles = 0;
+	clock.mBaseNsecs = 0;
+	
+#if defined( __x86_64__ )
+	if ( hasInvariantTsc() )
+	{
+		uint64_t c0, t0, c1, t1;
+		
+		// Time the TSC against the system clock for 10ms
+		readBoth( &c0, &t0 );
+		
+		do
+		{
+			readBoth( &c1, &t1 );
+		} while ( t1 - t0 < 10000000 );
+		
+		if ( c1 > c0 )
+		{
+			clock.mNsecsPerCycle = ( ( t1 - t0 ) << 32 ) / ( c1 - c0 );
+			clock.mBaseCycles = c1;
+			clock.mBaseNsecs = t1;
+			clock.mTsc = true;
+			
+			LOG_INFO( "TSC at %llu kHz", 
+					  (unsigned long long)( ( c1 - c0 ) * 1000 / 
+											( ( t1 - t0 ) / 1000 ) ) );
+		}
+	}
+#endif
+	
+	if ( not clock.mTsc )
+		LOG_INFO( "No invariant TSC, using CLOCK_MONOTONIC" );
+	
+	__sync_synchronize();
+	clock.mReady = true;
+}
+
+void TimeUtils::initCycleClock()
+{
+	pthread_once( &gCycleClockOnce, calibrate );
+}
@@ -39,25 +39,63 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <string.h>
 
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_NOTICE );
 
+/*
+ * Pick the time in [due, due + slack] with the most trailing zero bits.
+ * Timeouts whose windows overlap then tend to pick the same time.
+ */
+static uint64_t applySlack( uint64_t due, uint64_t slack )
+{
+	uint64_t limit = due + slack;
+	uint64_t differ = due ^ limit;
+	uint64_t bit = 1;
+	
+	if ( differ == 0 )
+		return due;
+	
+	// limit has the highest bit that differs set, and due doesn't.
+	//  Clearing everything below it stays in the window.
+	while ( differ >>= 1 )
+		bit <<= 1;
+	
+	return limit & ~( bit - 1 );
+}
 
 Timer::Timer(int tickTimeMs, bool stoppable)
-:	mClockThread(NULL),
+:	mStarted(false),
+	mTickUsecs(0),
+	mNextService(kNever),
+	mNumPending(0),
 	mMsPerTick(tickTimeMs),
 	mStoppable(stoppable),
-	mMutex(true),
+	mTickless(tickTimeMs == kTickless),
+	mSending(false),
+	mMutex("Timer", true),
+	mExpiring(NULL),
+	mHashSize(64),
+	mNumHashed(0),
+	mFreeNodes(NULL),
+	mNumFree(0),
 	mTicks(0)
 {
 	TRACE_BEGIN(LOG_LVL_INFO);
 	
+	memset(mWheel, 0, sizeof(mWheel));
+	memset(&mCoalescingStats, 0, sizeof(mCoalescingStats));
+	mEventHash = jh_new TimerNode*[mHashSize];
+	memset(mEventHash, 0, mHashSize * sizeof(TimerNode*));
+	
 	// If a negative tick time is specified then use 100ms
 	if (mMsPerTick < 0)
 		mMsPerTick = 100;
 	
-	// Start the timer thread running immediately
+	mUsecsPerTick = (uint64_t)mMsPerTick * 1000;
+	
+	// Start the timer running immediately
 	start();
 }
 
@@ -65,12 +103,21 @@ Timer::~Timer()
 {
 	TRACE_BEGIN(LOG_LVL_INFO);
 	
-	// Force stop of this timer
+	// Force stop of this timer, this also removes it from the
+	//  TimerManager
 	doStop();
 	
-	// Remove the Timer from the TimerManager
-	TimerManager::getInstance()->removeTimer(this);
+	// Free the pending nodes and then the ones kept for reuse
+	reset();
 	
+	while (mFreeNodes != NULL)
+	{
+		TimerNode *node = mFreeNodes;
+		mFreeNodes = node->mNext;
+		delete node;
+	}
+	
+	delete [] mEventHash;
 }
 
 int Timer::getTickTime()
@@ -78,24 +125,40 @@ int Timer::getTickTime()
 	return mMsPerTick;
 }
 
+void Timer::getCoalescingStats( CoalescingStats &stats )
+{
+	DebugAutoLock( mMutex );
+	stats = mCoalescingStats;
+}
+
+void Timer::resetCoalescingStats()
+{
+	DebugAutoLock( mMutex );
+	memset( &mCoalescingStats, 0, sizeof( mCoalescingStats ) );
+}
+
 void Timer::start()
 {
 	TRACE_BEGIN(LOG_LVL_NOISE);
 	
-	// If the clock thread is already running then the
-	if (mClockThread != NULL)
-		return;
-	
-	// Because we don't prevent additions to our timer list during
-	// periods where the timer is stopped we need to reset, which
-	// clears the timeout list and resets ticks to 0
-	reset();
-	
-	mClockThread = jh_new Runnable<Timer>("clockThread",
-										  this,
-										  &Timer::clockHandler);
-	mClockThread->Start();
+	{
+		DebugAutoLock(mMutex);
+		
+		// If the timer is already running then there is nothing to do
+		if (mStarted)
+			return;
+		
+		// Because we don't prevent additions to our timer list during
+		// periods where the timer is stopped we need to reset, which
+		// clears the timeout list and resets ticks to 0
+		reset();
+		
+		mStarted = true;
+		mTickUsecs = TimeUtils::getMonotonicUsecs();
+		mNextService = kNever;
+	}
 	
+	TimerManager::getInstance()->addTimer(this);
 }
 
 void Timer::stop()
@@ -116,14 +179,17 @@ void Timer::doStop()
 {
 	TRACE_BEGIN(LOG_LVL_NOISE);
 	
-	if (mClockThread != NULL)
 	{
-		// First stop the clock thread and join it
-		mClockThread->Stop();
-		mClockThread->Join();
-		delete mClockThread;
-		mClockThread = NULL;
+		DebugAutoLock(mMutex);
+		
+		if (not mStarted)
+			return;
+		
+		mStarted = false;
 	}
+	
+	// Once this returns the service thread is done with us
+	TimerManager::getInstance()->removeTimer(this);
 }
 
 void Timer::reset()
@@ -132,52 +198,138 @@ void Timer::reset()
 	
 	DebugAutoLock(mMutex);
 	
+	for (int level = 0; level < kNumWheels; level++)
+	{
+		for (unsigned slot = 0; slot < kWheelSize; slot++)
+		{
+			while (mWheel[level][slot] != NULL)
+				freeNode(mWheel[level][slot]);
+		}
+	}
+	
+	while (mExpiring != NULL)
+		freeNode(mExpiring);
+	
+	while (not mHeap.empty())
+		freeNode(mHeap[0]);
+	
 	mTicks = 0;
-	mList.clear();
 }
 
-void Timer::clockHandler()
+uint64_t Timer::service( uint64_t now )
 {
-	TRACE_BEGIN( LOG_LVL_INFO );	
-	struct timespec start, cur;
-	Condition c;
-	Mutex m;
-	AutoLock l(m);
+	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	TimeUtils::getCurTime( &start );
-	while ( !mClockThread->CheckStop() )
-	{	
-		// Wait for the tick to timeout
-		if (not c.Wait(m, mMsPerTick))
+	DebugAutoLock( mMutex );
+	
+	if ( mTickless )
+	{
+		while ( not mHeap.empty() and mHeap[ 0 ]->mDeadline <= now )
+			expireNode( mHeap[ 0 ] );
+	}
+	else if ( mNumPending == 0 )
+	{
+		// The wheels are empty, so we can jump straight to now.  A 
+		//  change of clock source can leave now behind the last tick.
+		uint32_t ticks = 0;
+		
+		if ( now > mTickUsecs )
+			ticks = ( now - mTickUsecs ) / mUsecsPerTick;
+		
+		mTicks += ticks;
+		mTickUsecs += ticks * mUsecsPerTick;
+	}
+	else
+	{
+		// Jump from one tick with something to do to the next, so a
+		//  big step of the clock costs no more than a small one.
+		while ( mNumPending != 0 )
 		{
-			TimeUtils::getCurTime( &cur );
+			uint32_t tick = nextBusyTick();
+			uint64_t due = mTickUsecs + 
+				(uint64_t)( tick - mTicks ) * mUsecsPerTick;
 			
-			// Check to see if the clock was set back, or jumps
-			// forward by more than 10 seconds. If so, update the
-			// starting time to the current time and wait for the next
-			// tick.
-			if ( TimeUtils::getDifference( &cur, &start ) < 0 or
-				 TimeUtils::getDifference( &cur, &start ) > 10000 )
+			if ( due > now )
 			{
-				TimeUtils::getCurTime( &start );
-				handleTick();
-			}
-			else
-			{	
-				// Get the current time and count ticks until cur time and the 
-				// actual tick time are less the mMsPerTick apart.
-				while ( TimeUtils::getDifference( &cur, &start ) > mMsPerTick )
+				// Nothing happens in between, so move up to now
+				if ( now > mTickUsecs )
 				{
-					TimeUtils::addOffset( &start, mMsPerTick );
-					handleTick();
+					uint32_t behind = ( now - mTickUsecs ) / mUsecsPerTick;
+					
+					mTicks += behind;
+					mTickUsecs += behind * mUsecsPerTick;
 				}
+				break;
 			}
+			
+			mTicks = tick - 1;
+			mTickUsecs = due - mUsecsPerTick;
+			handleTick();
 		}
-		else
+	}
+	
+	fireExpired();
+	
+	// The callbacks were made unlocked, so look again at what is next
+	if ( mTickless )
+	{
+		mNextService = mHeap.empty() ? kNever : mHeap[ 0 ]->mDeadline;
+	}
+	else if ( mNumPending == 0 )
+	{
+		mNextService = kNever;
+	}
+	else
+	{
+		mNextService = mTickUsecs + 
+			(uint64_t)( nextBusyTick() - mTicks ) * mUsecsPerTick;
+	}
+	
+	return mNextService;
+}
+
+uint32_t Timer::nextBusyTick()
+{
+	// Wheel 0 has a slot for each of the next kWheelSize ticks
+	uint64_t best = 1ULL << 32;
+	
+	for ( uint32_t ahead = 1; ahead <= kWheelSize; ahead++ )
+	{
+		if ( mWheel[ 0 ][ ( mTicks + ahead ) & kWheelMask ] != NULL )
+		{
+			best = ahead;
+			break;
+		}
+	}
+	
+	// Each wheel above has a slot for each of the next kWheelSize laps
+	//  of the wheel below, cascaded on the first tick of the lap (see
+	//  handleTick).  Only laps starting before the best so far matter.
+	for ( int level = 1; level < kNumWheels; level++ )
+	{
+		unsigned shift = level * kWheelBits;
+		uint64_t lap = 1ULL << shift;
+		uint64_t ahead = lap - ( mTicks & ( lap - 1 ) );
+		
+		for ( unsigned i = 0; i < kWheelSize and ahead < best; i++ )
 		{
-			LOG_ERR_FATAL("Signal recieved on timer condition????\n");
+			uint32_t tick = mTicks + (uint32_t)ahead;
+			
+			if ( mWheel[ level ][ ( tick >> shift ) & kWheelMask ] != NULL )
+			{
+				best = ahead;
+				break;
+			}
+			
+			ahead += lap;
 		}
 	}
+	
+	// Can't happen with anything pending, but keep going if it does
+	if ( best == 1ULL << 32 )
+		best = 1;
+	
+	return mTicks + (uint32_t)best;
 }
 
 void Timer::handleTick()
@@ -186,224 +338,343 @@ void Timer::handleTick()
 	
 	DebugAutoLock( mMutex );
 	
-	mTicks++;
+	uint32_t tick = mTicks + 1;
+	unsigned index = tick & kWheelMask;
 	
-	TimerNode timer;
+	// Every time a wheel comes round, the next slot of the wheel above
+	//  is spread over it.  Done before mTicks moves so nodes due on this
+	//  tick land in the slot we are about to handle.
+	if ( index == 0 and 
+		 cascade( 1, ( tick >> kWheelBits ) & kWheelMask ) == 0 and
+		 cascade( 2, ( tick >> ( 2 * kWheelBits ) ) & kWheelMask ) == 0 )
+	{
+		cascade( 3, ( tick >> ( 3 * kWheelBits ) ) & kWheelMask );
+	}
 	
-	while (not mList.empty())
+	mTicks = tick;
+	mTickUsecs += mUsecsPerTick;
+	
+	// Everything on the slot is due.  Move it aside so periodic timers
+	//  re-armed as they expire go on the wheel, even if due right away.
+	mExpiring = mWheel[ 0 ][ index ];
+	mWheel[ 0 ][ index ] = NULL;
+	
+	for ( TimerNode *node = mExpiring; node != NULL; node = node->mNext )
+		node->mSlot = &mExpiring;
+	
+	while ( mExpiring != NULL )
+		expireNode( mExpiring );
+}
+
+void Timer::expireNode( TimerNode *timer )
+{
+	// Take the node off all lists now, so it is out of reach of 
+	//  the callbacks
+	unlinkNode( timer );
+	if ( timer->mEvent != NULL )
+		unhashNode( timer );
+
+	// The callback is made by fireExpired once we let go of the lock.  
+	//  This holds a reference to the event until then.
+	ExpiredTimer expired;
+	expired.mEvent = timer->mEvent;
+	expired.mDispatcher = timer->mDispatcher;
+	expired.mListener = timer->mListener;
+	expired.mPrivateData = timer->mPrivateData;
+	mExpired.push_back( expired );
+	
+	// A tickless periodic timer keeps to its schedule, but doesn't try
+	//  to make up for periods that were missed.
+	if ( mTickless and timer->mPeriodUsecs != 0 )
 	{
-		timer = *mList.begin();
+		uint64_t now = TimeUtils::getMonotonicUsecs();
 		
-		int32_t diff = timer.mTick - mTicks;
+		timer->mDue += timer->mPeriodUsecs;
+		if ( timer->mDue <= now )
+			timer->mDue = now + timer->mPeriodUsecs;
 		
-		// List is sorted with nearest items first.  Once we find a node
-		// that is in the future we are done.
-		if ( diff > 0 )
-			break;
+		timer->mDeadline = applySlack( timer->mDue, timer->mSlack );
+		
+		if ( timer->mEvent != NULL )
+			hashNode( timer );
+		placeNode( timer );
+	}
+	// Check to see if this is a periodic timer.   If it is then
+	// we need to re-calculate the tick value for the timer.  In
+	// addition we are going to calculate the # of ms that are
+	// lost by the tick calculation and accumulate them so that
+	// over time we line up properly whenever possible.
+	else if (not mTickless and timer->mRepeatMS != 0)
+	{
+		unsigned newTicks = (timer->mRepeatMS + mMsPerTick - 1 - 
+							 timer->mRemainingMS) / mMsPerTick;
+		timer->mDue += newTicks;
+		timer->mTick = applySlack( timer->mDue, timer->mSlack );
+		timer->mRemainingMS = (timer->mRepeatMS + timer->mRemainingMS) % 
+			mMsPerTick;
 		
-		// Remove the timer from the list now
-		mList.pop_front();
+		if ( timer->mEvent != NULL )
+			hashNode( timer );
+		placeNode( timer );
+	}
+	// If this is a non-periodic then release our reference to
+	// the event if we have one
+	else
+	{
+		freeNode( timer );
+	}
+}
 
-		// If the timer doesn't have an event then we call the listener
-		if ( timer.mEvent == NULL )
-		{
-			timer.mListener->onTimeout( timer.mPrivateData );
-		}
-		// Otherwise send the event
-		else
-		{
-			// Send the event to the specified dispatcher
-			timer.mDispatcher->sendEvent( timer.mEvent );
-		}
+void Timer::fireExpired()
+{
+	if ( not mExpired.empty() )
+	{
+		mCoalescingStats.mWakeups++;
+		mCoalescingStats.mExpirations += mExpired.size();
+	}
+	
+	for ( unsigned i = 0; i < mExpired.size(); i++ )
+	{
+		ExpiredTimer &expired = mExpired[ i ];
 		
-		// Check to see if this is a periodic timer.   If it is then
-		// we need to re-calculate the tick value for the timer.  In
-		// addition we are going to calculate the # of ms that are
-		// lost by the tick calculation and accumulate them so that
-		// over time we line up properly whenever possible.
-		if (timer.mRepeatMS != 0)
+		// Only the clock thread adds to mExpired, so expired stays put
+		//  while we are unlocked.
+		if ( expired.mListener != NULL )
 		{
-			unsigned newTicks = (timer.mRepeatMS + mMsPerTick - 1 - 
-								 timer.mRemainingMS) / mMsPerTick;
-			timer.mTick += newTicks;
-			timer.mRemainingMS = (timer.mRepeatMS + timer.mRemainingMS) % 
-				mMsPerTick;
-			addTimerNode(timer);
+			TimerListener *listener = expired.mListener;
+			expired.mListener = NULL;
+			
+			mMutex.Unlock();
+			listener->onTimeout( expired.mPrivateData );
+			mMutex.Lock();
 		}
-		// If this is a non-periodic then release our reference to
-		// the event if we have one
-		else
+		else if ( expired.mDispatcher != NULL )
 		{
-			timer.mEvent = NULL;
+			IEventDispatcher *dispatcher = expired.mDispatcher;
+			
+			// Take every event still due for this dispatcher, they all
+			//  go to it in one go
+			for ( unsigned j = i; j < mExpired.size(); j++ )
+			{
+				if ( mExpired[ j ].mDispatcher == dispatcher )
+				{
+					mBatch.push_back( mExpired[ j ].mEvent );
+					mExpired[ j ].mDispatcher = NULL;
+				}
+			}
+			
+			mSending = true;
+			mMutex.Unlock();
+			dispatcher->sendEvents( &mBatch[ 0 ], mBatch.size() );
+			mMutex.Lock();
+			mSending = false;
+			
+			mBatch.clear();
+			mSent.Broadcast();
 		}
 	}
+	
+	// Drops our references, the dispatchers have their own
+	mExpired.clear();
+}
+
+void Timer::waitForSend()
+{
+	while ( mSending )
+		mSent.Wait( mMutex );
 }
 
 void Timer::addTimer( TimerListener *listener,
 					  uint32_t msecs,
-					  uint32_t private_data )
+					  uint32_t private_data,
+					  uint32_t slackMs )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	DebugAutoLock( mMutex );
-
 	if (listener == NULL) abort();
 
-	// Calculate the timeout time in ticks
-	uint32_t ticks = ( msecs +  mMsPerTick - 1 ) / mMsPerTick;
-	
-	// Initialize new timer node
-	TimerNode timer;
-	timer.mEvent = NULL;
-	timer.mDispatcher = NULL;
-	timer.mPrivateData = private_data;
-	timer.mListener = listener;
-	timer.mTick = mTicks + ticks;
-	timer.mRepeatMS = 0;
-	timer.mRemainingMS = 0;	
+	addNode( NULL, NULL, listener, private_data, (uint64_t)msecs * 1000, 0,
+			 (uint64_t)slackMs * 1000 );
+}
 
-	LOG( "timer at %d ticks", timer.mTick );
+void Timer::addTimerUsecs( TimerListener *listener,
+						   uint64_t usecs,
+						   uint32_t private_data,
+						   uint64_t slackUsecs )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
+	
+	if (listener == NULL) abort();
 
-	addTimerNode( timer );
+	addNode( NULL, NULL, listener, private_data, usecs, 0, slackUsecs );
 }
 
 void Timer::addPeriodicTimer( TimerListener *listener,
 							  uint32_t period,
-							  uint32_t private_data )
+							  uint32_t private_data,
+							  uint32_t slackMs )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	DebugAutoLock( mMutex );
-
 	if (listener == NULL) abort();
 
-	// Calculate the timeout time in ticks
-	uint32_t ticks = ( period +  mMsPerTick - 1 ) / mMsPerTick;
-	
-	// Initialize new timer node
-	TimerNode timer;
-	timer.mEvent = NULL;
-	timer.mDispatcher = NULL;
-	timer.mPrivateData = private_data;
-	timer.mListener = listener;
-	timer.mTick = mTicks + ticks;
-	timer.mRepeatMS = period;
-	timer.mRemainingMS = 0;	
-
-	LOG( "timer at %d ticks", timer.mTick );
-
-	addTimerNode( timer );
-	
+	addNode( NULL, NULL, listener, private_data, (uint64_t)period * 1000, 
+			 (uint64_t)period * 1000, (uint64_t)slackMs * 1000 );
 }
 
 void Timer::sendTimedEvent( Event *event,
 							IEventDispatcher *dispatcher,
-							uint32_t msecs )
+							uint32_t msecs,
+							uint32_t slackMs )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
-		
-	DebugAutoLock( mMutex );
-	
-	// Calculate the timeout time in ticks
-	uint32_t ticks = ( msecs +  mMsPerTick - 1 ) / mMsPerTick;
 	
-	// Initialize new timer node
-	TimerNode timer;
-	timer.mEvent = event; 
-	timer.mDispatcher = dispatcher;
-	timer.mPrivateData = 0;
-	timer.mListener = NULL;
-	timer.mTick = mTicks + ticks;
-	timer.mRepeatMS = 0;
-	timer.mRemainingMS = 0;
+	addNode( event, dispatcher, NULL, 0, (uint64_t)msecs * 1000, 0,
+			 (uint64_t)slackMs * 1000 );
+}
 
-	LOG( "timer at %d ticks", timer.mTick );
+void Timer::sendTimedEventUsecs( Event *event,
+								 IEventDispatcher *dispatcher,
+								 uint64_t usecs,
+								 uint64_t slackUsecs )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	addTimerNode( timer );
+	addNode( event, dispatcher, NULL, 0, usecs, 0, slackUsecs );
 }
 
 void Timer::sendPeriodicEvent( Event *event,
 							   IEventDispatcher *dispatcher,
-							   uint32_t period )
+							   uint32_t period,
+							   uint32_t slackMs )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
-		
-	DebugAutoLock( mMutex );
 	
-	// Calculate the timeout time in ticks
-	uint32_t ticks = ( period +  mMsPerTick - 1 ) / mMsPerTick;
-	
-	// Initialize new timer node
-	TimerNode timer;
-	timer.mEvent = event; 
-	timer.mDispatcher = dispatcher;
-	timer.mPrivateData = 0;
-	timer.mListener = NULL;
-	timer.mTick = mTicks + ticks;
-	timer.mRepeatMS = period;
-	timer.mRemainingMS = 0;
-	
-	LOG( "timer at %d ticks", timer.mTick );
-	
-	addTimerNode( timer );
+	addNode( event, dispatcher, NULL, 0, (uint64_t)period * 1000, 
+			 (uint64_t)period * 1000, (uint64_t)slackMs * 1000 );
 }
 
-void Timer::removeTimedEvent( Event::Id eventId,
-							  IEventDispatcher *dispatcher )
+void Timer::addNode( Event *event, IEventDispatcher *dispatcher,
+					 TimerListener *listener, uint32_t private_data,
+					 uint64_t usecs, uint64_t periodUsecs,
+					 uint64_t slackUsecs )
 {
-	TRACE_BEGIN( LOG_LVL_NOISE );
-	
-	TimerNode timer;
+	bool wake = false;
 	
-	DebugAutoLock( mMutex );
-
-	JetHead::list<TimerNode>::iterator i = mList.begin();
-	while (i != mList.end())
 	{
-		// Get the TimerNode
-		timer = *i;
+		DebugAutoLock( mMutex );
+		
+		uint64_t now = TimeUtils::getMonotonicUsecs();
+		uint64_t fireAt;
 		
-		// Check if the timer node has an event for the dispatcher
-		// specified
-		if ( timer.mDispatcher == dispatcher && timer.mEvent != NULL)
+		// Initialize new timer node
+		TimerNode timer;
+		timer.mEvent = event; 
+		timer.mDispatcher = dispatcher;
+		timer.mPrivateData = private_data;
+		timer.mListener = listener;
+		timer.mRemainingMS = 0;
+		timer.mHeapIndex = kNotInHeap;
+		
+		if ( mTickless )
 		{
-			// Now test if the timer node event has a matching id or if the
-			// id is Event::kInvalidEventId.  Event::kInvalidEventId is a
-			// special id used to remove all events for a dispatcher
-			if ( timer.mEvent->getEventId() == eventId
-				 || eventId == Event::kInvalidEventId )
+			timer.mDue = now + usecs;
+			timer.mSlack = slackUsecs;
+			timer.mDeadline = applySlack( timer.mDue, timer.mSlack );
+			timer.mPeriodUsecs = periodUsecs;
+			timer.mTick = 0;
+			timer.mRepeatMS = 0;
+			
+			fireAt = timer.mDeadline;
+			
+			LOG_NOISE( "timer at %llu us", (unsigned long long)timer.mDeadline );
+		}
+		else
+		{
+			// The service thread doesn't handle ticks nothing is due on,
+			//  so mTicks may be behind.  With nothing pending it can 
+			//  just be moved up to now.
+			uint32_t behind = 0;
+			
+			if ( now > mTickUsecs )
+				behind = ( now - mTickUsecs ) / mUsecsPerTick;
+			
+			if ( mNumPending == 0 )
 			{
-				i = i.erase();
-				continue;
+				mTicks += behind;
+				mTickUsecs += behind * mUsecsPerTick;
+				behind = 0;
 			}
+			
+			// Calculate the timeout time in ticks
+			uint32_t ticks = ( usecs + mUsecsPerTick - 1 ) / mUsecsPerTick;
+			
+			timer.mDeadline = 0;
+			timer.mPeriodUsecs = 0;
+			timer.mDue = (uint32_t)( mTicks + behind + ticks );
+			timer.mSlack = slackUsecs / mUsecsPerTick;
+			timer.mTick = applySlack( timer.mDue, timer.mSlack );
+			timer.mRepeatMS = ( periodUsecs + 999 ) / 1000;
+			
+			fireAt = mTickUsecs + 
+				(uint32_t)( timer.mTick - mTicks ) * mUsecsPerTick;
+			
+			LOG_NOISE( "timer at %d ticks", timer.mTick );
+		}
+		
+		if ( slackUsecs != 0 )
+			mCoalescingStats.mSlackTimers++;
+		
+		addTimerNode( timer );
+		
+		// The service thread may be asleep until later than this
+		if ( mStarted and fireAt < mNextService )
+		{
+			mNextService = fireAt;
+			wake = true;
 		}
-		++i;
 	}
+	
+	if ( wake )
+		TimerManager::getInstance()->wakeService();
 }
 
-void Timer::removeTimedEvent( Event *ev )
+void Timer::removeTimedEvent( Event::Id eventId,
+							  IEventDispatcher *dispatcher )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	TimerNode timer;
+	DebugAutoLock( mMutex );
+	waitForSend();
+	removeNodes( eventId, dispatcher, NULL );
+}
+
+void Timer::removeTimedEvent( Event *ev )
+{
+	TRACE_BEGIN( LOG_LVL_NOISE );
 	
 	DebugAutoLock( mMutex );
+	waitForSend();
 
-	JetHead::list<TimerNode>::iterator node = mList.begin();
-	while (node != mList.end())
+	// Only the nodes in ev's bucket can be for ev
+	TimerNode *node = mEventHash[ hashEvent( ev ) ];
+	
+	while ( node != NULL )
 	{
-		// Cast the node as a TimerNode
-		timer = *node;
+		TimerNode *next = node->mHashNext;
 		
-		// Check if the timer node has an event for the dispatcher
-		// specified
-		if ( (Event*)timer.mEvent == ev )
-		{
-			node = node.erase();
-			continue;
-		}
-		++node;
-	}	
+		if ( (Event*)node->mEvent == ev )
+			freeNode( node );
+		
+		node = next;
+	}
+	
+	// Or it may be due and waiting to be sent
+	for ( unsigned i = 0; i < mExpired.size(); i++ )
+	{
+		if ( (Event*)mExpired[ i ].mEvent == ev )
+			mExpired[ i ].mDispatcher = NULL;
+	}
 }
 
 void Timer::removeAgentsByReceiver( void* receiver,
@@ -411,26 +682,67 @@ void Timer::removeAgentsByReceiver( void* receiver,
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 	
-	TimerNode timer;
 	DebugAutoLock( mMutex );
+	waitForSend();
+	removeNodes( Event::kInvalidEventId, dispatcher, receiver );
+}
 
-	JetHead::list<TimerNode>::iterator i = mList.begin();
-	while (i != mList.end())
+/*
+ * Does ev, for evDispatcher, match what removeNodes was asked to remove?
+ */
+static bool matchEvent( Event *ev, IEventDispatcher *evDispatcher, 
+						Event::Id eventId, IEventDispatcher *dispatcher,
+						void *receiver )
+{
+	if ( evDispatcher != dispatcher )
+		return false;
+	
+	if ( receiver != NULL )
 	{
-		// Get the TimerNode
-		timer = *i;
+		return ( ev->getEventId() == Event::kAgentEventId and
+				 static_cast<EventAgent*>( ev )->getDeliveryTarget()
+				 == receiver );
+	}
+	
+	// Event::kInvalidEventId is a special id used to remove all
+	//  events for a dispatcher
+	return ( ev->getEventId() == eventId or 
+			 eventId == Event::kInvalidEventId );
+}
 
-		if ( timer.mEvent->getEventId() == Event::kAgentEventId and
-			 timer.mDispatcher == dispatcher )
+void Timer::removeNodes( Event::Id eventId, IEventDispatcher *dispatcher,
+						 void *receiver )
+{
+	// Every event node is in the hash, so that is all we have to look at
+	for ( unsigned bucket = 0; bucket < mHashSize; bucket++ )
+	{
+		TimerNode *node = mEventHash[ bucket ];
+		
+		while ( node != NULL )
 		{
-			EventAgent* agent = static_cast<EventAgent*>( (Event*)timer.mEvent );
-			if (agent->getDeliveryTarget() == receiver)
+			TimerNode *next = node->mHashNext;
+			
+			if ( matchEvent( node->mEvent, node->mDispatcher, eventId, 
+							 dispatcher, receiver ) )
 			{
-				i = i.erase();
-				continue;
+				freeNode( node );
 			}
+			
+			node = next;
+		}
+	}
+	
+	// Events that are due but not sent yet are cancelled too
+	for ( unsigned i = 0; i < mExpired.size(); i++ )
+	{
+		ExpiredTimer &expired = mExpired[ i ];
+		
+		if ( expired.mDispatcher != NULL and
+			 matchEvent( expired.mEvent, expired.mDispatcher, eventId,
+						 dispatcher, receiver ) )
+		{
+			expired.mDispatcher = NULL;
 		}
-		++i;
 	}
 }
 
@@ -438,27 +750,265 @@ void Timer::addTimerNode( const TimerNode& newTimer )
 {
 	TRACE_BEGIN( LOG_LVL_NOISE );
 
-	int32_t diff;
-	bool inserted = false;
+	TimerNode *node = mFreeNodes;
+	
+	if ( node != NULL )
+	{
+		mFreeNodes = node->mNext;
+		mNumFree--;
+		*node = newTimer;
+	}
+	else
+	{
+		node = jh_new TimerNode( newTimer );
+	}
+	
+	mNumPending++;
+	
+	if ( node->mEvent != NULL )
+		hashNode( node );
+	
+	placeNode( node );
+}
 
-	// Add new timer node to the list (sorted)	
-	for (JetHead::list<TimerNode>::iterator i = mList.begin();
-		 i != mList.end(); ++i)
+void Timer::placeNode( TimerNode *node )
+{
+	if ( mTickless )
+	{
+		node->mHeapIndex = mHeap.size();
+		mHeap.push_back( node );
+		heapUp( node->mHeapIndex );
+		return;
+	}
+	
+	// How far past the next tick is it due?
+	uint32_t idx = node->mTick - ( mTicks + 1 );
+	TimerNode **slot;
+	
+	if ( (int32_t)idx < 0 )
+	{
+		// Already due, do it on the next tick
+		slot = &mWheel[ 0 ][ ( mTicks + 1 ) & kWheelMask ];
+	}
+	else if ( idx < ( 1U << kWheelBits ) )
+	{
+		slot = &mWheel[ 0 ][ node->mTick & kWheelMask ];
+	}
+	else if ( idx < ( 1U << ( 2 * kWheelBits ) ) )
+	{
+		slot = &mWheel[ 1 ][ ( node->mTick >> kWheelBits ) & kWheelMask ];
+	}
+	else if ( idx < ( 1U << ( 3 * kWheelBits ) ) )
 	{
-		TimerNode timer = *i;
-		diff = newTimer.mTick - timer.mTick;
+		slot = &mWheel[ 2 ][ ( node->mTick >> ( 2 * kWheelBits ) ) & 
+							 kWheelMask ];
+	}
+	else
+	{
+		slot = &mWheel[ 3 ][ ( node->mTick >> ( 3 * kWheelBits ) ) & 
+							 kWheelMask ];
+	}
+	
+	node->mSlot = slot;
+	node->mPrev = NULL;
+	node->mNext = *slot;
+	
+	if ( *slot != NULL )
+		(*slot)->mPrev = node;
+	
+	*slot = node;
+}
+
+void Timer::unlinkNode( TimerNode *node )
+{
+	if ( mTickless )
+	{
+		unsigned index = node->mHeapIndex;
+		unsigned last = mHeap.size() - 1;
+		
+		if ( index == kNotInHeap )
+			return;
 		
-		if ( diff < 0 )
+		// Fill the hole with the last node and move that into place
+		node->mHeapIndex = kNotInHeap;
+		if ( index != last )
 		{
-			i.insertBefore(newTimer);			
-			inserted = true;
-			break;
+			mHeap[ index ] = mHeap[ last ];
+			mHeap[ index ]->mHeapIndex = index;
+		}
+		
+		mHeap.erase( last );
+		
+		if ( index < last )
+		{
+			heapDown( index );
+			heapUp( index );
+		}
+		return;
+	}
+	
+	if ( node->mSlot == NULL )
+		return;
+	
+	if ( node->mPrev != NULL )
+		node->mPrev->mNext = node->mNext;
+	else
+		*node->mSlot = node->mNext;
+	
+	if ( node->mNext != NULL )
+		node->mNext->mPrev = node->mPrev;
+	
+	node->mSlot = NULL;
+	node->mPrev = node->mNext = NULL;
+}
+
+unsigned Timer::hashEvent( Event *ev )
+{
+	// Events are heap objects, so the low bits say little
+	uint32_t h = (uint32_t)( (jh_ptr_int_t)ev >> 4 ) * 2654435761U;
+	return ( h >> 8 ) & ( mHashSize - 1 );
+}
+
+void Timer::hashNode( TimerNode *node )
+{
+	// Keep the chains short by doubling the buckets when they average 
+	//  more than one node.
+	if ( mNumHashed >= mHashSize )
+	{
+		TimerNode **old = mEventHash;
+		unsigned oldSize = mHashSize;
+		
+		mHashSize *= 2;
+		mEventHash = jh_new TimerNode*[ mHashSize ];
+		memset( mEventHash, 0, mHashSize * sizeof( TimerNode* ) );
+		
+		for ( unsigned bucket = 0; bucket < oldSize; bucket++ )
+		{
+			TimerNode *n = old[ bucket ];
+			
+			while ( n != NULL )
+			{
+				TimerNode *next = n->mHashNext;
+				unsigned b = hashEvent( n->mEvent );
+				n->mHashNext = mEventHash[ b ];
+				mEventHash[ b ] = n;
+				n = next;
+			}
+		}
+		
+		delete [] old;
+	}
+	
+	unsigned bucket = hashEvent( node->mEvent );
+	node->mHashNext = mEventHash[ bucket ];
+	mEventHash[ bucket ] = node;
+	mNumHashed++;
+}
+
+void Timer::unhashNode( TimerNode *node )
+{
+	TimerNode **prev = &mEventHash[ hashEvent( node->mEvent ) ];
+	
+	while ( *prev != NULL )
+	{
+		if ( *prev == node )
+		{
+			*prev = node->mHashNext;
+			node->mHashNext = NULL;
+			mNumHashed--;
+			return;
 		}
+		
+		prev = &(*prev)->mHashNext;
 	}
+}
+
+void Timer::freeNode( TimerNode *node )
+{
+	unlinkNode( node );
+	mNumPending--;
+	
+	if ( node->mEvent != NULL )
+	{
+		unhashNode( node );
+		node->mEvent = NULL;
+	}
+	
+	if ( mNumFree < kMaxFreeNodes )
+	{
+		node->mNext = mFreeNodes;
+		mFreeNodes = node;
+		mNumFree++;
+	}
+	else
+	{
+		delete node;
+	}
+}
+
+unsigned Timer::cascade( int level, unsigned index )
+{
+	TimerNode *node = mWheel[ level ][ index ];
+	mWheel[ level ][ index ] = NULL;
+	
+	// Every node here is due within the next turn of the wheel below, 
+	//  so placing it again moves it down.
+	while ( node != NULL )
+	{
+		TimerNode *next = node->mNext;
+		placeNode( node );
+		node = next;
+	}
+	
+	return index;
+}
+
+void Timer::heapUp( unsigned index )
+{
+	TimerNode *node = mHeap[ index ];
 	
-	if ( not inserted )
+	while ( index > 0 )
 	{
-		mList.push_back( newTimer );
+		unsigned parent = ( index - 1 ) / 2;
+		
+		if ( mHeap[ parent ]->mDeadline <= node->mDeadline )
+			break;
+		
+		mHeap[ index ] = mHeap[ parent ];
+		mHeap[ index ]->mHeapIndex = index;
+		index = parent;
 	}
+	
+	mHeap[ index ] = node;
+	node->mHeapIndex = index;
 }
 
+void Timer::heapDown( unsigned index )
+{
+	TimerNode *node = mHeap[ index ];
+	unsigned size = mHeap.size();
+	
+	while ( true )
+	{
+		unsigned child = 2 * index + 1;
+		
+		if ( child >= size )
+			break;
+		
+		if ( child + 1 < size and 
+			 mHeap[ child + 1 ]->mDeadline < mHeap[ child ]->mDeadline )
+		{
+			child++;
+		}
+		
+		if ( node->mDeadline <= mHeap[ child ]->mDeadline )
+			break;
+		
+		mHeap[ index ] = mHeap[ child ];
+		mHeap[ index ]->mHeapIndex = index;
+		index = child;
+	}
+	
+	mHeap[ index ] = node;
+	node->mHeapIndex = index;
+}
@@ -28,6 +28,7 @@
 #include "Timer.h"
 #include "TimerManager.h"
 
+#include "TimeUtils.h"
 #include "jh_memory.h"
 #include "jh_types.h"
 #include "logging.h"
@@ -41,7 +42,13 @@ TimerManager *TimerManager::getInstance()
 {
 	TRACE_BEGIN(LOG_LVL_INFO);
 	if (mSingleton == NULL) 
+	{
 		mSingleton = jh_new TimerManager;
+		
+		// The default timer adds itself to us, so it can't be made
+		//  until mSingleton is set
+		mSingleton->mDefaultTimer = jh_new Timer(kMsPerTick, false);
+	}
 	return mSingleton; 
 }
 
@@ -56,22 +63,35 @@ void TimerManager::destroyManager()
 }
 
 TimerManager::TimerManager()
-:	mMutex( true )
+:	mMutex( "TimerManager", true ),
+	mServicing( NULL ),
+	mWoken( false )
 {
 	TRACE_BEGIN(LOG_LVL_NOTICE);
 	
 	if (mSingleton != NULL)
 		LOG_ERR_FATAL("Illegal creation of TimerManager, use getInstance()");
 	
-	mDefaultTimer = jh_new Timer(kMsPerTick, false);
+	mServiceThread = jh_new Runnable<TimerManager>("timerService", this,
+											&TimerManager::serviceHandler);
+	mServiceThread->Start();
 };
 
 TimerManager::~TimerManager()
 {
 	TRACE_BEGIN(LOG_LVL_NOTICE);
 	
-	// Release reference to default timer
+	// Release reference to default timer and the shared ones
 	mDefaultTimer = NULL;
+	mSharedTimers.clear();
+	
+	mWakeLock.Lock();
+	mServiceThread->Stop();
+	mWakeup.Signal();
+	mWakeLock.Unlock();
+	
+	mServiceThread->Join();
+	delete mServiceThread;
 	
 	// At this point all outstanding timers should be
 	// gone.  If we still have a timer in our list then
@@ -93,20 +113,26 @@ Timer* TimerManager::getTimer(int tickTimeMs)
 {
 	TRACE_BEGIN(LOG_LVL_NOISE);
 	
-	// Lock mutex while accessing/modifying mTimers vector
+	// A Timer given a negative tick time uses kMsPerTick
+	if (tickTimeMs < 0 or tickTimeMs == kMsPerTick)
+		return mDefaultTimer;
+	
+	// Lock mutex while accessing/modifying mSharedTimers vector
 	AutoLock l(mMutex);
 	
-	for (unsigned i = 0; i < mTimers.size(); ++i)
+	for (unsigned i = 0; i < mSharedTimers.size(); ++i)
 	{
-		if (mTimers[i]->getTickTime() == tickTimeMs)
+		if (mSharedTimers[i]->getTickTime() == tickTimeMs)
 		{
-			return mTimers[i];
+			return mSharedTimers[i];
 		}
 	}
 	
-	// We didn't find a timer with the specified tick time so
-	// we need to create a new one and give it to the user.
-	Timer* newTimer = jh_new Timer(tickTimeMs);
+	// We didn't find a timer with the specified tick time so we need
+	// to create a new one.  Keep it for the next caller, and don't
+	// let anyone stop it from under the others.
+	Timer* newTimer = jh_new Timer(tickTimeMs, false);
+	mSharedTimers.push_back(newTimer);
 	
 	return newTimer;
 }
@@ -172,6 +198,7 @@ void TimerManager::addTimer(Timer* timer)
 	}
 	
 	mTimers.push_back(timer);
+	wakeService();
 }
 
 void TimerManager::removeTimer(Timer* timer)
@@ -188,7 +215,72 @@ void TimerManager::removeTimer(Timer* timer)
 		if (mTimers[i] == timer)
 		{
 			mTimers.erase(i);
-			return;
+			break;
+		}
+	}
+	
+	// The service thread may be in the middle of running it
+	while (mServicing == timer and 
+		   not (*mServiceThread == *Thread::GetCurrent()))
+	{
+		mServiced.Wait(mMutex);
+	}
+	
+	// The vector moved under the service thread, make it look again
+	wakeService();
+}
+
+void TimerManager::wakeService()
+{
+	AutoLock l(mWakeLock);
+	mWoken = true;
+	mWakeup.Signal();
+}
+
+void TimerManager::serviceHandler()
+{
+	TRACE_BEGIN(LOG_LVL_INFO);
+	
+	while (!mServiceThread->CheckStop())
+	{
+		uint64_t next = Timer::kNever;
+		
+		mMutex.Lock();
+		
+		// Timers are run with mMutex released, so their callbacks can
+		//  use us.  If the vector changes meanwhile we will be woken
+		//  to go round again.
+		for (unsigned i = 0; i < mTimers.size(); ++i)
+		{
+			Timer *timer = mTimers[i];
+			
+			mServicing = timer;
+			mMutex.Unlock();
+			
+			uint64_t due = timer->service(TimeUtils::getMonotonicUsecs());
+			
+			mMutex.Lock();
+			mServicing = NULL;
+			mServiced.Broadcast();
+			
+			if (due < next)
+				next = due;
+		}
+		
+		mMutex.Unlock();
+		
+		// Sleep until the first timeout of any Timer is due
+		mWakeLock.Lock();
+		
+		if (not mWoken and not mServiceThread->CheckStop())
+		{
+			if (next == Timer::kNever)
+				mWakeup.Wait(mWakeLock);
+			else
+				mWakeup.WaitUntil(mWakeLock, next);
 		}
+		
+		mWoken = false;
+		mWakeLock.Unlock();
 	}
 }
@@ -17,12 +17,14 @@ CFLAGS_PROG_$(DIR) += -DPLATFORM_DARWIN
 endif
 
 $(DIR)_JH_COMMON_SRCS = CircularBuffer.cpp Thread.cpp \
-	EventQueue.cpp Selector.cpp Socket.cpp File.cpp \
+	EventQueue.cpp Selector.cpp SelectorGroup.cpp SelectorPoller.cpp \
+	Socket.cpp File.cpp IoEngine.cpp IoUring.cpp \
 	EventThread.cpp EventDispatcher.cpp Timer.cpp jh_memory.cpp \
 	AppArgs.cpp URI.cpp JetHead.cpp FdReaderWriter.cpp \
 	HttpHeaderBase.cpp HttpHeader.cpp HttpRequest.cpp HttpResponse.cpp \
 	HttpAgent.cpp logging.cpp MulticastSocket.cpp \
-	Allocator.cpp Condition.cpp Mutex.cpp Regex.cpp Path.cpp
+	Allocator.cpp ClockSource.cpp Condition.cpp Mutex.cpp Regex.cpp Path.cpp \
+	Fiber.cpp TaskExecutor.cpp TimeUtils.cpp
 
 SRCS_libjhcommon := $($(DIR)_JH_COMMON_SRCS)
 
@@ -39,7 +39,8 @@
 class TestCase
 {
 public:
-	TestCase( const char *thread_name ) : mThread( thread_name, this, &TestCase::Run ) 
+	TestCase( const char *thread_name ) : mTestComplete( false ), 
+		mTestPassed( false ), mThread( thread_name, this, &TestCase::Run ) 
 	{
 	}
 	
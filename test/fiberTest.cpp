@@ -0,0 +1,707 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Fiber.h"
+#include "Socket.h"
+#include "CircularBuffer.h"
+#include "HttpAgent.h"
+#include "TimeUtils.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+using namespace JetHead;
+
+class FiberTest : public TestCase
+{
+public:
+	FiberTest( int test_id ) : TestCase( "Fiber" ), mTest( test_id ),
+		mSelector( "fibers" ), mFibers( &mSelector ), mErrors( 0 )
+	{
+		char name[ 32 ];
+		
+		sprintf( name, "Fiber Test %d", test_id );
+		SetTestName( name );
+	}
+	
+	virtual ~FiberTest() {}
+	
+	//! Counts a failure seen on a fiber, they can't throw TestFailed
+	void error( const char *what )
+	{
+		LOG_WARN( "%s", what );
+		__sync_fetch_and_add( &mErrors, 1 );
+	}
+	
+	bool onSelector() { return mSelector.isThreadCurrent(); }
+	
+	Selector *getSelector() { return &mSelector; }
+	FiberScheduler *getFibers() { return &mFibers; }
+	
+private:
+	void Run();
+	
+	void yieldAndSleep();
+	void echo();
+	void readTimeout();
+	void circularBuffer();
+	void http();
+	void recursiveWait();
+	
+	int mTest;
+	
+	Selector mSelector;
+	FiberScheduler mFibers;
+	
+	volatile int mErrors;
+};
+
+//! Counts up with a yield in between, see yieldAndSleep
+struct Counter
+{
+	Counter( FiberTest *test, volatile int &count ) :
+		mTest( test ), mCount( count ) {}
+	
+	void operator()()
+	{
+		if ( not mTest->onSelector() )
+			mTest->error( "Not on the selector's thread" );
+		
+		for ( int i = 0; i < 10; i++ )
+		{
+			Fiber::yield();
+			mCount++;
+		}
+		
+		Fiber::sleep( 100 );
+		mCount++;
+	}
+	
+	FiberTest *mTest;
+	volatile int &mCount;
+};
+
+void FiberTest::yieldAndSleep()
+{
+	const int kFibers = 100;
+	
+	volatile int count = 0;
+	JetHead::vector<SmartPtr<Fiber> > fibers;
+	
+	uint64_t start = TimeUtils::getMonotonicUsecs();
+	
+	for ( int i = 0; i < kFibers; i++ )
+		fibers.push_back( mFibers.spawnCall( Counter( this, count ) ) );
+	
+	for ( int i = 0; i < kFibers; i++ )
+		fibers[ i ]->join();
+	
+	uint64_t elapsed = TimeUtils::getMonotonicUsecs() - start;
+	
+	LOG_NOTICE( "%d fibers took %d ms", kFibers, (int)( elapsed / 1000 ) );
+	
+	if ( count != kFibers * 11 or mFibers.getNumFibers() != 0 )
+		TestFailed( "Counted %d", count );
+	
+	// The sleeps overlap
+	if ( elapsed < 100000 or elapsed > 2000000 )
+		TestFailed( "Took %d ms", (int)( elapsed / 1000 ) );
+}
+
+//! Echoes what it reads until the other end closes
+struct Echo
+{
+	Echo( Socket *sock ) : mSock( sock ) {}
+	
+	void operator()()
+	{
+		char buf[ 256 ];
+		int res;
+		
+		while ( ( res = mSock->read( buf, sizeof( buf ) ) ) > 0 )
+		{
+			if ( mSock->write( buf, res ) != res )
+				break;
+		}
+		
+		delete mSock;
+	}
+	
+	Socket *mSock;
+};
+
+//! Accepts count connections, echoing each in a fiber of its own
+struct Acceptor
+{
+	Acceptor( FiberTest *test, ServerSocket *server, int count, 
+			  bool echo = true ) :
+		mTest( test ), mServer( server ), mCount( count ), mEcho( echo ) {}
+	
+	void operator()()
+	{
+		for ( int i = 0; i < mCount; i++ )
+		{
+			Socket *sock = mServer->accept();
+			
+			if ( sock == NULL )
+			{
+				mTest->error( "Accept failed" );
+				return;
+			}
+			
+			if ( mEcho )
+				mTest->getFibers()->spawnCall( Echo( sock ) );
+			else
+			{
+				// Never answer, but keep it open a while
+				Fiber::sleep( 1500 );
+				delete sock;
+			}
+		}
+	}
+	
+	FiberTest *mTest;
+	ServerSocket *mServer;
+	int mCount;
+	bool mEcho;
+};
+
+//! Connects, sends a message and checks that it comes back
+struct EchoClient
+{
+	EchoClient( FiberTest *test, const Socket::Address &addr, int id ) :
+		mTest( test ), mAddr( addr ), mId( id ) {}
+	
+	void operator()()
+	{
+		Socket sock;
+		char msg[ 64 ];
+		char buf[ 64 ];
+		
+		if ( sock.connect( mAddr, 5 ) != 0 )
+		{
+			mTest->error( "Connect failed" );
+			return;
+		}
+		
+		sock.setReadTimeout( 5 );
+		
+		for ( int round = 0; round < 3; round++ )
+		{
+			int len = sprintf( msg, "hello from client %d round %d", mId, 
+							   round );
+			int got = 0;
+			
+			if ( sock.write( msg, len ) != len )
+			{
+				mTest->error( "Write failed" );
+				return;
+			}
+			
+			while ( got < len )
+			{
+				int res = sock.read( buf + got, len - got );
+				
+				if ( res <= 0 )
+				{
+					mTest->error( "Read failed" );
+					return;
+				}
+				
+				got += res;
+			}
+			
+			if ( memcmp( msg, buf, len ) != 0 )
+				mTest->error( "Wrong echo" );
+		}
+	}
+	
+	FiberTest *mTest;
+	Socket::Address mAddr;
+	int mId;
+};
+
+static bool listenLocal( ServerSocket &server, Socket::Address &addr, 
+						 int backlog )
+{
+	if ( server.bind( Socket::Address( 0 ) ) != 0 or 
+		 server.listen( backlog ) != 0 )
+		return false;
+	
+	server.getLocalAddress( addr );
+	addr.setAddress( "127.0.0.1" );
+	return true;
+}
+
+void FiberTest::echo()
+{
+	const int kClients = 100;
+	
+	ServerSocket server;
+	Socket::Address addr;
+	
+	if ( not listenLocal( server, addr, kClients ) )
+		TestFailed( "listen failed" );
+	
+	uint64_t start = TimeUtils::getMonotonicUsecs();
+	
+	mFibers.spawnCall( Acceptor( this, &server, kClients ) );
+	
+	for ( int i = 0; i < kClients; i++ )
+		mFibers.spawnCall( EchoClient( this, addr, i ) );
+	
+	mFibers.waitForAll();
+	
+	int took = ( TimeUtils::getMonotonicUsecs() - start ) / 1000;
+	
+	LOG_NOTICE( "%d echo sessions took %d ms", kClients, took );
+	
+	if ( mErrors != 0 )
+		TestFailed( "%d errors", mErrors );
+	
+	// Loopback sessions on one thread, nothing should be waiting long
+	if ( took > 5000 )
+		TestFailed( "%d echo sessions took %d ms", kClients, took );
+}
+
+//! Counts sleeps until told to stop
+struct Ticker
+{
+	Ticker( volatile int &ticks, volatile bool &stop ) : 
+		mTicks( ticks ), mStop( stop ) {}
+	
+	void operator()()
+	{
+		while ( not mStop )
+		{
+			Fiber::sleep( 10 );
+			mTicks++;
+		}
+	}
+	
+	volatile int &mTicks;
+	volatile bool &mStop;
+};
+
+//! Reads from a server that never answers
+struct SilentClient
+{
+	SilentClient( FiberTest *test, const Socket::Address &addr, 
+				  volatile bool &stop ) :
+		mTest( test ), mAddr( addr ), mStop( stop ) {}
+	
+	void operator()()
+	{
+		Socket sock;
+		char buf[ 16 ];
+		
+		if ( sock.connect( mAddr, 5 ) != 0 )
+			mTest->error( "Connect failed" );
+		else
+		{
+			uint64_t start = TimeUtils::getMonotonicUsecs();
+			
+			sock.setReadTimeout( 1 );
+			
+			if ( sock.read( buf, sizeof( buf ) ) != -1 )
+				mTest->error( "Read didn't time out" );
+			
+			if ( TimeUtils::getMonotonicUsecs() - start < 900000 )
+				mTest->error( "Read timed out early" );
+		}
+		
+		mStop = true;
+	}
+	
+	FiberTest *mTest;
+	Socket::Address mAddr;
+	volatile bool &mStop;
+};
+
+void FiberTest::readTimeout()
+{
+	ServerSocket server;
+	Socket::Address addr;
+	volatile int ticks = 0;
+	volatile bool stop = false;
+	
+	if ( not listenLocal( server, addr, 4 ) )
+		TestFailed( "listen failed" );
+	
+	mFibers.spawnCall( Acceptor( this, &server, 1, false ) );
+	mFibers.spawnCall( SilentClient( this, addr, stop ) );
+	mFibers.spawnCall( Ticker( ticks, stop ) );
+	
+	mFibers.waitForAll();
+	
+	LOG_NOTICE( "%d ticks while reading", ticks );
+	
+	if ( mErrors != 0 )
+		TestFailed( "%d errors", mErrors );
+	
+	// The ticker went on while the read waited
+	if ( ticks < 20 )
+		TestFailed( "Only %d ticks", ticks );
+}
+
+//! Waits for a CircularBuffer to fill
+struct BufferReader
+{
+	BufferReader( FiberTest *test, CircularBuffer &buffer, int len, 
+				  uint32_t msecs, bool expect ) :
+		mTest( test ), mBuffer( buffer ), mLen( len ), mMsecs( msecs ),
+		mExpect( expect ) {}
+	
+	void operator()()
+	{
+		uint64_t start = TimeUtils::getMonotonicUsecs();
+		
+		mBuffer.waitForData( mLen, mMsecs );
+		
+		bool got = ( mBuffer.getLength() >= mLen );
+		
+		if ( got != mExpect )
+			mTest->error( got ? "Got unexpected data" : "Data didn't come" );
+		
+		if ( not got and 
+			 TimeUtils::getMonotonicUsecs() - start < mMsecs * 900ULL )
+			mTest->error( "Timed out early" );
+		
+		if ( got )
+			mBuffer.read( NULL, mLen );
+	}
+	
+	FiberTest *mTest;
+	CircularBuffer &mBuffer;
+	int mLen;
+	uint32_t mMsecs;
+	bool mExpect;
+};
+
+//! Writes to a CircularBuffer after a while
+struct BufferWriter
+{
+	BufferWriter( CircularBuffer &buffer, int len ) : 
+		mBuffer( buffer ), mLen( len ) {}
+	
+	void operator()()
+	{
+		uint8_t data[ 64 ];
+		
+		memset( data, 'x', sizeof( data ) );
+		Fiber::sleep( 50 );
+		mBuffer.write( data, mLen );
+	}
+	
+	CircularBuffer &mBuffer;
+	int mLen;
+};
+
+void FiberTest::circularBuffer()
+{
+	CircularBuffer fromThread( 1024 );
+	CircularBuffer fromFiber( 1024 );
+	CircularBuffer never( 1024 );
+	volatile int ticks = 0;
+	volatile bool stop = false;
+	uint8_t data[ 16 ];
+	
+	memset( data, 'y', sizeof( data ) );
+	
+	mFibers.spawnCall( BufferReader( this, fromThread, 16, 5000, true ) );
+	mFibers.spawnCall( BufferReader( this, fromFiber, 32, 5000, true ) );
+	SmartPtr<Fiber> timeout = 
+		mFibers.spawnCall( BufferReader( this, never, 8, 200, false ) );
+	mFibers.spawnCall( BufferWriter( fromFiber, 32 ) );
+	mFibers.spawnCall( Ticker( ticks, stop ) );
+	
+	// Another thread
+	usleep( 100000 );
+	fromThread.write( data, sizeof( data ) );
+	
+	timeout->join();
+	stop = true;
+	mFibers.waitForAll();
+	
+	if ( mErrors != 0 )
+		TestFailed( "%d errors", mErrors );
+	
+	if ( ticks < 5 )
+		TestFailed( "Only %d ticks", ticks );
+	
+	if ( fromThread.getLength() != 0 or fromFiber.getLength() != 0 )
+		TestFailed( "Data left" );
+}
+
+//! Answers one request on each connection with a fixed body
+struct HttpServer
+{
+	HttpServer( FiberTest *test, Socket *sock ) : 
+		mTest( test ), mSock( sock ) {}
+	
+	void operator()()
+	{
+		JHSTD::string request;
+		char buf[ 512 ];
+		
+		while ( request.find( "\r\n\r\n" ) == JHSTD::string::npos )
+		{
+			int res = mSock->read( buf, sizeof( buf ) );
+			
+			if ( res <= 0 )
+			{
+				mTest->error( "Request read failed" );
+				delete mSock;
+				return;
+			}
+			
+			request.append( buf, res );
+		}
+		
+		const char *reply = "HTTP/1.1 200 OK\r\n"
+			"Content-Length: 11\r\n"
+			"\r\n"
+			"hello fiber";
+		
+		mSock->write( reply, strlen( reply ) );
+		delete mSock;
+	}
+	
+	FiberTest *mTest;
+	Socket *mSock;
+};
+
+struct HttpAcceptor
+{
+	HttpAcceptor( FiberTest *test, ServerSocket *server, int count ) :
+		mTest( test ), mServer( server ), mCount( count ) {}
+	
+	void operator()()
+	{
+		for ( int i = 0; i < mCount; i++ )
+		{
+			Socket *sock = mServer->accept();
+			
+			if ( sock == NULL )
+			{
+				mTest->error( "Accept failed" );
+				return;
+			}
+			
+			mTest->getFibers()->spawnCall( HttpServer( mTest, sock ) );
+		}
+	}
+	
+	FiberTest *mTest;
+	ServerSocket *mServer;
+	int mCount;
+};
+
+class StringBodyHandler : public BodyHandler
+{
+public:
+	void handleData( const char *buf, int len ) { mBody.append( buf, len ); }
+	
+	int handleSocket( Socket &sock, int len )
+	{
+		char buf[ 256 ];
+		int total = 0;
+		
+		while ( total < len )
+		{
+			int res = sock.read( buf, 
+								 std::min( len - total, (int)sizeof( buf ) ) );
+			
+			if ( res <= 0 )
+				return -1;
+			
+			mBody.append( buf, res );
+			total += res;
+		}
+		
+		return total;
+	}
+	
+	JHSTD::string mBody;
+};
+
+//! Gets a page with the blocking HttpAgent
+struct HttpClient
+{
+	HttpClient( FiberTest *test, const JHSTD::string &uri ) :
+		mTest( test ), mUri( uri ) {}
+	
+	void operator()()
+	{
+		HttpAgent agent;
+		HttpResponse res;
+		StringBodyHandler body;
+		
+		agent.get( URI( mUri ), res, &body );
+		
+		if ( res.getResponseCode() != 200 or body.mBody != "hello fiber" )
+			mTest->error( "Wrong response" );
+	}
+	
+	FiberTest *mTest;
+	JHSTD::string mUri;
+};
+
+void FiberTest::http()
+{
+	const int kClients = 50;
+	
+	ServerSocket server;
+	Socket::Address addr;
+	char uri[ 64 ];
+	
+	if ( not listenLocal( server, addr, kClients ) )
+		TestFailed( "listen failed" );
+	
+	sprintf( uri, "http://127.0.0.1:%d/fiber", addr.getPort() );
+	
+	mFibers.spawnCall( HttpAcceptor( this, &server, kClients ) );
+	
+	for ( int i = 0; i < kClients; i++ )
+		mFibers.spawnCall( HttpClient( this, uri ) );
+	
+	mFibers.waitForAll();
+	
+	if ( mErrors != 0 )
+		TestFailed( "%d errors", mErrors );
+}
+
+//! Waits with a recursive lock held twice, see recursiveWait
+struct RecursiveWaiter
+{
+	RecursiveWaiter( FiberTest *test, Mutex &lock, Condition &cond,
+					 volatile bool &waiting, volatile bool &signalled ) :
+		mTest( test ), mLock( lock ), mCond( cond ), mWaiting( waiting ),
+		mSignalled( signalled ) {}
+	
+	void operator()()
+	{
+		AutoLock outer( mLock );
+		AutoLock inner( mLock );
+		
+		mWaiting = true;
+		
+		while ( not mSignalled )
+		{
+			if ( not mCond.Wait( mLock, 2000 ) )
+			{
+				mTest->error( "Wait with a recursive lock timed out" );
+				break;
+			}
+		}
+	}
+	
+	FiberTest *mTest;
+	Mutex &mLock;
+	Condition &mCond;
+	volatile bool &mWaiting;
+	volatile bool &mSignalled;
+};
+
+/*
+ * A fiber waiting on a Condition gives up every level of a recursive
+ *  lock, so another thread can take it to signal.
+ */
+void FiberTest::recursiveWait()
+{
+	Mutex lock( true );
+	Condition cond;
+	volatile bool waiting = false;
+	volatile bool signalled = false;
+	
+	mFibers.spawnCall( RecursiveWaiter( this, lock, cond, waiting, 
+										signalled ) );
+	
+	while ( not waiting )
+		usleep( 1000 );
+	
+	{
+		AutoLock l( lock );
+		signalled = true;
+		cond.Signal();
+	}
+	
+	mFibers.waitForAll();
+	
+	if ( mErrors != 0 )
+		TestFailed( "%d errors", mErrors );
+}
+
+void FiberTest::Run()
+{
+	switch ( mTest )
+	{
+		case 1:
+			yieldAndSleep();
+			break;
+		case 2:
+			echo();
+			break;
+		case 3:
+			readTimeout();
+			break;
+		case 4:
+			circularBuffer();
+			break;
+		case 5:
+			http();
+			break;
+		case 6:
+			recursiveWait();
+			break;
+	}
+	
+	TestPassed();
+}
+
+int main( int argc, char*argv[] )
+{	
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 6 ];
+	
+	for ( int i = 0; i < 6; i++ )
+		test_set[ i ] = jh_new FiberTest( i + 1 );
+	
+	runner.RunAll( test_set, 6 );
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "IoEngine.h"
+#include "EventThread.h"
+#include "Condition.h"
+#include "Socket.h"
+#include "File.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+using namespace JetHead;
+
+class IoTest : public TestCase
+{
+public:
+	IoTest( IoEngine *engine, int number ) : TestCase( "IoTest" ), 
+		mEngine( engine ), mTestNum( number ), mServer( NULL ), 
+		mAccepted( NULL ), mHandler( this, &IoTest::handleIo, &mThread )
+	{
+		const char *names[] = { "Pipe", "File Offsets", "Batch", 
+								"Accept", "Cancel" };
+		
+		mName = names[ number - 1 ];
+		mName += engine->isUring() ? " (io_uring)" : " (selector)";
+		SetTestName( mName.c_str() );
+	}
+	
+	virtual ~IoTest() {}
+	
+private:
+	//! What we got from an AsyncIoEvent
+	struct Result
+	{
+		AsyncIoEvent::Op mOp;
+		int mResult;
+		int mError;
+		jh_ptr_int_t mPrivateData;
+		bool mOnThread;
+	};
+	
+	void handleIo( AsyncIoEvent *ev )
+	{
+		Result r;
+		r.mOp = ev->getOp();
+		r.mResult = ev->getResult();
+		r.mError = ev->getError();
+		r.mPrivateData = ev->getPrivateData();
+		r.mOnThread = mThread.isThreadCurrent();
+		
+		AutoLock l( mLock );
+		
+		if ( r.mOp == AsyncIoEvent::kAccept and mServer != NULL )
+			mAccepted = mServer->acceptComplete( ev );
+		
+		mResults.push_back( r );
+		mCondition.Signal();
+	}
+	
+	//! Wait for n results in total
+	bool waitFor( unsigned n )
+	{
+		AutoLock l( mLock );
+		
+		while ( mResults.size() < n )
+		{
+			if ( not mCondition.Wait( mLock, 5000 ) )
+				return false;
+		}
+		
+		return true;
+	}
+	
+	//! Check result i
+	void checkResult( unsigned i, AsyncIoEvent::Op op, int res, 
+					  jh_ptr_int_t pd )
+	{
+		Result &r = mResults[ i ];
+		
+		if ( r.mOp != op or r.mResult != res or r.mPrivateData != pd )
+		{
+			TestFailed( "Result %d: op %d res %d (%s) pd %d", i, r.mOp, 
+						r.mResult, strerror( r.mError ), (int)r.mPrivateData );
+		}
+		
+		if ( not r.mOnThread )
+			TestFailed( "Result %d on the wrong thread", i );
+	}
+	
+	void pipeTest()
+	{
+		int fds[ 2 ];
+		
+		if ( pipe( fds ) != 0 )
+			TestFailed( "pipe failed" );
+		
+		// The read is started first and has to wait for the write
+		char in[ 8 ] = { 0 };
+		
+		if ( mEngine->read( fds[ 0 ], in, sizeof( in ), -1, &mThread, 1 ) != 0 )
+			TestFailed( "read failed to start" );
+		
+		usleep( 10000 );
+		
+		if ( mEngine->getNumPending() != 1 )
+			TestFailed( "%d pending", mEngine->getNumPending() );
+		
+		if ( mEngine->write( fds[ 1 ], "hello", 5, -1, &mThread, 2 ) != 0 )
+			TestFailed( "write failed to start" );
+		
+		if ( not waitFor( 2 ) )
+			TestFailed( "Timed out" );
+		
+		// Either one can complete first
+		unsigned w = mResults[ 0 ].mOp == AsyncIoEvent::kWrite ? 0 : 1;
+		checkResult( w, AsyncIoEvent::kWrite, 5, 2 );
+		checkResult( 1 - w, AsyncIoEvent::kRead, 5, 1 );
+		
+		if ( memcmp( in, "hello", 5 ) != 0 )
+			TestFailed( "Read the wrong data" );
+		
+		// A closed write end gives end of file
+		close( fds[ 1 ] );
+		mEngine->read( fds[ 0 ], in, sizeof( in ), -1, &mThread, 3 );
+		
+		if ( not waitFor( 3 ) )
+			TestFailed( "Timed out on EOF" );
+		
+		checkResult( 2, AsyncIoEvent::kRead, 0, 3 );
+		close( fds[ 0 ] );
+		
+		if ( mEngine->read( -1, in, sizeof( in ), -1, &mThread ) != -1 or 
+			 errno != EBADF )
+		{
+			TestFailed( "read of a bad fd started" );
+		}
+	}
+	
+	void fileTest()
+	{
+		char name[] = "/tmp/ioEngineTestXXXXXX";
+		int fd = mkstemp( name );
+		
+		if ( fd < 0 )
+			TestFailed( "mkstemp failed" );
+		
+		unlink( name );
+		
+		// Write two blocks out of order, then read them back
+		if ( mEngine->write( fd, "world", 5, 5, &mThread, 1 ) != 0 or
+			 mEngine->write( fd, "hello", 5, 0, &mThread, 2 ) != 0 )
+		{
+			TestFailed( "write failed to start" );
+		}
+		
+		if ( not waitFor( 2 ) )
+			TestFailed( "Timed out on write" );
+		
+		char in[ 16 ] = { 0 };
+		mEngine->read( fd, in, sizeof( in ), 0, &mThread, 3 );
+		
+		if ( not waitFor( 3 ) )
+			TestFailed( "Timed out on read" );
+		
+		checkResult( 2, AsyncIoEvent::kRead, 10, 3 );
+		
+		if ( memcmp( in, "helloworld", 10 ) != 0 )
+			TestFailed( "Read the wrong data" );
+		
+		// Offset -1 uses, and moves, the file position
+		lseek( fd, 5, SEEK_SET );
+		mEngine->read( fd, in, 3, -1, &mThread, 4 );
+		
+		if ( not waitFor( 4 ) )
+			TestFailed( "Timed out on read" );
+		
+		checkResult( 3, AsyncIoEvent::kRead, 3, 4 );
+		
+		if ( memcmp( in, "wor", 3 ) != 0 or lseek( fd, 0, SEEK_CUR ) != 8 )
+			TestFailed( "Read at the wrong position" );
+		
+		close( fd );
+	}
+	
+	void batchTest()
+	{
+		static const int kNumPipes = 16;
+		int fds[ kNumPipes ][ 2 ];
+		char in[ kNumPipes ];
+		
+		mEngine->beginBatch();
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			if ( pipe( fds[ i ] ) != 0 )
+				TestFailed( "pipe failed" );
+			
+			mEngine->read( fds[ i ][ 0 ], &in[ i ], 1, -1, &mThread, i );
+		}
+		
+		mEngine->endBatch();
+		
+		mEngine->beginBatch();
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			static const char c = 'x';
+			mEngine->write( fds[ i ][ 1 ], &c, 1, -1, &mThread, 
+							kNumPipes + i );
+		}
+		
+		mEngine->endBatch();
+		
+		if ( not waitFor( kNumPipes * 2 ) )
+			TestFailed( "Timed out" );
+		
+		for ( int i = 0; i < kNumPipes * 2; i++ )
+		{
+			if ( mResults[ i ].mResult != 1 )
+				TestFailed( "Request %d failed", (int)mResults[ i ].mPrivateData );
+		}
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			if ( in[ i ] != 'x' )
+				TestFailed( "Pipe %d read the wrong data", i );
+			
+			close( fds[ i ][ 0 ] );
+			close( fds[ i ][ 1 ] );
+		}
+	}
+	
+	void acceptTest()
+	{
+		// This one goes through the default engine
+		ServerSocket server;
+		mServer = &server;
+		
+		if ( server.bind( Socket::Address( 0 ) ) != 0 or 
+			 server.listen( 4 ) != 0 )
+		{
+			TestFailed( "listen failed" );
+		}
+		
+		if ( server.acceptAsync( &mThread, 1 ) != 0 )
+			TestFailed( "acceptAsync failed" );
+		
+		Socket::Address addr;
+		server.getLocalAddress( addr );
+		addr.setAddress( "127.0.0.1" );
+		
+		Socket client;
+		
+		if ( client.connect( addr ) != 0 )
+			TestFailed( "connect failed" );
+		
+		if ( not waitFor( 1 ) )
+			TestFailed( "Timed out on accept" );
+		
+		if ( mResults[ 0 ].mResult < 0 )
+			TestFailed( "accept failed: %s", strerror( mResults[ 0 ].mError ) );
+		
+		Socket *conn = mAccepted;
+		
+		if ( conn == NULL )
+			TestFailed( "acceptComplete failed" );
+		
+		char in[ 4 ];
+		conn->readAsync( in, 4, &mThread, 2 );
+		client.writeAsync( "ping", 4, &mThread, 3 );
+		
+		if ( not waitFor( 3 ) )
+			TestFailed( "Timed out on ping" );
+		
+		if ( memcmp( in, "ping", 4 ) != 0 )
+			TestFailed( "Read the wrong data" );
+		
+		// Writes to a closed connection fail rather than raise SIGPIPE
+		conn->close();
+		delete conn;
+		usleep( 10000 );
+		
+		for ( int i = 0; i < 2; i++ )
+			client.writeAsync( "ping", 4, &mThread, 4 + i );
+		
+		if ( not waitFor( 5 ) )
+			TestFailed( "Timed out on closed write" );
+		
+		if ( mResults[ 3 ].mResult != -1 and mResults[ 4 ].mResult != -1 )
+			TestFailed( "Write to a closed socket succeeded" );
+	}
+	
+	void cancelTest()
+	{
+		IoEngine *engine = jh_new IoEngine( "Cancel", mEngine->isUring() );
+		int fds[ 2 ];
+		char in[ 4 ];
+		
+		if ( pipe( fds ) != 0 )
+			TestFailed( "pipe failed" );
+		
+		engine->read( fds[ 0 ], in, sizeof( in ), -1, &mThread );
+		usleep( 10000 );
+		
+		if ( engine->getNumPending() != 1 )
+			TestFailed( "%d pending", engine->getNumPending() );
+		
+		// The read never completes and is dropped
+		delete engine;
+		usleep( 10000 );
+		
+		if ( not mResults.empty() )
+			TestFailed( "Cancelled request sent an event" );
+		
+		close( fds[ 0 ] );
+		close( fds[ 1 ] );
+	}
+	
+	void Run()
+	{
+		switch ( mTestNum )
+		{
+			case 1: pipeTest(); break;
+			case 2: fileTest(); break;
+			case 3: batchTest(); break;
+			case 4: acceptTest(); break;
+			case 5: cancelTest(); break;
+		}
+		
+		// Let the engines finish with mThread before it goes away
+		while ( mEngine->getNumPending() != 0 or 
+				IoEngine::getDefault()->getNumPending() != 0 )
+		{
+			usleep( 1000 );
+		}
+		
+		TestPassed();
+	}
+	
+	IoEngine *mEngine;
+	int mTestNum;
+	JHSTD::string mName;
+	
+	ServerSocket *mServer;
+	Socket *mAccepted;
+	
+	EventThread mThread;
+	EventMethod<IoTest, AsyncIoEvent> mHandler;
+	
+	Mutex mLock;
+	Condition mCondition;
+	JetHead::vector<Result> mResults;
+};
+
+int main( int argc, char *argv[] )
+{
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 10 ];
+	int numTests = 0;
+	
+	// The engine falls back to a selector without io_uring, in which
+	//  case both sets of tests use the selector.
+	IoEngine uringEngine( "UringEngine" );
+	IoEngine selectorEngine( "SelectorEngine", false );
+	IoEngine *engines[ 2 ] = { &uringEngine, &selectorEngine };
+	
+	for ( int i = 0; i < 2; i++ )
+	{
+		for ( int test = 1; test <= 5; test++ )
+		{
+			// Accept uses the default engine, so only run it once
+			if ( test == 4 and i == 1 )
+				continue;
+			
+			test_set[ numTests++ ] = jh_new IoTest( engines[ i ], test );
+		}
+	}
+	
+	runner.RunAll( test_set, numTests );
+
+	IoEngine::destroyDefault();
+	
+	return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Measures what locking costs.  Usage:
+ *
+ *   mutexBench [iterations] [threads]
+ *
+ * It times an uncontended lock and unlock of a Mutex, of a bare pthread
+ * mutex, and of a copy of the Mutex as it was before it lost its debug
+ * bookkeeping (an error checking pthread mutex that records its owner,
+ * file and line on every lock).  Then it times them with threads
+ * fighting over them, and the EventQueue and CircularBuffer, whose
+ * locks are on every event and every read and write, and state that is
+ * read far more than written under a Mutex, an RWLock and a SeqLock.
+ * Build with and without JH_MUTEX_DEBUG to compare the two kinds of 
+ * Mutex in use.
+ *
+ * A thread sits idle throughout, as glibc cheats on locking in a
+ * process that only has one thread.
+ */
+
+#include "Mutex.h"
+#include "Thread.h"
+#include "Condition.h"
+#include "EventQueue.h"
+#include "CircularBuffer.h"
+#include "TimeUtils.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+//! The Mutex as it used to be
+class CheckedMutex
+{
+public:
+	CheckedMutex() : mLockedBy( NULL ), mLockFile( NULL ), mLockLine( 0 )
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init( &attr );
+		pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_ERRORCHECK );
+		pthread_mutex_init( &mMutex, &attr );
+		pthread_mutexattr_destroy( &attr );
+	}
+	
+	~CheckedMutex() { pthread_mutex_destroy( &mMutex ); }
+	
+	void Lock()
+	{
+		if ( pthread_mutex_lock( &mMutex ) != 0 )
+			abort();
+		
+		mLockedBy = Thread::GetCurrent();
+		mLockFile = __FILE__;
+		mLockLine = __LINE__;
+	}
+	
+	void Unlock()
+	{
+		mLockedBy = NULL;
+		
+		if ( pthread_mutex_unlock( &mMutex ) != 0 )
+			abort();
+	}
+	
+private:
+	pthread_mutex_t mMutex;
+	Thread *mLockedBy;
+	const char *mLockFile;
+	int mLockLine;
+};
+
+class PlainMutex
+{
+public:
+	PlainMutex() { pthread_mutex_init( &mMutex, NULL ); }
+	~PlainMutex() { pthread_mutex_destroy( &mMutex ); }
+	
+	void Lock() { pthread_mutex_lock( &mMutex ); }
+	void Unlock() { pthread_mutex_unlock( &mMutex ); }
+	
+private:
+	pthread_mutex_t mMutex;
+};
+
+class Idler
+{
+public:
+	Idler() : mDone( false ), mThread( "idler", this, &Idler::run ) 
+	{
+		mThread.Start();
+	}
+	
+	~Idler()
+	{
+		mLock.Lock();
+		mDone = true;
+		mCond.Signal();
+		mLock.Unlock();
+		mThread.Join();
+	}
+	
+	void run()
+	{
+		AutoLock lock( mLock );
+		
+		while ( not mDone )
+			mCond.Wait( mLock );
+	}
+	
+private:
+	Mutex mLock;
+	Condition mCond;
+	bool mDone;
+	Runnable<Idler> mThread;
+};
+
+static double nsecsSince( uint64_t start )
+{
+	return (double)( TimeUtils::getSystemMonotonicNsecs() - start );
+}
+
+template<class T>
+static double uncontended( int iterations )
+{
+	T lock;
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < iterations; i++ )
+	{
+		lock.Lock();
+		lock.Unlock();
+	}
+	
+	return nsecsSince( start ) / iterations;
+}
+
+//! Threads taking turns incrementing a counter under a T
+template<class T>
+class Fight
+{
+public:
+	Fight( T &lock, int iterations, volatile int &counter ) 
+	:	mLock( lock ), mIterations( iterations ), mCounter( counter ),
+		mThread( "fight", this, &Fight::run ) {}
+	
+	void run()
+	{
+		for ( int i = 0; i < mIterations; i++ )
+		{
+			mLock.Lock();
+			mCounter++;
+			mLock.Unlock();
+		}
+	}
+	
+	T &mLock;
+	int mIterations;
+	volatile int &mCounter;
+	Runnable<Fight> mThread;
+};
+
+template<class T>
+static double contended( int iterations, int threads )
+{
+	T lock;
+	volatile int counter = 0;
+	JetHead::vector<Fight<T>*> fights;
+	
+	for ( int i = 0; i < threads; i++ )
+		fights.push_back( jh_new Fight<T>( lock, iterations, counter ) );
+	
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < threads; i++ )
+		fights[ i ]->mThread.Start();
+	
+	for ( int i = 0; i < threads; i++ )
+	{
+		fights[ i ]->mThread.Join();
+		delete fights[ i ];
+	}
+	
+	if ( counter != iterations * threads )
+		printf( "Lost %d increments\n", iterations * threads - counter );
+	
+	return nsecsSince( start ) / ( (double)iterations * threads );
+}
+
+struct BenchEvent : public Event
+{
+	BenchEvent() : Event( 1 ) {}
+	SMART_CASTABLE( 1 );
+};
+
+class Producer
+{
+public:
+	Producer( EventQueue &queue, int count ) 
+	:	mQueue( queue ), mCount( count ),
+		mThread( "producer", this, &Producer::run ) {}
+	
+	void run()
+	{
+		for ( int i = 0; i < mCount; i++ )
+			mQueue.SendEvent( jh_new BenchEvent() );
+	}
+	
+	EventQueue &mQueue;
+	int mCount;
+	Runnable<Producer> mThread;
+};
+
+static void eventQueue( int iterations, int threads )
+{
+	EventQueue queue;
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < iterations; i++ )
+	{
+		queue.SendEvent( jh_new BenchEvent() );
+		queue.PollEvent()->Release();
+	}
+	
+	printf( "EventQueue send and poll         %7.1f ns\n", 
+			nsecsSince( start ) / iterations );
+	
+	JetHead::vector<Producer*> producers;
+	
+	for ( int i = 0; i < threads; i++ )
+		producers.push_back( jh_new Producer( queue, iterations ) );
+	
+	start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < threads; i++ )
+		producers[ i ]->mThread.Start();
+	
+	for ( int i = 0; i < iterations * threads; i++ )
+		queue.WaitEvent()->Release();
+	
+	printf( "EventQueue %d producers          %7.1f ns/event\n", threads,
+			nsecsSince( start ) / ( (double)iterations * threads ) );
+	
+	for ( int i = 0; i < threads; i++ )
+	{
+		producers[ i ]->mThread.Join();
+		delete producers[ i ];
+	}
+}
+
+class Writer
+{
+public:
+	Writer( JetHead::CircularBuffer &buffer, int count ) 
+	:	mBuffer( buffer ), mCount( count ),
+		mThread( "writer", this, &Writer::run ) {}
+	
+	void run()
+	{
+		uint8_t data[ 64 ] = { 0 };
+		
+		for ( int i = 0; i < mCount; )
+		{
+			if ( mBuffer.write( data, sizeof( data ) ) > 0 )
+				i++;
+			else
+				mBuffer.waitForFreeSpace( sizeof( data ), 1000 );
+		}
+	}
+	
+	JetHead::CircularBuffer &mBuffer;
+	int mCount;
+	Runnable<Writer> mThread;
+};
+
+static void circularBuffer( int iterations )
+{
+	JetHead::CircularBuffer buffer( 4096 );
+	uint8_t data[ 64 ] = { 0 };
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < iterations; i++ )
+	{
+		buffer.write( data, sizeof( data ) );
+		buffer.read( data, sizeof( data ) );
+	}
+	
+	printf( "CircularBuffer 64 byte write+read %7.1f ns\n", 
+			nsecsSince( start ) / iterations );
+	
+	// One thread writing while this one reads
+	Writer writer( buffer, iterations );
+	int total = iterations * sizeof( data );
+	
+	start = TimeUtils::getSystemMonotonicNsecs();
+	writer.mThread.Start();
+	
+	while ( total > 0 )
+	{
+		int res = buffer.read( data, sizeof( data ) );
+		
+		if ( res == 0 )
+			buffer.waitForData( sizeof( data ), 1000 );
+		
+		total -= res;
+	}
+	
+	printf( "CircularBuffer across threads    %7.1f ns/write\n", 
+			nsecsSince( start ) / iterations );
+	
+	writer.mThread.Join();
+}
+
+struct Pair
+{
+	int mA;
+	int mB;
+};
+
+class MutexPair
+{
+public:
+	MutexPair() { mPair.mA = mPair.mB = 0; }
+	
+	Pair read() { AutoLock lock( mLock ); return mPair; }
+	void write( const Pair &pair ) { AutoLock lock( mLock ); mPair = pair; }
+	
+private:
+	Mutex mLock;
+	Pair mPair;
+};
+
+class RWLockPair
+{
+public:
+	RWLockPair() { mPair.mA = mPair.mB = 0; }
+	
+	Pair read() { AutoReadLock lock( mLock ); return mPair; }
+	void write( const Pair &pair )
+	{
+		AutoWriteLock lock( mLock );
+		mPair = pair;
+	}
+	
+private:
+	RWLock mLock;
+	Pair mPair;
+};
+
+class SeqLockPair
+{
+public:
+	Pair read() { return mPair.get(); }
+	void write( const Pair &pair ) { mPair.set( pair ); }
+	
+private:
+	SeqLocked<Pair> mPair;
+};
+
+//! Threads reading a Pair, and writing it one time in kWriteEvery
+template<class T>
+class Reader
+{
+public:
+	Reader( T &pair, int iterations ) 
+	:	mPair( pair ), mIterations( iterations ), mTorn( 0 ),
+		mThread( "reader", this, &Reader::run ) {}
+	
+	void run()
+	{
+		for ( int i = 1; i <= mIterations; i++ )
+		{
+			if ( i % kWriteEvery == 0 )
+			{
+				Pair pair = { i, i };
+				mPair.write( pair );
+			}
+			else
+			{
+				Pair pair = mPair.read();
+				
+				if ( pair.mA != pair.mB )
+					mTorn++;
+			}
+		}
+	}
+	
+	static const int kWriteEvery = 1000;
+	
+	T &mPair;
+	int mIterations;
+	int mTorn;
+	Runnable<Reader> mThread;
+};
+
+template<class T>
+static double readMostly( int iterations, int threads )
+{
+	T pair;
+	JetHead::vector<Reader<T>*> readers;
+	int torn = 0;
+	
+	for ( int i = 0; i < threads; i++ )
+		readers.push_back( jh_new Reader<T>( pair, iterations ) );
+	
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	
+	for ( int i = 0; i < threads; i++ )
+		readers[ i ]->mThread.Start();
+	
+	for ( int i = 0; i < threads; i++ )
+	{
+		readers[ i ]->mThread.Join();
+		torn += readers[ i ]->mTorn;
+		delete readers[ i ];
+	}
+	
+	if ( torn != 0 )
+		printf( "%d torn reads\n", torn );
+	
+	return nsecsSince( start ) / ( (double)iterations * threads );
+}
+
+int main( int argc, char *argv[] )
+{
+	int iterations = 1000000;
+	int threads = 4;
+	
+	if ( argc > 1 )
+		iterations = atoi( argv[ 1 ] );
+	
+	if ( argc > 2 )
+		threads = atoi( argv[ 2 ] );
+	
+	Idler idler;
+	
+#ifdef JH_MUTEX_DEBUG
+	printf( "Mutex with JH_MUTEX_DEBUG\n" );
+#else
+	printf( "Mutex without JH_MUTEX_DEBUG\n" );
+#endif
+	
+	printf( "uncontended Mutex                %7.1f ns\n", 
+			uncontended<Mutex>( iterations ) );
+	printf( "uncontended old Mutex            %7.1f ns\n", 
+			uncontended<CheckedMutex>( iterations ) );
+	printf( "uncontended pthread mutex        %7.1f ns\n", 
+			uncontended<PlainMutex>( iterations ) );
+	
+	printf( "%d threads Mutex                  %7.1f ns\n", threads,
+			contended<Mutex>( iterations, threads ) );
+	printf( "%d threads old Mutex              %7.1f ns\n", threads,
+			contended<CheckedMutex>( iterations, threads ) );
+	printf( "%d threads pthread mutex          %7.1f ns\n", threads,
+			contended<PlainMutex>( iterations, threads ) );
+	
+	printf( "%d threads reading Mutex          %7.1f ns\n", threads,
+			readMostly<MutexPair>( iterations, threads ) );
+	printf( "%d threads reading RWLock         %7.1f ns\n", threads,
+			readMostly<RWLockPair>( iterations, threads ) );
+	printf( "%d threads reading SeqLock        %7.1f ns\n", threads,
+			readMostly<SeqLockPair>( iterations, threads ) );
+	
+	eventQueue( iterations, threads );
+	circularBuffer( iterations );
+	
+	return 0;
+}
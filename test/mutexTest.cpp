@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "Mutex.h"
+#include "Condition.h"
+#include "Thread.h"
+#include "CircularBuffer.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "jh_memory.h"
+#include "logging.h"
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+//! Find name in the profile, at line if line isn't 0
+static const Mutex::LockProfile *findProfile( 
+	JetHead::vector<Mutex::LockProfile> &profile, const char *name, 
+	int line = 0 )
+{
+	for ( unsigned i = 0; i < profile.size(); i++ )
+	{
+		if ( strcmp( profile[ i ].mName, name ) == 0 and
+			 ( line == 0 or profile[ i ].mLine == line ) )
+			return &profile[ i ];
+	}
+	
+	return NULL;
+}
+
+class Contender
+{
+public:
+	Contender( Mutex &lock, int count ) : mLock( lock ), mCount( count ),
+		mThread( "contender", this, &Contender::run ) {}
+	
+	void run()
+	{
+		for ( int i = 0; i < mCount; i++ )
+		{
+			DebugAutoLock( mLock ); sLine = __LINE__;
+			usleep( 100 );
+		}
+	}
+	
+	Mutex &mLock;
+	int mCount;
+	Runnable<Contender> mThread;
+	
+	static int sLine;
+};
+
+int Contender::sLine = 0;
+
+struct Pair
+{
+	int mA;
+	int mB;
+};
+
+//! Reads a Pair under an RWLock, and writes it now and then
+class PairUser
+{
+public:
+	PairUser( RWLock &lock, Pair &pair, volatile int &inside, int count ) 
+	:	mLock( lock ), mPair( pair ), mInside( inside ), mCount( count ),
+		mErrors( 0 ), mThread( "pair user", this, &PairUser::run ) {}
+	
+	void run()
+	{
+		for ( int i = 1; i <= mCount; i++ )
+		{
+			if ( i % 10 == 0 )
+			{
+				AutoWriteLock lock( mLock );
+				
+				if ( mInside != 0 )
+					mErrors++;
+				
+				mPair.mA = i;
+				sched_yield();
+				mPair.mB = i;
+			}
+			else
+			{
+				AutoReadLock lock( mLock );
+				
+				__sync_fetch_and_add( &mInside, 1 );
+				
+				if ( mPair.mA != mPair.mB )
+					mErrors++;
+				
+				__sync_fetch_and_sub( &mInside, 1 );
+			}
+		}
+	}
+	
+	RWLock &mLock;
+	Pair &mPair;
+	volatile int &mInside;
+	int mCount;
+	int mErrors;
+	Runnable<PairUser> mThread;
+};
+
+//! Takes an RWLock once, noting whether a writer had been first
+class Taker
+{
+public:
+	Taker( RWLock &lock, bool write, volatile bool &written )
+	:	mLock( lock ), mWrite( write ), mWritten( written ), mDone( false ),
+		mSawWrite( false ), mThread( "taker", this, &Taker::run ) {}
+	
+	void run()
+	{
+		if ( mWrite )
+		{
+			AutoWriteLock lock( mLock );
+			mWritten = true;
+		}
+		else
+		{
+			AutoReadLock lock( mLock );
+			mSawWrite = mWritten;
+		}
+		
+		mDone = true;
+	}
+	
+	RWLock &mLock;
+	bool mWrite;
+	volatile bool &mWritten;
+	volatile bool mDone;
+	bool mSawWrite;
+	Runnable<Taker> mThread;
+};
+
+class SeqWriter
+{
+public:
+	SeqWriter( SeqLocked<Pair> &pair, int count ) 
+	:	mPair( pair ), mCount( count ),
+		mThread( "seq writer", this, &SeqWriter::run ) {}
+	
+	void run()
+	{
+		for ( int i = 1; i <= mCount; i++ )
+		{
+			Pair pair = { i, i };
+			mPair.set( pair );
+			
+			if ( i % 100 == 0 )
+				sched_yield();
+		}
+	}
+	
+	SeqLocked<Pair> &mPair;
+	int mCount;
+	Runnable<SeqWriter> mThread;
+};
+
+class MutexTest : public TestCase
+{
+public:
+	MutexTest( int test_id );
+	virtual ~MutexTest() {}
+	
+private:
+	void Run();
+	
+	void profileOff();
+	void contention();
+	void holdTime();
+	void criticalSection();
+	void rwLock();
+	void rwLockWriterFirst();
+	void seqLock();
+	void priorityInherit();
+	
+	int mTest;
+};
+
+MutexTest::MutexTest( int test_id ) : TestCase( "Mutex" ), mTest( test_id )
+{
+	char name[ 32 ];
+	
+	sprintf( name, "Mutex Test %d", test_id );
+	
+	SetTestName( name );
+}
+
+void MutexTest::Run()
+{
+	Mutex::resetProfile();
+	
+	switch ( mTest )
+	{
+		case 1:
+			profileOff();
+			break;
+		case 2:
+			contention();
+			break;
+		case 3:
+			holdTime();
+			break;
+		case 4:
+			criticalSection();
+			break;
+		case 5:
+			rwLock();
+			break;
+		case 6:
+			rwLockWriterFirst();
+			break;
+		case 7:
+			seqLock();
+			break;
+		case 8:
+			priorityInherit();
+			break;
+	}
+	
+	Mutex::setProfiling( false );
+	
+	TestPassed();
+}
+
+void MutexTest::profileOff()
+{
+	Mutex lock( "off" );
+	
+	lock.Lock();
+	lock.Unlock();
+	
+	JetHead::vector<Mutex::LockProfile> profile;
+	Mutex::getProfile( profile );
+	
+	if ( findProfile( profile, "off" ) != NULL )
+		TestFailed( "Counted with profiling off" );
+}
+
+void MutexTest::contention()
+{
+	const int kThreads = 4;
+	const int kCount = 200;
+	
+	Mutex lock( "contended" );
+	Contender *threads[ kThreads ];
+	
+	Mutex::setProfiling( true );
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ] = jh_new Contender( lock, kCount );
+		threads[ i ]->mThread.Start();
+	}
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ]->mThread.Join();
+		delete threads[ i ];
+	}
+	
+	Mutex::setProfiling( false );
+	
+	JetHead::vector<Mutex::LockProfile> profile;
+	Mutex::getProfile( profile, false );
+	
+	const Mutex::LockProfile *entry = findProfile( profile, "contended" );
+	
+	if ( entry == NULL )
+		TestFailed( "Lock not profiled" );
+	
+	if ( entry->mAcquisitions != kThreads * kCount )
+		TestFailed( "%llu acquisitions", 
+					(unsigned long long)entry->mAcquisitions );
+	
+	if ( entry->mContended == 0 or entry->mWaitNsecs == 0 or 
+		 entry->mMaxWaitNsecs == 0 )
+		TestFailed( "No contention seen" );
+	
+	// Each hold sleeps for 100us
+	if ( entry->mHoldNsecs < 100000ULL * kThreads * kCount or
+		 entry->mMaxHoldNsecs < 100000 )
+		TestFailed( "Hold time %llu ns", 
+					(unsigned long long)entry->mHoldNsecs );
+	
+	// And the site is the line in Contender::run
+	Mutex::getProfile( profile, true );
+	entry = findProfile( profile, "contended", Contender::sLine );
+	
+	if ( entry == NULL or strcmp( entry->mFile, __FILE__ ) != 0 )
+		TestFailed( "Site not profiled" );
+	
+	if ( entry->mAcquisitions != kThreads * kCount )
+		TestFailed( "%llu acquisitions at site", 
+					(unsigned long long)entry->mAcquisitions );
+	
+	Mutex::logProfile( 5 );
+}
+
+void MutexTest::holdTime()
+{
+	Mutex lock( "held", true );
+	Condition cond;
+	
+	Mutex::setProfiling( true );
+	
+	// A recursive hold counts as one, and a Condition wait isn't held
+	lock.Lock();
+	lock.Lock();
+	cond.Wait( lock, 50 );
+	lock.Unlock();
+	lock.Unlock();
+	
+	Mutex::setProfiling( false );
+	
+	JetHead::vector<Mutex::LockProfile> profile;
+	Mutex::getProfile( profile, false );
+	
+	const Mutex::LockProfile *entry = findProfile( profile, "held" );
+	
+	if ( entry == NULL )
+		TestFailed( "Lock not profiled" );
+	
+	if ( entry->mAcquisitions != 2 or entry->mContended != 0 )
+		TestFailed( "%llu acquisitions, %llu contended", 
+					(unsigned long long)entry->mAcquisitions,
+					(unsigned long long)entry->mContended );
+	
+	if ( entry->mHoldNsecs > 20000000 )
+		TestFailed( "Held for %llu ns", 
+					(unsigned long long)entry->mHoldNsecs );
+}
+
+void MutexTest::criticalSection()
+{
+	Mutex::setProfiling( true );
+	
+	Mutex::EnterCriticalSection();
+	Mutex::ExitCriticalSection();
+	
+	Mutex::setProfiling( false );
+	
+	JetHead::vector<Mutex::LockProfile> profile;
+	Mutex::getProfile( profile, false );
+	
+	const Mutex::LockProfile *entry = 
+		findProfile( profile, "CriticalSection" );
+	
+	if ( entry == NULL or entry->mAcquisitions == 0 )
+		TestFailed( "Critical section not profiled" );
+}
+
+void MutexTest::rwLock()
+{
+	const int kThreads = 4;
+	const int kCount = 20000;
+	
+	RWLock lock( "rwlock" );
+	Pair pair = { 0, 0 };
+	volatile int inside = 0;
+	PairUser *threads[ kThreads ];
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ] = jh_new PairUser( lock, pair, inside, kCount );
+		threads[ i ]->mThread.Start();
+	}
+	
+	int errors = 0;
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ]->mThread.Join();
+		errors += threads[ i ]->mErrors;
+		delete threads[ i ];
+	}
+	
+	if ( errors != 0 )
+		TestFailed( "%d reads or writes not excluded", errors );
+	
+	// Readers don't exclude each other
+	lock.ReadLock();
+	lock.ReadLock();
+	lock.ReadUnlock();
+	lock.ReadUnlock();
+}
+
+void MutexTest::rwLockWriterFirst()
+{
+	RWLock lock;
+	volatile bool written = false;
+	
+	lock.ReadLock();
+	
+	Taker writer( lock, true, written );
+	writer.mThread.Start();
+	usleep( 50000 );
+	
+	if ( writer.mDone )
+		TestFailed( "Writer got in with a reader" );
+	
+	// A reader coming after a waiting writer waits for it
+	Taker reader( lock, false, written );
+	reader.mThread.Start();
+	usleep( 50000 );
+	
+	if ( reader.mDone )
+		TestFailed( "Reader got in ahead of the writer" );
+	
+	lock.ReadUnlock();
+	
+	writer.mThread.Join();
+	reader.mThread.Join();
+	
+	if ( not reader.mSawWrite )
+		TestFailed( "Reader didn't wait for the writer" );
+}
+
+void MutexTest::seqLock()
+{
+	const int kCount = 200000;
+	
+	SeqLocked<Pair> pair;
+	SeqWriter writer( pair, kCount );
+	
+	writer.mThread.Start();
+	
+	int last = 0;
+	
+	while ( last < kCount )
+	{
+		Pair read = pair.get();
+		
+		if ( read.mA != read.mB )
+			TestFailed( "Torn read %d %d", read.mA, read.mB );
+		
+		if ( read.mA < last )
+			TestFailed( "Went back from %d to %d", last, read.mA );
+		
+		last = read.mA;
+	}
+	
+	writer.mThread.Join();
+	
+	// And by hand
+	SeqLock lock;
+	int a = 1, b = 1;
+	uint32_t seq = lock.ReadBegin();
+	
+	if ( lock.ReadRetry( seq ) )
+		TestFailed( "Retry with no write" );
+	
+	{
+		AutoSeqWriteLock write( lock );
+		a = b = 2;
+	}
+	
+	if ( not lock.ReadRetry( seq ) or a != b )
+		TestFailed( "No retry after a write" );
+}
+
+void MutexTest::priorityInherit()
+{
+	const int kThreads = 4;
+	const int kCount = 100;
+	
+	Mutex lock( "inherit", false, true );
+	Contender *threads[ kThreads ];
+	
+	if ( not lock.isPriorityInherit() )
+		TestFailed( "Not priority inheriting" );
+	
+	Mutex::setProfiling( true );
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ] = jh_new Contender( lock, kCount );
+		threads[ i ]->mThread.Start();
+	}
+	
+	for ( int i = 0; i < kThreads; i++ )
+	{
+		threads[ i ]->mThread.Join();
+		delete threads[ i ];
+	}
+	
+	Mutex::setProfiling( false );
+	
+	JetHead::vector<Mutex::LockProfile> profile;
+	Mutex::getProfile( profile, false );
+	
+	const Mutex::LockProfile *entry = findProfile( profile, "inherit" );
+	
+	if ( entry == NULL or entry->mAcquisitions != kThreads * kCount )
+		TestFailed( "Lost acquisitions" );
+	
+	// Recursive, and given up for a Condition wait
+	Mutex recursive( "inherit recursive", true, true );
+	Condition cond;
+	
+	recursive.Lock();
+	recursive.Lock();
+	
+	if ( not recursive.isLocked() )
+		TestFailed( "Recursive lock not held" );
+	
+	cond.Wait( recursive, 10 );
+	recursive.Unlock();
+	recursive.Unlock();
+	
+	// The queues take the default
+	Mutex::setQueuePriorityInherit( true );
+	
+	JetHead::CircularBuffer buffer( 64 );
+	char data[ 16 ] = "inherit";
+	
+	buffer.write( (uint8_t*)data, sizeof( data ) );
+	memset( data, 0, sizeof( data ) );
+	buffer.read( (uint8_t*)data, sizeof( data ) );
+	
+	Mutex::setQueuePriorityInherit( false );
+	
+	if ( strcmp( data, "inherit" ) != 0 )
+		TestFailed( "Buffer lost data" );
+}
+
+int main( int argc, char*argv[] )
+{	
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 10 ];
+	
+	test_set[ 0 ] = jh_new MutexTest( 1 );
+	test_set[ 1 ] = jh_new MutexTest( 2 );
+	test_set[ 2 ] = jh_new MutexTest( 3 );
+	test_set[ 3 ] = jh_new MutexTest( 4 );
+	test_set[ 4 ] = jh_new MutexTest( 5 );
+	test_set[ 5 ] = jh_new MutexTest( 6 );
+	test_set[ 6 ] = jh_new MutexTest( 7 );
+	test_set[ 7 ] = jh_new MutexTest( 8 );
+	
+	runner.RunAll( test_set, 8 );
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Measures how the parallel algorithms scale.  Usage:
+ *
+ *   parallelBench [count] [max threads]
+ *
+ * For 1, 2, 4 and so on up to max threads (the number of CPUs by
+ * default) it makes a TaskExecutor with that many threads and times
+ * parallel_for, parallel_reduce, parallel_sort and parallel_scan over
+ * count elements on it, printing each time and its speed up over the
+ * plain serial loop or std::sort.  The loop bodies do a little work
+ * per element so the loops are not just measuring memory bandwidth.
+ */
+
+#include "ParallelAlgorithms.h"
+#include "TimeUtils.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <functional>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+using namespace JetHead;
+
+static double msecsSince( uint64_t start )
+{
+	return (double)( TimeUtils::getSystemMonotonicNsecs() - start ) / 1000000;
+}
+
+static inline double work( double x )
+{
+	return sqrt( x * x + 1.0 ) * 0.5;
+}
+
+struct Work
+{
+	Work( const double *in, double *out ) : mIn( in ), mOut( out ) {}
+	
+	void operator()( unsigned begin, unsigned end ) const
+	{
+		for ( unsigned i = begin; i < end; i++ )
+			mOut[ i ] = work( mIn[ i ] );
+	}
+	
+	const double *mIn;
+	double *mOut;
+};
+
+struct SumWork
+{
+	SumWork( const double *in ) : mIn( in ) {}
+	
+	double operator()( unsigned begin, unsigned end, double init ) const
+	{
+		for ( unsigned i = begin; i < end; i++ )
+			init += work( mIn[ i ] );
+		
+		return init;
+	}
+	
+	const double *mIn;
+};
+
+//! Prints a time and its speed up over the serial time
+static void report( const char *name, int threads, double serial, 
+					double parallel )
+{
+	printf( "%-16s %2d threads %9.2f ms %6.2fx\n", name, threads, parallel,
+			serial / parallel );
+}
+
+int main( int argc, char *argv[] )
+{
+	unsigned count = 4000000;
+	int maxThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	
+	if ( argc > 1 )
+		count = atoi( argv[ 1 ] );
+	
+	if ( argc > 2 )
+		maxThreads = atoi( argv[ 2 ] );
+	
+	double *in = jh_new double[ count ];
+	double *out = jh_new double[ count ];
+	int *keys = jh_new int[ count ];
+	int *sorted = jh_new int[ count ];
+	volatile double sink = 0;
+	
+	srand( 1 );
+	
+	for ( unsigned i = 0; i < count; i++ )
+	{
+		in[ i ] = rand() / (double)RAND_MAX;
+		keys[ i ] = rand();
+		out[ i ] = 0;
+		sorted[ i ] = 0;
+	}
+	
+	// The serial versions, to compare against
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	Work( in, out )( 0, count );
+	double serialFor = msecsSince( start );
+	
+	start = TimeUtils::getSystemMonotonicNsecs();
+	sink = SumWork( in )( 0, count, 0.0 );
+	double serialReduce = msecsSince( start );
+	
+	std::copy( keys, keys + count, sorted );
+	start = TimeUtils::getSystemMonotonicNsecs();
+	std::sort( sorted, sorted + count );
+	double serialSort = msecsSince( start );
+	
+	start = TimeUtils::getSystemMonotonicNsecs();
+	double sum = 0;
+	
+	for ( unsigned i = 0; i < count; i++ )
+	{
+		sum += in[ i ];
+		out[ i ] = sum;
+	}
+	
+	double serialScan = msecsSince( start );
+	
+	printf( "%u elements, %ld CPUs\n", count, 
+			sysconf( _SC_NPROCESSORS_ONLN ) );
+	printf( "serial for %.2f ms, reduce %.2f ms, sort %.2f ms, "
+			"scan %.2f ms\n", serialFor, serialReduce, serialSort, 
+			serialScan );
+	
+	// 1, 2, 4 and so on, ending on maxThreads even if it is not a power of 2
+	for ( int threads = 1; ; threads = std::min( threads * 2, maxThreads ) )
+	{
+		TaskExecutor executor( threads );
+		
+		start = TimeUtils::getSystemMonotonicNsecs();
+		parallel_for( 0, count, Work( in, out ), 0, &executor );
+		report( "parallel_for", threads, serialFor, msecsSince( start ) );
+		
+		start = TimeUtils::getSystemMonotonicNsecs();
+		sink = parallel_reduce( 0, count, 0.0, SumWork( in ), 
+								std::plus<double>(), 0, &executor );
+		report( "parallel_reduce", threads, serialReduce, 
+				msecsSince( start ) );
+		
+		std::copy( keys, keys + count, sorted );
+		start = TimeUtils::getSystemMonotonicNsecs();
+		parallel_sort( sorted, count, 0, &executor );
+		report( "parallel_sort", threads, serialSort, msecsSince( start ) );
+		
+		start = TimeUtils::getSystemMonotonicNsecs();
+		parallel_scan( in, out, count, 0.0, std::plus<double>(), 0, 
+					   &executor );
+		report( "parallel_scan", threads, serialScan, msecsSince( start ) );
+		
+		if ( threads >= maxThreads )
+			break;
+	}
+	
+	(void)sink;
+	
+	delete [] in;
+	delete [] out;
+	delete [] keys;
+	delete [] sorted;
+	
+	return 0;
+}
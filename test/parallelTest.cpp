@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ParallelAlgorithms.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <functional>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+using namespace JetHead;
+
+//! Counts the visits to each index
+struct Visit
+{
+	Visit( volatile int *visits ) : mVisits( visits ) {}
+	
+	void operator()( unsigned begin, unsigned end ) const
+	{
+		for ( unsigned i = begin; i < end; i++ )
+			__sync_fetch_and_add( &mVisits[ i ], 1 );
+	}
+	
+	volatile int *mVisits;
+};
+
+struct Double
+{
+	void operator()( int *first, int *last ) const
+	{
+		for ( int *i = first; i < last; i++ )
+			*i *= 2;
+	}
+};
+
+struct SumRange
+{
+	uint64_t operator()( unsigned begin, unsigned end, uint64_t init ) const
+	{
+		for ( unsigned i = begin; i < end; i++ )
+			init += i;
+		
+		return init;
+	}
+};
+
+//! Associative but not commutative, so checks the order things combine
+struct Concat
+{
+	std::string operator()( const std::string &a, const std::string &b ) const
+	{
+		return a + b;
+	}
+};
+
+struct Letters
+{
+	std::string operator()( unsigned begin, unsigned end, 
+							const std::string &init ) const
+	{
+		std::string result = init;
+		
+		for ( unsigned i = begin; i < end; i++ )
+			result += (char)( 'a' + i % 26 );
+		
+		return result;
+	}
+};
+
+struct Greater
+{
+	bool operator()( int a, int b ) const { return a > b; }
+};
+
+//! Sums each row of a matrix with a nested parallel_reduce
+struct RowSums
+{
+	RowSums( const int *matrix, unsigned width, TaskExecutor *executor,
+			 int *sums ) : 
+		mMatrix( matrix ), mWidth( width ), mExecutor( executor ),
+		mSums( sums ) {}
+	
+	void operator()( unsigned begin, unsigned end ) const
+	{
+		for ( unsigned row = begin; row < end; row++ )
+		{
+			mSums[ row ] = parallel_reduce( mMatrix + row * mWidth, mWidth,
+											0, std::plus<int>(), 16, 
+											mExecutor );
+		}
+	}
+	
+	const int *mMatrix;
+	unsigned mWidth;
+	TaskExecutor *mExecutor;
+	int *mSums;
+};
+
+//! Sorts an array, as a task
+struct SortCall
+{
+	SortCall( int *array, unsigned count, TaskExecutor *executor ) :
+		mArray( array ), mCount( count ), mExecutor( executor ) {}
+	
+	void operator()() { parallel_sort( mArray, mCount, 64, mExecutor ); }
+	
+	int *mArray;
+	unsigned mCount;
+	TaskExecutor *mExecutor;
+};
+
+class ParallelTest : public TestCase
+{
+public:
+	ParallelTest( int test_id ) : TestCase( "Parallel" ), mTest( test_id ),
+		mExecutor( 4 )
+	{
+		char name[ 32 ];
+		
+		sprintf( name, "Parallel Test %d", test_id );
+		SetTestName( name );
+	}
+	
+	virtual ~ParallelTest() {}
+	
+private:
+	void Run();
+	
+	void loops();
+	void reduce();
+	void sort();
+	void scan();
+	void nested();
+	
+	void checkSorted( const int *array, unsigned count, const char *what );
+	
+	int mTest;
+	
+	TaskExecutor mExecutor;
+};
+
+void ParallelTest::Run()
+{
+	switch ( mTest )
+	{
+		case 1:
+			loops();
+			break;
+		case 2:
+			reduce();
+			break;
+		case 3:
+			sort();
+			break;
+		case 4:
+			scan();
+			break;
+		case 5:
+			nested();
+			break;
+	}
+	
+	TestPassed();
+}
+
+void ParallelTest::loops()
+{
+	const unsigned kCount = 10000;
+	const unsigned kGrains[] = { 0, 1, 7, 100, kCount, kCount * 2 };
+	
+	volatile int *visits = jh_new volatile int[ kCount ];
+	
+	for ( unsigned g = 0; g < sizeof( kGrains ) / sizeof( kGrains[ 0 ] ); g++ )
+	{
+		memset( (void*)visits, 0, kCount * sizeof( int ) );
+		
+		parallel_for( 10, kCount, Visit( visits ), kGrains[ g ], &mExecutor );
+		
+		for ( unsigned i = 0; i < kCount; i++ )
+		{
+			if ( visits[ i ] != ( i < 10 ? 0 : 1 ) )
+				TestFailed( "Grain %u visited %u %d times", kGrains[ g ], i,
+							visits[ i ] );
+		}
+	}
+	
+	// Empty and backwards ranges do nothing
+	parallel_for( 5, 5, Visit( NULL ), 0, &mExecutor );
+	parallel_for( 5, 1, Visit( NULL ), 0, &mExecutor );
+	
+	delete [] visits;
+	
+	JetHead::vector<int> vec;
+	
+	for ( unsigned i = 0; i < kCount; i++ )
+		vec.push_back( i );
+	
+	parallel_for( vec, Double(), 0, &mExecutor );
+	parallel_for( &vec[ 0 ], kCount / 2, Double(), 3, &mExecutor );
+	
+	for ( unsigned i = 0; i < kCount; i++ )
+	{
+		if ( vec[ i ] != (int)( i < kCount / 2 ? i * 4 : i * 2 ) )
+			TestFailed( "vec[ %u ] is %d", i, vec[ i ] );
+	}
+	
+	// And with the default executor
+	JetHead::vector<int> empty;
+	parallel_for( empty, Double() );
+	parallel_for( vec, Double() );
+	
+	if ( vec[ kCount - 1 ] != (int)( kCount - 1 ) * 4 )
+		TestFailed( "Default executor did not run" );
+}
+
+void ParallelTest::reduce()
+{
+	const unsigned kCount = 100000;
+	
+	uint64_t sum = parallel_reduce( 0, kCount, (uint64_t)0, SumRange(),
+									std::plus<uint64_t>(), 0, &mExecutor );
+	
+	if ( sum != (uint64_t)kCount * ( kCount - 1 ) / 2 )
+		TestFailed( "Sum is %llu", (unsigned long long)sum );
+	
+	std::string letters = parallel_reduce( 0, 1000, std::string(), Letters(),
+										   Concat(), 3, &mExecutor );
+	
+	if ( letters != Letters()( 0, 1000, "" ) )
+		TestFailed( "Combined out of order" );
+	
+	if ( parallel_reduce( 7, 7, 42ULL, SumRange(), std::plus<uint64_t>(),
+						  0, &mExecutor ) != 42 )
+		TestFailed( "Empty range is not the identity" );
+	
+	JetHead::vector<int> vec;
+	int expected = 0;
+	
+	for ( unsigned i = 0; i < kCount; i++ )
+	{
+		vec.push_back( i % 1000 - 500 );
+		expected += vec[ i ];
+	}
+	
+	if ( parallel_reduce( vec, 0, std::plus<int>(), 0, &mExecutor ) 
+		 != expected )
+		TestFailed( "Vector sum wrong" );
+	
+	if ( parallel_reduce( &vec[ 0 ], 3, 0, std::plus<int>(), 1, &mExecutor )
+		 != -500 - 499 - 498 )
+		TestFailed( "Array sum wrong" );
+}
+
+void ParallelTest::checkSorted( const int *array, unsigned count,
+								const char *what )
+{
+	for ( unsigned i = 1; i < count; i++ )
+	{
+		if ( array[ i - 1 ] > array[ i ] )
+			TestFailed( "%s of %u not sorted at %u", what, count, i );
+	}
+}
+
+void ParallelTest::sort()
+{
+	const unsigned kSizes[] = { 0, 1, 2, 63, 64, 65, 1000, 100000 };
+	
+	srand( 1 );
+	
+	for ( unsigned s = 0; s < sizeof( kSizes ) / sizeof( kSizes[ 0 ] ); s++ )
+	{
+		unsigned count = kSizes[ s ];
+		int *array = jh_new int[ count + 1 ];
+		int sum = 0;
+		
+		for ( unsigned i = 0; i < count; i++ )
+		{
+			// Plenty of duplicates
+			array[ i ] = rand() % ( count / 2 + 1 );
+			sum += array[ i ];
+		}
+		
+		parallel_sort( array, count, 64, &mExecutor );
+		checkSorted( array, count, "Array" );
+		
+		for ( unsigned i = 0; i < count; i++ )
+			sum -= array[ i ];
+		
+		if ( sum != 0 )
+			TestFailed( "Sort of %u lost elements", count );
+		
+		// Already sorted, with the default grain
+		parallel_sort( array, count, 0, &mExecutor );
+		checkSorted( array, count, "Sorted array" );
+		
+		delete [] array;
+	}
+	
+	JetHead::vector<int> vec;
+	
+	for ( unsigned i = 0; i < 50000; i++ )
+		vec.push_back( rand() );
+	
+	parallel_sort( vec, Greater(), 100, &mExecutor );
+	
+	for ( unsigned i = 1; i < vec.size(); i++ )
+	{
+		if ( vec[ i - 1 ] < vec[ i ] )
+			TestFailed( "Vector not sorted descending at %u", i );
+	}
+	
+	parallel_sort( vec );
+	checkSorted( &vec[ 0 ], vec.size(), "Vector" );
+}
+
+void ParallelTest::scan()
+{
+	const unsigned kCount = 10007;
+	const unsigned kGrains[] = { 0, 1, 13, kCount };
+	
+	JetHead::vector<int> in;
+	JetHead::vector<int> out;
+	
+	for ( unsigned i = 0; i < kCount; i++ )
+		in.push_back( i % 17 );
+	
+	for ( unsigned g = 0; g < sizeof( kGrains ) / sizeof( kGrains[ 0 ] ); g++ )
+	{
+		parallel_scan( in, out, 0, std::plus<int>(), kGrains[ g ], 
+					   &mExecutor );
+		
+		int sum = 0;
+		
+		for ( unsigned i = 0; i < kCount; i++ )
+		{
+			sum += in[ i ];
+			
+			if ( out[ i ] != sum )
+				TestFailed( "Grain %u scanned %d at %u not %d", kGrains[ g ],
+							out[ i ], i, sum );
+		}
+	}
+	
+	// In place, and in order
+	JetHead::vector<std::string> strings;
+	
+	for ( unsigned i = 0; i < 300; i++ )
+		strings.push_back( std::string( 1, 'a' + i % 26 ) );
+	
+	parallel_scan( &strings[ 0 ], &strings[ 0 ], strings.size(), 
+				   std::string(), Concat(), 7, &mExecutor );
+	
+	for ( unsigned i = 0; i < strings.size(); i++ )
+	{
+		if ( strings[ i ] != Letters()( 0, i + 1, "" ) )
+			TestFailed( "String scan wrong at %u", i );
+	}
+}
+
+void ParallelTest::nested()
+{
+	const unsigned kRows = 50;
+	const unsigned kWidth = 1000;
+	
+	int *matrix = jh_new int[ kRows * kWidth ];
+	int sums[ kRows ];
+	
+	for ( unsigned i = 0; i < kRows * kWidth; i++ )
+		matrix[ i ] = i / kWidth + 1;
+	
+	parallel_for( 0, kRows, RowSums( matrix, kWidth, &mExecutor, sums ), 1,
+				  &mExecutor );
+	
+	for ( unsigned row = 0; row < kRows; row++ )
+	{
+		if ( sums[ row ] != (int)( ( row + 1 ) * kWidth ) )
+			TestFailed( "Row %u summed to %d", row, sums[ row ] );
+	}
+	
+	delete [] matrix;
+	
+	// Several sorts started from tasks at once
+	const unsigned kSorts = 8;
+	const unsigned kCount = 5000;
+	int *arrays[ kSorts ];
+	SmartPtr<Task> tasks[ kSorts ];
+	
+	for ( unsigned s = 0; s < kSorts; s++ )
+	{
+		arrays[ s ] = jh_new int[ kCount ];
+		
+		for ( unsigned i = 0; i < kCount; i++ )
+			arrays[ s ][ i ] = rand();
+		
+		tasks[ s ] = mExecutor.submitCall( SortCall( arrays[ s ], kCount, 
+													 &mExecutor ) );
+	}
+	
+	for ( unsigned s = 0; s < kSorts; s++ )
+	{
+		tasks[ s ]->wait();
+		checkSorted( arrays[ s ], kCount, "Task" );
+		delete [] arrays[ s ];
+	}
+}
+
+int main( int argc, char*argv[] )
+{	
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 5 ];
+	
+	for ( int i = 0; i < 5; i++ )
+		test_set[ i ] = jh_new ParallelTest( i + 1 );
+	
+	runner.RunAll( test_set, 5 );
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Measures the cost of a Selector with many mostly idle sockets
+ * registered, for each backend.  Usage:
+ *
+ *   selectorBench [idle sockets] [round trips]
+ *
+ * For every backend it reports how long it takes to register and
+ * remove the idle sockets and the average round trip latency of one
+ * active socket while the idle ones are registered.  It also reports
+ * how many events per second a Selector can handle when they are sent
+ * in bursts, and the round trip latency with and without busy polling.
+ */
+
+#include "Selector.h"
+#include "TimeUtils.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+class PingListener : public SelectorListener
+{
+public:
+	PingListener() : mCount( 0 ) {}
+	virtual ~PingListener() {}
+
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		char buf[ 16 ];
+		
+		if ( events & POLLIN )
+		{
+			read( fd, buf, sizeof( buf ) );
+			
+			AutoLock l( mLock );
+			mCount++;
+			mCondition.Signal();
+		}
+	}
+
+	void waitFor( int count )
+	{
+		AutoLock l( mLock );
+		
+		while ( mCount < count )
+			mCondition.Wait( mLock );
+	}
+	
+private:
+	Mutex mLock;
+	Condition mCondition;
+	int mCount;
+};
+
+class EventCounter
+{
+public:
+	EventCounter( Selector *selector ) : mCount( 0 ), 
+		mHandler( this, &EventCounter::process, selector ) {}
+
+	struct CountEvent : public Event
+	{
+		CountEvent() : Event( 100 ) {}
+		SMART_CASTABLE( 100 );
+	};
+	
+	void waitFor( int count )
+	{
+		AutoLock l( mLock );
+		
+		while ( mCount < count )
+			mCondition.Wait( mLock );
+	}
+
+private:
+	void process( CountEvent *ev )
+	{
+		AutoLock l( mLock );
+		mCount++;
+		mCondition.Signal();
+	}
+	
+	Mutex mLock;
+	Condition mCondition;
+	int mCount;
+	EventMethod<EventCounter,CountEvent> mHandler;
+};
+
+static void runEventBench( int numEvents, int burst )
+{
+	Selector selector( "BenchSelector" );
+	EventCounter counter( &selector );
+	struct timespec start, end;
+	
+	TimeUtils::getCurTime( &start );
+	
+	for ( int sent = 0; sent < numEvents; )
+	{
+		for ( int i = 0; i < burst and sent < numEvents; i++, sent++ )
+			selector.sendEvent( jh_new EventCounter::CountEvent() );
+		
+		counter.waitFor( sent );
+	}
+	
+	TimeUtils::getCurTime( &end );
+	uint32_t us = TimeUtils::getDifferenceMicroSecs( &end, &start );
+	
+	printf( "events in bursts of %4d: %8.0f events/s\n", burst, 
+			numEvents * 1000000.0 / us );
+}
+
+class IdleListener : public SelectorListener
+{
+public:
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		LOG_WARN( "unexpected event %x on idle fd %d", events, fd );
+	}
+};
+
+static void runBench( Selector::Backend backend, int numIdle, int roundTrips )
+{
+	Selector selector( "BenchSelector", backend );
+	IdleListener idle;
+	PingListener ping;
+	struct timespec start, end;
+	
+	int numPairs = numIdle / 2;
+	int (*pairs)[ 2 ] = jh_new int[ numPairs ][ 2 ];
+	
+	for ( int i = 0; i < numPairs; i++ )
+	{
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, pairs[ i ] ) != 0 )
+			LOG_ERR_FATAL( "socketpair %d failed", i );
+	}
+	
+	TimeUtils::getCurTime( &start );
+
+	for ( int i = 0; i < numPairs; i++ )
+	{
+		selector.addListener( pairs[ i ][ 0 ], POLLIN, &idle );
+		selector.addListener( pairs[ i ][ 1 ], POLLIN, &idle );
+	}
+	
+	TimeUtils::getCurTime( &end );
+	uint32_t addUs = TimeUtils::getDifferenceMicroSecs( &end, &start );
+	
+	int active[ 2 ];
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, active ) != 0 )
+		LOG_ERR_FATAL( "socketpair failed" );
+	
+	selector.addListener( active[ 0 ], POLLIN, &ping );
+	
+	TimeUtils::getCurTime( &start );
+	
+	for ( int i = 1; i <= roundTrips; i++ )
+	{
+		write( active[ 1 ], "X", 1 );
+		ping.waitFor( i );
+	}
+	
+	TimeUtils::getCurTime( &end );
+	uint32_t pingUs = TimeUtils::getDifferenceMicroSecs( &end, &start );
+	
+	selector.removeListener( active[ 0 ], &ping );
+	close( active[ 0 ] );
+	close( active[ 1 ] );
+	
+	TimeUtils::getCurTime( &start );
+	
+	for ( int i = 0; i < numPairs; i++ )
+	{
+		selector.removeListener( pairs[ i ][ 0 ], &idle );
+		selector.removeListener( pairs[ i ][ 1 ], &idle );
+	}
+	
+	TimeUtils::getCurTime( &end );
+	uint32_t removeUs = TimeUtils::getDifferenceMicroSecs( &end, &start );
+	
+	for ( int i = 0; i < numPairs; i++ )
+	{
+		close( pairs[ i ][ 0 ] );
+		close( pairs[ i ][ 1 ] );
+	}
+	
+	delete [] pairs;
+	
+	const char *name = "poll";
+	
+	if ( selector.getBackend() == Selector::kBackendEpoll )
+		name = "epoll";
+	else if ( selector.getBackend() == Selector::kBackendIoUring )
+		name = "uring";
+	
+	printf( "%-6s %6d idle fds: add %6.2f us/fd, remove %6.2f us/fd, "
+			"round trip %7.2f us\n", name,
+			numPairs * 2, (double)addUs / ( numPairs * 2 ), 
+			(double)removeUs / ( numPairs * 2 ), (double)pingUs / roundTrips );
+}
+
+static void runBusyPollBench( int roundTrips, uint32_t spinUsecs )
+{
+	Selector selector( "BenchSelector" );
+	PingListener ping;
+	struct timespec start, end;
+	
+	int active[ 2 ];
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, active ) != 0 )
+		LOG_ERR_FATAL( "socketpair failed" );
+	
+	selector.setBusyPoll( spinUsecs );
+	selector.addListener( active[ 0 ], POLLIN, &ping );
+	
+	TimeUtils::getCurTime( &start );
+	
+	for ( int i = 1; i <= roundTrips; i++ )
+	{
+		write( active[ 1 ], "X", 1 );
+		ping.waitFor( i );
+	}
+	
+	TimeUtils::getCurTime( &end );
+	uint32_t pingUs = TimeUtils::getDifferenceMicroSecs( &end, &start );
+	
+	Selector::BusyPollStats stats;
+	selector.getBusyPollStats( stats );
+	
+	selector.removeListener( active[ 0 ], &ping );
+	close( active[ 0 ] );
+	close( active[ 1 ] );
+	
+	printf( "busy poll %5u us: round trip %7.2f us, %llu spins (%llu hits) "
+			"%llu us spinning, %llu sleeps %llu us sleeping\n", spinUsecs,
+			(double)pingUs / roundTrips, (unsigned long long)stats.mSpins, 
+			(unsigned long long)stats.mSpinHits, 
+			(unsigned long long)stats.mSpinUsecs,
+			(unsigned long long)stats.mSleeps, 
+			(unsigned long long)stats.mSleepUsecs );
+}
+
+int main( int argc, char *argv[] )
+{
+	int numIdle = 10000;
+	int roundTrips = 10000;
+	
+	if ( argc > 1 )
+		numIdle = atoi( argv[ 1 ] );
+	
+	if ( argc > 2 )
+		roundTrips = atoi( argv[ 2 ] );
+	
+	// Each idle socket is an fd, make sure we are allowed that many
+	struct rlimit limit;
+	getrlimit( RLIMIT_NOFILE, &limit );
+	
+	if ( limit.rlim_cur < (rlim_t)numIdle + 64 )
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit( RLIMIT_NOFILE, &limit );
+		
+		if ( limit.rlim_cur < (rlim_t)numIdle + 64 )
+		{
+			numIdle = limit.rlim_cur - 64;
+			printf( "fd limit is %d, only using %d idle fds\n", 
+					(int)limit.rlim_cur, numIdle );
+		}
+	}
+	
+	runBench( Selector::kBackendPoll, numIdle, roundTrips );
+	runBench( Selector::kBackendEpoll, numIdle, roundTrips );
+	runBench( Selector::kBackendIoUring, numIdle, roundTrips );
+	
+	runBusyPollBench( roundTrips, 0 );
+	runBusyPollBench( roundTrips, 50 );
+	
+	runEventBench( 100000, 1 );
+	runEventBench( 100000, 1000 );
+	
+	return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "SelectorGroup.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <unistd.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+using namespace JetHead;
+
+class DummyListener : public SelectorListener
+{
+public:
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data ) {}
+};
+
+class PolicyTest : public TestCase
+{
+public:
+	PolicyTest( int number ) : TestCase( "PolicyTest" ), mTestNum( number )
+	{
+		if ( number == 1 )
+			SetTestName( "Round Robin" );
+		else
+			SetTestName( "Least Loaded" );
+	}
+	
+	virtual ~PolicyTest() {}
+	
+private:
+	void Run()
+	{
+		if ( mTestNum == 1 )
+		{
+			SelectorGroup group( 3, SelectorGroup::kRoundRobin, "RR" );
+			
+			if ( group.size() != 3 )
+				TestFailed( "Group has %d selectors", group.size() );
+			
+			for ( int i = 0; i < 6; i++ )
+			{
+				if ( group.getNextSelector() != group.getSelector( i % 3 ) )
+					TestFailed( "Selector %d out of order", i );
+			}
+			
+			if ( group.getCurrentSelector() != NULL )
+				TestFailed( "Current selector on a non selector thread" );
+		}
+		else
+		{
+			SelectorGroup group( 3, SelectorGroup::kLeastLoaded, "LL" );
+			DummyListener listener;
+			int fds[ 2 ];
+			
+			if ( pipe( fds ) != 0 )
+				LOG_ERR_FATAL( "failed to create pipe" );
+			
+			group.getSelector( 0 )->addListener( fds[ 0 ], POLLIN, &listener );
+			group.getSelector( 0 )->addListener( fds[ 1 ], POLLOUT, &listener );
+			group.getSelector( 2 )->addListener( fds[ 0 ], POLLIN, &listener );
+			
+			if ( group.getNextSelector() != group.getSelector( 1 ) )
+				TestFailed( "Didn't pick the idle selector" );
+			
+			group.getSelector( 1 )->addListener( fds[ 0 ], POLLIN, &listener );
+			group.getSelector( 1 )->addListener( fds[ 1 ], POLLOUT, &listener );
+			
+			if ( group.getNextSelector() != group.getSelector( 2 ) )
+				TestFailed( "Didn't pick the least loaded selector" );
+			
+			for ( int i = 0; i < 3; i++ )
+			{
+				group.getSelector( i )->removeListener( fds[ 0 ], &listener );
+				group.getSelector( i )->removeListener( fds[ 1 ], &listener );
+			}
+			
+			close( fds[ 0 ] );
+			close( fds[ 1 ] );
+		}
+		
+		TestPassed();
+	}
+	
+	int mTestNum;
+};
+
+class AcceptTest : public TestCase, public SocketListener
+{
+public:
+	AcceptTest( bool reusePort ) : TestCase( "AcceptTest" ), 
+		mReusePort( reusePort ), mGroup( NULL ), mAccepted( 0 ), 
+		mWrongSelector( 0 )
+	{
+		if ( reusePort )
+			SetTestName( "SO_REUSEPORT Accept" );
+		else
+			SetTestName( "Single Acceptor" );
+	}
+	
+	virtual ~AcceptTest() {}
+	
+private:
+	static const int kNumClients = 32;
+	
+	bool handleAccept( ServerSocket *server, Socket *socket )
+	{
+		// With SO_REUSEPORT connections are accepted on every
+		//  selector, otherwise always on the first one.
+		Selector *current = mGroup->getCurrentSelector();
+		
+		if ( current == NULL or 
+			 ( not mReusePort and current != mGroup->getSelector( 0 ) ) )
+		{
+			mWrongSelector++;
+		}
+		
+		// Count it before assign, after which the client can get its
+		//  echo back before we return.
+		AutoLock l( mLock );
+		mSockets.push_back( socket );
+		mAccepted++;
+		
+		mGroup->assign( socket, this );
+		return true;
+	}
+	
+	void handleData( Socket *socket )
+	{
+		char buf[ 16 ];
+		int res = socket->read( buf, sizeof( buf ) );
+		
+		if ( res > 0 )
+			socket->write( buf, res );
+	}
+	
+	bool handleClose( Socket *socket )
+	{
+		return false;
+	}
+	
+	void Run()
+	{
+		SelectorGroup group( 4, SelectorGroup::kRoundRobin, "Accept" );
+		mGroup = &group;
+		
+		if ( group.listen( Socket::Address( 0 ), 64, this, mReusePort ) != 0 )
+			TestFailed( "listen failed" );
+		
+		if ( group.isReusePort() != mReusePort )
+			LOG_NOTICE( "SO_REUSEPORT %s", group.isReusePort() ? "on" : "off" );
+		
+		Socket::Address addr;
+		group.getLocalAddress( addr );
+		addr.setAddress( "127.0.0.1" );
+		
+		Socket clients[ kNumClients ];
+		
+		for ( int i = 0; i < kNumClients; i++ )
+		{
+			if ( clients[ i ].connect( addr ) != 0 )
+				TestFailed( "connect %d failed", i );
+			
+			if ( clients[ i ].write( "ping", 4 ) != 4 )
+				TestFailed( "write %d failed", i );
+		}
+		
+		for ( int i = 0; i < kNumClients; i++ )
+		{
+			char buf[ 4 ];
+			int got = 0;
+			
+			while ( got < 4 )
+			{
+				int res = clients[ i ].read( buf + got, 4 - got );
+				
+				if ( res <= 0 )
+					TestFailed( "read %d failed", i );
+				
+				got += res;
+			}
+			
+			if ( memcmp( buf, "ping", 4 ) != 0 )
+				TestFailed( "bad echo on %d", i );
+		}
+		
+		if ( mAccepted != kNumClients )
+			TestFailed( "accepted %d of %d", (int)mAccepted, kNumClients );
+		
+		if ( mWrongSelector != 0 )
+			TestFailed( "%d accepts on the wrong thread", (int)mWrongSelector );
+		
+		// Without SO_REUSEPORT the sockets are handed out round robin
+		int used = 0;
+		for ( int i = 0; i < group.size(); i++ )
+		{
+			if ( group.getSelector( i )->getNumListeners() > 0 )
+				used++;
+		}
+		
+		if ( not group.isReusePort() and used != group.size() )
+			TestFailed( "Only %d selectors used", used );
+		
+		group.stopListening();
+		
+		for ( unsigned i = 0; i < mSockets.size(); i++ )
+		{
+			delete mSockets[ i ];
+		}
+		
+		mSockets.clear();
+		
+		TestPassed();
+	}
+	
+	bool mReusePort;
+	SelectorGroup *mGroup;
+	Mutex mLock;
+	JetHead::vector<Socket*> mSockets;
+	volatile int mAccepted;
+	volatile int mWrongSelector;
+};
+
+int main( int argc, char *argv[] )
+{
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 4 ];
+	
+	test_set[ 0 ] = jh_new PolicyTest( 1 );
+	test_set[ 1 ] = jh_new PolicyTest( 2 );
+	test_set[ 2 ] = jh_new AcceptTest( false );
+	test_set[ 3 ] = jh_new AcceptTest( true );
+	
+	runner.RunAll( test_set, 4 );
+
+	return 0;
+}
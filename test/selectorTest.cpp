@@ -26,10 +26,15 @@
  */
 
 #include "Selector.h"
+#include "EventThread.h"
+#include "TimeUtils.h"
 #include "jh_memory.h"
 #include "logging.h"
 
 #include <unistd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <string.h>
 SET_LOG_CAT( LOG_CAT_ALL );
 SET_LOG_LEVEL( LOG_LVL_INFO );
 
@@ -370,19 +375,857 @@ void OtherListenerClass::processFileEvents( int fd, short events, jh_ptr_int_t p
 	}	
 }
 
+class IdleTest : public TestCase, public IdleTask
+{
+public:
+	IdleTest( EventDispatcher *d, const char *name ) : TestCase( "IdleTest" ),
+		mDispatcher( d ), mRuns( 0 ), mWork( 0 ), mEventHandled( false )
+	{
+		SetTestName( name );
+	}
+	
+	virtual ~IdleTest() {}
+
+private:
+	struct WakeEvent : public Event
+	{
+		WakeEvent() : Event( 100 ) {}
+		SMART_CASTABLE( 100 );
+	};
+
+	void ProcessWake( WakeEvent *ev ) { mEventHandled = true; }
+	
+	bool runIdle()
+	{
+		mRuns++;
+		
+		if ( mWork == 0 )
+			return false;
+		
+		// Simulate a chunk of housekeeping
+		usleep( 1000 );
+		mWork--;
+		return true;
+	}
+	
+	void Run()
+	{
+		EventMethod<IdleTest,WakeEvent> handler( this, &IdleTest::ProcessWake,
+												  mDispatcher );
+		
+		// A task with no work is called once when added and not again
+		//  until an event has been handled.
+		mDispatcher->addIdleTask( this );
+		usleep( 100000 );
+		
+		if ( mRuns != 1 )
+			TestFailed( "Idle task called %d times, expected 1", mRuns );
+		
+		// Now give it a lot of work, events must still be handled promptly
+		mWork = 1000;
+		mDispatcher->sendEvent( jh_new WakeEvent() );
+		usleep( 50000 );
+		
+		if ( not mEventHandled )
+			TestFailed( "Wake event not handled" );
+		
+		if ( mWork == 1000 )
+			TestFailed( "Idle task did not run after event" );
+		
+		mEventHandled = false;
+		struct timespec start, end;
+		TimeUtils::getCurTime( &start );
+		mDispatcher->sendEventSync( jh_new WakeEvent() );
+		TimeUtils::getCurTime( &end );
+		
+		int elapsed = TimeUtils::getDifference( &end, &start );
+		if ( not mEventHandled or mWork == 0 )
+			TestFailed( "Sync event not handled while idle work pending" );
+
+		if ( elapsed > (int)EventDispatcher::kDefaultIdleBudget / 1000 + 20 )
+			TestFailed( "Idle task delayed event by %d ms", elapsed );
+		
+		mDispatcher->removeIdleTask( this );
+		int runs = mRuns;
+		usleep( 20000 );
+		
+		if ( runs != mRuns )
+			TestFailed( "Idle task called after removal" );
+		
+		TestPassed();
+	}
+	
+	EventDispatcher *mDispatcher;
+	volatile int mRuns;
+	volatile int mWork;
+	volatile bool mEventHandled;
+};
+
+class ManyFdsTest : public TestCase, public SelectorListener
+{
+public:
+	ManyFdsTest( Selector *s, const char *name ) : TestCase( "ManyFdsTest" ),
+		mSelector( s ), mCount( 0 ), mWrongEvents( 0 )
+	{
+		SetTestName( name );
+	}
+	
+	virtual ~ManyFdsTest() {}
+
+private:
+	// Well past the 64 fds the selector used to be limited to
+	static const int kNumPipes = 200;
+	
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		if ( private_data == 1 )
+		{
+			// Only asked for POLLOUT, must not see POLLIN from the
+			//  other listener on this fd.
+			if ( events & POLLIN )
+				mWrongEvents++;
+			return;
+		}
+		
+		if ( events & POLLIN )
+		{
+			char buf[ 10 ];
+			read( fd, buf, sizeof( buf ) );
+			mCount++;
+		}
+	}
+	
+	void Run()
+	{
+		int pipes[ kNumPipes ][ 2 ];
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			if ( pipe( pipes[ i ] ) != 0 )
+				LOG_ERR_FATAL( "failed to create pipe" );
+			
+			mSelector->addListener( pipes[ i ][ 0 ], POLLIN, this );
+		}
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			write( pipes[ i ][ 1 ], "X", 1 );
+		}
+		
+		for ( int i = 0; i < 100 and mCount < kNumPipes; i++ )
+		{
+			usleep( 10000 );
+		}
+		
+		if ( mCount != kNumPipes )
+			TestFailed( "Got %d of %d events", (int)mCount, kNumPipes );
+		
+		// Two listeners with different masks on the same fd
+		int sv[ 2 ];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+			LOG_ERR_FATAL( "failed to create socketpair" );
+		
+		mCount = 0;
+		mSelector->addListener( sv[ 0 ], POLLIN, this, 2 );
+		mSelector->removeListener( sv[ 0 ], this );
+		mSelector->addListener( sv[ 0 ], POLLOUT, this, 1 );
+		mSelector->addListener( sv[ 0 ], POLLIN, this, 2 );
+		write( sv[ 1 ], "X", 1 );
+		usleep( 100000 );
+		
+		if ( mCount != 1 )
+			TestFailed( "Read listener called %d times", (int)mCount );
+		
+		mSelector->removeListener( sv[ 0 ], this );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		
+		for ( int i = 0; i < kNumPipes; i++ )
+		{
+			mSelector->removeListener( pipes[ i ][ 0 ], this );
+			close( pipes[ i ][ 0 ] );
+			close( pipes[ i ][ 1 ] );
+		}
+		
+		if ( mWrongEvents != 0 )
+			TestFailed( "Listener got events it didn't ask for" );
+		
+		TestPassed();
+	}
+	
+	Selector *mSelector;
+	volatile int mCount;
+	volatile int mWrongEvents;
+};
+
+class TriggerTest : public TestCase, public SelectorListener
+{
+public:
+	TriggerTest( Selector *s, const char *name, int flags ) : 
+		TestCase( "TriggerTest" ), mSelector( s ), mFlags( flags ), mCount( 0 )
+	{
+		SetTestName( name );
+	}
+	
+	virtual ~TriggerTest() {}
+
+private:
+	// Doesn't read, so a level triggered listener would be called
+	//  over and over.
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		mCount++;
+	}
+	
+	void Run()
+	{
+		int sv[ 2 ];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+			LOG_ERR_FATAL( "failed to create socketpair" );
+		
+		mSelector->addListener( sv[ 0 ], POLLIN, this, 0, mFlags );
+		write( sv[ 1 ], "X", 1 );
+		usleep( 50000 );
+		
+		if ( mCount != 1 )
+			TestFailed( "Called %d times after first write", (int)mCount );
+		
+		if ( mFlags & Selector::kOneShot )
+		{
+			// Rearming with data still there calls it once more
+			mSelector->rearm( sv[ 0 ], this );
+			usleep( 50000 );
+			
+			if ( mCount != 2 )
+				TestFailed( "Called %d times after rearm", (int)mCount );
+			
+			// Still disarmed, more data doesn't call it
+			write( sv[ 1 ], "X", 1 );
+			usleep( 50000 );
+			
+			if ( mCount != 2 )
+				TestFailed( "Called %d times while disarmed", (int)mCount );
+		}
+		else
+		{
+			// A new edge
+			write( sv[ 1 ], "X", 1 );
+			usleep( 50000 );
+			
+			if ( mCount != 2 )
+				TestFailed( "Called %d times after second write", (int)mCount );
+		}
+		
+		mSelector->removeListener( sv[ 0 ], this );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		
+		TestPassed();
+	}
+	
+	Selector *mSelector;
+	int mFlags;
+	volatile int mCount;
+};
+
+class BusyPollTest : public TestCase, public SelectorListener
+{
+public:
+	BusyPollTest() : TestCase( "BusyPollTest" ), mCount( 0 )
+	{
+		SetTestName( "Busy Poll" );
+	}
+	
+	virtual ~BusyPollTest() {}
+	
+private:
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		char buf[ 16 ];
+		
+		if ( events & POLLIN )
+		{
+			read( fd, buf, sizeof( buf ) );
+			mCount++;
+		}
+	}
+	
+	void waitFor( int count )
+	{
+		for ( int i = 0; i < 1000 and mCount < count; i++ )
+			usleep( 1000 );
+		
+		if ( mCount != count )
+			TestFailed( "Called %d times, expected %d", (int)mCount, count );
+	}
+	
+	void checkSocket( int fd, int usecs )
+	{
+#ifdef SO_BUSY_POLL
+		int val = -1;
+		socklen_t len = sizeof( val );
+		getsockopt( fd, SOL_SOCKET, SO_BUSY_POLL, &val, &len );
+		
+		// Raising it needs CAP_NET_ADMIN, so it may not have stuck
+		if ( val != usecs and geteuid() == 0 )
+			TestFailed( "SO_BUSY_POLL on fd %d is %d", fd, val );
+#endif
+	}
+	
+	void Run()
+	{
+		Selector selector( "BusySelector" );
+		Selector::BusyPollStats stats;
+		
+		int sv[ 2 ];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+			LOG_ERR_FATAL( "failed to create socketpair" );
+		
+		// One socket registered before busy polling is turned on and
+		//  one after, both get the socket option.
+		selector.addListener( sv[ 1 ], POLLIN, this );
+		selector.setBusyPoll( 20000, 50 );
+		selector.addListener( sv[ 0 ], POLLIN, this );
+		checkSocket( sv[ 0 ], 50 );
+		checkSocket( sv[ 1 ], 50 );
+		
+		// The second write is well within the spin window
+		write( sv[ 1 ], "X", 1 );
+		waitFor( 1 );
+		write( sv[ 1 ], "X", 1 );
+		waitFor( 2 );
+		
+		// And after this the window is over and the selector sleeps
+		usleep( 100000 );
+		selector.getBusyPollStats( stats );
+		
+		if ( stats.mSpins == 0 or stats.mSpinHits == 0 or 
+			 stats.mSpinUsecs == 0 or stats.mSleeps == 0 )
+		{
+			TestFailed( "Stats: %d spins, %d hits, %d us, %d sleeps", 
+						(int)stats.mSpins, (int)stats.mSpinHits, 
+						(int)stats.mSpinUsecs, (int)stats.mSleeps );
+		}
+		
+		// Turned off, it never spins
+		selector.setBusyPoll( 0 );
+		selector.resetBusyPollStats();
+		write( sv[ 1 ], "X", 1 );
+		waitFor( 3 );
+		usleep( 50000 );
+		selector.getBusyPollStats( stats );
+		
+		if ( stats.mSpins != 0 )
+			TestFailed( "%d spins while turned off", (int)stats.mSpins );
+		
+		checkSocket( sv[ 0 ], 0 );
+		
+		selector.removeListener( sv[ 0 ], this );
+		selector.removeListener( sv[ 1 ], this );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		
+		TestPassed();
+	}
+	
+	volatile int mCount;
+};
+
+class FairnessTest : public TestCase, public SelectorListener
+{
+public:
+	FairnessTest() : TestCase( "FairnessTest" ), mFloodRead( 0 ), 
+		mFloodCalls( 0 ), mMaxRead( 0 ), mQuietAt( -1 ), mFirst( -1 ),
+		mCalls( 0 )
+	{
+		SetTestName( "Fairness" );
+	}
+	
+	virtual ~FairnessTest() {}
+	
+private:
+	enum { kGate, kFlood, kQuiet, kUrgent };
+	
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		char buf[ 1024 ];
+		
+		if ( ( events & POLLIN ) == 0 )
+			return;
+		
+		if ( mFirst < 0 and private_data != kGate )
+			mFirst = private_data;
+		
+		switch ( private_data )
+		{
+		case kGate:
+			// Hold up the selector so everything else is ready at once
+			read( fd, buf, 1 );
+			usleep( 50000 );
+			break;
+			
+		case kFlood:
+		{
+			int total = 0;
+			
+			while ( mSelector->hasReadBudget() )
+			{
+				int res = read( fd, buf, sizeof( buf ) );
+				if ( res <= 0 )
+					break;
+				
+				total += res;
+				mSelector->chargeRead( res );
+			}
+			
+			if ( total > mMaxRead )
+				mMaxRead = total;
+			
+			mFloodRead += total;
+			mFloodCalls++;
+			break;
+		}
+			
+		default:
+			read( fd, buf, 1 );
+			if ( private_data == kQuiet )
+				mQuietAt = mFloodRead;
+			break;
+		}
+		
+		mCalls++;
+	}
+	
+	void runFlood( int gate, int fd, int quiet, int urgent, int len )
+	{
+		char buf[ 1024 ];
+		memset( buf, 'F', sizeof( buf ) );
+		
+		mFloodRead = mFloodCalls = mMaxRead = 0;
+		mQuietAt = mFirst = -1;
+		
+		write( gate, "G", 1 );
+		usleep( 10000 );
+		
+		for ( int i = 0; i < len; i += sizeof( buf ) )
+			write( fd, buf, sizeof( buf ) );
+		
+		write( quiet, "Q", 1 );
+		write( urgent, "U", 1 );
+		
+		for ( int i = 0; i < 2000 and ( mFloodRead < len or mQuietAt < 0 ); 
+			  i++ )
+		{
+			usleep( 1000 );
+		}
+		
+		if ( mFloodRead != len or mQuietAt < 0 )
+			TestFailed( "Read %d of %d, quiet %d", (int)mFloodRead, len,
+						(int)mQuietAt );
+		
+		if ( mFirst != kUrgent )
+			TestFailed( "High priority fd was not first (%d)", (int)mFirst );
+	}
+	
+	void Run()
+	{
+		Selector selector( "FairSelector" );
+		Selector::FairnessStats stats;
+		mSelector = &selector;
+		
+		const int kLen = 32 * 1024;
+		const int kBudget = 4096;
+		int gate[ 2 ], flood[ 2 ], quiet[ 2 ], urgent[ 2 ];
+		
+		if ( pipe( gate ) != 0 or pipe( quiet ) != 0 or pipe( urgent ) != 0 or
+			 socketpair( AF_UNIX, SOCK_STREAM, 0, flood ) != 0 )
+		{
+			LOG_ERR_FATAL( "failed to create fds" );
+		}
+		
+		fcntl( flood[ 0 ], F_SETFL, O_NONBLOCK );
+		
+		selector.addListener( gate[ 0 ], POLLIN, this, kGate );
+		selector.addListener( flood[ 0 ], POLLIN, this, kFlood );
+		selector.addListener( quiet[ 0 ], POLLIN, this, kQuiet );
+		selector.addListener( urgent[ 0 ], POLLIN, this, kUrgent, 
+							  Selector::kHighPriority );
+		selector.setReadBudget( kBudget );
+		
+		// The flood is read a budget at a time and the quiet fd gets
+		//  its turn before the flood is through its first budget.
+		runFlood( gate[ 1 ], flood[ 1 ], quiet[ 1 ], urgent[ 1 ], kLen );
+		
+		if ( mMaxRead > kBudget or mFloodCalls < kLen / kBudget )
+			TestFailed( "Flood read %d max in %d calls", (int)mMaxRead, 
+						(int)mFloodCalls );
+		
+		if ( mQuietAt > kBudget )
+			TestFailed( "Quiet fd waited for %d bytes", (int)mQuietAt );
+		
+		selector.getFairnessStats( stats );
+		
+		if ( stats.mReadBudgetExhausted < (uint64_t)( kLen / kBudget - 1 ) or
+			 stats.mHighPriorityCalls == 0 )
+		{
+			TestFailed( "Stats: %d exhausted, %d high priority",
+						(int)stats.mReadBudgetExhausted,
+						(int)stats.mHighPriorityCalls );
+		}
+		
+		// With its own budget turned off the flood is read in one go
+		selector.setReadBudget( flood[ 0 ], this, 0 );
+		selector.resetFairnessStats();
+		runFlood( gate[ 1 ], flood[ 1 ], quiet[ 1 ], urgent[ 1 ], kLen );
+		
+		if ( mFloodCalls != 1 )
+			TestFailed( "Unlimited flood took %d calls", (int)mFloodCalls );
+		
+		selector.getFairnessStats( stats );
+		
+		if ( stats.mReadBudgetExhausted != 0 )
+			TestFailed( "%d exhausted without a budget", 
+						(int)stats.mReadBudgetExhausted );
+		
+		// Outside a listener nothing is charged
+		if ( not selector.chargeRead( kLen ) or not selector.hasReadBudget() )
+			TestFailed( "Charged outside a listener" );
+		
+		selector.removeListener( gate[ 0 ], this );
+		selector.removeListener( flood[ 0 ], this );
+		selector.removeListener( quiet[ 0 ], this );
+		selector.removeListener( urgent[ 0 ], this );
+		
+		int fds[] = { gate[ 0 ], gate[ 1 ], flood[ 0 ], flood[ 1 ], 
+					  quiet[ 0 ], quiet[ 1 ], urgent[ 0 ], urgent[ 1 ] };
+		for ( unsigned i = 0; i < sizeof( fds ) / sizeof( int ); i++ )
+			close( fds[ i ] );
+		
+		TestPassed();
+	}
+	
+	Selector *mSelector;
+	volatile int mFloodRead;
+	volatile int mFloodCalls;
+	volatile int mMaxRead;
+	volatile int mQuietAt;
+	volatile int mFirst;
+	volatile int mCalls;
+};
+
+class LocalTimerTest : public TestCase
+{
+public:
+	LocalTimerTest( EventDispatcher *dispatcher, const char *name ) : 
+		TestCase( "LocalTimerTest" ), mDispatcher( dispatcher ), 
+		mCount( 0 ), mLast( -1 ), mWrongThread( 0 ), mOutOfOrder( 0 )
+	{
+		SetTestName( name );
+		mHandler = jh_new EventMethod<LocalTimerTest,TimedEvent>(
+			this, &LocalTimerTest::handleTimed, mDispatcher );
+	}
+	
+	virtual ~LocalTimerTest() 
+	{
+		delete mHandler;
+	}
+	
+private:
+	enum { kTimedEventId = 200, kOtherEventId };
+	enum { kOrderTag = 100 };
+	
+	struct TimedEvent : public Event
+	{
+		TimedEvent( int tag, Event::Id id = kTimedEventId ) : Event( id ),
+			mTag( tag ), mSent( TimeUtils::getMonotonicUsecs() ) {}
+		
+		SMART_CASTABLE( kTimedEventId );
+		
+		int mTag;
+		uint64_t mSent;
+	};
+	
+	void handleTimed( TimedEvent *ev )
+	{
+		if ( not mDispatcher->isThreadCurrent() )
+			mWrongThread++;
+		
+		mElapsed = TimeUtils::getMonotonicUsecs() - ev->mSent;
+		
+		// Tags from kOrderTag on are sent in the order they should fire
+		if ( ev->mTag >= kOrderTag and mLast >= kOrderTag and 
+			 ev->mTag < mLast )
+			mOutOfOrder++;
+		
+		mLast = ev->mTag;
+		mCount++;
+	}
+	
+	void expect( int count, int last )
+	{
+		if ( mCount != count or mLast != last )
+			TestFailed( "Got %d events, last %d, expected %d, last %d", 
+						(int)mCount, (int)mLast, count, last );
+	}
+	
+	void Run()
+	{
+		// Fires on the dispatcher's thread, and not early
+		mDispatcher->sendTimedEvent( jh_new TimedEvent( 1 ), 50 );
+		usleep( 20000 );
+		expect( 0, -1 );
+		usleep( 100000 );
+		expect( 1, 1 );
+		
+		if ( mElapsed < 50000 or mElapsed > 100000 )
+			TestFailed( "Fired after %d us", (int)mElapsed );
+		
+		// Nearest deadline first, even when added last
+		mDispatcher->sendTimedEvent( jh_new TimedEvent( 2 ), 60 );
+		mDispatcher->sendTimedEvent( jh_new TimedEvent( 3 ), 30 );
+		usleep( 45000 );
+		expect( 2, 3 );
+		usleep( 50000 );
+		expect( 3, 2 );
+		
+		// Removing an event removes its timer
+		SmartPtr<Event> ev = jh_new TimedEvent( 4 );
+		mDispatcher->sendTimedEvent( ev, 30 );
+		mDispatcher->remove( ev );
+		
+		// Removing by id leaves other ids alone
+		mDispatcher->sendTimedEvent( jh_new TimedEvent( 5, kOtherEventId ), 
+									 30 );
+		mDispatcher->sendTimedEvent( jh_new TimedEvent( 6 ), 40 );
+		mDispatcher->remove( kOtherEventId );
+		usleep( 80000 );
+		expect( 4, 6 );
+		
+		// Equal deadlines fire in the order sent, and removing most of
+		//  the timers leaves the rest in order
+		for ( int i = 0; i < 20; i++ )
+		{
+			mDispatcher->sendTimedEvent( jh_new TimedEvent( kOrderTag + i, 
+				( i % 4 == 0 ) ? kTimedEventId : kOtherEventId ), 30 );
+		}
+		
+		mDispatcher->remove( kOtherEventId );
+		usleep( 80000 );
+		expect( 9, kOrderTag + 16 );
+		
+		if ( mOutOfOrder != 0 )
+			TestFailed( "%d events out of order", (int)mOutOfOrder );
+		
+		// Periodic until removed
+		mCount = 0;
+		mDispatcher->sendPeriodicEvent( jh_new TimedEvent( 7 ), 20 );
+		usleep( 110000 );
+		mDispatcher->remove( kTimedEventId );
+		int count = mCount;
+		
+		if ( count < 4 or count > 6 )
+			TestFailed( "Periodic fired %d times", count );
+		
+		usleep( 60000 );
+		expect( count, 7 );
+		
+		if ( mWrongThread != 0 )
+			TestFailed( "%d events on the wrong thread", (int)mWrongThread );
+		
+		TestPassed();
+	}
+	
+	EventDispatcher *mDispatcher;
+	EventMethod<LocalTimerTest,TimedEvent> *mHandler;
+	volatile int mCount;
+	volatile int mLast;
+	volatile int mWrongThread;
+	volatile int mOutOfOrder;
+	volatile uint64_t mElapsed;
+};
+
+class AsyncTest : public TestCase, public SelectorListener, 
+	public SelectorUpdateListener
+{
+public:
+	AsyncTest( Selector *s ) : TestCase( "AsyncTest" ), mSelector( s ), 
+		mAdded( 0 ), mRemoved( 0 ), mWrongThread( 0 ), mStaleCalls( 0 ),
+		mCalls( 0 ), mOldFd( -1 )
+	{
+		SetTestName( "Async Registration" );
+	}
+	
+	virtual ~AsyncTest() {}
+
+private:
+	struct BusyEvent : public Event
+	{
+		BusyEvent() : Event( 101 ) {}
+		SMART_CASTABLE( 101 );
+	};
+
+	// Keep the selector thread busy for a while
+	void ProcessBusy( BusyEvent *ev ) { usleep( 200000 ); }
+	
+	void listenerUpdated( int fd, SelectorListener *listener, bool added )
+	{
+		if ( not mSelector->isThreadCurrent() or listener != this )
+			mWrongThread++;
+		
+		if ( added )
+			mAdded++;
+		else
+			mRemoved++;
+	}
+	
+	void processFileEvents( int fd, short events, jh_ptr_int_t private_data )
+	{
+		char buf[ 10 ];
+		
+		// private data 1 is the listener for the old pipe
+		if ( private_data == 1 )
+			mStaleCalls++;
+		else
+			mCalls++;
+		
+		if ( events & POLLIN )
+			read( fd, buf, sizeof( buf ) );
+	}
+	
+	void Run()
+	{
+		EventMethod<AsyncTest,BusyEvent> handler( this, &AsyncTest::ProcessBusy,
+												  mSelector );
+		int fds[ 2 ];
+		
+		if ( pipe( fds ) != 0 )
+			LOG_ERR_FATAL( "failed to create pipe" );
+		
+		mSelector->addListenerAsync( fds[ 0 ], POLLIN, this, 1, 
+									 Selector::kLevelTriggered, this );
+		usleep( 50000 );
+		
+		if ( mAdded != 1 )
+			TestFailed( "Completion not called for add" );
+		
+		// With the selector busy the calls must not block.  The old pipe
+		//  has data waiting that must never reach either listener even
+		//  though the new pipe gets the same fd.
+		mSelector->sendEvent( jh_new BusyEvent() );
+		usleep( 20000 );
+		write( fds[ 1 ], "X", 1 );
+		
+		struct timespec start, end;
+		TimeUtils::getCurTime( &start );
+
+		mSelector->removeListenerAsync( fds[ 0 ], this, this );
+		mOldFd = fds[ 0 ];
+		close( fds[ 0 ] );
+		close( fds[ 1 ] );
+		
+		if ( pipe( fds ) != 0 )
+			LOG_ERR_FATAL( "failed to create pipe" );
+		
+		if ( fds[ 0 ] != mOldFd )
+			LOG_NOTICE( "fd not reused (%d, %d)", fds[ 0 ], mOldFd );
+		
+		mSelector->addListenerAsync( fds[ 0 ], POLLIN, this, 2, 
+									 Selector::kLevelTriggered, this );
+		TimeUtils::getCurTime( &end );
+		
+		int elapsed = TimeUtils::getDifference( &end, &start );
+		if ( elapsed > 50 )
+			TestFailed( "Async calls blocked for %d ms", elapsed );
+		
+		usleep( 300000 );
+		
+		if ( mAdded != 2 or mRemoved != 1 )
+			TestFailed( "Completions %d added %d removed", (int)mAdded,
+						(int)mRemoved );
+		
+		if ( mCalls != 0 )
+			TestFailed( "New listener called for the old pipe" );
+		
+		write( fds[ 1 ], "X", 1 );
+		usleep( 50000 );
+		
+		if ( mCalls != 1 )
+			TestFailed( "New listener called %d times", (int)mCalls );
+		
+		if ( mStaleCalls != 0 )
+			TestFailed( "Removed listener called %d times", (int)mStaleCalls );
+		
+		if ( mWrongThread != 0 )
+			TestFailed( "Completion called with bad params" );
+		
+		mSelector->removeListener( fds[ 0 ], this );
+		close( fds[ 0 ] );
+		close( fds[ 1 ] );
+		
+		TestPassed();
+	}
+	
+	Selector *mSelector;
+	volatile int mAdded;
+	volatile int mRemoved;
+	volatile int mWrongThread;
+	volatile int mStaleCalls;
+	volatile int mCalls;
+	int mOldFd;
+};
+
 int main( int argc, char*argv[] )
 {
 	TestRunner runner( argv[ 0 ] );
 
-	TestCase *test_set[ 10 ];
+	TestCase *test_set[ 22 ];
 	
 	Selector testSelector;
 	test_set[ 0 ] = jh_new EventTest( &testSelector, 1 );
 	test_set[ 1 ] = jh_new EventTest( &testSelector, 2 );
 	test_set[ 2 ] = jh_new EventTest( &testSelector, 3 );
 	test_set[ 3 ] = jh_new SelectorTest( &testSelector );
+	test_set[ 4 ] = jh_new IdleTest( &testSelector, "Selector Idle Tasks" );
+	
+	EventThread testThread;
+	test_set[ 5 ] = jh_new IdleTest( &testThread, "EventThread Idle Tasks" );
+	
+	test_set[ 6 ] = jh_new ManyFdsTest( &testSelector, "Many Fds" );
+	test_set[ 7 ] = jh_new TriggerTest( &testSelector, "One Shot", 
+										Selector::kOneShot );
+
+	Selector pollSelector( "PollSelector", Selector::kBackendPoll );
+	test_set[ 8 ] = jh_new SelectorTest( &pollSelector );
+	test_set[ 9 ] = jh_new ManyFdsTest( &pollSelector, "Many Fds (poll)" );
+	test_set[ 10 ] = jh_new TriggerTest( &pollSelector, "One Shot (poll)", 
+										 Selector::kOneShot );
+	test_set[ 11 ] = jh_new AsyncTest( &testSelector );
+	test_set[ 12 ] = jh_new AsyncTest( &pollSelector );
+	int numTests = 13;
+	
+	// Falls back to the default backend where io_uring isn't available
+	Selector uringSelector( "UringSelector", Selector::kBackendIoUring );
+	test_set[ numTests++ ] = jh_new SelectorTest( &uringSelector );
+	test_set[ numTests++ ] = jh_new ManyFdsTest( &uringSelector, 
+												 "Many Fds (io_uring)" );
+	test_set[ numTests++ ] = jh_new TriggerTest( &uringSelector, 
+		"One Shot (io_uring)", Selector::kOneShot );
+	test_set[ numTests++ ] = jh_new AsyncTest( &uringSelector );
+	test_set[ numTests++ ] = jh_new BusyPollTest();
+	test_set[ numTests++ ] = jh_new FairnessTest();
+	test_set[ numTests++ ] = jh_new LocalTimerTest( &testSelector, 
+													"Selector Timers" );
+	test_set[ numTests++ ] = jh_new LocalTimerTest( &testThread, 
+													"EventThread Timers" );
+	
+	// Edge triggering falls back to level triggering with poll
+	if ( testSelector.getBackend() == Selector::kBackendEpoll )
+	{
+		test_set[ numTests++ ] = jh_new TriggerTest( &testSelector, 
+			"Edge Triggered", Selector::kEdgeTriggered );
+	}
 	
-	runner.RunAll( test_set, 4 );
+	runner.RunAll( test_set, numTests );
 
 	return 0;
 }
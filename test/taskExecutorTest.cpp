@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TaskExecutor.h"
+#include "EventThread.h"
+#include "Condition.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+//! Adds to a counter
+struct Increment
+{
+	Increment( volatile int &counter ) : mCounter( counter ) {}
+	
+	void operator()() { __sync_fetch_and_add( &mCounter, 1 ); }
+	
+	volatile int &mCounter;
+};
+
+struct Square
+{
+	Square( int value ) : mValue( value ) {}
+	
+	int operator()() { return mValue * mValue; }
+	
+	int mValue;
+};
+
+/**
+ * Sums a range by splitting it in two, summing one half as a new task
+ *  and the other itself, down to kLeaf numbers.
+ */
+class RangeSum : public Future<uint64_t>
+{
+public:
+	RangeSum( TaskExecutor *executor, uint32_t begin, uint32_t end ) :
+		mExecutor( executor ), mBegin( begin ), mEnd( end ) {}
+	
+	void run()
+	{
+		if ( mEnd - mBegin <= kLeaf )
+		{
+			mResult = 0;
+			
+			for ( uint32_t i = mBegin; i < mEnd; i++ )
+				mResult += i;
+			
+			return;
+		}
+		
+		uint32_t middle = mBegin + ( mEnd - mBegin ) / 2;
+		SmartPtr<RangeSum> low = jh_new RangeSum( mExecutor, mBegin, middle );
+		SmartPtr<RangeSum> high = jh_new RangeSum( mExecutor, middle, mEnd );
+		
+		mExecutor->submit( low );
+		high->run();
+		
+		mResult = low->get() + high->mResult;
+	}
+	
+	static const uint32_t kLeaf = 256;
+	
+private:
+	TaskExecutor *mExecutor;
+	uint32_t mBegin;
+	uint32_t mEnd;
+};
+
+class TaskTest : public TestCase
+{
+public:
+	TaskTest( int test_id ) : TestCase( "Task" ), mTest( test_id ),
+		mThread( "task events" ),
+		mHandler( this, &TaskTest::handleDone, &mThread ),
+		mDoneCount( 0 ), mDoneSum( 0 ), mDoneOnThread( true )
+	{
+		char name[ 32 ];
+		
+		sprintf( name, "Task Test %d", test_id );
+		SetTestName( name );
+	}
+	
+	virtual ~TaskTest() {}
+	
+private:
+	void Run();
+	
+	void functors();
+	void futures();
+	void forkJoin();
+	void completion();
+	void shutdown();
+	void blockedWait();
+	
+	void handleDone( TaskDoneEvent *ev )
+	{
+		AutoLock l( mLock );
+		
+		if ( not ev->getTask()->isDone() or not mThread.isThreadCurrent() )
+			mDoneOnThread = false;
+		
+		mDoneCount++;
+		mDoneSum += ev->getPrivateData();
+		mCondition.Signal();
+	}
+	
+	int mTest;
+	
+	EventThread mThread;
+	EventMethod<TaskTest, TaskDoneEvent> mHandler;
+	
+	Mutex mLock;
+	Condition mCondition;
+	int mDoneCount;
+	int mDoneSum;
+	bool mDoneOnThread;
+};
+
+void TaskTest::Run()
+{
+	switch ( mTest )
+	{
+		case 1:
+			functors();
+			break;
+		case 2:
+			futures();
+			break;
+		case 3:
+			forkJoin();
+			break;
+		case 4:
+			completion();
+			break;
+		case 5:
+			shutdown();
+			break;
+		case 6:
+			blockedWait();
+			break;
+	}
+	
+	TestPassed();
+}
+
+void TaskTest::functors()
+{
+	const int kCount = 1000;
+	
+	TaskExecutor executor( 4 );
+	volatile int counter = 0;
+	JetHead::vector<SmartPtr<Task> > tasks;
+	
+	if ( executor.getNumThreads() != 4 or executor.isWorkerThread() )
+		TestFailed( "Wrong threads" );
+	
+	for ( int i = 0; i < kCount; i++ )
+		tasks.push_back( executor.submitCall( Increment( counter ) ) );
+	
+	for ( int i = 0; i < kCount; i++ )
+	{
+		tasks[ i ]->wait();
+		
+		if ( not tasks[ i ]->isDone() )
+			TestFailed( "Task %d not done", i );
+	}
+	
+	if ( counter != kCount )
+		TestFailed( "Ran %d of %d", counter, kCount );
+}
+
+void TaskTest::futures()
+{
+	const int kCount = 100;
+	
+	TaskExecutor *executor = TaskExecutor::getDefault();
+	JetHead::vector<SmartPtr<Future<int> > > squares;
+	
+	if ( executor->getNumThreads() != sysconf( _SC_NPROCESSORS_ONLN ) )
+		TestFailed( "%d threads in the default", executor->getNumThreads() );
+	
+	for ( int i = 0; i < kCount; i++ )
+		squares.push_back( executor->submitFuture<int>( Square( i ) ) );
+	
+	for ( int i = 0; i < kCount; i++ )
+	{
+		if ( squares[ i ]->get() != i * i )
+			TestFailed( "%d squared is %d", i, squares[ i ]->get() );
+	}
+	
+	TaskExecutor::destroyDefault();
+}
+
+void TaskTest::forkJoin()
+{
+	const uint32_t kEnd = 1 << 20;
+	
+	TaskExecutor executor( 4 );
+	SmartPtr<RangeSum> sum = jh_new RangeSum( &executor, 0, kEnd );
+	
+	executor.submit( sum );
+	
+	uint64_t expected = (uint64_t)kEnd * ( kEnd - 1 ) / 2;
+	
+	if ( sum->get() != expected )
+		TestFailed( "Sum %llu not %llu", (unsigned long long)sum->get(),
+					(unsigned long long)expected );
+}
+
+void TaskTest::completion()
+{
+	const int kCount = 50;
+	
+	TaskExecutor executor( 2 );
+	volatile int counter = 0;
+	int expected = 0;
+	
+	for ( int i = 0; i < kCount; i++ )
+	{
+		executor.submitCall( Increment( counter ), &mThread, i );
+		expected += i;
+	}
+	
+	AutoLock l( mLock );
+	
+	while ( mDoneCount < kCount )
+	{
+		if ( not mCondition.Wait( mLock, 5000 ) )
+			TestFailed( "Got %d of %d events", mDoneCount, kCount );
+	}
+	
+	if ( mDoneSum != expected or not mDoneOnThread or counter != kCount )
+		TestFailed( "Wrong events" );
+}
+
+//! Sleeps a little, then counts
+struct Slow
+{
+	Slow( volatile int &counter ) : mCounter( counter ) {}
+	
+	void operator()()
+	{
+		usleep( 100 );
+		__sync_fetch_and_add( &mCounter, 1 );
+	}
+	
+	volatile int &mCounter;
+};
+
+void TaskTest::shutdown()
+{
+	const int kCount = 200;
+	
+	volatile int counter = 0;
+	TaskExecutor *executor = jh_new TaskExecutor( 2 );
+	
+	for ( int i = 0; i < kCount; i++ )
+		executor->submitCall( Slow( counter ) );
+	
+	// Runs whatever is left first
+	delete executor;
+	
+	if ( counter != kCount )
+		TestFailed( "Ran %d of %d", counter, kCount );
+}
+
+/**
+ * Sleeps, and while it does leaves a task on its deque for whoever is
+ *  waiting for it to steal.
+ */
+class Sleeper : public Task
+{
+public:
+	Sleeper( TaskExecutor *executor ) : mExecutor( executor ), 
+		mCounter( 0 ), mStolen( false ) {}
+	
+	void run()
+	{
+		usleep( 100000 );
+		SmartPtr<Task> child = mExecutor->submitCall( Increment( mCounter ) );
+		usleep( 200000 );
+		
+		mStolen = child->isDone();
+		child->wait();
+	}
+	
+	TaskExecutor *mExecutor;
+	volatile int mCounter;
+	bool mStolen;
+};
+
+//! Waits for another task from a worker
+struct WaitFor
+{
+	WaitFor( Task *task ) : mTask( task ) {}
+	
+	void operator()() { mTask->wait(); }
+	
+	Task *mTask;
+};
+
+static uint64_t getCpuUsecs()
+{
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+	
+	return (uint64_t)( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 
+		1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/*
+ * A worker waiting on a task another worker is running sleeps rather
+ *  than spinning, and still wakes to steal new work.
+ */
+void TaskTest::blockedWait()
+{
+	TaskExecutor executor( 2 );
+	SmartPtr<Sleeper> sleeper = jh_new Sleeper( &executor );
+	
+	executor.submit( sleeper );
+	
+	uint64_t start = getCpuUsecs();
+	SmartPtr<Task> waiter = executor.submitCall( WaitFor( sleeper ) );
+	
+	waiter->wait();
+	
+	uint64_t cpu = getCpuUsecs() - start;
+	
+	if ( not sleeper->mStolen or sleeper->mCounter != 1 )
+		TestFailed( "Waiting worker didn't steal the new task" );
+	
+	// Spinning would use most of the 300ms the sleeper takes
+	if ( cpu > 100000 )
+		TestFailed( "Used %llu us of CPU waiting", (unsigned long long)cpu );
+}
+
+int main( int argc, char*argv[] )
+{	
+	TestRunner runner( argv[ 0 ] );
+
+	TestCase *test_set[ 6 ];
+	
+	for ( int i = 0; i < 6; i++ )
+		test_set[ i ] = jh_new TaskTest( i + 1 );
+	
+	runner.RunAll( test_set, 6 );
+
+	return 0;
+}
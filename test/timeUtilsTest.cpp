@@ -27,6 +27,7 @@
 
 #include <unistd.h>
 #include "TimeUtils.h"
+#include "CodeTimer.h"
 #include "jh_memory.h"
 #include "logging.h"
 
@@ -49,6 +50,7 @@ private:
 	void test1();
 	void test2();
 	void test3();
+	void test4();
 	
 	int mTest;
 };
@@ -77,6 +79,9 @@ void TimeUtilsTest::Run()
 		case 3:
 			test2();
 			break;
+		case 4:
+			test4();
+			break;
 	}
 	
 	TestPassed();
@@ -182,6 +187,67 @@ void TimeUtilsTest::test3()
 	}	
 }
 
+void TimeUtilsTest::test4()
+{
+	uint64_t last = TimeUtils::getCycles();
+	
+	for ( int i = 0; i < 100000; i++ )
+	{
+		uint64_t now = TimeUtils::getCycles();
+		
+		if ( now < last )
+			TestFailed( "Cycle clock went back" );
+		
+		last = now;
+	}
+	
+	// The fast clock should keep to the system's monotonic clock
+	uint64_t fast = TimeUtils::getFastMonotonicNsecs();
+	uint64_t system = TimeUtils::getSystemMonotonicNsecs();
+	int64_t skew = (int64_t)( fast - system );
+	
+	if ( skew > 1000000 or skew < -1000000 )
+		TestFailed( "Fast clock is %lld ns off", (long long)skew );
+	
+	CodeTimer timer( NULL, 1 );
+	timer.Start();
+	usleep( 20000 );
+	timer.End();
+	
+	// The cycle clock is only calibrated over 10ms, so allow it a few
+	//  percent
+	if ( timer.getAverage() < 19000 or timer.getAverage() > 200000 )
+		TestFailed( "CodeTimer timed 20ms as %u us", timer.getAverage() );
+	
+	// And be cheap
+	uint64_t start = TimeUtils::getSystemMonotonicNsecs();
+	uint64_t startCycles = TimeUtils::getCycles();
+	
+	for ( int i = 0; i < 1000000; i++ )
+		last += TimeUtils::getCycles();
+	
+	uint64_t cycles = TimeUtils::getCyclesOrdered() - startCycles;
+	uint64_t took = TimeUtils::getSystemMonotonicNsecs() - start;
+	
+	LOG_NOTICE( "getCycles %s takes %llu ns",
+				TimeUtils::cycleClockIsTsc() ? "(TSC)" : "(CLOCK_MONOTONIC)",
+				(unsigned long long)( took / 1000000 ) );
+	
+	// Well under a microsecond a read, even from the system clock
+	if ( took > 1000000000 )
+		TestFailed( "getCycles takes %llu ns", 
+					(unsigned long long)( took / 1000000 ) );
+	
+	// The cycle clock times the loop as the system clock does
+	int64_t off = (int64_t)( took - TimeUtils::cyclesToNsecs( cycles ) );
+	
+	if ( off > (int64_t)( took / 10 + 1000000 ) or 
+		 off < -(int64_t)( took / 10 + 1000000 ) )
+		TestFailed( "Cycle clock timed %llu ns as %llu ns", 
+					(unsigned long long)took, 
+					(unsigned long long)TimeUtils::cyclesToNsecs( cycles ) );
+}
+
 int main( int argc, char*argv[] )
 {	
 	TestRunner runner( argv[ 0 ] );
@@ -191,8 +257,9 @@ int main( int argc, char*argv[] )
 	test_set[ 0 ] = jh_new TimeUtilsTest( 1 );
 	test_set[ 1 ] = jh_new TimeUtilsTest( 2 );
 	test_set[ 2 ] = jh_new TimeUtilsTest( 3 );
+	test_set[ 3 ] = jh_new TimeUtilsTest( 4 );
 	
-	runner.RunAll( test_set, 3 );
+	runner.RunAll( test_set, 4 );
 
 	return 0;
 }
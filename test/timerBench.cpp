@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Measures the cost of a Timer with many pending timers.  Usage:
+ *
+ *   timerBench [pending timers] [expiring timers] [tick ms]
+ *
+ * It reports how long it takes to add the pending timers, to add and
+ * then remove as many timed events, and how late the expiring timers
+ * fire while the pending ones are still waiting.  A tick of 0 runs a
+ * tickless Timer, with the expiring timers set in microseconds.  Last
+ * it checks that a slow listener doesn't hold up adding timers, how
+ * long a burst of events due together takes to be delivered, and how
+ * many wakeups slack saves.
+ */
+
+#include "Timer.h"
+#include "EventThread.h"
+#include "TimeUtils.h"
+#include "jh_memory.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_NOTICE );
+
+//! Private data of the timers that should never fire
+static const uint32_t kPending = 0xFFFFFFFF;
+
+class BenchListener : public TimerListener
+{
+public:
+	BenchListener( int numExpiring, int tickMs ) : 
+		mNumExpiring( numExpiring ), mTickUsecs( tickMs * 1000 ), 
+		mFired( 0 ), mEarly( 0 ), mStray( 0 ), mLateUsecs( 0 ), 
+		mMaxLateUsecs( 0 )
+	{
+		mDue = jh_new uint64_t[ numExpiring ];
+	}
+	
+	virtual ~BenchListener()
+	{
+		delete [] mDue;
+	}
+	
+	void setDue( uint32_t i, uint64_t due ) { mDue[ i ] = due; }
+	
+	// Only called on the clock thread
+	void onTimeout( uint32_t private_data )
+	{
+		if ( private_data >= (uint32_t)mNumExpiring )
+		{
+			mStray++;
+			return;
+		}
+		
+		uint64_t now = TimeUtils::getMonotonicUsecs();
+		
+		// Timers count whole ticks from the last one, so they can be
+		//  up to a tick early, more if the clock thread fell behind.
+		if ( now + mTickUsecs < mDue[ private_data ] )
+		{
+			mEarly++;
+		}
+		else if ( now >= mDue[ private_data ] )
+		{
+			uint64_t late = now - mDue[ private_data ];
+			mLateUsecs += late;
+			if ( late > mMaxLateUsecs )
+				mMaxLateUsecs = late;
+		}
+		
+		__sync_fetch_and_add( &mFired, 1 );
+	}
+	
+	int getFired() { return __sync_fetch_and_add( &mFired, 0 ); }
+
+	int mNumExpiring;
+	uint64_t mTickUsecs;
+	int mFired;
+	int mEarly;
+	int mStray;
+	uint64_t mLateUsecs;
+	uint64_t mMaxLateUsecs;
+	uint64_t *mDue;
+};
+
+// Blocks the clock thread in its callback
+class SlowListener : public TimerListener
+{
+public:
+	SlowListener() : mStarted( 0 ) {}
+	
+	void onTimeout( uint32_t )
+	{
+		__sync_fetch_and_add( &mStarted, 1 );
+		usleep( 200000 );
+	}
+	
+	int mStarted;
+};
+
+// Counts the timeouts of the slack runs
+class CountListener : public TimerListener
+{
+public:
+	CountListener() : mFired( 0 ) {}
+	
+	void onTimeout( uint32_t )
+	{
+		__sync_fetch_and_add( &mFired, 1 );
+	}
+	
+	int getFired() { return __sync_fetch_and_add( &mFired, 0 ); }
+	
+	int mFired;
+};
+
+/*
+ * Run count timeouts spread over two seconds with slackMs, return the
+ *  number of wakeups they took.
+ */
+static uint64_t slackRun( Timer *timer, int count, uint32_t slackMs )
+{
+	CountListener counter;
+	Timer::CoalescingStats stats;
+	
+	timer->resetCoalescingStats();
+	
+	for ( int i = 0; i < count; i++ )
+		timer->addTimer( &counter, random() % 2000, 0, slackMs );
+	
+	uint64_t start = TimeUtils::getMonotonicUsecs();
+	
+	while ( counter.getFired() < count )
+	{
+		usleep( 10000 );
+		
+		if ( TimeUtils::getMonotonicUsecs() - start > 10000000 )
+			break;
+	}
+	
+	timer->getCoalescingStats( stats );
+	
+	printf( "%d timeouts with %3u ms slack: %d fired, %llu wakeups, "
+			"%.1f per wakeup\n", count, slackMs, counter.getFired(), 
+			(unsigned long long)stats.mWakeups, stats.mWakeups ? 
+			(double)stats.mExpirations / stats.mWakeups : 0.0 );
+	
+	return ( counter.getFired() == count ) ? stats.mWakeups : 0;
+}
+
+// Counts the burst events as the EventThread dispatches them
+class BurstListener : public IEventListener
+{
+public:
+	BurstListener() : mReceived( 0 ) {}
+	
+	void receiveEvent( Event * )
+	{
+		__sync_fetch_and_add( &mReceived, 1 );
+	}
+	
+	int getReceived() { return __sync_fetch_and_add( &mReceived, 0 ); }
+	
+	int mReceived;
+};
+
+static const Event::Id kBurstEventId = 300;
+
+// How many threads this process has
+static int countThreads()
+{
+	DIR *dir = opendir( "/proc/self/task" );
+	int count = 0;
+	
+	if ( dir == NULL )
+		return -1;
+	
+	while ( struct dirent *entry = readdir( dir ) )
+	{
+		if ( entry->d_name[ 0 ] != '.' )
+			count++;
+	}
+	
+	closedir( dir );
+	return count;
+}
+
+static double usecsPer( uint64_t start, int count )
+{
+	return (double)( TimeUtils::getMonotonicUsecs() - start ) / count;
+}
+
+int main( int argc, char *argv[] )
+{
+	int numPending = 1000000;
+	int numExpiring = 100000;
+	int tickMs = 10;
+	
+	if ( argc > 1 )
+		numPending = atoi( argv[ 1 ] );
+	
+	if ( argc > 2 )
+		numExpiring = atoi( argv[ 2 ] );
+	
+	if ( argc > 3 )
+		tickMs = atoi( argv[ 3 ] );
+	
+	SmartPtr<Timer> timer = jh_new Timer( tickMs );
+	BenchListener listener( numExpiring, tickMs );
+	EventThread thread( "BenchThread" );
+	uint64_t start;
+	
+	srandom( 1 );
+	
+	// All timers share the TimerManager's thread, and getTimer shares
+	//  one timer per resolution
+	int threadsBefore = countThreads();
+	SmartPtr<Timer> extra[ 8 ];
+	
+	for ( int i = 0; i < 8; i++ )
+	{
+		extra[ i ] = jh_new Timer( i * 5 );
+		extra[ i ]->addTimer( &listener, 3600000, kPending );
+	}
+	
+	bool shared = ( TimerManager::getInstance()->getTimer( 20 ) == 
+					TimerManager::getInstance()->getTimer( 20 ) );
+	int threadsAfter = countThreads();
+	
+	printf( "8 more timers: %d threads before, %d after, getTimer %s\n", 
+			threadsBefore, threadsAfter, shared ? "shares" : "doesn't share" );
+	
+	for ( int i = 0; i < 8; i++ )
+	{
+		extra[ i ]->stop();
+		extra[ i ] = NULL;
+	}
+	
+	// Idle timeouts a minute to ten minutes out, like connection timers
+	start = TimeUtils::getMonotonicUsecs();
+	
+	for ( int i = 0; i < numPending; i++ )
+		timer->addTimer( &listener, 60000 + random() % 540000, kPending );
+	
+	printf( "%d pending timers: add %6.3f us/timer\n", numPending,
+			usecsPer( start, numPending ) );
+	
+	// Timed events that get cancelled before they fire
+	Event **events = jh_new Event*[ numPending ];
+	
+	start = TimeUtils::getMonotonicUsecs();
+	
+	for ( int i = 0; i < numPending; i++ )
+	{
+		events[ i ] = jh_new Event( 100 );
+		timer->sendTimedEvent( events[ i ], &thread, 
+							   60000 + random() % 540000 );
+	}
+	
+	printf( "%d timed events: add %6.3f us/event, ", numPending,
+			usecsPer( start, numPending ) );
+	
+	start = TimeUtils::getMonotonicUsecs();
+	
+	// The timer holds the only reference, so this frees the event
+	for ( int i = 0; i < numPending; i++ )
+		timer->removeTimedEvent( events[ i ] );
+	
+	printf( "remove %6.3f us/event\n", usecsPer( start, numPending ) );
+	delete [] events;
+	
+	// Timers due in the next five seconds, past the end of the first
+	//  wheel, fired with the others pending
+	start = TimeUtils::getMonotonicUsecs();
+	
+	for ( int i = 0; i < numExpiring; i++ )
+	{
+		uint64_t usecs = random() % 5000000;
+		
+		if ( tickMs != Timer::kTickless )
+			usecs -= usecs % 1000;
+		
+		listener.setDue( i, TimeUtils::getMonotonicUsecs() + usecs );
+		if ( tickMs == Timer::kTickless )
+			timer->addTimerUsecs( &listener, usecs, i );
+		else
+			timer->addTimer( &listener, usecs / 1000, i );
+	}
+	
+	while ( listener.getFired() < numExpiring )
+	{
+		usleep( 10000 );
+		
+		if ( TimeUtils::getMonotonicUsecs() - start > 15000000 )
+			break;
+	}
+	
+	int fired = listener.getFired();
+	printf( "%d expiring timers: %d fired, %d over a tick early, %d stray, "
+			"late %.2f ms avg %.2f ms max (tick %d ms)\n", numExpiring, 
+			fired, listener.mEarly, listener.mStray,
+			fired ? (double)listener.mLateUsecs / fired / 1000 : 0.0,
+			(double)listener.mMaxLateUsecs / 1000, tickMs );
+	
+	// Nothing should wait on a callback while it runs
+	SlowListener slow;
+	timer->addTimer( &slow, 1, 0 );
+	
+	while ( __sync_fetch_and_add( &slow.mStarted, 0 ) == 0 )
+		usleep( 1000 );
+	
+	uint64_t maxAddUsecs = 0;
+	
+	for ( int i = 0; i < 1000; i++ )
+	{
+		start = TimeUtils::getMonotonicUsecs();
+		timer->addTimer( &listener, 60000, kPending );
+		
+		uint64_t add = TimeUtils::getMonotonicUsecs() - start;
+		if ( add > maxAddUsecs )
+			maxAddUsecs = add;
+	}
+	
+	printf( "add during a 200 ms callback: %.3f ms max\n", 
+			(double)maxAddUsecs / 1000 );
+	
+	// Events due together are queued to the dispatcher in one go
+	BurstListener burst;
+	thread.addEventListener( &burst, kBurstEventId );
+	
+	for ( int i = 0; i < numExpiring; i++ )
+		timer->sendTimedEvent( jh_new Event( kBurstEventId ), &thread, 300 );
+	
+	uint64_t due = TimeUtils::getMonotonicUsecs() + 300000;
+	
+	while ( burst.getReceived() < numExpiring )
+	{
+		usleep( 1000 );
+		
+		if ( TimeUtils::getMonotonicUsecs() > due + 10000000 )
+			break;
+	}
+	
+	int received = burst.getReceived();
+	printf( "%d events due together: %d received %.2f ms after due\n",
+			numExpiring, received, 
+			(double)( (int64_t)( TimeUtils::getMonotonicUsecs() - due ) ) 
+			/ 1000 );
+	
+	thread.removeEventListener( &burst, kBurstEventId );
+	
+	// Timeouts that can be late share wakeups
+	int numSlack = numExpiring / 10;
+	uint64_t exactWakeups = slackRun( timer, numSlack, 0 );
+	uint64_t slackWakeups = slackRun( timer, numSlack, 250 );
+	
+	start = TimeUtils::getMonotonicUsecs();
+	timer->stop();
+	timer = NULL;
+	printf( "teardown %6.3f us/timer\n", usecsPer( start, numPending ) );
+	
+	return ( threadsAfter == threadsBefore and shared and
+			 fired == numExpiring and listener.mStray == 0 and 
+			 maxAddUsecs < 100000 and received == numExpiring and
+			 slackWakeups != 0 and slackWakeups < exactWakeups ) ? 0 : 1;
+}
@@ -30,6 +30,7 @@
 #include "Timer.h"
 #include "TimeUtils.h"
 #include "EventAgent.h"
+#include "ClockSource.h"
 
 #include "jh_memory.h"
 #include "logging.h"
@@ -95,6 +96,41 @@ struct Event3 : public Event
 	struct timeval mSent;
 };
 
+static int gFailures = 0;
+
+#define CHECK( cond, fmt, args... )				\
+do {											\
+	if ( not ( cond ) )							\
+	{											\
+		LOG_ERR( fmt, ## args );				\
+		gFailures++;							\
+	}											\
+} while ( 0 )
+
+//! How late past its tick a timed event may be handled on a busy machine
+static const int kLateMs = 50;
+
+/*
+ * A tickless timer fires on timeoutMs, others on the first tick boundary
+ *  at least timeoutMs of whole ticks on, so from a tick early to on time.
+ */
+static void checkElapsed( const char *what, int elapsed, int timeoutMs, 
+						  int tickMs )
+{
+	int early = timeoutMs;
+	int late = timeoutMs;
+	
+	if ( tickMs != Timer::kTickless )
+	{
+		late = ( timeoutMs + tickMs - 1 ) / tickMs * tickMs;
+		early = late - tickMs;
+	}
+	
+	CHECK( elapsed >= early and elapsed <= late + kLateMs,
+		   "%s took %d ms, expected %d to %d", what, elapsed, early, 
+		   late + kLateMs );
+}
+
 class TestClass : public TimerListener
 {
 public:
@@ -234,6 +270,7 @@ void TestClass::ProcessFunc1( Event1 *ev )
 	int elapsed = TimeUtils::getDifference( &curTime, &ev->mSent );
 	
 	LOG("Received Func1 timed event, elapsed time is %d", elapsed);
+	checkElapsed( "Func1", elapsed, 3000, Timer::kTickless );
 	// Run once
 	if (firstFunc1)
 	{
@@ -261,6 +298,7 @@ void TestClass::ProcessFunc2( Event2 *ev )
 	int elapsed = TimeUtils::getDifference( &curTime, &ev->mSent );
 	
 	LOG("Received Func2 timed event, elapsed time is %d", elapsed);
+	checkElapsed( "Func2", elapsed, 3500, mDefaultTimer->getTickTime() );
 }
 
 void TestClass::ProcessFunc3( Event3 *ev )
@@ -273,6 +311,7 @@ void TestClass::ProcessFunc3( Event3 *ev )
 	int elapsed = TimeUtils::getDifference( &curTime, &ev->mSent );
 	LOG_NOTICE( "Timer %p with tick time %d, elapsed is %d\n",
 				ev->mTimer, ev->mTimer->getTickTime(), elapsed );
+	checkElapsed( "Func3", elapsed, 200, ev->mTimer->getTickTime() );
 }
 
 void TestClass::handlePeriodic()
@@ -290,23 +329,389 @@ void TestClass::handlePeriodic()
 	mLastTime = curTime;
 }
 
+//! Remembers when each timeout fired, on the clock source
+class RecordListener : public TimerListener
+{
+public:
+	RecordListener() : mBase( TimeUtils::getMonotonicUsecs() ) {}
+	
+	void onTimeout( uint32_t private_data )
+	{
+		AutoLock l( mLock );
+		mIds.push_back( private_data );
+		mTimes.push_back( TimeUtils::getMonotonicUsecs() - mBase );
+		mFired.Broadcast();
+	}
+	
+	int count()
+	{
+		AutoLock l( mLock );
+		return mIds.size();
+	}
+	
+	//! Wait on the system clock until count have fired
+	bool waitFor( int count, uint32_t timeoutMs )
+	{
+		uint64_t deadline = TimeUtils::getSystemMonotonicUsecs() + 
+			(uint64_t)timeoutMs * 1000;
+		
+		AutoLock l( mLock );
+		
+		while ( (int)mIds.size() < count )
+		{
+			if ( not mFired.WaitUntilSystem( mLock, deadline ) and
+				 (int)mIds.size() < count )
+				return false;
+		}
+		
+		return true;
+	}
+	
+	uint64_t mBase;
+	Mutex mLock;
+	Condition mFired;
+	JetHead::vector<uint32_t> mIds;
+	JetHead::vector<uint64_t> mTimes;
+};
+
+/*
+ * Move clock to base + usecs and wait, on the system clock, for the
+ *  timer service thread to have handled it.  It has when it is waiting
+ *  for a deadline after the new time, which the tests make sure it has
+ *  by keeping a far off timeout pending.
+ */
+static bool advanceAndSettle( VirtualClock *clock, uint64_t base, 
+							  uint64_t usecs )
+{
+	clock->advanceTo( base + usecs );
+	
+	uint64_t giveUp = TimeUtils::getSystemMonotonicUsecs() + 2000000;
+	
+	while ( clock->getNumWaiters() == 0 or 
+			clock->getNextDeadline() <= base + usecs )
+	{
+		if ( TimeUtils::getSystemMonotonicUsecs() > giveUp )
+			return false;
+		
+		usleep( 500 );
+	}
+	
+	return true;
+}
+
+//! A timeout far enough off to never fire in these tests
+static const uint32_t kSentinelMs = 0x7fffffff;
+
+/*
+ * Wait on the system clock until the service thread waits no later than
+ *  a new Timer's first timeout at base + usecs.  Until it picks up the
+ *  Timer its wait for later ones looks to advanceAndSettle like settling.
+ */
+static bool waitForService( VirtualClock *clock, uint64_t base, 
+							uint64_t usecs )
+{
+	uint64_t giveUp = TimeUtils::getSystemMonotonicUsecs() + 2000000;
+	
+	while ( clock->getNextDeadline() > base + usecs )
+	{
+		if ( TimeUtils::getSystemMonotonicUsecs() > giveUp )
+			return false;
+		
+		usleep( 500 );
+	}
+	
+	return true;
+}
+
+/*
+ * Timeouts on either side of where each wheel of a 1ms Timer laps, and
+ *  a jump of the clock far enough that doing it a tick at a time would
+ *  not settle in time.
+ */
+static void wheelBoundaries( VirtualClock *clock )
+{
+	static const uint32_t kTimeouts[] = { 
+		255, 256, 257, 511, 512, 513, 
+		65535, 65536, 65537, 65536 + 255, 65536 + 257, 131072,
+		16777215, 16777216, 16777217, 1000000000
+	};
+	static const int kNumTimeouts = sizeof( kTimeouts ) / sizeof( kTimeouts[ 0 ] );
+	
+	SmartPtr<Timer> timer = jh_new Timer( 1 );
+	RecordListener listener;
+	
+	// Added backwards so the order they fire in is down to the wheels
+	timer->addTimer( &listener, kSentinelMs, kSentinelMs );
+	for ( int i = kNumTimeouts - 1; i >= 0; i-- )
+		timer->addTimer( &listener, kTimeouts[ i ], kTimeouts[ i ] );
+	
+	CHECK( waitForService( clock, listener.mBase, 
+						   (uint64_t)kTimeouts[ 0 ] * 1000 ),
+		   "Timer never waited for %u ms", kTimeouts[ 0 ] );
+	
+	for ( int i = 0; i < kNumTimeouts; i++ )
+	{
+		uint64_t due = (uint64_t)kTimeouts[ i ] * 1000;
+		
+		CHECK( advanceAndSettle( clock, listener.mBase, due - 1000 ),
+			   "Timer didn't settle before %u ms", kTimeouts[ i ] );
+		CHECK( listener.count() == i, "%d fired before %u ms, expected %d", 
+			   listener.count(), kTimeouts[ i ], i );
+		
+		CHECK( advanceAndSettle( clock, listener.mBase, due ),
+			   "Timer didn't settle at %u ms", kTimeouts[ i ] );
+		CHECK( listener.count() == i + 1, "%d fired at %u ms, expected %d", 
+			   listener.count(), kTimeouts[ i ], i + 1 );
+	}
+	
+	AutoLock l( listener.mLock );
+	
+	for ( unsigned i = 0; i < listener.mIds.size(); i++ )
+	{
+		CHECK( listener.mIds[ i ] == kTimeouts[ i ] and
+			   listener.mTimes[ i ] == (uint64_t)kTimeouts[ i ] * 1000,
+			   "%u ms timeout fired %d th at %llu us", listener.mIds[ i ], i,
+			   (unsigned long long)listener.mTimes[ i ] );
+	}
+	
+	timer->stop();
+}
+
+struct CancelEvent : public Event
+{
+	CancelEvent( int tag ) : Event( EVENT_ID_END ), mTag( tag ) {}
+	
+	SMART_CASTABLE( EVENT_ID_END );
+	
+	int mTag;
+};
+
+class CancelHandler
+{
+public:
+	CancelHandler() : mHandler( this, &CancelHandler::handle, &mThread ),
+		mReceived( 0 ) {}
+	
+	void handle( CancelEvent *ev )
+	{
+		AutoLock l( mLock );
+		mReceived |= 1 << ev->mTag;
+		mDone.Broadcast();
+	}
+	
+	EventThread mThread;
+	EventMethod<CancelHandler,CancelEvent> mHandler;
+	Mutex mLock;
+	Condition mDone;
+	int mReceived;
+};
+
+/*
+ * Events removed after their timeout moved down from wheel 2 to wheel
+ *  1, and after it moved on down to wheel 0, never arrive.
+ */
+static void cancelAfterCascade( VirtualClock *clock )
+{
+	SmartPtr<Timer> timer = jh_new Timer( 1 );
+	RecordListener sentinel;
+	CancelHandler handler;
+	SmartPtr<Event> once = jh_new CancelEvent( 0 );
+	SmartPtr<Event> twice = jh_new CancelEvent( 1 );
+	
+	timer->addTimer( &sentinel, kSentinelMs, kSentinelMs );
+	timer->sendTimedEvent( once, &handler.mThread, 70000 );
+	timer->sendTimedEvent( twice, &handler.mThread, 70000 );
+	timer->sendTimedEvent( jh_new CancelEvent( 2 ), &handler.mThread, 70000 );
+	
+	CHECK( waitForService( clock, sentinel.mBase, 70000000 ),
+		   "Timer never waited for 70000 ms" );
+	
+	// 65536 cascades wheel 2, 69888 wheel 1
+	CHECK( advanceAndSettle( clock, sentinel.mBase, 69000000 ), 
+		   "Timer didn't settle at 69000 ms" );
+	timer->removeTimedEvent( once );
+	
+	CHECK( advanceAndSettle( clock, sentinel.mBase, 69900000 ), 
+		   "Timer didn't settle at 69900 ms" );
+	timer->removeTimedEvent( twice );
+	
+	CHECK( advanceAndSettle( clock, sentinel.mBase, 70000000 ), 
+		   "Timer didn't settle at 70000 ms" );
+	
+	AutoLock l( handler.mLock );
+	
+	while ( handler.mReceived == 0 )
+	{
+		if ( not handler.mDone.WaitUntilSystem( handler.mLock, 
+				TimeUtils::getSystemMonotonicUsecs() + 2000000 ) )
+			break;
+	}
+	
+	CHECK( handler.mReceived == 4, "Got events %x after cancelling, "
+		   "expected only 4", handler.mReceived );
+	
+	timer->stop();
+}
+
+/*
+ * A 7ms periodic timer on a 5ms Timer fires within a tick or so of each
+ *  7ms, with no drift over many wheel laps.
+ */
+static void periodicDrift( VirtualClock *clock )
+{
+	const int kPeriods = 200;
+	const uint64_t kTickUsecs = 5000;
+	
+	SmartPtr<Timer> timer = jh_new Timer( 5 );
+	RecordListener listener;
+	
+	timer->addTimer( &listener, kSentinelMs, kSentinelMs );
+	timer->addPeriodicTimer( &listener, 7, 7 );
+	
+	CHECK( waitForService( clock, listener.mBase, 7000 + kTickUsecs ),
+		   "Timer never waited for its first tick after 7 ms" );
+	
+	uint64_t end = kPeriods * 7000 + kTickUsecs;
+	
+	for ( uint64_t t = kTickUsecs; t <= end; t += kTickUsecs )
+	{
+		if ( not advanceAndSettle( clock, listener.mBase, t ) )
+		{
+			CHECK( false, "Timer didn't settle at %llu us", 
+				   (unsigned long long)t );
+			break;
+		}
+	}
+	
+	timer->stop();
+	
+	AutoLock l( listener.mLock );
+	
+	CHECK( listener.mTimes.size() == kPeriods, "Fired %d times in %d periods",
+		   listener.mTimes.size(), kPeriods );
+	
+	for ( unsigned i = 0; i < listener.mTimes.size(); i++ )
+	{
+		uint64_t ideal = ( i + 1 ) * 7000ULL;
+		
+		CHECK( listener.mTimes[ i ] >= ideal and
+			   listener.mTimes[ i ] < ideal + 2 * kTickUsecs,
+			   "Period %d fired at %llu us", i + 1, 
+			   (unsigned long long)listener.mTimes[ i ] );
+	}
+}
+
+//! Wait on the system clock until the next wait on clock is for deadline
+static bool waitForDeadline( VirtualClock *clock, uint64_t deadline )
+{
+	uint64_t giveUp = TimeUtils::getSystemMonotonicUsecs() + 2000000;
+
+	while ( clock->getNextDeadline() != deadline )
+	{
+		if ( TimeUtils::getSystemMonotonicUsecs() > giveUp )
+			return false;
+
+		usleep( 500 );
+	}
+
+	return true;
+}
+
+/*
+ * A tickless timer fires microsecond timeouts on the microsecond, and
+ *  once it has nothing pending leaves the service thread asleep however
+ *  far the clock moves.
+ */
+static void ticklessUsecs( VirtualClock *clock )
+{
+	static const uint64_t kTimeouts[] = { 1500, 2750 };
+	static const int kNumTimeouts = sizeof( kTimeouts ) / sizeof( kTimeouts[ 0 ] );
+
+	SmartPtr<Timer> timer = jh_new Timer( Timer::kTickless );
+	RecordListener listener;
+
+	for ( int i = 0; i < kNumTimeouts; i++ )
+		timer->addTimerUsecs( &listener, kTimeouts[ i ], i );
+
+	for ( int i = 0; i < kNumTimeouts; i++ )
+	{
+		uint64_t due = listener.mBase + kTimeouts[ i ];
+
+		CHECK( waitForDeadline( clock, due ),
+			   "Service thread isn't waiting for %llu us",
+			   (unsigned long long)kTimeouts[ i ] );
+
+		clock->advanceTo( due - 1 );
+		usleep( 20000 );
+		CHECK( listener.count() == i, "%d fired before %llu us, expected %d",
+			   listener.count(), (unsigned long long)kTimeouts[ i ], i );
+
+		clock->advanceTo( due );
+		CHECK( listener.waitFor( i + 1, 2000 ), "%llu us timeout didn't fire",
+			   (unsigned long long)kTimeouts[ i ] );
+	}
+
+	{
+		AutoLock l( listener.mLock );
+
+		for ( unsigned i = 0; i < listener.mTimes.size(); i++ )
+		{
+			CHECK( listener.mTimes[ i ] == kTimeouts[ i ],
+				   "%llu us timeout fired at %llu us",
+				   (unsigned long long)kTimeouts[ i ],
+				   (unsigned long long)listener.mTimes[ i ] );
+		}
+	}
+
+	// With nothing pending the service thread must not wait on the clock
+	uint64_t giveUp = TimeUtils::getSystemMonotonicUsecs() + 2000000;
+
+	while ( clock->getNumWaiters() != 0 and
+			TimeUtils::getSystemMonotonicUsecs() < giveUp )
+		usleep( 500 );
+
+	Timer::CoalescingStats before;
+	timer->getCoalescingStats( before );
+
+	usleep( 100000 );
+	CHECK( clock->getNumWaiters() == 0, "Idle tickless timer has %d waits "
+		   "on the clock", clock->getNumWaiters() );
+
+	clock->advance( 3600000000ULL );
+	usleep( 100000 );
+
+	Timer::CoalescingStats after;
+	timer->getCoalescingStats( after );
+
+	CHECK( after.mWakeups == before.mWakeups and listener.count() == kNumTimeouts,
+		   "Idle tickless timer woke %llu times",
+		   (unsigned long long)( after.mWakeups - before.mWakeups ) );
+	CHECK( clock->getNumWaiters() == 0, "Idle tickless timer has %d waits "
+		   "on the clock after an hour", clock->getNumWaiters() );
+
+	timer->stop();
+}
+
 int main( int argc, char*argv[] )
 {	
 	LOG_NOTICE( "Test Started" );
 
 	TestClass *c = jh_new TestClass;
 	SmartPtr<Timer> testTimer = jh_new Timer(166);
+	SmartPtr<Timer> ticklessTimer = jh_new Timer(Timer::kTickless);
 
 	// Initiate test by making back-to-back calls to Func1 and Func2
 	c->Func1();
 	c->Func2( 5, 10 );
 	
-	// Send two timed events.  One using default timer, one using
+	// Send three timed events.  One using default timer, one using
 	// a timer with a resolution of 50ms.   Timed event is set to
 	// fire after 250ms.   Default timer should actually be ~200
-	// and testTimer should be ~250
+	// and testTimer should be ~250.  The tickless timer should be
+	// right on 200.  ProcessFunc3 checks each.
 	c->Func3();
 	c->Func3( testTimer );
+	c->Func3( ticklessTimer );
 	
 	c->sendPeriodic( testTimer );
 	
@@ -317,11 +722,33 @@ int main( int argc, char*argv[] )
 	
 	testTimer->stop();
 	testTimer = NULL;
+	ticklessTimer->stop();
+	ticklessTimer = NULL;
 	delete c;
 	
 	if ( gEventCount != 0 )
 		LOG_ERR_FATAL( "Events leaked %d", gEventCount );
-
+	
+	// The rest run on a virtual clock, which the timer service thread
+	//  started from here on waits on
+	VirtualClock *clock = jh_new VirtualClock();
+	TimeUtils::setClockSource( clock );
+	
+	wheelBoundaries( clock );
+	cancelAfterCascade( clock );
+	periodicDrift( clock );
+	ticklessUsecs( clock );
+	
+	TimerManager::destroyManager();
+	TimeUtils::setClockSource( NULL );
+	delete clock;
+	
+	if ( gFailures != 0 )
+	{
+		LOG_ERR( "%d checks failed", gFailures );
+		return 1;
+	}
+	
 	return 0;
 }
 
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2010, JetHead Development, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the JetHead Development nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ClockSource.h"
+#include "EventThread.h"
+#include "Selector.h"
+#include "Timer.h"
+#include "TimeUtils.h"
+
+#include "jh_memory.h"
+#include "logging.h"
+
+SET_LOG_CAT( LOG_CAT_ALL );
+SET_LOG_LEVEL( LOG_LVL_INFO );
+
+#include "TestCase.h"
+
+static const uint64_t kHourUsecs = 3600ULL * 1000000;
+
+// One clock for the whole run, so the time never goes backwards
+VirtualClock *gClock = NULL;
+
+//! Counts things that happened, waits for them on the system clock
+class Counter
+{
+public:
+	Counter() : mCount( 0 ) {}
+	
+	void add()
+	{
+		AutoLock lock( mLock );
+		mCount++;
+		mCond.Broadcast();
+	}
+	
+	int get()
+	{
+		AutoLock lock( mLock );
+		return mCount;
+	}
+	
+	bool waitFor( int count, uint32_t timeoutMs )
+	{
+		uint64_t deadline = TimeUtils::getSystemMonotonicUsecs() + 
+			(uint64_t)timeoutMs * 1000;
+		
+		AutoLock lock( mLock );
+		
+		while ( mCount < count )
+		{
+			if ( not mCond.WaitUntilSystem( mLock, deadline ) and
+				 mCount < count )
+				return false;
+		}
+		
+		return true;
+	}
+	
+private:
+	Mutex		mLock;
+	Condition	mCond;
+	int			mCount;
+};
+
+class CountListener : public TimerListener
+{
+public:
+	void onTimeout( uint32_t ) { mFired.add(); }
+	
+	Counter mFired;
+};
+
+struct TickEvent : public Event
+{
+	TickEvent() : Event( 1 ) {}
+	SMART_CASTABLE( 1 );
+};
+
+template<class Dispatcher>
+class EventCounter
+{
+public:
+	EventCounter() : mHandler( this, &EventCounter::onTick, &mThread ) {}
+	
+	void onTick( TickEvent * ) { mTicks.add(); }
+	
+	Dispatcher mThread;
+	Counter mTicks;
+	EventMethod<EventCounter,TickEvent> mHandler;
+};
+
+class VirtualClockTest : public TestCase
+{
+public:
+	VirtualClockTest( int test_id );
+	virtual ~VirtualClockTest() {}
+	
+private:
+	void Run();
+	
+	void conditionTimeout();
+	void timerTimeout( int tickMs );
+	template<class Dispatcher> void dispatcherTimeout();
+	void warpClock();
+	
+	int mTest;
+};
+
+VirtualClockTest::VirtualClockTest( int test_id ) 
+:	TestCase( "VirtualClock" ), mTest( test_id )
+{
+	char name[ 32 ];
+	
+	sprintf( name, "Virtual Clock Test %d", test_id );
+	
+	SetTestName( name );
+}
+
+void VirtualClockTest::Run()
+{
+	uint64_t start = TimeUtils::getSystemMonotonicUsecs();
+	
+	switch ( mTest )
+	{
+		case 1:
+			conditionTimeout();
+			break;
+		case 2:
+			timerTimeout( Timer::kTickless );
+			break;
+		case 3:
+			timerTimeout( 10 );
+			break;
+		case 4:
+			dispatcherTimeout<EventThread>();
+			break;
+		case 5:
+			warpClock();
+			break;
+		case 6:
+			dispatcherTimeout<Selector>();
+			break;
+	}
+	
+	// None of these should take anything like the time they simulate
+	uint64_t took = TimeUtils::getSystemMonotonicUsecs() - start;
+	
+	if ( took > 2000000 )
+		TestFailed( "Took %llu us", (unsigned long long)took );
+	
+	TestPassed();
+}
+
+class Sleeper
+{
+public:
+	Sleeper() : mThread( "sleeper", this, &Sleeper::run ), mResult( -1 ) {}
+	
+	void run()
+	{
+		AutoLock lock( mLock );
+		mResult = mCond.Wait( mLock, 5000 ) ? 1 : 0;
+	}
+	
+	Runnable<Sleeper> mThread;
+	Mutex		mLock;
+	Condition	mCond;
+	int			mResult;
+};
+
+void VirtualClockTest::conditionTimeout()
+{
+	Sleeper sleeper;
+	
+	int waiters = gClock->getNumWaiters();
+	sleeper.mThread.Start();
+	
+	if ( not gClock->waitForWaiters( waiters + 1, 1000 ) )
+		TestFailed( "Sleeper never waited" );
+	
+	// Not long enough
+	gClock->advance( 4999000 );
+	usleep( 20000 );
+	
+	if ( sleeper.mResult != -1 )
+		TestFailed( "Wait ended early" );
+	
+	gClock->advance( 1000 );
+	sleeper.mThread.Join();
+	
+	if ( sleeper.mResult != 0 )
+		TestFailed( "Wait didn't time out" );
+	
+	// A signal still ends the wait
+	Sleeper signaled;
+	signaled.mThread.Start();
+	
+	if ( not gClock->waitForWaiters( waiters + 1, 1000 ) )
+		TestFailed( "Sleeper never waited" );
+	
+	signaled.mLock.Lock();
+	signaled.mCond.Signal();
+	signaled.mLock.Unlock();
+	signaled.mThread.Join();
+	
+	if ( signaled.mResult != 1 )
+		TestFailed( "Wait wasn't signaled" );
+}
+
+void VirtualClockTest::timerTimeout( int tickMs )
+{
+	SmartPtr<Timer> timer = jh_new Timer( tickMs );
+	CountListener listener;
+	uint64_t start = TimeUtils::getMonotonicUsecs();
+	
+	timer->addTimer( &listener, 3600 * 1000, 0 );
+	
+	gClock->advance( kHourUsecs - 60 * 1000000ULL );
+	
+	if ( listener.mFired.waitFor( 1, 50 ) )
+		TestFailed( "Fired a minute early" );
+	
+	gClock->advance( 60 * 1000000ULL );
+	
+	if ( not listener.mFired.waitFor( 1, 1000 ) )
+		TestFailed( "Never fired" );
+	
+	if ( TimeUtils::getMonotonicUsecs() - start < kHourUsecs )
+		TestFailed( "Clock didn't move" );
+	
+	timer->stop();
+}
+
+/*
+ * Timed events wait on the dispatcher's own thread, which for a Selector
+ *  means its clock thread rather than the timerfd.
+ */
+template<class Dispatcher>
+void VirtualClockTest::dispatcherTimeout()
+{
+	EventCounter<Dispatcher> counter;
+	struct timeval before, after;
+	
+	TimeUtils::getCurTime( &before );
+	counter.mThread.sendTimedEvent( jh_new TickEvent(), 10 * 60 * 1000 );
+	
+	for ( int i = 0; i < 9; i++ )
+		gClock->advance( 60 * 1000000ULL );
+	
+	if ( counter.mTicks.waitFor( 1, 50 ) )
+		TestFailed( "Event came early" );
+	
+	gClock->advance( 60 * 1000000ULL );
+	
+	if ( not counter.mTicks.waitFor( 1, 1000 ) )
+		TestFailed( "Event never came" );
+	
+	// The time of day moves with the clock
+	TimeUtils::getCurTime( &after );
+	
+	if ( TimeUtils::getDifference( &after, &before ) < 10 * 60 * 1000 )
+		TestFailed( "Time of day didn't move" );
+}
+
+void VirtualClockTest::warpClock()
+{
+	// An hour in a bit over a second
+	WarpClock warp( 3000.0 );
+	TimeUtils::setClockSource( &warp );
+	
+	SmartPtr<Timer> timer = jh_new Timer( Timer::kTickless );
+	CountListener listener;
+	uint64_t start = TimeUtils::getMonotonicUsecs();
+	
+	timer->addTimer( &listener, 3600 * 1000, 0 );
+	bool fired = listener.mFired.waitFor( 1, 1500 );
+	uint64_t took = TimeUtils::getMonotonicUsecs() - start;
+	
+	timer->stop();
+	
+	// Carry on from the warped time.  The old clock is left alone, as
+	//  something may still be looking at it.
+	gClock = jh_new VirtualClock();
+	TimeUtils::setClockSource( gClock );
+	
+	if ( not fired )
+		TestFailed( "Never fired" );
+	
+	if ( took < kHourUsecs )
+		TestFailed( "Fired early, after %llu us", (unsigned long long)took );
+}
+
+int main( int argc, char*argv[] )
+{	
+	TestRunner runner( argv[ 0 ] );
+
+	gClock = jh_new VirtualClock();
+	TimeUtils::setClockSource( gClock );
+	
+	TestCase *test_set[ 10 ];
+	
+	test_set[ 0 ] = jh_new VirtualClockTest( 1 );
+	test_set[ 1 ] = jh_new VirtualClockTest( 2 );
+	test_set[ 2 ] = jh_new VirtualClockTest( 3 );
+	test_set[ 3 ] = jh_new VirtualClockTest( 4 );
+	test_set[ 4 ] = jh_new VirtualClockTest( 5 );
+	test_set[ 5 ] = jh_new VirtualClockTest( 6 );
+	
+	runner.RunAll( test_set, 6 );
+
+	return 0;
+}